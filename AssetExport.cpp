@@ -0,0 +1,281 @@
+#include "AssetExport.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cwctype>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "chunk.h"
+#include "gameobj.h"
+#include "texture.h"
+#include "TextureDecode.h"
+#include "ThreadPool.h"
+
+#include <stb_image_write.h>
+
+namespace {
+	struct ExportItem {
+		const Chunk* chunk;
+		std::filesystem::path path;
+		bool texture;
+		// texture or audio object ID
+		uint32_t id;
+	};
+
+	// Assets with the same name would be written to the same file at the same time, so the ones after the first
+	// get their ID at the end of their name. The file names are compared without case, as on Windows.
+	void MakePathsUnique(std::vector<ExportItem>& items)
+	{
+		auto key = [](const std::filesystem::path& path) {
+			std::wstring str = path.lexically_normal().wstring();
+			for (wchar_t& c : str)
+				c = (wchar_t)std::towlower(c);
+			return str;
+		};
+		std::unordered_set<std::wstring> used;
+		for (ExportItem& item : items) {
+			if (used.insert(key(item.path)).second)
+				continue;
+			const std::filesystem::path stem = item.path.parent_path() / item.path.stem();
+			const std::filesystem::path extension = item.path.extension();
+			for (int n = 1; ; ++n) {
+				std::filesystem::path path = stem;
+				path += "_" + std::to_string(item.id) + ((n > 1) ? "_" + std::to_string(n) : "");
+				path += extension;
+				if (used.insert(key(path)).second) {
+					item.path = std::move(path);
+					break;
+				}
+			}
+		}
+	}
+
+	std::vector<ExportItem> CollectItems(const Scene& scene, const std::filesystem::path& directory, int assets)
+	{
+		std::vector<ExportItem> items;
+		if (assets & AssetExport::Textures) {
+			for (const Chunk& chk : scene.palPack.subchunks) {
+				const TexInfo* ti = (const TexInfo*)chk.maindata.data();
+				std::string name = ti->getName();
+				if (name.empty()) {
+					char tbuf[20];
+					sprintf_s(tbuf, "NoName%04X", ti->id);
+					name = tbuf;
+				}
+				items.push_back({ &chk, directory / (name + ".png"), true, ti->id });
+			}
+		}
+		if (assets & AssetExport::Waves) {
+			// the wave objects are in the same order as their data in the wavPack
+			size_t waveIndex = 0;
+			const auto& audioObjects = scene.audioMgr.audioObjects;
+			for (size_t id = 0; id < audioObjects.size(); ++id) {
+				if (!audioObjects[id] || audioObjects[id]->getType() != WaveAudioObject::TYPEID)
+					continue;
+				if (id >= 1 && waveIndex < scene.wavPack.subchunks.size()) {
+					const std::string& name = scene.audioMgr.audioNames[id];
+					items.push_back({ &scene.wavPack.subchunks[waveIndex], directory / std::filesystem::path(name).relative_path(), false, (uint32_t)id });
+				}
+				waveIndex += 1;
+			}
+		}
+		MakePathsUnique(items);
+		return items;
+	}
+
+	std::vector<uint8_t> EncodePNG(const Chunk* texChunk)
+	{
+		// not GetLayout, the chunk may be a copy that won't live long
+		auto layout = TextureDecode::ParseLayout(texChunk);
+		if (layout->levels.empty())
+			return {};
+		std::vector<uint32_t> pixels(TextureDecode::GetNumPixels(*layout, 0));
+		TextureDecode::DecodeLevelTo(texChunk, *layout, 0, pixels.data());
+		std::vector<uint8_t> png;
+		auto writeFunc = [](void* context, void* data, int size) -> void {
+			auto* bytes = (std::vector<uint8_t>*)context;
+			bytes->insert(bytes->end(), (uint8_t*)data, (uint8_t*)data + size);
+		};
+		stbi_write_png_to_func(writeFunc, &png, layout->width, layout->height, 4, pixels.data(), 0);
+		return png;
+	}
+
+	bool WriteFile(const std::filesystem::path& path, const void* data, size_t size)
+	{
+		FILE* file;
+		_wfopen_s(&file, path.c_str(), L"wb");
+		if (!file)
+			return false;
+		bool success = fwrite(data, size, 1, file) == 1 || size == 0;
+		success = (fclose(file) == 0) && success;
+		return success;
+	}
+
+	// The background export reads the chunks of the live scene until the scene modifies its packs.
+	// They are then copied, except the ones already exported, once the ones being read are exported.
+	struct SharedChunks {
+		std::mutex mutex;
+		std::condition_variable readingDone;
+		std::vector<char> exported;
+		// live chunks being read
+		size_t numReading = 0;
+		bool copied = false;
+		std::deque<Chunk> copies;
+	};
+
+	AssetExport::Result ExportItems(const std::vector<ExportItem>& items, const std::atomic<bool>* cancel,
+		const std::function<void(size_t filesDone, size_t numFiles)>& progress, SharedChunks* shared = nullptr)
+	{
+		auto startTime = std::chrono::steady_clock::now();
+		std::set<std::filesystem::path> directories;
+		for (const ExportItem& item : items)
+			directories.insert(item.path.parent_path());
+		std::error_code ec;
+		for (const auto& directory : directories)
+			std::filesystem::create_directories(directory, ec);
+
+		std::atomic<size_t> filesDone = 0, numFailed = 0, numBytes = 0;
+		ThreadPool::global().parallelFor(items.size(), [&](size_t i) {
+			if (cancel && *cancel)
+				return;
+			const ExportItem& item = items[i];
+			const Chunk* chunk = item.chunk;
+			bool live = false;
+			if (shared) {
+				// the chunk may have been replaced by a copy
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				chunk = item.chunk;
+				live = !shared->copied;
+				shared->numReading += live ? 1 : 0;
+			}
+			bool success;
+			if (item.texture) {
+				std::vector<uint8_t> png = EncodePNG(chunk);
+				success = !png.empty() && WriteFile(item.path, png.data(), png.size());
+				numBytes += png.size();
+			}
+			else {
+				success = WriteFile(item.path, chunk->maindata.data(), chunk->maindata.size());
+				numBytes += chunk->maindata.size();
+			}
+			if (shared) {
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				shared->exported[i] = 1;
+				if (live) {
+					shared->numReading -= 1;
+					shared->readingDone.notify_all();
+				}
+			}
+			if (!success)
+				numFailed += 1;
+			size_t done = ++filesDone;
+			if (progress)
+				progress(done, items.size());
+			});
+
+		AssetExport::Result result;
+		result.numFiles = filesDone;
+		result.numFailed = numFailed;
+		result.numBytes = numBytes;
+		result.cancelled = cancel && *cancel;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		return result;
+	}
+
+	struct ExportJob {
+		std::vector<ExportItem> items;
+		SharedChunks shared;
+		AssetExport::Result result;
+		std::thread thread;
+		std::atomic<bool> cancel = false;
+		std::atomic<bool> finished = false;
+		std::atomic<size_t> filesDone = 0;
+	};
+
+	std::unique_ptr<ExportJob> g_exportJob;
+}
+
+AssetExport::Result AssetExport::Export(const Scene& scene, const std::filesystem::path& directory, int assets,
+	const std::function<void(size_t filesDone, size_t numFiles)>& progress)
+{
+	return ExportItems(CollectItems(scene, directory, assets), nullptr, progress);
+}
+
+bool AssetExport::Start(const Scene& scene, const std::filesystem::path& directory, int assets)
+{
+	if (g_exportJob)
+		return false;
+	g_exportJob = std::make_unique<ExportJob>();
+	ExportJob* job = g_exportJob.get();
+	job->items = CollectItems(scene, directory, assets);
+	job->shared.exported.resize(job->items.size(), 0);
+	job->thread = std::thread([job]() {
+		job->result = ExportItems(job->items, &job->cancel, [job](size_t filesDone, size_t numFiles) {
+			job->filesDone = filesDone;
+			}, &job->shared);
+		job->finished = true;
+		});
+	return true;
+}
+
+bool AssetExport::IsRunning()
+{
+	return (bool)g_exportJob;
+}
+
+float AssetExport::GetProgress()
+{
+	if (!g_exportJob || g_exportJob->items.empty())
+		return 1.0f;
+	return (float)g_exportJob->filesDone / (float)g_exportJob->items.size();
+}
+
+void AssetExport::Cancel()
+{
+	if (g_exportJob)
+		g_exportJob->cancel = true;
+}
+
+void AssetExport::Wait()
+{
+	if (g_exportJob && g_exportJob->thread.joinable())
+		g_exportJob->thread.join();
+}
+
+std::optional<AssetExport::Result> AssetExport::PollFinished()
+{
+	if (!g_exportJob || !g_exportJob->finished)
+		return std::nullopt;
+	Wait();
+	Result result = g_exportJob->result;
+	g_exportJob.reset();
+	return result;
+}
+
+void AssetExport::EditPacks()
+{
+	if (!g_exportJob)
+		return;
+	SharedChunks& shared = g_exportJob->shared;
+	std::unique_lock<std::mutex> lock(shared.mutex);
+	if (shared.copied)
+		return;
+	shared.readingDone.wait(lock, [&shared]() { return shared.numReading == 0; });
+	for (size_t i = 0; i < g_exportJob->items.size(); ++i) {
+		ExportItem& item = g_exportJob->items[i];
+		if (!shared.exported[i]) {
+			shared.copies.push_back(*item.chunk);
+			item.chunk = &shared.copies.back();
+		}
+	}
+	shared.copied = true;
+}
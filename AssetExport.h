@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <optional>
+
+struct Scene;
+
+// Export of all the textures (PNG) and waves (WAV) of a scene to a directory.
+// The textures are decoded, encoded and written in parallel by the thread pool, one file at a
+// time per thread, so that only a few decoded images are in memory at once.
+namespace AssetExport {
+	enum Assets {
+		Textures = 1,
+		Waves = 2,
+	};
+
+	struct Result {
+		size_t numFiles = 0;
+		size_t numFailed = 0;
+		size_t numBytes = 0;
+		double seconds = 0.0;
+		bool cancelled = false;
+	};
+
+	// Exports on the calling thread, calling progress(filesDone, numFiles) from the threads writing the files.
+	Result Export(const Scene& scene, const std::filesystem::path& directory, int assets,
+		const std::function<void(size_t filesDone, size_t numFiles)>& progress = {});
+
+	// Same on a worker thread, reading the chunks of the scene, which must be g_scene, until EditPacks is called.
+	// Returns false if an export is already running.
+	bool Start(const Scene& scene, const std::filesystem::path& directory, int assets);
+	bool IsRunning();
+	float GetProgress();
+	void Cancel();
+	// Blocks until the running export is finished.
+	void Wait();
+	// To call every frame from the main thread. Returns the result once the export is finished.
+	std::optional<Result> PollFinished();
+	// Copies the chunks not exported yet, to call before modifying the packs of g_scene (see BackgroundSave::EditPacks).
+	void EditPacks();
+}
@@ -0,0 +1,210 @@
+#include "BackgroundSave.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "AssetExport.h"
+#include "gameobj.h"
+
+namespace {
+	const std::pair<const char*, Chunk Scene::*> packMembers[] = {
+		{ "Pack.PAL", &Scene::palPack },
+		{ "Pack.DXT", &Scene::dxtPack },
+		{ "Pack.LGT", &Scene::lgtPack },
+		{ "Pack.WAV", &Scene::wavPack },
+		{ "Pack.ANM", &Scene::anmPack },
+	};
+
+	struct SaveJob {
+		std::unique_ptr<Scene> snapshot;
+		std::filesystem::path path;
+		SaveOptions options;
+		std::vector<ZipCompression::EntryReport> reports;
+		std::string error;
+		std::thread thread;
+		std::chrono::steady_clock::time_point startTime;
+		std::atomic<bool> cancel = false;
+		std::atomic<bool> finished = false;
+		std::atomic<size_t> entriesDone = 0, numEntries = 1;
+		bool success = false;
+
+		// The packs are serialized from the live scene, unless they were copied
+		// into the snapshot because the live ones were about to be modified.
+		std::mutex packMutex;
+		std::unordered_set<std::string> serializedPacks;
+		bool packsCopied = false;
+	};
+
+	std::unique_ptr<SaveJob> g_saveJob;
+	std::optional<BackgroundSave::Result> g_finishedResult;
+
+	std::unique_ptr<Scene> CreateSnapshot(Scene& scene)
+	{
+		auto snap = std::make_unique<Scene>();
+		std::unordered_map<GameObject*, GameObject*> cloneMap;
+
+		auto cloneObj = [&](GameObject* obj, GameObject* parent, auto& rec) -> GameObject* {
+			GameObject* clone = new GameObject(*obj);
+			cloneMap[obj] = clone;
+			clone->parent = parent;
+			// meshes, lines and EXC chunks stay shared, they are replaced by new copies when edited
+			if (clone->light)
+				clone->light = std::make_shared<Light>(*clone->light);
+			for (GameObject*& child : clone->subobj)
+				child = rec(child, clone, rec);
+			return clone;
+		};
+		snap->superroot = cloneObj(scene.superroot, nullptr, cloneObj);
+		snap->rootobj = cloneMap.at(scene.rootobj);
+		snap->cliprootobj = cloneMap.at(scene.cliprootobj);
+
+		// Object references must now point to the clones
+		auto getClone = [&cloneMap](GameObject* obj) -> GameObject* {
+			auto it = cloneMap.find(obj);
+			return (it != cloneMap.end()) ? it->second : nullptr;
+		};
+		auto remapDbl = [&getClone](DBLList& dbl, auto& rec) -> void {
+			for (DBLEntry& entry : dbl.entries) {
+				if (GORef* ref = std::get_if<GORef>(&entry.value))
+					*ref = getClone(ref->get());
+				else if (auto* refs = std::get_if<std::vector<GORef>>(&entry.value))
+					for (GORef& ref : *refs)
+						ref = getClone(ref.get());
+				else if (DBLList* sublist = std::get_if<DBLList>(&entry.value))
+					rec(*sublist, rec);
+			}
+		};
+		for (auto& [original, clone] : cloneMap) {
+			if (clone->root)
+				clone->root = getClone(clone->root);
+			remapDbl(clone->dbl, remapDbl);
+		}
+
+		snap->lastSpkFilepath = scene.lastSpkFilepath;
+		snap->hasAnmPack = scene.hasAnmPack;
+		for (auto& [name, member] : packMembers)
+			(snap.get()->*member).tag = (scene.*member).tag;
+		auto [ands, sndr] = scene.audioMgr.save();
+		snap->audioMgr.load(ands, sndr);
+		snap->zdefNames = scene.zdefNames;
+		snap->zdefValues = scene.zdefValues;
+		remapDbl(snap->zdefValues, remapDbl);
+		snap->zdefTypes = scene.zdefTypes;
+		snap->msgDefinitions = scene.msgDefinitions;
+		snap->textureMaterialMap = scene.textureMaterialMap;
+		snap->numTextures = scene.numTextures;
+		snap->zipFilesIncluded = scene.zipFilesIncluded;
+		snap->dlcFiles = scene.dlcFiles;
+		snap->scenePaths = scene.scenePaths;
+		snap->remainingChunks = scene.remainingChunks;
+		// only used to print the differences with the new SPK, given back once the save is done
+		snap->oldSpkChunk = std::move(scene.oldSpkChunk);
+		snap->ready = true;
+		return snap;
+	}
+
+	void FinalizeJob()
+	{
+		g_saveJob->thread.join();
+		BackgroundSave::Result result;
+		result.success = g_saveJob->success;
+		result.cancelled = g_saveJob->cancel;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_saveJob->startTime).count();
+		result.reports = std::move(g_saveJob->reports);
+		result.error = std::move(g_saveJob->error);
+		g_scene.oldSpkChunk = std::move(g_saveJob->snapshot->oldSpkChunk);
+		// the snapshot holds references counted in g_objRefCounts, so it must be destroyed on the main thread
+		g_saveJob.reset();
+		g_finishedResult = std::move(result);
+	}
+}
+
+bool BackgroundSave::Start(const std::filesystem::path& fn, ZipCompression::Profile profile)
+{
+	if (g_saveJob)
+		return false;
+	g_saveJob = std::make_unique<SaveJob>();
+	SaveJob* job = g_saveJob.get();
+	job->startTime = std::chrono::steady_clock::now();
+	job->path = fn;
+	job->snapshot = CreateSnapshot(g_scene);
+
+	job->options.profile = profile;
+	job->options.reports = &job->reports;
+	job->options.sourceZip = &g_scene.zipmem;
+	job->options.cancel = &job->cancel;
+	job->options.error = &job->error;
+	job->options.progress = [job](size_t entriesDone, size_t numEntries) {
+		job->numEntries = numEntries;
+		job->entriesDone = entriesDone;
+	};
+	job->options.serializePack = [job](const char* filename, Chunk& snapshotPack) {
+		std::lock_guard<std::mutex> lock(job->packMutex);
+		job->serializedPacks.insert(filename);
+		if (job->packsCopied)
+			return snapshotPack.saveToString();
+		for (auto& [name, member] : packMembers)
+			if (!strcmp(name, filename))
+				return (g_scene.*member).saveToString();
+		return snapshotPack.saveToString();
+	};
+
+	job->thread = std::thread([job]() {
+		job->success = job->snapshot->SaveSceneSPK(job->path, job->options);
+		job->finished = true;
+	});
+	return true;
+}
+
+bool BackgroundSave::IsRunning()
+{
+	return (bool)g_saveJob;
+}
+
+float BackgroundSave::GetProgress()
+{
+	if (!g_saveJob)
+		return 1.0f;
+	return (float)g_saveJob->entriesDone / (float)g_saveJob->numEntries;
+}
+
+void BackgroundSave::Cancel()
+{
+	if (g_saveJob)
+		g_saveJob->cancel = true;
+}
+
+void BackgroundSave::Wait()
+{
+	if (g_saveJob)
+		FinalizeJob();
+}
+
+std::optional<BackgroundSave::Result> BackgroundSave::PollFinished()
+{
+	if (g_saveJob && g_saveJob->finished)
+		FinalizeJob();
+	return std::exchange(g_finishedResult, std::nullopt);
+}
+
+void BackgroundSave::EditPacks()
+{
+	// the running asset export shares the packs too
+	AssetExport::EditPacks();
+	if (!g_saveJob)
+		return;
+	std::lock_guard<std::mutex> lock(g_saveJob->packMutex);
+	if (g_saveJob->packsCopied)
+		return;
+	for (auto& [name, member] : packMembers)
+		if (!g_saveJob->serializedPacks.count(name))
+			g_saveJob->snapshot.get()->*member = g_scene.*member;
+	g_saveJob->packsCopied = true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ZipCompression.h"
+
+// Saving g_scene on a worker thread while the editor keeps running.
+// The worker saves a snapshot of the scene that shares its meshes, EXC chunks and asset packs
+// with the live scene. Meshes and EXC chunks are never modified in place (see UndoHistory),
+// the packs must be made writable with EditPacks before being modified.
+namespace BackgroundSave {
+	struct Result {
+		bool success = false;
+		bool cancelled = false;
+		double seconds = 0.0;
+		std::vector<ZipCompression::EntryReport> reports;
+		// why the save failed, to show from the main thread
+		std::string error;
+	};
+
+	// Takes the snapshot and starts the save. Returns false if a save is already running.
+	bool Start(const std::filesystem::path& fn, ZipCompression::Profile profile);
+	bool IsRunning();
+	float GetProgress();
+	void Cancel();
+	// Blocks until the running save is completely finished.
+	void Wait();
+	// To call every frame from the main thread. Returns the result once the save is finished.
+	std::optional<Result> PollFinished();
+
+	// To call before modifying the texture, lightmap or wave packs of g_scene. Also tells the asset export.
+	void EditPacks();
+}
@@ -50,7 +50,7 @@ private:
 };
 
 template<>
-void ByteReader::readTo<Vector3>(Vector3& val) {
+inline void ByteReader::readTo<Vector3>(Vector3& val) {
     readTo(val.x);
     readTo(val.y);
     readTo(val.z);
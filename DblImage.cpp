@@ -0,0 +1,494 @@
+#include "DblImage.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <list>
+
+#include "TextureDecode.h"
+
+#include <emmintrin.h>
+
+namespace {
+	constexpr uint32_t swap_rb(uint32_t a) { return (a & 0xFF00FF00) | ((a & 0xFF0000) >> 16) | ((a & 255) << 16); }
+
+	// Reads the data, checking that it holds the values
+	struct Reader {
+		const uint8_t* ptr;
+		const uint8_t* end;
+		bool has(size_t numBytes) const { return (size_t)(end - ptr) >= numBytes; }
+		template <typename T> T read() {
+			T val;
+			memcpy(&val, ptr, sizeof(T));
+			ptr += sizeof(T);
+			return val;
+		}
+	};
+
+	struct Header {
+		bool weird = false;
+		std::vector<std::array<int32_t, 4>> quadIndices;
+		std::vector<std::array<int16_t, 2>> vertices;
+		// padded to 256 colors for the lookups
+		std::array<uint32_t, 256> palette = {};
+	};
+
+	bool ReadHeader(Reader& r, int type, Header& header)
+	{
+		if (!r.has(8))
+			return false;
+		int numQuads = r.read<int32_t>();
+		if (numQuads == 0x40000001) {
+			numQuads = r.read<int32_t>();
+			header.weird = true;
+			if (!r.has(4))
+				return false;
+		}
+		numQuads &= 0xFFFFFF;
+		uint32_t numVerts = r.read<uint32_t>();
+		if (!r.has((size_t)numQuads * 16) || !r.has((size_t)numQuads * 16 + (size_t)numVerts * 8))
+			return false;
+		header.quadIndices.resize(numQuads);
+		for (auto& qi : header.quadIndices)
+			for (auto& c : qi)
+				c = r.read<int32_t>();
+		header.vertices.resize(numVerts);
+		for (auto& v : header.vertices)
+			for (auto& c : v)
+				c = (int16_t)r.read<int32_t>();
+		if (type >= 2 && type <= 4) {
+			if (!r.has(4))
+				return false;
+			uint32_t numPaletteColors = r.read<uint32_t>();
+			if (!r.has((size_t)numPaletteColors * 4))
+				return false;
+			for (uint32_t i = 0; i < numPaletteColors; i++) {
+				uint32_t c = swap_rb(r.read<uint32_t>());
+				if (i < 256)
+					header.palette[i] = c;
+			}
+		}
+		return true;
+	}
+
+	// Position, size and visible part of a piece
+	struct Piece {
+		int lowX, lowY;
+		int dw, dh;
+		// visible rectangle, relative to the piece
+		int x0, x1, y0, y1;
+		size_t dataSize;
+	};
+
+	bool ReadPiece(Reader& r, const Header& header, const std::array<int32_t, 4>& qi, int type, int width, int height, Piece& piece)
+	{
+		for (int32_t index : qi)
+			if (index < 0 || (size_t)index >= header.vertices.size())
+				return false;
+		const auto& v = header.vertices;
+		auto [lowX, highX] = std::minmax({ v[qi[0]][0], v[qi[1]][0], v[qi[2]][0], v[qi[3]][0] });
+		auto [lowY, highY] = std::minmax({ v[qi[0]][1], v[qi[1]][1], v[qi[2]][1], v[qi[3]][1] });
+		if (!r.has(header.weird ? 12 : 8))
+			return false;
+		if (header.weird)
+			r.read<int32_t>();
+		int16_t dw = r.read<int16_t>();
+		int16_t dh = r.read<int16_t>();
+		int16_t s2 = r.read<int16_t>();
+		int16_t s3 = r.read<int16_t>();
+		if (dw < 0 || dh < 0)
+			return false;
+		int rw = (s2 >= 0) ? s2 : dw;
+		int rh = (s3 >= 0) ? s3 : dh;
+		piece.lowX = lowX;
+		piece.lowY = lowY;
+		piece.dw = dw;
+		piece.dh = dh;
+		piece.x0 = std::max(0, -lowX);
+		piece.x1 = std::min({ rw, (int)dw, width - lowX });
+		piece.y0 = std::max(0, -lowY);
+		piece.y1 = std::min({ rh, (int)dh, height - lowY });
+		const size_t numPixels = (size_t)dw * dh;
+		switch (type) {
+		case 0: piece.dataSize = numPixels * 4; break;
+		case 3: piece.dataSize = numPixels * 2; break;
+		case 4: piece.dataSize = (size_t)((dw + 1) / 2) * dh; break;
+		default: piece.dataSize = numPixels; break;
+		}
+		return r.has(piece.dataSize);
+	}
+
+	// dst[i] = swap_rb(src[i]) ^ xorMask
+	void SwapRBRow(const uint8_t* src, size_t count, uint32_t* dst, uint32_t xorMask)
+	{
+		const __m128i agMask = _mm_set1_epi32((int)0xFF00FF00);
+		const __m128i byteMask = _mm_set1_epi32(0xFF);
+		const __m128i xorVec = _mm_set1_epi32((int)xorMask);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i p = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+			__m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), byteMask);
+			__m128i b = _mm_slli_epi32(_mm_and_si128(p, byteMask), 16);
+			__m128i q = _mm_or_si128(_mm_and_si128(p, agMask), _mm_or_si128(r, b));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(q, xorVec));
+		}
+		for (; i < count; i++) {
+			uint32_t c;
+			memcpy(&c, src + 4 * i, 4);
+			dst[i] = swap_rb(c) ^ xorMask;
+		}
+	}
+
+	// dst[i] |= alpha[i] << 24
+	void MergeAlphaRow(const uint8_t* alpha, size_t count, uint32_t* dst)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i a8 = _mm_loadu_si128((const __m128i*)(alpha + i));
+			__m128i a16lo = _mm_unpacklo_epi8(zero, a8);
+			__m128i a16hi = _mm_unpackhi_epi8(zero, a8);
+			// the alpha bytes end up in the top byte of each pixel
+			__m128i a32[4] = { _mm_unpacklo_epi16(zero, a16lo), _mm_unpackhi_epi16(zero, a16lo),
+				_mm_unpacklo_epi16(zero, a16hi), _mm_unpackhi_epi16(zero, a16hi) };
+			for (int k = 0; k < 4; k++) {
+				__m128i* p = (__m128i*)(dst + i + 4 * k);
+				_mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), a32[k]));
+			}
+		}
+		for (; i < count; i++)
+			dst[i] |= (uint32_t)alpha[i] << 24;
+	}
+
+	// indices[2i] = bytes[i] & 15, indices[2i+1] = bytes[i] >> 4
+	void SplitNibbles(const uint8_t* bytes, size_t numBytes, uint8_t* indices)
+	{
+		const __m128i lowMask = _mm_set1_epi8(15);
+		size_t i = 0;
+		for (; i + 16 <= numBytes; i += 16) {
+			__m128i b = _mm_loadu_si128((const __m128i*)(bytes + i));
+			__m128i lo = _mm_and_si128(b, lowMask);
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), lowMask);
+			_mm_storeu_si128((__m128i*)(indices + 2 * i), _mm_unpacklo_epi8(lo, hi));
+			_mm_storeu_si128((__m128i*)(indices + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+		}
+		for (; i < numBytes; i++) {
+			indices[2 * i] = bytes[i] & 15;
+			indices[2 * i + 1] = bytes[i] >> 4;
+		}
+	}
+
+	void ApplyAlphaMode(std::vector<uint32_t>& pixels, bool opacity)
+	{
+		// opacity: inverse alpha, else force alpha to 255
+		const __m128i mask = _mm_set1_epi32((int)0xFF000000);
+		uint32_t* p = pixels.data();
+		size_t i = 0;
+		for (; i + 4 <= pixels.size(); i += 4) {
+			__m128i c = _mm_loadu_si128((const __m128i*)(p + i));
+			c = opacity ? _mm_xor_si128(c, mask) : _mm_or_si128(c, mask);
+			_mm_storeu_si128((__m128i*)(p + i), c);
+		}
+		for (; i < pixels.size(); i++)
+			p[i] = opacity ? (p[i] ^ 0xFF000000) : (p[i] | 0xFF000000);
+	}
+
+	struct CacheEntry {
+		GameObject* obj;
+		const uint8_t* data;
+		size_t dataSize;
+		int type, width, height;
+		bool opacity;
+		std::shared_ptr<const DblImage::Image> image;
+	};
+	// most recently used first
+	std::list<CacheEntry> g_imageCache;
+	size_t g_imageCacheBytes = 0;
+	constexpr size_t imageCacheBudget = (size_t)64 << 20;
+	uint64_t g_nextImageSerial = 1;
+
+	size_t GetImageBytes(const DblImage::Image& image) { return image.pixels.size() * 4; }
+}
+
+std::vector<uint32_t> DblImage::Unsplit(const uint8_t* data, size_t dataSize, int type, int width, int height, bool opacity)
+{
+	std::vector<uint32_t> unpacked((size_t)width * height, 0xFFFF00FF);
+	Reader r = { data, data + dataSize };
+	Header header;
+	if (!ReadHeader(r, type, header)) {
+		ApplyAlphaMode(unpacked, opacity);
+		return unpacked;
+	}
+	std::array<uint32_t, 256> colorPalette = header.palette;
+	for (uint32_t& c : colorPalette)
+		c &= 0xFFFFFF;
+	std::vector<uint8_t> indices;
+
+	for (const auto& qi : header.quadIndices) {
+		Piece pc;
+		if (!ReadPiece(r, header, qi, type, width, height, pc))
+			break;
+		const uint8_t* src = r.ptr;
+		r.ptr += pc.dataSize;
+		if (pc.x0 >= pc.x1 || pc.y0 >= pc.y1)
+			continue;
+		const size_t count = pc.x1 - pc.x0;
+		for (int dy = pc.y0; dy < pc.y1; ++dy) {
+			uint32_t* dst = unpacked.data() + (size_t)(pc.lowY + dy) * width + (pc.lowX + pc.x0);
+			const size_t rowStart = (size_t)dy * pc.dw + pc.x0;
+			if (type == 0)
+				SwapRBRow(src + 4 * rowStart, count, dst, 0);
+			else if (type == 2)
+				TextureDecode::ExpandPalette(src + rowStart, count, header.palette.data(), dst);
+			else if (type == 3) {
+				TextureDecode::ExpandPalette(src + rowStart, count, colorPalette.data(), dst);
+				MergeAlphaRow(src + (size_t)pc.dw * pc.dh + rowStart, count, dst);
+			}
+			else if (type == 4) {
+				const size_t bytesPerRow = (pc.dw + 1) / 2;
+				indices.resize(2 * bytesPerRow);
+				SplitNibbles(src + dy * bytesPerRow, bytesPerRow, indices.data());
+				TextureDecode::ExpandPalette(indices.data() + pc.x0, count, header.palette.data(), dst);
+			}
+		}
+	}
+	ApplyAlphaMode(unpacked, opacity);
+	return unpacked;
+}
+
+std::vector<uint32_t> DblImage::UnsplitScalar(const uint8_t* data, size_t dataSize, int type, int width, int height, bool opacity)
+{
+	std::vector<uint32_t> unpacked((size_t)width * height, 0xFFFF00FF);
+	Reader r = { data, data + dataSize };
+	Header header;
+	if (ReadHeader(r, type, header)) {
+		for (const auto& qi : header.quadIndices) {
+			Piece pc;
+			if (!ReadPiece(r, header, qi, type, width, height, pc))
+				break;
+			const uint8_t* src = r.ptr;
+			r.ptr += pc.dataSize;
+			auto visible = [&pc](int dx, int dy) { return dx >= pc.x0 && dx < pc.x1 && dy >= pc.y0 && dy < pc.y1; };
+			auto pixel = [&](int dx, int dy) -> uint32_t& { return unpacked[(size_t)(pc.lowY + dy) * width + (pc.lowX + dx)]; };
+			for (int dy = 0; dy < pc.dh; ++dy) {
+				for (int dx = 0; dx < pc.dw; ++dx) {
+					if (!visible(dx, dy))
+						continue;
+					const size_t i = (size_t)dy * pc.dw + dx;
+					if (type == 0) {
+						uint32_t c;
+						memcpy(&c, src + 4 * i, 4);
+						pixel(dx, dy) = swap_rb(c);
+					}
+					else if (type == 2)
+						pixel(dx, dy) = header.palette[src[i]];
+					else if (type == 3)
+						pixel(dx, dy) = (header.palette[src[i]] & 0xFFFFFF) | ((uint32_t)src[(size_t)pc.dw * pc.dh + i] << 24);
+					else if (type == 4) {
+						uint8_t byte = src[dy * ((pc.dw + 1) / 2) + dx / 2];
+						pixel(dx, dy) = header.palette[(dx & 1) ? (byte >> 4) : (byte & 15)];
+					}
+				}
+			}
+		}
+	}
+	for (auto& col : unpacked)
+		col = opacity ? (col ^ 0xFF000000) : (0xFF000000 | (col & 0x00FFFFFF));
+	return unpacked;
+}
+
+std::vector<uint8_t> DblImage::Split(const uint32_t* image, int width, int height)
+{
+	// NOTE: Texture pieces can only have a max size of 256x256 pixels.
+	// For D3D and OGL renderers, pieces can be non power of 2.
+	// For Glide, they HAVE to be power of 2.
+	// Hence:
+	// This algorithm will split image in 256x256 textures, remaining are upped to power of 2.
+	// Not exactly how the original dbl images were splitted by devs, but good enough.
+
+	auto bitceil = [](uint32_t val) {
+		for (uint32_t t = 0x80000000; t != 0; t >>= 1) {
+			if (t & val) {
+				return (t == val) ? t : (t << 1);
+			}
+		}
+		return 0u;
+		};
+
+	static constexpr int MAX_LENGTH = 256;
+	int numQuadsX = width / MAX_LENGTH + ((width % MAX_LENGTH) ? 1 : 0);
+	int numQuadsY = height / MAX_LENGTH + ((height % MAX_LENGTH) ? 1 : 0);
+	int numQuads = numQuadsX * numQuadsY;
+	int numVertices = (numQuadsX + 1) * (numQuadsY + 1);
+
+	// the size is known in advance
+	size_t totalSize = 8 + (size_t)numQuads * 16 + (size_t)numVertices * 8;
+	for (int y = 0; y < numQuadsY; ++y)
+		for (int x = 0; x < numQuadsX; ++x)
+			totalSize += 8 + (size_t)4 * bitceil(std::min(MAX_LENGTH, width - x * MAX_LENGTH)) * bitceil(std::min(MAX_LENGTH, height - y * MAX_LENGTH));
+	std::vector<uint8_t> buffer(totalSize);
+	uint8_t* out = buffer.data();
+	auto writeAny = [&out](const auto& val) { memcpy(out, &val, sizeof(val)); out += sizeof(val); };
+	auto write16 = [&](int16_t val) {writeAny(val); };
+	auto write32 = [&](int32_t val) {writeAny(val); };
+
+	write32(numQuads);
+	write32(numVertices);
+	for (int y = 0; y < numQuadsY; ++y) {
+		for (int x = 0; x < numQuadsX; ++x) {
+			write32((y + 1) * (numQuadsX + 1) + x);
+			write32((y + 1) * (numQuadsX + 1) + x + 1);
+			write32(y * (numQuadsX + 1) + x + 1);
+			write32(y * (numQuadsX + 1) + x);
+		}
+	}
+	for (int y = 0; y < numQuadsY + 1; ++y) {
+		for (int x = 0; x < numQuadsX + 1; ++x) {
+			write32(std::min(x * MAX_LENGTH, width));
+			write32(std::min(y * MAX_LENGTH, height));
+		}
+	}
+	for (int y = 0; y < numQuadsY; ++y) {
+		for (int x = 0; x < numQuadsX; ++x) {
+			int px0 = x * MAX_LENGTH;
+			int py0 = y * MAX_LENGTH;
+			int px1 = std::min((x + 1) * MAX_LENGTH, width);
+			int py1 = std::min((y + 1) * MAX_LENGTH, height);
+			int sqwidth = px1 - px0;
+			int sqheight = py1 - py0;
+			int texwidth = bitceil(sqwidth);
+			int texheight = bitceil(sqheight);
+			write16(texwidth);
+			write16(texheight);
+			write16(sqwidth);
+			write16(sqheight);
+			for (int v = py0; v < py0 + texheight; ++v) {
+				uint32_t* row = (uint32_t*)out;
+				if (v < py1) {
+					SwapRBRow((const uint8_t*)(image + (size_t)v * width + px0), sqwidth, row, 0xFF000000);
+					memset(row + sqwidth, 0, (size_t)4 * (texwidth - sqwidth));
+				}
+				else
+					memset(row, 0, (size_t)4 * texwidth);
+				out += (size_t)4 * texwidth;
+			}
+		}
+	}
+	return buffer;
+}
+
+std::shared_ptr<const DblImage::Image> DblImage::GetCached(GameObject* obj, const std::vector<uint8_t>& data, int type, int width, int height, bool opacity)
+{
+	auto it = std::find_if(g_imageCache.begin(), g_imageCache.end(), [obj](const CacheEntry& entry) { return entry.obj == obj; });
+	if (it != g_imageCache.end()) {
+		if (it->data == data.data() && it->dataSize == data.size() && it->type == type && it->width == width && it->height == height && it->opacity == opacity) {
+			g_imageCache.splice(g_imageCache.begin(), g_imageCache, it);
+			return it->image;
+		}
+		g_imageCacheBytes -= GetImageBytes(*it->image);
+		g_imageCache.erase(it);
+	}
+
+	auto image = std::make_shared<Image>();
+	image->width = width;
+	image->height = height;
+	image->pixels = Unsplit(data.data(), data.size(), type, width, height, opacity);
+	image->serial = g_nextImageSerial++;
+	g_imageCache.push_front({ obj, data.data(), data.size(), type, width, height, opacity, image });
+	g_imageCacheBytes += GetImageBytes(*image);
+	// the image just decoded always stays
+	while (g_imageCacheBytes > imageCacheBudget && g_imageCache.size() > 1) {
+		g_imageCacheBytes -= GetImageBytes(*g_imageCache.back().image);
+		g_imageCache.pop_back();
+	}
+	return image;
+}
+
+void DblImage::Invalidate(GameObject* obj)
+{
+	auto it = std::find_if(g_imageCache.begin(), g_imageCache.end(), [obj](const CacheEntry& entry) { return entry.obj == obj; });
+	if (it != g_imageCache.end()) {
+		g_imageCacheBytes -= GetImageBytes(*it->image);
+		g_imageCache.erase(it);
+	}
+}
+
+void DblImage::ClearCache()
+{
+	g_imageCache.clear();
+	g_imageCacheBytes = 0;
+}
+
+void DblImage::PrintBenchmark()
+{
+	// HUD-sized image, with pieces cut at the edges
+	static constexpr int width = 2000, height = 1200;
+	static const char* const typeNames[5] = { "BGRA", "", "8-bit", "8-bit+alpha", "4-bit" };
+	std::vector<uint32_t> source((size_t)width * height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			source[(size_t)y * width + x] = (x * 255 / width) | ((y * 255 / height) << 8) | (((x ^ y) & 255) << 16) | (((x + y) & 255) << 24);
+
+	auto timeBest = [](auto&& func) {
+		double best = 1e9;
+		for (int run = 0; run < 5; run++) {
+			auto startTime = std::chrono::steady_clock::now();
+			func();
+			best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+		}
+		return best;
+	};
+
+	std::vector<uint8_t> encoded;
+	double splitSeconds = timeBest([&]() { encoded = Split(source.data(), width, height); });
+	printf("DBL image benchmark: %ix%i, split in %.2f ms (%zu bytes)\n", width, height, splitSeconds * 1000.0, encoded.size());
+
+	for (int type : { 0, 2, 3, 4 }) {
+		// the palette formats reuse the pieces of the BGRA data, converted
+		std::vector<uint8_t> data;
+		if (type == 0)
+			data = encoded;
+		else {
+			Reader r = { encoded.data(), encoded.data() + encoded.size() };
+			Header header;
+			ReadHeader(r, 0, header);
+			const uint8_t* headerEnd = r.ptr;
+			data.assign((const uint8_t*)encoded.data(), headerEnd);
+			const uint32_t numColors = (type == 4) ? 16 : 256;
+			data.insert(data.end(), (const uint8_t*)&numColors, (const uint8_t*)&numColors + 4);
+			for (uint32_t i = 0; i < numColors; i++) {
+				uint32_t color = (i * 0x010101u * ((type == 4) ? 17 : 1)) | 0xFF000000;
+				data.insert(data.end(), (const uint8_t*)&color, (const uint8_t*)&color + 4);
+			}
+			for (const auto& qi : header.quadIndices) {
+				Piece pc;
+				ReadPiece(r, header, qi, 0, width, height, pc);
+				data.insert(data.end(), r.ptr - 8, r.ptr);
+				const uint8_t* src = r.ptr;
+				r.ptr += pc.dataSize;
+				const size_t numPixels = (size_t)pc.dw * pc.dh;
+				if (type == 4) {
+					for (int dy = 0; dy < pc.dh; dy++)
+						for (int dx = 0; dx < pc.dw; dx += 2)
+							data.push_back((src[4 * (dy * pc.dw + dx)] >> 4) | ((dx + 1 < pc.dw) ? (src[4 * (dy * pc.dw + dx + 1)] & 0xF0) : 0));
+				}
+				else {
+					for (size_t i = 0; i < numPixels; i++)
+						data.push_back(src[4 * i]);
+					if (type == 3)
+						for (size_t i = 0; i < numPixels; i++)
+							data.push_back(src[4 * i + 3]);
+				}
+			}
+		}
+
+		std::vector<uint32_t> scalar, vectorized;
+		double scalarSeconds = timeBest([&]() { scalar = UnsplitScalar(data.data(), data.size(), type, width, height, true); });
+		double vectorSeconds = timeBest([&]() { vectorized = Unsplit(data.data(), data.size(), type, width, height, true); });
+		const double mpix = (double)width * height / 1e6;
+		printf("  type %i %-12s scalar %7.2f ms, SSE %7.2f ms (%6.1f Mpix/s), %s\n", type, typeNames[type],
+			scalarSeconds * 1000.0, vectorSeconds * 1000.0, mpix / vectorSeconds, (scalar == vectorized) ? "identical" : "DIFFERENT");
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct GameObject;
+
+// Images of the 2D objects, stored in their DBL's "Squares" data as pieces of at most 256x256 pixels.
+// Piece pixel formats: 0 = BGRA, 2 = 8-bit palette, 3 = 8-bit palette then 8-bit alpha, 4 = 4-bit palette.
+namespace DblImage {
+	struct Image {
+		int width = 0, height = 0;
+		std::vector<uint32_t> pixels;
+		// different for every decoded image, to know when a texture must be updated
+		uint64_t serial = 0;
+	};
+
+	// Assembles the pieces into a RGBA8 image. The pieces outside of the image or the data are ignored.
+	std::vector<uint32_t> Unsplit(const uint8_t* data, size_t dataSize, int type, int width, int height, bool opacity);
+	// Same, one pixel at a time, to verify Unsplit.
+	std::vector<uint32_t> UnsplitScalar(const uint8_t* data, size_t dataSize, int type, int width, int height, bool opacity);
+	// Splits the RGBA8 image into BGRA pieces (format 0).
+	std::vector<uint8_t> Split(const uint32_t* image, int width, int height);
+
+	// Returns the decoded image of the object, decoding it only if the data or format changed since the last time.
+	// The least recently used images are dropped above a memory budget.
+	std::shared_ptr<const Image> GetCached(GameObject* obj, const std::vector<uint8_t>& data, int type, int width, int height, bool opacity);
+	// To call when the object's DBL was modified or the object was destroyed.
+	void Invalidate(GameObject* obj);
+	void ClearCache();
+
+	// Times the decoding of large synthetic images in every format, scalar and vectorized, and the encoding.
+	void PrintBenchmark();
+}
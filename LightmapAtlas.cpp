@@ -0,0 +1,193 @@
+#include "LightmapAtlas.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.h"
+#include "gameobj.h"
+#include "texture.h"
+#include "TextureDecode.h"
+
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "imgui/imstb_rectpack.h"
+
+namespace {
+	// texels repeated around each lightmap, so that the bilinear filtering doesn't take the neighbours
+	constexpr int padding = 1;
+	constexpr size_t maxAtlases = 0x100;
+
+	struct PackedLightmap {
+		uint32_t lgtId;
+		int x, y, width, height;
+	};
+
+	struct Atlas {
+		int width, height;
+		std::vector<PackedLightmap> lightmaps;
+	};
+
+	struct AtlasState {
+		bool valid = false;
+		size_t numLgtChunks = 0;
+		std::vector<Atlas> atlases;
+		std::unordered_map<uint32_t, LightmapAtlas::Placement> placements;
+		LightmapAtlas::Stats stats;
+	};
+	AtlasState g_atlasState;
+
+	int RoundUpToPowerOf2(int value)
+	{
+		int result = 1;
+		while (result < value)
+			result *= 2;
+		return result;
+	}
+}
+
+bool LightmapAtlas::Update(const Scene& scene)
+{
+	AtlasState& state = g_atlasState;
+	if (state.valid && state.numLgtChunks == scene.lgtPack.subchunks.size())
+		return false;
+	auto startTime = std::chrono::steady_clock::now();
+
+	// the old atlases must not stay on the GPU under their IDs
+	for (size_t k = 0; k < state.atlases.size(); k++)
+		GetTextureResidency().invalidate(firstAtlasId + (uint32_t)k);
+	state.atlases.clear();
+	state.placements.clear();
+	state.stats = {};
+	state.valid = true;
+	state.numLgtChunks = scene.lgtPack.subchunks.size();
+
+	std::vector<stbrp_rect> remaining;
+	const auto& lgtChunks = scene.lgtPack.subchunks;
+	for (size_t i = 0; i < lgtChunks.size(); i++) {
+		if (lgtChunks[i].tag != 'PALN' && lgtChunks[i].tag != 'RGBA')
+			continue;
+		const TexInfo* ti = (const TexInfo*)lgtChunks[i].maindata.data();
+		state.stats.numLightmaps++;
+		// the large lightmaps wouldn't save much, and would waste the atlases' space
+		if (ti->width + 2 * padding > atlasSize / 2 || ti->height + 2 * padding > atlasSize / 2)
+			continue;
+		stbrp_rect rect = {};
+		rect.id = (int)i;
+		rect.w = ti->width + 2 * padding;
+		rect.h = ti->height + 2 * padding;
+		remaining.push_back(rect);
+	}
+	// the atlas IDs must not be used by the scene's textures
+	if (scene.numTextures >= firstAtlasId)
+		remaining.clear();
+
+	std::vector<stbrp_node> nodes(atlasSize);
+	while (!remaining.empty() && state.atlases.size() < maxAtlases) {
+		stbrp_context context;
+		stbrp_init_target(&context, atlasSize, atlasSize, nodes.data(), (int)nodes.size());
+		stbrp_pack_rects(&context, remaining.data(), (int)remaining.size());
+
+		Atlas atlas;
+		atlas.width = atlasSize;
+		int usedHeight = 0;
+		std::vector<stbrp_rect> unpacked;
+		for (const stbrp_rect& rect : remaining) {
+			if (!rect.was_packed) {
+				unpacked.push_back(rect);
+				continue;
+			}
+			const TexInfo* ti = (const TexInfo*)lgtChunks[rect.id].maindata.data();
+			atlas.lightmaps.push_back({ ti->id, rect.x + padding, rect.y + padding, ti->width, ti->height });
+			usedHeight = std::max(usedHeight, rect.y + rect.h);
+		}
+		if (atlas.lightmaps.empty())
+			break;
+		// the last atlas is often partly empty
+		atlas.height = RoundUpToPowerOf2(usedHeight);
+
+		const uint16_t atlasId = (uint16_t)(firstAtlasId + state.atlases.size());
+		for (const PackedLightmap& lm : atlas.lightmaps) {
+			Placement& placement = state.placements[lm.lgtId];
+			placement.atlasId = atlasId;
+			placement.offsetU = ((float)lm.x + 0.5f) / (float)atlas.width;
+			placement.offsetV = ((float)lm.y + 0.5f) / (float)atlas.height;
+			placement.scaleU = (float)lm.width / (float)atlas.width;
+			placement.scaleV = (float)lm.height / (float)atlas.height;
+		}
+		state.stats.numPacked += atlas.lightmaps.size();
+		state.atlases.push_back(std::move(atlas));
+		remaining = std::move(unpacked);
+	}
+
+	state.stats.numAtlases = state.atlases.size();
+	state.stats.packSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	return true;
+}
+
+void LightmapAtlas::Invalidate()
+{
+	g_atlasState.valid = false;
+}
+
+const LightmapAtlas::Placement* LightmapAtlas::Find(uint32_t lgtId)
+{
+	if (!g_atlasState.valid)
+		return nullptr;
+	auto it = g_atlasState.placements.find(lgtId);
+	return (it != g_atlasState.placements.end()) ? &it->second : nullptr;
+}
+
+bool LightmapAtlas::IsAtlasId(uint32_t texId)
+{
+	return texId >= firstAtlasId && texId < firstAtlasId + g_atlasState.atlases.size();
+}
+
+TextureDecodeJob LightmapAtlas::MakeDecodeJob(uint32_t atlasId)
+{
+	if (!IsAtlasId(atlasId))
+		return {};
+	const Atlas& atlas = g_atlasState.atlases[atlasId - firstAtlasId];
+
+	// the job decodes copies of the lightmaps, as the packs can be modified in the meantime
+	std::vector<std::pair<PackedLightmap, std::shared_ptr<Chunk>>> sources;
+	for (const PackedLightmap& lm : atlas.lightmaps) {
+		if (Chunk* lgtChunk = FindTextureChunk(g_scene, lm.lgtId).first) {
+			auto copy = std::make_shared<Chunk>(lgtChunk->tag);
+			copy->maindata = lgtChunk->maindata;
+			sources.emplace_back(lm, std::move(copy));
+		}
+	}
+
+	return [width = atlas.width, height = atlas.height, sources = std::move(sources)]() {
+		auto pixels = std::make_shared<std::vector<uint32_t>>((size_t)width * height, 0xFFFFFFFF);
+		for (const auto& [lm, chunk] : sources) {
+			auto layout = TextureDecode::ParseLayout(chunk.get());
+			if (layout->levels.empty() || layout->width != lm.width || layout->height != lm.height)
+				continue;
+			const uint32_t* src = TextureDecode::DecodeLevel(chunk.get(), *layout, 0);
+			// copy with the borders repeating the edge texels
+			for (int y = -padding; y < lm.height + padding; y++) {
+				const uint32_t* srcRow = src + (size_t)std::clamp(y, 0, lm.height - 1) * lm.width;
+				uint32_t* dstRow = pixels->data() + (size_t)(lm.y + y) * width + lm.x;
+				for (int x = -padding; x < 0; x++)
+					dstRow[x] = srcRow[0];
+				std::copy(srcRow, srcRow + lm.width, dstRow);
+				for (int x = lm.width; x < lm.width + padding; x++)
+					dstRow[x] = srcRow[lm.width - 1];
+			}
+		}
+		DecodedTexture texture;
+		texture.levels.push_back({ width, height, pixels->data(), pixels->size() * 4 });
+		texture.numBytes = pixels->size() * 4;
+		texture.storage = pixels;
+		return texture;
+		};
+}
+
+const LightmapAtlas::Stats& LightmapAtlas::GetStats()
+{
+	return g_atlasState.stats;
+}
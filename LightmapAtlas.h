@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "TextureResidency.h"
+
+struct Scene;
+
+// Packing of the lgtPack's lightmaps into a few large textures, for the 3D view only: the scene
+// keeps its lightmaps, but the prepared meshes sample the atlases with remapped lightmap UVs,
+// so that the faces only differing by their lightmap are drawn together.
+namespace LightmapAtlas {
+	// The atlases are given to GetTexture with these IDs, above the scene's texture IDs.
+	constexpr uint32_t firstAtlasId = 0xFE00;
+	constexpr int atlasSize = 1024;
+
+	struct Placement {
+		uint16_t atlasId;
+		// atlas UV = lightmap UV * scale + offset, with the half texel offset of the lightmaps
+		float offsetU, offsetV, scaleU, scaleV;
+	};
+
+	struct Stats {
+		size_t numLightmaps = 0;
+		size_t numPacked = 0;
+		size_t numAtlases = 0;
+		double packSeconds = 0.0;
+	};
+
+	// Packs the lightmaps of the scene again if they changed since the last time.
+	// Returns true if the placements changed, then the prepared meshes must be rebuilt.
+	bool Update(const Scene& scene);
+	// The lightmaps will be packed again on the next update.
+	void Invalidate();
+	// Placement of the lightmap, null if it isn't in an atlas.
+	const Placement* Find(uint32_t lgtId);
+	bool IsAtlasId(uint32_t texId);
+	// Job composing the atlas from copies of its lightmaps, to give to the texture residency.
+	TextureDecodeJob MakeDecodeJob(uint32_t atlasId);
+	const Stats& GetStats();
+}
@@ -0,0 +1,338 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace {
+	// Forsyth's scoring
+	constexpr int forsythCacheSize = 32;
+	constexpr float lastTriangleScore = 0.75f;
+	constexpr float cacheDecayPower = 1.5f;
+	constexpr float valenceBoostScale = 2.0f;
+	constexpr float valenceBoostPower = 0.5f;
+	constexpr int maxValence = 64;
+
+	struct ScoreTables {
+		std::array<float, forsythCacheSize> cache;
+		std::array<float, maxValence + 1> valence;
+		ScoreTables() {
+			for (int i = 0; i < forsythCacheSize; i++) {
+				if (i < 3)
+					cache[i] = lastTriangleScore;
+				else
+					cache[i] = std::pow(1.0f - (float)(i - 3) / (forsythCacheSize - 3), cacheDecayPower);
+			}
+			valence[0] = 0.0f;
+			for (int i = 1; i <= maxValence; i++)
+				valence[i] = valenceBoostScale * std::pow((float)i, -valenceBoostPower);
+		}
+	};
+
+	float VertexScore(const ScoreTables& tables, int cachePosition, int remainingValence)
+	{
+		if (remainingValence == 0)
+			return -1.0f;
+		float score = (cachePosition >= 0) ? tables.cache[cachePosition] : 0.0f;
+		return score + tables.valence[std::min(remainingValence, maxValence)];
+	}
+
+	struct Vec3 {
+		float x, y, z;
+		Vec3 operator+(const Vec3& o) const { return { x + o.x, y + o.y, z + o.z }; }
+		Vec3 operator-(const Vec3& o) const { return { x - o.x, y - o.y, z - o.z }; }
+		Vec3 operator*(float f) const { return { x * f, y * f, z * f }; }
+		float dot(const Vec3& o) const { return x * o.x + y * o.y + z * o.z; }
+		Vec3 cross(const Vec3& o) const { return { y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x }; }
+	};
+}
+
+MeshOptimizer::CacheStats MeshOptimizer::AnalyzeVertexCache(const uint16_t* indices, size_t numIndices, size_t numVertices, int cacheSize)
+{
+	CacheStats stats;
+	stats.numTriangles = numIndices / 3;
+	stats.numVertices = numVertices;
+	// a vertex is in the cache if it was added less than cacheSize misses ago
+	std::vector<size_t> addedAt(numVertices, 0);
+	size_t time = (size_t)cacheSize + 1;
+	for (size_t i = 0; i < numIndices; i++) {
+		const uint16_t v = indices[i];
+		if (time - addedAt[v] > (size_t)cacheSize) {
+			addedAt[v] = time++;
+			stats.numMisses++;
+		}
+	}
+	return stats;
+}
+
+void MeshOptimizer::OptimizeVertexCache(uint16_t* indices, size_t numIndices, size_t numVertices)
+{
+	static const ScoreTables tables;
+	const size_t numTriangles = numIndices / 3;
+	if (numTriangles < 2)
+		return;
+
+	// triangles of each vertex
+	std::vector<uint32_t> adjacencyStart(numVertices + 1, 0);
+	for (size_t i = 0; i < numTriangles * 3; i++)
+		adjacencyStart[indices[i] + 1]++;
+	std::partial_sum(adjacencyStart.begin(), adjacencyStart.end(), adjacencyStart.begin());
+	std::vector<uint32_t> adjacency(numTriangles * 3);
+	std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t t = 0; t < numTriangles; t++)
+		for (int k = 0; k < 3; k++)
+			adjacency[fill[indices[3 * t + k]]++] = (uint32_t)t;
+
+	std::vector<int> remainingValence(numVertices), cachePosition(numVertices, -1);
+	std::vector<float> vertexScore(numVertices);
+	for (size_t v = 0; v < numVertices; v++) {
+		remainingValence[v] = (int)(adjacencyStart[v + 1] - adjacencyStart[v]);
+		vertexScore[v] = VertexScore(tables, -1, remainingValence[v]);
+	}
+	std::vector<float> triangleScore(numTriangles);
+	std::vector<bool> emitted(numTriangles, false);
+	for (size_t t = 0; t < numTriangles; t++)
+		triangleScore[t] = vertexScore[indices[3 * t]] + vertexScore[indices[3 * t + 1]] + vertexScore[indices[3 * t + 2]];
+
+	std::vector<uint16_t> output;
+	output.reserve(numTriangles * 3);
+	// the 3 extra entries receive the vertices pushed out by the last triangle
+	std::array<int, forsythCacheSize + 3> cache, newCache;
+	int cacheCount = 0;
+	size_t scanCursor = 0;
+	auto bestInAll = [&]() -> int64_t {
+		while (scanCursor < numTriangles && emitted[scanCursor])
+			scanCursor++;
+		int64_t best = -1;
+		float bestScore = -1e30f;
+		for (size_t t = scanCursor; t < numTriangles; t++) {
+			if (!emitted[t] && triangleScore[t] > bestScore) {
+				bestScore = triangleScore[t];
+				best = (int64_t)t;
+			}
+		}
+		return best;
+	};
+
+	int64_t nextTriangle = bestInAll();
+	while (nextTriangle >= 0) {
+		const size_t t = (size_t)nextTriangle;
+		emitted[t] = true;
+		const uint16_t* tri = indices + 3 * t;
+		output.insert(output.end(), tri, tri + 3);
+
+		// the triangle's vertices move to the front of the cache
+		int newCount = 0;
+		for (int k = 0; k < 3; k++) {
+			const uint16_t v = tri[k];
+			newCache[newCount++] = v;
+			remainingValence[v]--;
+			// remove the triangle from the vertex's remaining ones
+			uint32_t* begin = adjacency.data() + adjacencyStart[v];
+			uint32_t* end = begin + remainingValence[v] + 1;
+			std::iter_swap(std::find(begin, end, (uint32_t)t), end - 1);
+		}
+		for (int i = 0; i < cacheCount; i++) {
+			const int v = cache[i];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				newCache[newCount++] = v;
+		}
+		for (int i = forsythCacheSize; i < newCount; i++)
+			cachePosition[newCache[i]] = -1;
+		cacheCount = std::min(newCount, forsythCacheSize);
+		std::copy(newCache.begin(), newCache.begin() + cacheCount, cache.begin());
+
+		// rescore the vertices of the cache and their triangles, and pick the best one
+		for (int i = 0; i < newCount; i++) {
+			const int v = newCache[i];
+			if (i < forsythCacheSize)
+				cachePosition[v] = i;
+			const float newScore = VertexScore(tables, cachePosition[v], remainingValence[v]);
+			const float delta = newScore - vertexScore[v];
+			vertexScore[v] = newScore;
+			for (uint32_t a = 0; a < (uint32_t)remainingValence[v]; a++)
+				triangleScore[adjacency[adjacencyStart[v] + a]] += delta;
+		}
+		nextTriangle = -1;
+		float bestScore = -1e30f;
+		for (int i = 0; i < cacheCount; i++) {
+			const int v = cache[i];
+			for (uint32_t a = 0; a < (uint32_t)remainingValence[v]; a++) {
+				const uint32_t candidate = adjacency[adjacencyStart[v] + a];
+				if (triangleScore[candidate] > bestScore) {
+					bestScore = triangleScore[candidate];
+					nextTriangle = candidate;
+				}
+			}
+		}
+		if (nextTriangle < 0)
+			nextTriangle = bestInAll();
+	}
+	std::copy(output.begin(), output.end(), indices);
+}
+
+void MeshOptimizer::OptimizeOverdraw(uint16_t* indices, size_t numIndices, const float* positions, size_t stride, size_t numVertices, float threshold)
+{
+	const size_t numTriangles = numIndices / 3;
+	if (numTriangles < 2)
+		return;
+	auto position = [positions, stride](uint16_t v) {
+		const float* p = (const float*)((const uint8_t*)positions + v * stride);
+		return Vec3{ p[0], p[1], p[2] };
+	};
+
+	// the clusters start at the triangles missing the cache for all their vertices
+	static constexpr int cacheSize = 16;
+	std::vector<size_t> clusterStarts;
+	std::vector<size_t> addedAt(numVertices, 0);
+	size_t time = cacheSize + 1;
+	for (size_t t = 0; t < numTriangles; t++) {
+		int misses = 0;
+		for (int k = 0; k < 3; k++) {
+			const uint16_t v = indices[3 * t + k];
+			if (time - addedAt[v] > cacheSize) {
+				addedAt[v] = time++;
+				misses++;
+			}
+		}
+		if (t == 0 || misses == 3)
+			clusterStarts.push_back(t);
+	}
+	if (clusterStarts.size() < 2)
+		return;
+	clusterStarts.push_back(numTriangles);
+
+	// sort key: how much the cluster faces away from the mesh's center
+	Vec3 meshCenter = { 0, 0, 0 };
+	float meshArea = 0.0f;
+	const size_t numClusters = clusterStarts.size() - 1;
+	std::vector<Vec3> clusterCenters(numClusters), clusterNormals(numClusters);
+	for (size_t c = 0; c < numClusters; c++) {
+		Vec3 center = { 0, 0, 0 }, normal = { 0, 0, 0 };
+		float area = 0.0f;
+		for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; t++) {
+			const Vec3 p0 = position(indices[3 * t]), p1 = position(indices[3 * t + 1]), p2 = position(indices[3 * t + 2]);
+			const Vec3 n = (p1 - p0).cross(p2 - p0);
+			const float a = std::sqrt(n.dot(n));
+			center = center + (p0 + p1 + p2) * (a / 3.0f);
+			normal = normal + n;
+			area += a;
+		}
+		meshCenter = meshCenter + center;
+		meshArea += area;
+		clusterCenters[c] = (area > 0.0f) ? center * (1.0f / area) : position(indices[3 * clusterStarts[c]]);
+		const float length = std::sqrt(normal.dot(normal));
+		clusterNormals[c] = (length > 0.0f) ? normal * (1.0f / length) : normal;
+	}
+	if (meshArea > 0.0f)
+		meshCenter = meshCenter * (1.0f / meshArea);
+	std::vector<float> sortKeys(numClusters);
+	for (size_t c = 0; c < numClusters; c++)
+		sortKeys[c] = (clusterCenters[c] - meshCenter).dot(clusterNormals[c]);
+	std::vector<size_t> order(numClusters);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&sortKeys](size_t a, size_t b) { return sortKeys[a] > sortKeys[b]; });
+
+	std::vector<uint16_t> reordered;
+	reordered.reserve(numTriangles * 3);
+	for (size_t c : order)
+		reordered.insert(reordered.end(), indices + 3 * clusterStarts[c], indices + 3 * clusterStarts[c + 1]);
+	const double before = AnalyzeVertexCache(indices, numTriangles * 3, numVertices).acmr();
+	const double after = AnalyzeVertexCache(reordered.data(), reordered.size(), numVertices).acmr();
+	if (after <= before * threshold)
+		std::copy(reordered.begin(), reordered.end(), indices);
+}
+
+void MeshOptimizer::OptimizeVertexFetch(void* vertices, size_t vertexSize, size_t numVertices, uint16_t* indices, size_t numIndices)
+{
+	static constexpr uint32_t unused = 0xFFFFFFFF;
+	std::vector<uint32_t> remap(numVertices, unused);
+	uint32_t next = 0;
+	for (size_t i = 0; i < numIndices; i++) {
+		uint32_t& r = remap[indices[i]];
+		if (r == unused)
+			r = next++;
+		indices[i] = (uint16_t)r;
+	}
+	// the vertices that no triangle uses go at the end
+	for (uint32_t& r : remap)
+		if (r == unused)
+			r = next++;
+
+	std::vector<uint8_t> reordered(numVertices * vertexSize);
+	for (size_t v = 0; v < numVertices; v++)
+		memcpy(reordered.data() + remap[v] * vertexSize, (const uint8_t*)vertices + v * vertexSize, vertexSize);
+	memcpy(vertices, reordered.data(), reordered.size());
+}
+
+bool MeshOptimizer::SelfCheck()
+{
+	struct TestVertex {
+		float x, y, z;
+		uint32_t id;
+	};
+	std::mt19937 rng(47);
+	bool success = true;
+	for (int gridSize : { 2, 16, 100 }) {
+		// grid bent into a half cylinder, with the triangles shuffled
+		std::vector<TestVertex> vertices;
+		for (int y = 0; y <= gridSize; y++) {
+			for (int x = 0; x <= gridSize; x++) {
+				const float angle = 3.14159f * x / gridSize;
+				vertices.push_back({ std::cos(angle), (float)y / gridSize, std::sin(angle), (uint32_t)vertices.size() });
+			}
+		}
+		std::vector<std::array<uint16_t, 3>> triangles;
+		for (int y = 0; y < gridSize; y++) {
+			for (int x = 0; x < gridSize; x++) {
+				const uint16_t v = (uint16_t)(y * (gridSize + 1) + x);
+				triangles.push_back({ v, (uint16_t)(v + 1), (uint16_t)(v + gridSize + 2) });
+				triangles.push_back({ v, (uint16_t)(v + gridSize + 2), (uint16_t)(v + gridSize + 1) });
+			}
+		}
+		std::shuffle(triangles.begin(), triangles.end(), rng);
+		std::vector<uint16_t> indices;
+		for (const auto& tri : triangles)
+			indices.insert(indices.end(), tri.begin(), tri.end());
+
+		const CacheStats before = AnalyzeVertexCache(indices.data(), indices.size(), vertices.size());
+		OptimizeVertexCache(indices.data(), indices.size(), vertices.size());
+		const CacheStats afterCache = AnalyzeVertexCache(indices.data(), indices.size(), vertices.size());
+		OptimizeOverdraw(indices.data(), indices.size(), &vertices[0].x, sizeof(TestVertex), vertices.size());
+		OptimizeVertexFetch(vertices.data(), sizeof(TestVertex), vertices.size(), indices.data(), indices.size());
+		const CacheStats after = AnalyzeVertexCache(indices.data(), indices.size(), vertices.size());
+
+		// the same triangles, with the same winding, must remain
+		auto canonical = [](std::array<uint32_t, 3> tri) {
+			std::rotate(tri.begin(), std::min_element(tri.begin(), tri.end()), tri.end());
+			return tri;
+		};
+		std::vector<std::array<uint32_t, 3>> expected, actual;
+		for (const auto& tri : triangles)
+			expected.push_back(canonical({ tri[0], tri[1], tri[2] }));
+		for (size_t i = 0; i < indices.size(); i += 3)
+			actual.push_back(canonical({ vertices[indices[i]].id, vertices[indices[i + 1]].id, vertices[indices[i + 2]].id }));
+		std::sort(expected.begin(), expected.end());
+		std::sort(actual.begin(), actual.end());
+		const bool sameTriangles = expected == actual;
+		bool fetchOrdered = true;
+		uint16_t maxIndex = 0;
+		for (uint16_t index : indices) {
+			if (index > maxIndex + 1)
+				fetchOrdered = false;
+			maxIndex = std::max(maxIndex, index);
+		}
+		const bool improved = gridSize < 16 || after.acmr() < before.acmr();
+		printf("  %3ix%-3i grid: ACMR %.3f -> %.3f (%.3f before overdraw), ATVR %.3f -> %.3f, %s\n", gridSize, gridSize,
+			before.acmr(), after.acmr(), afterCache.acmr(), before.atvr(), after.atvr(),
+			(sameTriangles && fetchOrdered && improved) ? "OK" : "FAILED");
+		success = success && sameTriangles && fetchOrdered && improved;
+	}
+	printf("Mesh optimizer self-check %s\n", success ? "passed" : "FAILED");
+	return success;
+}
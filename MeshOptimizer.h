@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Reordering of indexed triangle lists for the GPU, on the CPU only:
+// vertex cache locality (Forsyth), overdraw (clusters sorted by their facing, after Sander et al.)
+// and vertex fetch locality (vertices in the order of first use).
+namespace MeshOptimizer {
+	struct CacheStats {
+		size_t numTriangles = 0;
+		size_t numVertices = 0;
+		size_t numMisses = 0;
+		// average cache miss ratio (misses per triangle) and average transformed vertex ratio (misses per vertex)
+		double acmr() const { return numTriangles ? (double)numMisses / numTriangles : 0.0; }
+		double atvr() const { return numVertices ? (double)numMisses / numVertices : 0.0; }
+	};
+
+	// Simulates a FIFO post-transform cache of cacheSize vertices.
+	CacheStats AnalyzeVertexCache(const uint16_t* indices, size_t numIndices, size_t numVertices, int cacheSize = 16);
+
+	// Reorders the triangles for the vertex cache.
+	void OptimizeVertexCache(uint16_t* indices, size_t numIndices, size_t numVertices);
+	// Reorders clusters of triangles, from the ones facing outwards to the ones facing inwards, unless the
+	// ACMR would get worse than threshold times the current one. position(v) of vertex v is at positions + v * stride bytes.
+	void OptimizeOverdraw(uint16_t* indices, size_t numIndices, const float* positions, size_t stride, size_t numVertices, float threshold = 1.05f);
+	// Reorders the vertices in the order the triangles use them and remaps the indices.
+	void OptimizeVertexFetch(void* vertices, size_t vertexSize, size_t numVertices, uint16_t* indices, size_t numIndices);
+
+	// Checks on generated meshes that the triangles are kept and the ACMR is improved, without GL.
+	bool SelfCheck();
+}
@@ -40,12 +40,13 @@ static uint32_t GetTextureFromAssimp(const aiTexture* atex, std::string_view nam
 		auto* ti = (TexInfo*)texChunk->maindata.data();
 		return ti->id;
 	}
+	// other models may have embedded the same image under another name
 	if (atex->mHeight != 0) {
-		auto id = AddTexture(g_scene, (uint8_t*)atex->pcData, atex->mWidth, atex->mHeight, name);
+		auto id = FindOrAddTexture(g_scene, (uint8_t*)atex->pcData, atex->mWidth, atex->mHeight, name);
 		return id;
 	}
 	else {
-		auto id = AddTexture(g_scene, atex->pcData, atex->mWidth, name);
+		auto id = FindOrAddTexture(g_scene, atex->pcData, atex->mWidth, name);
 		return id;
 	}
 }
@@ -99,7 +100,8 @@ std::optional<std::pair<Mesh, std::optional<Chunk>>> ImportWithAssimp(const std:
 					auto aistr = mat->GetName();
 					tn = { aistr.data, aistr.length };
 				}
-				texId = (uint16_t)GetTextureFromAssimp(atex, tn);
+				if (uint32_t id = GetTextureFromAssimp(atex, tn))
+					texId = (uint16_t)id;
 			}
 			else
 			{
@@ -112,8 +114,9 @@ std::optional<std::pair<Mesh, std::optional<Chunk>>> ImportWithAssimp(const std:
 					texId = (uint16_t)((TexInfo*)chk->maindata.data())->id;
 				}
 				else if (std::filesystem::is_regular_file(texpath)) {
-					// the file exists, import it
-					texId = (uint16_t)AddTexture(g_scene, texpath);
+					// the file exists, import it, or reuse an identical texture with another name
+					if (uint32_t id = FindOrAddTexture(g_scene, texpath))
+						texId = (uint16_t)id;
 				}
 			}
 
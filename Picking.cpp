@@ -0,0 +1,517 @@
+#include "Picking.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "gameobj.h"
+#include "chunk.h"
+#include "video.h"
+#include "RayCast.h"
+
+namespace {
+	constexpr uint32_t maxLeafSize = 4;
+
+	struct Box {
+		Vector3 min, max;
+		void add(const Box& other) {
+			for (int j = 0; j < 3; j++) {
+				min.coord[j] = std::min(min.coord[j], other.min.coord[j]);
+				max.coord[j] = std::max(max.coord[j], other.max.coord[j]);
+			}
+		}
+		Vector3 center() const { return (min + max) * 0.5f; }
+	};
+
+	// Bounding volume hierarchy in depth-first order: an inner node's children are the next node and the node at first
+	struct Tree {
+		struct Node {
+			Box box;
+			uint32_t first = 0, count = 0;
+		};
+		std::vector<Node> nodes;
+		// the primitives in the order of the leaves, each leaf having count of them from first
+		std::vector<uint32_t> order;
+
+		void build(const std::vector<Box>& boxes) {
+			nodes.clear();
+			order.resize(boxes.size());
+			for (uint32_t i = 0; i < (uint32_t)boxes.size(); i++)
+				order[i] = i;
+			if (!boxes.empty())
+				buildNode(boxes, 0, (uint32_t)boxes.size());
+		}
+
+		// Updates the boxes of the nodes for the moved primitives, keeping the hierarchy
+		void refit(const std::vector<Box>& boxes) {
+			for (size_t n = nodes.size(); n-- > 0;) {
+				Node& node = nodes[n];
+				if (node.count) {
+					node.box = boxes[order[node.first]];
+					for (uint32_t i = 1; i < node.count; i++)
+						node.box.add(boxes[order[node.first + i]]);
+				}
+				else {
+					node.box = nodes[n + 1].box;
+					node.box.add(nodes[node.first].box);
+				}
+			}
+		}
+
+	private:
+		uint32_t buildNode(const std::vector<Box>& boxes, uint32_t begin, uint32_t end) {
+			const uint32_t index = (uint32_t)nodes.size();
+			nodes.emplace_back();
+			Box box = boxes[order[begin]];
+			Box centers = { box.center(), box.center() };
+			for (uint32_t i = begin + 1; i < end; i++) {
+				box.add(boxes[order[i]]);
+				const Vector3 center = boxes[order[i]].center();
+				centers.add({ center, center });
+			}
+			nodes[index].box = box;
+
+			if (end - begin <= maxLeafSize) {
+				nodes[index].first = begin;
+				nodes[index].count = end - begin;
+				return index;
+			}
+			// split at the median along the axis where the centers are the most spread, or in two halves
+			// when the centers are all the same, like the faces of cross billboards, so no leaf is larger
+			const Vector3 spread = centers.max - centers.min;
+			const int axis = (spread.x >= spread.y && spread.x >= spread.z) ? 0 : (spread.y >= spread.z ? 1 : 2);
+			const uint32_t middle = (begin + end) / 2;
+			if (spread.coord[axis] > 0.0f) {
+				std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&boxes, axis](uint32_t a, uint32_t b) {
+					return boxes[a].min.coord[axis] + boxes[a].max.coord[axis] < boxes[b].min.coord[axis] + boxes[b].max.coord[axis];
+					});
+			}
+			buildNode(boxes, begin, middle);
+			const uint32_t second = buildNode(boxes, middle, end);
+			nodes[index].first = second;
+			return index;
+		}
+	};
+
+	struct Ray {
+		Vector3 start, dir, invDir;
+		Ray(const Vector3& start, const Vector3& dir) : start(start), dir(dir) {
+			for (int j = 0; j < 3; j++)
+				invDir.coord[j] = (std::abs(dir.coord[j]) > 1e-30f) ? 1.0f / dir.coord[j] : std::copysign(1e30f, dir.coord[j]);
+		}
+		bool hits(const Box& box) const {
+			float tmin = 0.0f, tmax = std::numeric_limits<float>::infinity();
+			for (int j = 0; j < 3; j++) {
+				float t0 = (box.min.coord[j] - start.coord[j]) * invDir.coord[j];
+				float t1 = (box.max.coord[j] - start.coord[j]) * invDir.coord[j];
+				if (t0 > t1)
+					std::swap(t0, t1);
+				tmin = std::max(tmin, t0);
+				tmax = std::min(tmax, t1);
+			}
+			return tmin <= tmax;
+		}
+	};
+
+	// Lowest squared horizontal distance from the eye to a point of the box
+	float HorizontalDistance(const Box& box, const Vector3& eye)
+	{
+		const float dx = std::max({ 0.0f, box.min.x - eye.x, eye.x - box.max.x });
+		const float dz = std::max({ 0.0f, box.min.z - eye.z, eye.z - box.max.z });
+		return dx * dx + dz * dz;
+	}
+
+	Vector3 FaceVertex(const float* vertices, uint16_t index)
+	{
+		return Vector3(vertices[index * 3 / 2], vertices[index * 3 / 2 + 1], vertices[index * 3 / 2 + 2]);
+	}
+
+	// The vertices as drawn, skinned if the object has a skin
+	const float* GetVertices(GameObject* o)
+	{
+		Mesh* m = o->mesh.get();
+		return (o->excChunk && o->excChunk->findSubchunk('LCHE')) ? ApplySkinToMesh(m, o->excChunk.get()) : m->vertices.data();
+	}
+
+	// Faces of a mesh: the quads then the triangles
+	struct MeshTree {
+		Tree tree;
+		size_t numVertices = 0, numQuads = 0, numTris = 0;
+		// the triangles of each leaf, the quads being split in two
+		std::vector<uint32_t> nodePackets;
+		std::vector<RayCast::Packet8> packets;
+	};
+	// the leaves have at most maxLeafSize faces
+	static_assert(maxLeafSize * 2 <= 8, "the faces of a leaf must fit in a packet");
+
+	// Visible object with a mesh, in the order of the scene
+	struct Instance {
+		GameObject* object;
+		const Mesh* mesh;
+		const float* vertices;
+		bool skinned;
+		Matrix matrix, inverse;
+		float facing;
+	};
+
+	std::unordered_map<const Mesh*, MeshTree> g_meshTrees;
+	std::vector<Instance> g_instances;
+	std::vector<Box> g_instanceBoxes;
+	Tree g_topTree;
+	// the objects and meshes the top tree was built for
+	std::vector<std::pair<const GameObject*, const Mesh*>> g_topTreeKey;
+	Picking::Stats g_stats;
+
+	Box GetFaceBox(const float* vertices, const uint16_t* face, int numverts)
+	{
+		const Vector3 first = FaceVertex(vertices, face[0]);
+		Box box = { first, first };
+		for (int i = 1; i < numverts; i++) {
+			const Vector3 v = FaceVertex(vertices, face[i]);
+			box.add({ v, v });
+		}
+		return box;
+	}
+
+	const MeshTree& GetMeshTree(const Mesh* mesh)
+	{
+		MeshTree& meshTree = g_meshTrees[mesh];
+		if (meshTree.numVertices == mesh->getNumVertices() && meshTree.numQuads == mesh->getNumQuads() && meshTree.numTris == mesh->getNumTris()
+			&& !meshTree.tree.nodes.empty())
+			return meshTree;
+		meshTree.numVertices = mesh->getNumVertices();
+		meshTree.numQuads = mesh->getNumQuads();
+		meshTree.numTris = mesh->getNumTris();
+		std::vector<Box> boxes;
+		boxes.reserve(meshTree.numQuads + meshTree.numTris);
+		for (size_t i = 0; i < meshTree.numQuads; i++)
+			boxes.push_back(GetFaceBox(mesh->vertices.data(), mesh->quadindices.data() + i * 4, 4));
+		for (size_t i = 0; i < meshTree.numTris; i++)
+			boxes.push_back(GetFaceBox(mesh->vertices.data(), mesh->triindices.data() + i * 3, 3));
+		meshTree.tree.build(boxes);
+
+		const float* vertices = mesh->vertices.data();
+		meshTree.nodePackets.assign(meshTree.tree.nodes.size(), 0);
+		meshTree.packets.clear();
+		for (size_t n = 0; n < meshTree.tree.nodes.size(); n++) {
+			const Tree::Node& node = meshTree.tree.nodes[n];
+			if (!node.count)
+				continue;
+			meshTree.nodePackets[n] = (uint32_t)meshTree.packets.size();
+			RayCast::Packet8& packet = meshTree.packets.emplace_back();
+			int lane = 0;
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				const uint32_t face = meshTree.tree.order[i];
+				if (face < meshTree.numQuads) {
+					const uint16_t* quad = mesh->quadindices.data() + face * 4;
+					const Vector3 p0 = FaceVertex(vertices, quad[0]), p2 = FaceVertex(vertices, quad[2]);
+					packet.set(lane++, p0, FaceVertex(vertices, quad[1]), p2);
+					packet.set(lane++, p0, p2, FaceVertex(vertices, quad[3]));
+				}
+				else {
+					const uint16_t* tri = mesh->triindices.data() + (face - meshTree.numQuads) * 3;
+					packet.set(lane++, FaceVertex(vertices, tri[0]), FaceVertex(vertices, tri[1]), FaceVertex(vertices, tri[2]));
+				}
+			}
+			for (; lane < 8; lane++)
+				packet.clear(lane);
+		}
+		return meshTree;
+	}
+
+	// Inverse of the affine transform, unlike Matrix::getInverse4x3 which does not divide by the determinant
+	Matrix GetAffineInverse(const Matrix& m, float& determinant)
+	{
+		Matrix inv = Matrix::getIdentity();
+		for (int i = 0; i < 3; i++) {
+			int i_1 = (i + 1) % 3, i_2 = (i + 2) % 3;
+			for (int j = 0; j < 3; j++) {
+				int j_1 = (j + 1) % 3, j_2 = (j + 2) % 3;
+				inv.m[j][i] = m.m[i_1][j_1] * m.m[i_2][j_2] - m.m[i_1][j_2] * m.m[i_2][j_1];
+			}
+		}
+		determinant = m.m[0][0] * inv.m[0][0] + m.m[0][1] * inv.m[1][0] + m.m[0][2] * inv.m[2][0];
+		const float scale = (determinant != 0.0f) ? 1.0f / determinant : 0.0f;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				inv.m[i][j] *= scale;
+		return Matrix::getTranslationMatrix(-m.getTranslationVector()) * inv;
+	}
+
+	void CollectInstances(GameObject* o, const Matrix& parentTransform, Picking::VisibilityTest isVisible)
+	{
+		const Matrix transform = o->matrix * parentTransform;
+		if (o->mesh && isVisible(o)) {
+			Instance instance;
+			instance.object = o;
+			instance.mesh = o->mesh.get();
+			instance.vertices = GetVertices(o);
+			instance.skinned = instance.vertices != instance.mesh->vertices.data();
+			instance.matrix = transform;
+			float determinant;
+			instance.inverse = GetAffineInverse(transform, determinant);
+			instance.facing = (determinant < 0.0f) ? -1.0f : 1.0f;
+			g_instances.push_back(instance);
+		}
+		for (GameObject* child : o->subobj)
+			CollectInstances(child, transform, isVisible);
+	}
+
+	Box GetInstanceBox(const Instance& instance)
+	{
+		Box local = { Vector3(INFINITY, INFINITY, INFINITY), Vector3(-INFINITY, -INFINITY, -INFINITY) };
+		if (instance.skinned) {
+			for (size_t i = 0; i < instance.mesh->getNumVertices(); i++) {
+				const Vector3 v(instance.vertices[3 * i], instance.vertices[3 * i + 1], instance.vertices[3 * i + 2]);
+				local.add({ v, v });
+			}
+		}
+		else {
+			const MeshTree& meshTree = GetMeshTree(instance.mesh);
+			if (!meshTree.tree.nodes.empty())
+				local = meshTree.tree.nodes[0].box;
+		}
+		if (local.min.x > local.max.x)
+			return local;
+		// the world box of the local box's corners
+		Box world = { Vector3(INFINITY, INFINITY, INFINITY), Vector3(-INFINITY, -INFINITY, -INFINITY) };
+		for (int c = 0; c < 8; c++) {
+			const Vector3 corner((c & 1) ? local.max.x : local.min.x, (c & 2) ? local.max.y : local.min.y, (c & 4) ? local.max.z : local.min.z);
+			const Vector3 v = corner.transform(instance.matrix);
+			world.add({ v, v });
+		}
+		return world;
+	}
+
+	void KeepNearest(const Instance& instance, const Vector3& point, const Vector3& eye, Picking::Hit& best)
+	{
+		const float d = (point - eye).sqlen2xz();
+		if (d < best.distance) {
+			best.distance = d;
+			best.object = instance.object;
+			best.position = point;
+		}
+	}
+
+	template <int numverts>
+	void TestFace(const Instance& instance, const Ray& ray, const uint16_t* face, const Vector3& eye, Picking::Hit& best)
+	{
+		Vector3 pnts[numverts];
+		for (int i = 0; i < numverts; i++)
+			pnts[i] = FaceVertex(instance.vertices, face[i]);
+		Vector3 point;
+		g_stats.numFacesTested++;
+		if (RayCast::IntersectFace<numverts>(ray.start, ray.dir, pnts, instance.facing, point))
+			KeepNearest(instance, point.transform(instance.matrix), eye, best);
+	}
+
+	void PickInstance(const Instance& instance, const Vector3& rayStart, const Vector3& rayDir, const Vector3& eye, Picking::Hit& best)
+	{
+		const Mesh* m = instance.mesh;
+		const Ray ray(rayStart.transform(instance.inverse), rayDir.transformNormal(instance.inverse));
+		if (instance.skinned) {
+			for (size_t i = 0; i < m->getNumQuads(); i++)
+				TestFace<4>(instance, ray, m->quadindices.data() + i * 4, eye, best);
+			for (size_t i = 0; i < m->getNumTris(); i++)
+				TestFace<3>(instance, ray, m->triindices.data() + i * 3, eye, best);
+			return;
+		}
+
+		const MeshTree& meshTree = GetMeshTree(m);
+		const Tree& tree = meshTree.tree;
+		if (tree.nodes.empty())
+			return;
+		uint32_t stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while (stackSize > 0) {
+			const Tree::Node& node = tree.nodes[stack[--stackSize]];
+			g_stats.numNodesVisited++;
+			if (!ray.hits(node.box))
+				continue;
+			if (node.count) {
+				// a quad is hit if one of its triangles is
+				const uint32_t index = (uint32_t)(&node - tree.nodes.data());
+				RayCast::PacketHits<8> hits;
+				g_stats.numFacesTested += node.count;
+				const int mask = RayCast::Intersect(ray.start, ray.dir, meshTree.packets[meshTree.nodePackets[index]], instance.facing, hits);
+				for (int lane = 0; mask >> lane; lane++)
+					if (mask & (1 << lane))
+						KeepNearest(instance, (ray.start + ray.dir * hits.t[lane]).transform(instance.matrix), eye, best);
+			}
+			else {
+				stack[stackSize++] = node.first;
+				stack[stackSize++] = (uint32_t)(&node - tree.nodes.data()) + 1;
+			}
+		}
+	}
+
+	template <int numverts>
+	void TestWorldFace(GameObject* o, const float* vertices, const uint16_t* face, const Matrix& worldmtx,
+		const Vector3& raystart, const Vector3& raydir, const Vector3& eye, Picking::Hit& best)
+	{
+		Vector3 pnts[numverts];
+		for (int i = 0; i < numverts; i++)
+			pnts[i] = FaceVertex(vertices, face[i]).transform(worldmtx);
+		Vector3 point;
+		if (!RayCast::IntersectFace<numverts>(raystart, raydir, pnts, 1.0f, point))
+			return;
+		const float d = (point - eye).sqlen2xz();
+		if (d < best.distance) {
+			best.distance = d;
+			best.object = o;
+			best.position = point;
+		}
+	}
+
+	void PickObjectBruteForce(GameObject* o, const Matrix& worldmtx, const Vector3& raystart, const Vector3& raydir,
+		const Vector3& eye, Picking::VisibilityTest isVisible, Picking::Hit& best)
+	{
+		Matrix objmtx = o->matrix * worldmtx;
+		if (o->mesh && isVisible(o))
+		{
+			Mesh* m = o->mesh.get();
+			const float* vertices = GetVertices(o);
+			for (size_t i = 0; i < m->getNumQuads(); i++)
+				TestWorldFace<4>(o, vertices, m->quadindices.data() + i * 4, objmtx, raystart, raydir, eye, best);
+			for (size_t i = 0; i < m->getNumTris(); i++)
+				TestWorldFace<3>(o, vertices, m->triindices.data() + i * 3, objmtx, raystart, raydir, eye, best);
+		}
+		for (GameObject* child : o->subobj)
+			PickObjectBruteForce(child, objmtx, raystart, raydir, eye, isVisible, best);
+	}
+}
+
+Picking::Hit Picking::PickBruteForce(GameObject* root, const Vector3& rayStart, const Vector3& rayDir, const Vector3& eye, VisibilityTest isVisible)
+{
+	Hit best;
+	PickObjectBruteForce(root, Matrix::getIdentity(), rayStart, rayDir, eye, isVisible, best);
+	return best;
+}
+
+Picking::Hit Picking::Pick(GameObject* root, const Vector3& rayStart, const Vector3& rayDir, const Vector3& eye, VisibilityTest isVisible)
+{
+	const auto startTime = std::chrono::steady_clock::now();
+	g_stats.numNodesVisited = 0;
+	g_stats.numFacesTested = 0;
+
+	// the objects are collected on each pick, as they can have moved, been hidden or been skinned since the last one
+	g_instances.clear();
+	CollectInstances(root, Matrix::getIdentity(), isVisible);
+	g_instanceBoxes.resize(g_instances.size());
+	for (size_t i = 0; i < g_instances.size(); i++)
+		g_instanceBoxes[i] = GetInstanceBox(g_instances[i]);
+
+	bool sameObjects = g_topTreeKey.size() == g_instances.size();
+	for (size_t i = 0; sameObjects && i < g_instances.size(); i++)
+		sameObjects = g_topTreeKey[i] == std::make_pair((const GameObject*)g_instances[i].object, g_instances[i].mesh);
+	if (sameObjects) {
+		g_topTree.refit(g_instanceBoxes);
+		g_stats.numRefits++;
+	}
+	else {
+		g_topTree.build(g_instanceBoxes);
+		g_topTreeKey.resize(g_instances.size());
+		for (size_t i = 0; i < g_instances.size(); i++)
+			g_topTreeKey[i] = { g_instances[i].object, g_instances[i].mesh };
+		g_stats.numRebuilds++;
+	}
+
+	// the nearest boxes first, skipping the ones which can't be nearer than the best hit
+	Hit best;
+	const Ray ray(rayStart, rayDir);
+	std::vector<uint32_t> stack;
+	if (!g_topTree.nodes.empty())
+		stack.push_back(0);
+	while (!stack.empty()) {
+		const uint32_t index = stack.back();
+		stack.pop_back();
+		const Tree::Node& node = g_topTree.nodes[index];
+		g_stats.numNodesVisited++;
+		if (HorizontalDistance(node.box, eye) >= best.distance || !ray.hits(node.box))
+			continue;
+		if (node.count) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++)
+				PickInstance(g_instances[g_topTree.order[i]], rayStart, rayDir, eye, best);
+		}
+		else {
+			uint32_t first = index + 1, second = node.first;
+			if (HorizontalDistance(g_topTree.nodes[first].box, eye) > HorizontalDistance(g_topTree.nodes[second].box, eye))
+				std::swap(first, second);
+			stack.push_back(second);
+			stack.push_back(first);
+		}
+	}
+
+	g_stats.numObjects = g_instances.size();
+	g_stats.numMeshTrees = g_meshTrees.size();
+	g_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	return best;
+}
+
+void Picking::InvalidateMesh(const Mesh* mesh)
+{
+	g_meshTrees.erase(mesh);
+}
+
+void Picking::ClearCache()
+{
+	g_meshTrees.clear();
+	g_topTreeKey.clear();
+	g_topTree = {};
+}
+
+const Picking::Stats& Picking::GetStats()
+{
+	return g_stats;
+}
+
+void Picking::PrintBenchmark(GameObject* root, const Vector3& eye, const Vector3& forward, VisibilityTest isVisible)
+{
+	// rays spread over 60 degrees around the forward direction
+	constexpr int gridSize = 24;
+	const Vector3 side = (std::abs(forward.y) < 0.99f) ? Vector3(0.0f, 1.0f, 0.0f).cross(forward).normal() : Vector3(1.0f, 0.0f, 0.0f);
+	const Vector3 up = forward.cross(side).normal();
+	std::vector<Vector3> directions;
+	for (int y = 0; y < gridSize; y++)
+		for (int x = 0; x < gridSize; x++) {
+			const float sx = ((x + 0.5f) / gridSize * 2.0f - 1.0f) * 0.577f, sy = ((y + 0.5f) / gridSize * 2.0f - 1.0f) * 0.577f;
+			directions.push_back(forward + side * sx + up * sy);
+		}
+
+	ClearCache();
+	auto startTime = std::chrono::steady_clock::now();
+	Pick(root, eye, directions[0], eye, isVisible);
+	const double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	for (const Vector3& dir : directions)
+		Pick(root, eye, dir, eye, isVisible);
+
+	std::vector<Hit> bvhHits(directions.size()), bruteHits(directions.size());
+	startTime = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < directions.size(); i++)
+		bvhHits[i] = Pick(root, eye, directions[i], eye, isVisible);
+	const double bvhSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	startTime = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < directions.size(); i++)
+		bruteHits[i] = PickBruteForce(root, eye, directions[i], eye, isVisible);
+	const double bruteSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	// both find the same face up to the rounding, the BVH in the mesh's space, so the distances only nearly match
+	size_t numHits = 0, numMismatches = 0;
+	for (size_t i = 0; i < directions.size(); i++) {
+		const Hit& a = bvhHits[i];
+		const Hit& b = bruteHits[i];
+		numHits += b.object != nullptr;
+		const bool same = (a.object == b.object || std::abs(a.distance - b.distance) <= 1e-3f * std::max(1.0f, b.distance))
+			&& (!b.object || (a.position - b.position).len3() <= 1e-2f * std::max(1.0f, std::sqrt(b.distance)));
+		if (!same && numMismatches++ < 8)
+			printf("  ray %zu: BVH %s at %f, brute force %s at %f\n", i, a.object ? a.object->name.c_str() : "nothing", a.distance,
+				b.object ? b.object->name.c_str() : "nothing", b.distance);
+	}
+	printf("Picking benchmark: %zu objects, %zu rays, %zu hits, %zu mismatches\n", g_stats.numObjects, directions.size(), numHits, numMismatches);
+	printf("  BVH:         %9.0f picks/s (build on first pick %.2f ms)\n", directions.size() / bvhSeconds, buildSeconds * 1000.0);
+	printf("  brute force: %9.0f picks/s\n", directions.size() / bruteSeconds);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+
+#include "vecmat.h"
+
+struct GameObject;
+struct Mesh;
+
+// Finding the object face under the mouse. The faces facing away are ignored, and the hit kept is the one
+// nearest to the eye on the horizontal plane, as the editor has always done.
+namespace Picking {
+	struct Hit {
+		GameObject* object = nullptr;
+		Vector3 position;
+		// squared horizontal distance from the eye
+		float distance = std::numeric_limits<float>::infinity();
+	};
+
+	// which objects with meshes can be picked
+	using VisibilityTest = bool (*)(GameObject* object);
+
+	// Tests every face of every visible mesh under root, in world space.
+	Hit PickBruteForce(GameObject* root, const Vector3& rayStart, const Vector3& rayDir, const Vector3& eye, VisibilityTest isVisible);
+
+	// Same hit from two levels of bounding volume hierarchies: one over the objects' world bounds, refitted when
+	// only the transforms changed since the last pick, then one per mesh over its faces, in the mesh's space.
+	// The faces of the leaves are tested 8 triangles at a time, the quads as two triangles.
+	Hit Pick(GameObject* root, const Vector3& rayStart, const Vector3& rayDir, const Vector3& eye, VisibilityTest isVisible);
+
+	// The hierarchies of the meshes' faces are built on their first pick and kept until their meshes change
+	void InvalidateMesh(const Mesh* mesh);
+	void ClearCache();
+
+	struct Stats {
+		size_t numObjects = 0;
+		size_t numMeshTrees = 0;
+		size_t numRebuilds = 0;
+		size_t numRefits = 0;
+		// for the last pick
+		size_t numNodesVisited = 0;
+		size_t numFacesTested = 0;
+		double seconds = 0.0;
+	};
+	const Stats& GetStats();
+
+	// Picks along rays around the eye's forward direction with both, printing the mismatches and the picks per second.
+	void PrintBenchmark(GameObject* root, const Vector3& eye, const Vector3& forward, VisibilityTest isVisible);
+}
@@ -0,0 +1,230 @@
+#include "PortalVisibility.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "gameobj.h"
+
+namespace {
+	constexpr uint32_t ZGATE = 21;
+	constexpr uint32_t ZBOUND = 28;
+	constexpr uint32_t ZROOM = 33;
+
+	// how far a gate's box can be from the rooms it opens to
+	constexpr float gateMargin = 10.0f;
+	// rooms visited again through other gates before giving up on growing their view, on cyclic graphs
+	constexpr size_t maxVisitsPerRoom = 8;
+
+	// Part of the screen in normalized device coordinates
+	struct Rect {
+		float minX = -1.0f, minY = -1.0f, maxX = 1.0f, maxY = 1.0f;
+		bool empty() const { return minX >= maxX || minY >= maxY; }
+		bool contains(const Rect& other) const { return minX <= other.minX && minY <= other.minY && maxX >= other.maxX && maxY >= other.maxY; }
+		Rect intersect(const Rect& other) const {
+			return { std::max(minX, other.minX), std::max(minY, other.minY), std::min(maxX, other.maxX), std::min(maxY, other.maxY) };
+		}
+		Rect unite(const Rect& other) const {
+			return { std::min(minX, other.minX), std::min(minY, other.minY), std::max(maxX, other.maxX), std::max(maxY, other.maxY) };
+		}
+	};
+
+	struct Room {
+		uint32_t node = 0;
+		std::optional<ViewCulling::Bounds> bounds, meshBounds;
+		std::vector<uint32_t> gates;
+		// union of the parts of the screen the room is seen through
+		std::optional<Rect> view;
+		size_t numVisits = 0;
+	};
+
+	struct Gate {
+		std::vector<Vector3> polygon;
+		ViewCulling::Bounds bounds;
+		std::vector<uint16_t> rooms;
+	};
+
+	bool Overlaps(const ViewCulling::Bounds& a, const ViewCulling::Bounds& b, float margin)
+	{
+		for (int i = 0; i < 3; i++)
+			if (std::abs(a.center.coord[i] - b.center.coord[i]) > a.extent.coord[i] + b.extent.coord[i] + margin)
+				return false;
+		return true;
+	}
+
+	bool Contains(const ViewCulling::Bounds& bounds, const Vector3& point)
+	{
+		for (int i = 0; i < 3; i++)
+			if (std::abs(point.coord[i] - bounds.center.coord[i]) > bounds.extent.coord[i])
+				return false;
+		return true;
+	}
+
+	// Screen rectangle of the gate's polygon clipped to view, the whole view if the polygon reaches behind the camera
+	Rect ProjectGate(const Gate& gate, const Matrix& viewProj, const Rect& view)
+	{
+		Rect rect = { 1.0f, 1.0f, -1.0f, -1.0f };
+		for (const Vector3& v : gate.polygon) {
+			float clip[4];
+			for (int j = 0; j < 4; j++)
+				clip[j] = v.x * viewProj.m[0][j] + v.y * viewProj.m[1][j] + v.z * viewProj.m[2][j] + viewProj.m[3][j];
+			if (clip[3] <= 1e-4f)
+				return view;
+			const float x = clip[0] / clip[3], y = clip[1] / clip[3];
+			rect.minX = std::min(rect.minX, x);
+			rect.minY = std::min(rect.minY, y);
+			rect.maxX = std::max(rect.maxX, x);
+			rect.maxY = std::max(rect.maxY, y);
+		}
+		return rect.intersect(view);
+	}
+
+	// The camera's frustum with the sides narrowed to the rectangle
+	ViewCulling::Frustum NarrowFrustum(const ViewCulling::Frustum& frustum, const Matrix& viewProj, const Rect& rect)
+	{
+		ViewCulling::Frustum result = frustum;
+		for (int i = 0; i < 4; i++) {
+			const float x = viewProj.m[i][0], y = viewProj.m[i][1], w = viewProj.m[i][3];
+			result.planes[0][i] = x - rect.minX * w;
+			result.planes[1][i] = rect.maxX * w - x;
+			result.planes[2][i] = y - rect.minY * w;
+			result.planes[3][i] = rect.maxY * w - y;
+		}
+		return result;
+	}
+}
+
+void PortalVisibility::Compute(const std::vector<ViewCulling::Node>& nodes, const std::vector<GameObject*>& objects,
+	const Vector3& cameraPosition, const Matrix& viewProj, Result& result, Stats& stats)
+{
+	const auto startTime = std::chrono::steady_clock::now();
+	stats = {};
+
+	// the rooms of the nodes, the top level rooms (Root, ClipRoot) being the outside
+	std::vector<Room> rooms(1);
+	std::vector<std::pair<uint32_t, uint16_t>> roomStack;
+	result.nodeRooms.resize(nodes.size());
+	for (uint32_t i = 0; i < (uint32_t)nodes.size(); i++) {
+		while (!roomStack.empty() && i >= roomStack.back().first)
+			roomStack.pop_back();
+		uint16_t room = roomStack.empty() ? 0 : roomStack.back().second;
+		const GameObject* o = objects[i];
+		if (o->type == ZROOM && o->parent && o->parent->parent && rooms.size() < UINT16_MAX) {
+			room = (uint16_t)rooms.size();
+			rooms.emplace_back().node = i;
+			roomStack.emplace_back(nodes[i].subtreeEnd, room);
+		}
+		result.nodeRooms[i] = room;
+
+		if (room == 0)
+			continue;
+		Room& r = rooms[room];
+		if (o->type == ZBOUND && o->mesh && !o->mesh->vertices.empty()) {
+			const ViewCulling::Bounds bounds = ViewCulling::GetMeshBounds(o->mesh.get()).transform(nodes[i].transform);
+			r.bounds = r.bounds ? r.bounds->merge(bounds) : bounds;
+		}
+		else if (nodes[i].mesh && !nodes[i].mesh->vertices.empty()) {
+			const ViewCulling::Bounds bounds = ViewCulling::GetMeshBounds(nodes[i].mesh).transform(nodes[i].transform);
+			r.meshBounds = r.meshBounds ? r.meshBounds->merge(bounds) : bounds;
+		}
+	}
+
+	// the rooms without volume can't be entered nor seen through gates, so their objects count as outside
+	std::vector<uint16_t> remap(rooms.size(), 0);
+	std::vector<Room> kept(1);
+	for (size_t r = 1; r < rooms.size(); r++) {
+		if (!rooms[r].bounds)
+			rooms[r].bounds = rooms[r].meshBounds;
+		if (rooms[r].bounds) {
+			remap[r] = (uint16_t)kept.size();
+			kept.push_back(std::move(rooms[r]));
+		}
+	}
+	rooms = std::move(kept);
+	for (uint16_t& room : result.nodeRooms)
+		room = remap[room];
+
+	// the gates, linking their room with the other rooms their box touches, or else with the outside
+	std::vector<Gate> gates;
+	for (uint32_t i = 0; i < (uint32_t)nodes.size(); i++) {
+		const GameObject* o = objects[i];
+		if (o->type != ZGATE || !o->mesh || o->mesh->vertices.empty())
+			continue;
+		Gate gate;
+		const std::vector<float>& vertices = o->mesh->vertices;
+		for (size_t v = 0; v + 2 < vertices.size(); v += 3)
+			gate.polygon.push_back(Vector3(vertices[v], vertices[v + 1], vertices[v + 2]).transform(nodes[i].transform));
+		gate.bounds = ViewCulling::GetMeshBounds(o->mesh.get()).transform(nodes[i].transform);
+		const uint16_t owner = result.nodeRooms[i];
+		gate.rooms.push_back(owner);
+		for (uint16_t r = 1; r < (uint16_t)rooms.size(); r++)
+			if (r != owner && Overlaps(*rooms[r].bounds, gate.bounds, gateMargin))
+				gate.rooms.push_back(r);
+		if (gate.rooms.size() == 1) {
+			if (owner == 0)
+				continue;
+			gate.rooms.push_back(0);
+		}
+		for (uint16_t r : gate.rooms)
+			rooms[r].gates.push_back((uint32_t)gates.size());
+		gates.push_back(std::move(gate));
+	}
+	stats.numRooms = rooms.size() - 1;
+	stats.numGates = gates.size();
+
+	// the smallest room around the camera
+	result.cameraRoom = 0;
+	float cameraRoomVolume = 0.0f;
+	for (uint16_t r = 1; r < (uint16_t)rooms.size(); r++) {
+		const ViewCulling::Bounds& bounds = *rooms[r].bounds;
+		const float volume = bounds.extent.x * bounds.extent.y * bounds.extent.z;
+		if (Contains(bounds, cameraPosition) && (result.cameraRoom == 0 || volume < cameraRoomVolume)) {
+			result.cameraRoom = r;
+			cameraRoomVolume = volume;
+		}
+	}
+	if (result.cameraRoom)
+		stats.cameraRoom = objects[rooms[result.cameraRoom].node]->name;
+
+	// flood fill from the camera's room through the gates in view, each room being visited again only if it
+	// is seen through a part of the screen it wasn't seen through before
+	std::vector<std::pair<uint16_t, Rect>> stack;
+	stack.emplace_back(result.cameraRoom, Rect());
+	rooms[result.cameraRoom].view = Rect();
+	while (!stack.empty()) {
+		const auto [r, view] = stack.back();
+		stack.pop_back();
+		for (uint32_t g : rooms[r].gates) {
+			const Gate& gate = gates[g];
+			stats.numPortalsTested++;
+			const Rect rect = ProjectGate(gate, viewProj, view);
+			if (rect.empty())
+				continue;
+			bool passed = false;
+			for (uint16_t next : gate.rooms) {
+				Room& room = rooms[next];
+				if (next == r || (room.view && room.view->contains(rect)) || room.numVisits >= maxVisitsPerRoom)
+					continue;
+				room.view = room.view ? room.view->unite(rect) : rect;
+				room.numVisits++;
+				stack.emplace_back(next, rect);
+				passed = true;
+			}
+			if (passed)
+				stats.numPortalsPassed++;
+		}
+	}
+
+	const ViewCulling::Frustum frustum = ViewCulling::Frustum::fromMatrix(viewProj);
+	result.roomFrustums.assign(rooms.size(), std::nullopt);
+	for (size_t r = 0; r < rooms.size(); r++) {
+		if (!rooms[r].view)
+			continue;
+		result.roomFrustums[r] = NarrowFrustum(frustum, viewProj, *rooms[r].view);
+		stats.numRoomsVisited++;
+	}
+	for (uint32_t i = 0; i < (uint32_t)nodes.size(); i++)
+		if (nodes[i].mesh && !result.roomFrustums[result.nodeRooms[i]])
+			stats.numObjectsHidden++;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ViewCulling.h"
+
+struct GameObject;
+
+// Visibility through the rooms (ZROOM) and the gates between them (ZGATE), as the game does it.
+// The rooms' volumes are their bounds (ZBOUND) or else their meshes' bounds, and a gate links its room with
+// the other rooms its box touches, or with the outside. The rooms are visited from the camera's room through
+// the gates in view, each narrowing the part of the screen the next rooms can be seen through.
+namespace PortalVisibility {
+	struct Stats {
+		size_t numRooms = 0;
+		size_t numGates = 0;
+		// empty if the camera is outside of the rooms
+		std::string cameraRoom;
+		size_t numRoomsVisited = 0;
+		size_t numPortalsTested = 0;
+		size_t numPortalsPassed = 0;
+		// objects with meshes in the rooms not seen
+		size_t numObjectsHidden = 0;
+		double seconds = 0.0;
+	};
+
+	struct Result {
+		// room of each node, 0 being the outside (the objects of no room)
+		std::vector<uint16_t> nodeRooms;
+		// frustum through which each room is seen, none for the rooms not seen
+		std::vector<std::optional<ViewCulling::Frustum>> roomFrustums;
+		uint16_t cameraRoom = 0;
+	};
+
+	// objects[i] is the object of nodes[i], including the hidden ones like the gates.
+	void Compute(const std::vector<ViewCulling::Node>& nodes, const std::vector<GameObject*>& objects,
+		const Vector3& cameraPosition, const Matrix& viewProj, Result& result, Stats& stats);
+}
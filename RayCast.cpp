@@ -0,0 +1,228 @@
+#include "RayCast.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <intrin.h>
+#include <immintrin.h>
+
+namespace {
+#if defined(_MSC_VER)
+#define TARGET_AVX
+#else
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+
+	// Lanes offset to offset + 3 of the packet
+	template <int width>
+	int IntersectSSE(const Vector3& origin, const Vector3& dir, const RayCast::Packet<width>& packet, int offset, float facing,
+		float* outT, float* outU, float* outV)
+	{
+		const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+		const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+		const __m128 e1x = _mm_loadu_ps(packet.e1[0] + offset), e1y = _mm_loadu_ps(packet.e1[1] + offset), e1z = _mm_loadu_ps(packet.e1[2] + offset);
+		const __m128 e2x = _mm_loadu_ps(packet.e2[0] + offset), e2y = _mm_loadu_ps(packet.e2[1] + offset), e2z = _mm_loadu_ps(packet.e2[2] + offset);
+
+		// p = dir x e2, det = e1 . p
+		const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+		// s = origin - v0, q = s x e1
+		const __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(packet.v0[0] + offset));
+		const __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(packet.v0[1] + offset));
+		const __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(packet.v0[2] + offset));
+		const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+		const __m128 u = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), det);
+		const __m128 v = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), det);
+		const __m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), det);
+
+		// the editor's front faces have a negative determinant
+		const __m128 zero = _mm_setzero_ps();
+		__m128 hit = (facing > 0.0f) ? _mm_cmplt_ps(det, zero) : (facing < 0.0f) ? _mm_cmpgt_ps(det, zero) : _mm_cmpneq_ps(det, zero);
+		hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+		hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)), _mm_cmpge_ps(t, zero)));
+
+		const __m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		_mm_storeu_ps(outT, _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, infinity)));
+		_mm_storeu_ps(outU, u);
+		_mm_storeu_ps(outV, v);
+		return _mm_movemask_ps(hit);
+	}
+
+	TARGET_AVX int IntersectAVX(const Vector3& origin, const Vector3& dir, const RayCast::Packet8& packet, float facing, RayCast::PacketHits<8>& hits)
+	{
+		const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+		const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+		const __m256 e1x = _mm256_loadu_ps(packet.e1[0]), e1y = _mm256_loadu_ps(packet.e1[1]), e1z = _mm256_loadu_ps(packet.e1[2]);
+		const __m256 e2x = _mm256_loadu_ps(packet.e2[0]), e2y = _mm256_loadu_ps(packet.e2[1]), e2z = _mm256_loadu_ps(packet.e2[2]);
+
+		const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+
+		const __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(packet.v0[0]));
+		const __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(packet.v0[1]));
+		const __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(packet.v0[2]));
+		const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+		const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+		const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+		const __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), det);
+		const __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), det);
+		const __m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), det);
+
+		const __m256 zero = _mm256_setzero_ps();
+		__m256 hit = (facing > 0.0f) ? _mm256_cmp_ps(det, zero, _CMP_LT_OQ) : (facing < 0.0f) ? _mm256_cmp_ps(det, zero, _CMP_GT_OQ)
+			: _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ), _mm256_cmp_ps(t, zero, _CMP_GE_OQ)));
+
+		_mm256_storeu_ps(hits.t, _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), t, hit));
+		_mm256_storeu_ps(hits.u, u);
+		_mm256_storeu_ps(hits.v, v);
+		return _mm256_movemask_ps(hit);
+	}
+}
+
+template <int numverts>
+bool RayCast::IntersectFace(const Vector3& raystart, const Vector3& raydir, const Vector3* pnts, float facing, Vector3& interpnt)
+{
+	Vector3 edges[numverts];
+	for (int i = 0; i < numverts - 1; i++)
+		edges[i] = pnts[i + 1] - pnts[i];
+	edges[numverts - 1] = pnts[0] - pnts[numverts - 1];
+
+	Vector3 planenorm = edges[1].cross(edges[0]);
+	float planeord = -planenorm.dot(pnts[0]);
+
+	float planenorm_dot_raydir = planenorm.dot(raydir);
+	if (facing != 0.0f ? planenorm_dot_raydir * facing >= 0 : planenorm_dot_raydir == 0) return false;
+
+	float param = -(planenorm.dot(raystart) + planeord) / planenorm_dot_raydir;
+	if (param < 0) return false;
+
+	interpnt = raystart + raydir * param;
+
+	// Check if plane/ray intersection point is inside face
+	for (int i = 0; i < numverts; i++)
+	{
+		Vector3 edgenorm = -planenorm.cross(edges[i]);
+		Vector3 ptoi = interpnt - pnts[i];
+		if (edgenorm.dot(ptoi) < 0)
+			return false;
+	}
+	return true;
+}
+
+template bool RayCast::IntersectFace<3>(const Vector3&, const Vector3&, const Vector3*, float, Vector3&);
+template bool RayCast::IntersectFace<4>(const Vector3&, const Vector3&, const Vector3*, float, Vector3&);
+
+int RayCast::Intersect(const Vector3& origin, const Vector3& dir, const Packet4& packet, float facing, PacketHits<4>& hits)
+{
+	return IntersectSSE(origin, dir, packet, 0, facing, hits.t, hits.u, hits.v);
+}
+
+int RayCast::Intersect(const Vector3& origin, const Vector3& dir, const Packet8& packet, float facing, PacketHits<8>& hits)
+{
+	if (IsAVXSupported())
+		return IntersectAVX(origin, dir, packet, facing, hits);
+	return IntersectSSE(origin, dir, packet, 0, facing, hits.t, hits.u, hits.v)
+		| (IntersectSSE(origin, dir, packet, 4, facing, hits.t + 4, hits.u + 4, hits.v + 4) << 4);
+}
+
+bool RayCast::IsAVXSupported()
+{
+	static const bool supported = []() {
+		int info[4];
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+		// the OS must also save the YMM registers
+		return osxsave && avx && (_xgetbv(0) & 6) == 6;
+	}();
+	return supported;
+}
+
+void RayCast::PrintBenchmark()
+{
+	// triangles around the origin, rays from a sphere around them towards points near the origin
+	constexpr size_t numTriangles = 1 << 14, numRays = 256;
+	std::mt19937 rng(47);
+	std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+	auto randomVector = [&](float scale) { return Vector3(random(rng), random(rng), random(rng)) * scale; };
+	std::vector<Vector3> triangles(numTriangles * 3);
+	for (size_t i = 0; i < numTriangles; i++) {
+		const Vector3 center = randomVector(100.0f);
+		for (int j = 0; j < 3; j++)
+			triangles[i * 3 + j] = center + randomVector(20.0f);
+	}
+	std::vector<Packet4> packets4(numTriangles / 4);
+	std::vector<Packet8> packets8(numTriangles / 8);
+	for (size_t i = 0; i < numTriangles; i++) {
+		const Vector3* tri = &triangles[i * 3];
+		packets4[i / 4].set((int)(i % 4), tri[0], tri[1], tri[2]);
+		packets8[i / 8].set((int)(i % 8), tri[0], tri[1], tri[2]);
+	}
+	std::vector<std::pair<Vector3, Vector3>> rays(numRays);
+	for (auto& [origin, dir] : rays) {
+		origin = randomVector(1.0f).normal() * 300.0f;
+		dir = randomVector(50.0f) - origin;
+	}
+
+	// the nearest hit of each ray, with the three tests
+	auto timeRun = [&](const char* name, auto intersect) {
+		std::vector<float> nearest(numRays, std::numeric_limits<float>::infinity());
+		const auto startTime = std::chrono::steady_clock::now();
+		for (size_t r = 0; r < numRays; r++)
+			nearest[r] = intersect(rays[r].first, rays[r].second);
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		printf("  %-14s %8.1f M triangles/s\n", name, numTriangles * numRays / seconds / 1e6);
+		return nearest;
+	};
+	printf("Ray cast benchmark: %zu triangles, %zu rays, AVX %s\n", numTriangles, numRays, IsAVXSupported() ? "supported" : "not supported");
+	const std::vector<float> scalar = timeRun("IntersectFace", [&](const Vector3& origin, const Vector3& dir) {
+		float best = std::numeric_limits<float>::infinity();
+		Vector3 point;
+		for (size_t i = 0; i < numTriangles; i++)
+			if (IntersectFace<3>(origin, dir, &triangles[i * 3], 1.0f, point))
+				best = std::min(best, (point - origin).len3() / dir.len3());
+		return best;
+		});
+	const std::vector<float> sse = timeRun("4 wide (SSE)", [&](const Vector3& origin, const Vector3& dir) {
+		float best = std::numeric_limits<float>::infinity();
+		PacketHits<4> hits;
+		for (const Packet4& packet : packets4)
+			if (Intersect(origin, dir, packet, 1.0f, hits))
+				for (float t : hits.t)
+					best = std::min(best, t);
+		return best;
+		});
+	const std::vector<float> wide = timeRun(IsAVXSupported() ? "8 wide (AVX)" : "8 wide (2xSSE)", [&](const Vector3& origin, const Vector3& dir) {
+		float best = std::numeric_limits<float>::infinity();
+		PacketHits<8> hits;
+		for (const Packet8& packet : packets8)
+			if (Intersect(origin, dir, packet, 1.0f, hits))
+				for (float t : hits.t)
+					best = std::min(best, t);
+		return best;
+		});
+
+	size_t numHits = 0, numMismatches = 0;
+	for (size_t r = 0; r < numRays; r++) {
+		numHits += scalar[r] != std::numeric_limits<float>::infinity();
+		for (float t : { sse[r], wide[r] })
+			if (!(t == scalar[r] || std::abs(t - scalar[r]) <= 1e-4f * scalar[r]))
+				numMismatches++;
+	}
+	printf("  %zu rays hit, %zu nearest hits differ from IntersectFace\n", numHits, numMismatches);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "vecmat.h"
+
+// Ray and face intersection tests, without state so they can be run from any thread.
+// facing selects the faces hit: 1 for the ones whose (p2 - p1) x (p1 - p0) normal points against the ray, as the
+// editor has always picked, -1 for the ones facing away (in spaces mirrored from the world), 0 for both.
+namespace RayCast {
+	// Scalar test of a face of 3 or 4 points, in the plane of its first three, as picking first did it.
+	// Sets point to rayStart + rayDir * t with t >= 0 if the face is hit.
+	template <int numverts>
+	bool IntersectFace(const Vector3& rayStart, const Vector3& rayDir, const Vector3* points, float facing, Vector3& point);
+
+	// width triangles in structure of arrays: their first vertex and their edges to the second and third vertices.
+	// The lanes left clear never hit.
+	template <int width>
+	struct Packet {
+		float v0[3][width], e1[3][width], e2[3][width];
+		void set(int lane, const Vector3& a, const Vector3& b, const Vector3& c) {
+			for (int j = 0; j < 3; j++) {
+				v0[j][lane] = a.coord[j];
+				e1[j][lane] = b.coord[j] - a.coord[j];
+				e2[j][lane] = c.coord[j] - a.coord[j];
+			}
+		}
+		void clear(int lane) {
+			for (int j = 0; j < 3; j++)
+				v0[j][lane] = e1[j][lane] = e2[j][lane] = 0.0f;
+		}
+	};
+	using Packet4 = Packet<4>;
+	using Packet8 = Packet<8>;
+
+	template <int width>
+	struct PacketHits {
+		// the hit point is origin + dir * t, and v0 + e1 * u + e2 * v; t is infinite for the lanes missed
+		float t[width], u[width], v[width];
+	};
+
+	// Möller-Trumbore tests of the ray against all the packet's triangles at once, returning the mask of the lanes hit
+	// with t >= 0. Quads are tested as the triangles (p0, p1, p2) and (p0, p2, p3).
+	int Intersect(const Vector3& origin, const Vector3& dir, const Packet4& packet, float facing, PacketHits<4>& hits);
+	// With AVX if the CPU supports it, else as two halves with SSE
+	int Intersect(const Vector3& origin, const Vector3& dir, const Packet8& packet, float facing, PacketHits<8>& hits);
+
+	bool IsAVXSupported();
+
+	// Compares the packet tests with IntersectFace on random triangles and prints the triangles tested per second.
+	void PrintBenchmark();
+}
@@ -0,0 +1,1081 @@
+#include "RecoveryJournal.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "BackgroundSave.h"
+#include "ByteReader.h"
+#include "ByteWriter.h"
+#include "chunk.h"
+#include "gameobj.h"
+#include "global.h"
+#include "texture.h"
+
+#include <miniz/miniz.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+
+namespace {
+	constexpr uint32_t journalMagic = 'JR74';
+	constexpr uint32_t journalVersion = 1;
+	constexpr uint32_t nullPath = 0xFFFFFFFF;
+	constexpr size_t recordHeaderSize = 12; // type, payload size, CRC-32 of the payload
+
+	// the records are written at least this often, or sooner when many are waiting
+	constexpr auto syncInterval = std::chrono::milliseconds(500);
+	constexpr size_t maxPendingBytes = 1 << 20;
+	// the journal is folded into a recovery save when it gets too big or too old
+	constexpr size_t compactionBytes = 8 << 20;
+	constexpr auto compactionInterval = std::chrono::minutes(5);
+	constexpr auto compactionRetryDelay = std::chrono::seconds(30);
+
+	enum class RecordType : uint32_t {
+		Transform = 1,
+		DblRange,
+		InsertObject,
+		RemoveObject,
+		MoveObject,
+		ObjectData,
+		Texture,
+		TextureTail,
+	};
+
+	using Writer = ByteWriter<std::string>;
+	using Clock = std::chrono::steady_clock;
+
+	RecoveryJournal::Stats g_stats;
+
+	std::filesystem::path g_scenePath;
+	// true once the journal of g_scenePath was created by this editor, which only happens on the first edit,
+	// so that opening a scene doesn't write next to it or remove the recovery files of another editor
+	bool g_ownsFiles = false;
+	FILE* g_file = nullptr;
+	std::string g_pending; // records not written to the file yet
+	size_t g_fileSize = 0;
+	bool g_unsynced = false;
+	Clock::time_point g_lastSync, g_baseTime, g_lastCompaction;
+	size_t g_recordsSinceBase = 0;
+	// recovery ZIP the journal is based on (0 or 1), -1 for the scene itself
+	int g_baseSlot = -1;
+
+	// save whose file becomes the new base of the journal once finished
+	bool g_saving = false, g_compacting = false, g_discardedCompaction = false;
+	std::filesystem::path g_savePath;
+	size_t g_saveOffset = 0, g_saveRecords = 0;
+
+	std::filesystem::path JournalPath(const std::filesystem::path& scenePath)
+	{
+		std::filesystem::path path = scenePath;
+		path += ".journal";
+		return path;
+	}
+
+	std::filesystem::path RecoveryZipPath(const std::filesystem::path& scenePath, int slot)
+	{
+		std::filesystem::path path = scenePath;
+		path += (slot == 0) ? ".recovery0.zip" : ".recovery1.zip";
+		return path;
+	}
+
+	void RemoveFile(const std::filesystem::path& path)
+	{
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+	}
+
+	// Writing
+
+	bool FindIndexPath(GameObject* obj, std::vector<uint32_t>& path)
+	{
+		path.clear();
+		if (!obj)
+			return false;
+		for (; obj->parent; obj = obj->parent) {
+			auto& siblings = obj->parent->subobj;
+			auto it = std::find(siblings.begin(), siblings.end(), obj);
+			if (it == siblings.end())
+				return false;
+			path.push_back((uint32_t)(it - siblings.begin()));
+		}
+		std::reverse(path.begin(), path.end());
+		return obj == g_scene.superroot;
+	}
+
+	void WriteIndexPath(Writer& w, const std::vector<uint32_t>& path)
+	{
+		w.addU32((uint32_t)path.size());
+		w.addData(path.data(), path.size() * sizeof(uint32_t));
+	}
+
+	// Objects that are not in the scene are written as null
+	void WritePath(Writer& w, GameObject* obj)
+	{
+		std::vector<uint32_t> path;
+		if (FindIndexPath(obj, path))
+			WriteIndexPath(w, path);
+		else
+			w.addU32(nullPath);
+	}
+
+	void WriteString(Writer& w, const std::string& str)
+	{
+		w.addU32((uint32_t)str.size());
+		w.addData(str.data(), str.size());
+	}
+
+	template <typename T> void WriteVector(Writer& w, const std::vector<T>& vec)
+	{
+		w.addU32((uint32_t)vec.size());
+		w.addData(vec.data(), vec.size() * sizeof(T));
+	}
+
+	void WriteEntries(Writer& w, const DBLEntry* entries, size_t count);
+
+	void WriteDbl(Writer& w, const DBLList& dbl)
+	{
+		w.addS32(dbl.flags);
+		WriteEntries(w, dbl.entries.data(), dbl.entries.size());
+	}
+
+	void WriteEntries(Writer& w, const DBLEntry* entries, size_t count)
+	{
+		w.addU32((uint32_t)count);
+		for (size_t i = 0; i < count; ++i) {
+			const DBLEntry& entry = entries[i];
+			w.addS32((int)entry.type);
+			w.addS32(entry.flags);
+			w.addU8((uint8_t)entry.value.index());
+			std::visit([&w](const auto& val) {
+				using T = std::decay_t<decltype(val)>;
+				if constexpr (std::is_same_v<T, double> || std::is_same_v<T, float> || std::is_same_v<T, uint32_t>)
+					w.addValue(val);
+				else if constexpr (std::is_same_v<T, std::string>)
+					WriteString(w, val);
+				else if constexpr (std::is_same_v<T, std::vector<uint8_t>>)
+					WriteVector(w, val);
+				else if constexpr (std::is_same_v<T, GORef>)
+					WritePath(w, val.get());
+				else if constexpr (std::is_same_v<T, std::vector<GORef>>) {
+					w.addU32((uint32_t)val.size());
+					for (const GORef& ref : val)
+						WritePath(w, ref.get());
+				}
+				else if constexpr (std::is_same_v<T, DBLList>)
+					WriteDbl(w, val);
+				else if constexpr (std::is_same_v<T, AudioRef>)
+					w.addU32(val.id);
+				}, entry.value);
+		}
+	}
+
+	void WriteMesh(Writer& w, const Mesh& mesh)
+	{
+		WriteVector(w, mesh.vertices);
+		WriteVector(w, mesh.quadindices);
+		WriteVector(w, mesh.triindices);
+		w.addU32(mesh.weird);
+		WriteVector(w, mesh.textureCoords);
+		WriteVector(w, mesh.lightCoords);
+		WriteVector(w, mesh.ftxFaces);
+		w.addU8(mesh.extension != nullptr);
+		if (mesh.extension) {
+			w.addU32(mesh.extension->type);
+			for (const auto& texAnim : mesh.extension->texAnims) {
+				WriteVector(w, texAnim.frames);
+				WriteString(w, texAnim.name);
+			}
+		}
+	}
+
+	void WriteLine(Writer& w, const ObjLine& line)
+	{
+		WriteVector(w, line.vertices);
+		WriteVector(w, line.terms);
+		w.addU32(line.ftxo);
+		w.addU32(line.weird);
+	}
+
+	void WriteChunk(Writer& w, Chunk& chunk)
+	{
+		WriteString(w, chunk.saveToString());
+	}
+
+	// Meshes, lines and EXC chunks are shared by several objects. They are written once per record,
+	// or replaced by the path of an object of the scene that already has them before the record is replayed.
+	struct SharedDataWriter {
+		enum Kind : uint8_t { None, FromObject, FromRecord, Inline };
+
+		const std::unordered_set<GameObject*>& recordObjects;
+		std::unordered_map<const void*, uint32_t> recordIndices;
+		std::unordered_map<const void*, GameObject*> sceneOwners;
+		bool ownersFound = false;
+
+		SharedDataWriter(const std::unordered_set<GameObject*>& recordObjects) : recordObjects(recordObjects) {}
+
+		template <typename T, typename WriteFunc> void write(Writer& w, const std::shared_ptr<T>& data, WriteFunc writeData) {
+			if (!data) {
+				w.addU8(None);
+				return;
+			}
+			auto it = recordIndices.find(data.get());
+			if (it != recordIndices.end()) {
+				w.addU8(FromRecord);
+				w.addU32(it->second);
+				return;
+			}
+			// only look for other owners when the data is shared at all
+			if (data.use_count() > 1) {
+				if (!ownersFound)
+					findOwners();
+				auto owner = sceneOwners.find(data.get());
+				if (owner != sceneOwners.end()) {
+					w.addU8(FromObject);
+					WritePath(w, owner->second);
+					return;
+				}
+			}
+			w.addU8(Inline);
+			recordIndices[data.get()] = (uint32_t)recordIndices.size();
+			writeData(w, *data);
+		}
+
+		void findOwners() {
+			auto walk = [this](GameObject* obj, auto& rec) -> void {
+				if (recordObjects.count(obj))
+					return;
+				for (const void* data : { (const void*)obj->mesh.get(), (const void*)obj->line.get(), (const void*)obj->excChunk.get() })
+					if (data)
+						sceneOwners.try_emplace(data, obj);
+				for (GameObject* child : obj->subobj)
+					rec(child, rec);
+			};
+			walk(g_scene.superroot, walk);
+			ownersFound = true;
+		}
+	};
+
+	void WriteObject(Writer& w, GameObject* obj, SharedDataWriter& shared)
+	{
+		WriteString(w, obj->name);
+		w.addU32(obj->type);
+		w.addU32(obj->flags);
+		w.addU8(obj->isIncludedScene);
+		w.addData(obj->matrix.v, sizeof(obj->matrix.v));
+		w.addU32(obj->color);
+		WritePath(w, obj->root);
+		w.addU8(obj->light != nullptr);
+		if (obj->light)
+			w.addData(obj->light->param, sizeof(obj->light->param));
+		shared.write(w, obj->mesh, WriteMesh);
+		shared.write(w, obj->line, WriteLine);
+		shared.write(w, obj->excChunk, WriteChunk);
+		WriteDbl(w, obj->dbl);
+		w.addU32((uint32_t)obj->subobj.size());
+		for (GameObject* child : obj->subobj)
+			WriteObject(w, child, shared);
+	}
+
+	void WritePending(bool sync)
+	{
+		if (!g_pending.empty()) {
+			fwrite(g_pending.data(), g_pending.size(), 1, g_file);
+			g_fileSize += g_pending.size();
+			g_pending.clear();
+			g_unsynced = true;
+		}
+		if (sync && g_unsynced) {
+			auto startTime = Clock::now();
+			fflush(g_file);
+			_commit(_fileno(g_file));
+			g_unsynced = false;
+			g_lastSync = Clock::now();
+			g_stats.numSyncs += 1;
+			g_stats.syncSeconds += std::chrono::duration<double>(g_lastSync - startTime).count();
+		}
+	}
+
+	bool CreateJournal();
+
+	template <typename Func> void AddRecord(RecordType type, Func serialize)
+	{
+		if (!g_file && !CreateJournal())
+			return;
+		auto startTime = Clock::now();
+		Writer w;
+		serialize(w);
+		std::string payload = w.take();
+		Writer header;
+		header.addU32((uint32_t)type);
+		header.addU32((uint32_t)payload.size());
+		header.addU32((uint32_t)mz_crc32(MZ_CRC32_INIT, (const uint8_t*)payload.data(), payload.size()));
+		g_pending += header.take();
+		g_pending += payload;
+		g_recordsSinceBase += 1;
+		g_stats.numRecords += 1;
+		g_stats.numBytes += recordHeaderSize + payload.size();
+		g_stats.serializeSeconds += std::chrono::duration<double>(Clock::now() - startTime).count();
+	}
+
+	std::string MakeHeader(const std::filesystem::path& basePath)
+	{
+		std::error_code ec;
+		Writer w;
+		w.addU32(journalMagic);
+		w.addU32(journalVersion);
+		WriteString(w, basePath.u8string());
+		// the journal only applies to this exact version of the base
+		w.addValue((uint64_t)std::filesystem::file_size(basePath, ec));
+		w.addValue((int64_t)std::filesystem::last_write_time(basePath, ec).time_since_epoch().count());
+		return w.take();
+	}
+
+	// Replaces the journal file atomically, and keeps it open for appending the next records
+	bool WriteJournal(const std::filesystem::path& path, const std::string& header, const std::string& records)
+	{
+		std::filesystem::path tempPath = path;
+		tempPath += ".tmp";
+		FILE* file = nullptr;
+		_wfopen_s(&file, tempPath.c_str(), L"wb");
+		if (!file)
+			return false;
+		fwrite(header.data(), header.size(), 1, file);
+		fwrite(records.data(), records.size(), 1, file);
+		fflush(file);
+		_commit(_fileno(file));
+		fclose(file);
+		if (!MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+			RemoveFile(tempPath);
+			return false;
+		}
+		_wfopen_s(&g_file, path.c_str(), L"ab");
+		g_fileSize = header.size() + records.size();
+		g_unsynced = false;
+		g_lastSync = g_baseTime = Clock::now();
+		return g_file != nullptr;
+	}
+
+	void CloseJournal()
+	{
+		if (g_file)
+			fclose(g_file);
+		g_file = nullptr;
+		g_pending.clear();
+		g_fileSize = 0;
+		g_recordsSinceBase = 0;
+	}
+
+	bool CreateJournal()
+	{
+		if (g_ownsFiles || g_scenePath.empty())
+			return false;
+		g_ownsFiles = true;
+		RemoveFile(RecoveryZipPath(g_scenePath, 0));
+		RemoveFile(RecoveryZipPath(g_scenePath, 1));
+		if (!WriteJournal(JournalPath(g_scenePath), MakeHeader(g_scenePath), {})) {
+			printf("Couldn't create the recovery journal of %s\n", g_scenePath.u8string().c_str());
+			CloseJournal();
+			return false;
+		}
+		// the save running doesn't have the edits that start the journal
+		if (g_saving) {
+			g_saveOffset = g_fileSize;
+			g_saveRecords = 0;
+		}
+		return true;
+	}
+
+	bool ReadFile(const std::filesystem::path& path, std::string& data)
+	{
+		FILE* file = nullptr;
+		_wfopen_s(&file, path.c_str(), L"rb");
+		if (!file)
+			return false;
+		std::error_code ec;
+		const uintmax_t fileSize = std::filesystem::file_size(path, ec);
+		data.resize(ec ? 0 : (size_t)fileSize);
+		size_t numRead = fread(data.data(), 1, data.size(), file);
+		fclose(file);
+		data.resize(numRead);
+		return true;
+	}
+
+	// Reading
+
+	struct JournalContents {
+		std::filesystem::path basePath;
+		std::string header;
+		// the records after the header, without the incomplete or corrupted ones written during a crash
+		std::vector<std::pair<size_t, size_t>> records; // offset and size with header
+	};
+
+	bool ParseJournal(const std::string& data, JournalContents& contents)
+	{
+		const uint8_t* bytes = (const uint8_t*)data.data();
+		if (data.size() < 12)
+			return false;
+		ByteReader reader(bytes);
+		uint32_t magic = reader.readUint32();
+		uint32_t version = reader.readUint32();
+		uint32_t pathLength = reader.readUint32();
+		if (magic != journalMagic || version != journalVersion || data.size() < 12 + pathLength + 16)
+			return false;
+		contents.basePath = std::filesystem::u8path(std::string((const char*)reader.currentPointer(), pathLength));
+		reader.skip(pathLength);
+		uint64_t baseSize;
+		int64_t baseTime;
+		reader.readTo(baseSize, baseTime);
+		size_t offset = reader.currentPointer() - bytes;
+		contents.header = data.substr(0, offset);
+
+		std::error_code ec;
+		if (std::filesystem::file_size(contents.basePath, ec) != baseSize || ec
+			|| std::filesystem::last_write_time(contents.basePath, ec).time_since_epoch().count() != baseTime || ec)
+			return false;
+
+		while (data.size() - offset >= recordHeaderSize) {
+			ByteReader recordReader(bytes + offset);
+			recordReader.skip(4);
+			uint32_t size = recordReader.readUint32();
+			uint32_t crc = recordReader.readUint32();
+			if (data.size() - offset - recordHeaderSize < size)
+				break;
+			if ((uint32_t)mz_crc32(MZ_CRC32_INIT, recordReader.currentPointer(), size) != crc)
+				break;
+			contents.records.emplace_back(offset, recordHeaderSize + size);
+			offset += recordHeaderSize + size;
+		}
+		return true;
+	}
+
+	// The records are complete and checked by their CRC, so they are read without bounds checking.
+	// Object paths that don't lead to an object mean the journal doesn't match the scene.
+	struct RecordReader : ByteReader {
+		using ByteReader::ByteReader;
+
+		std::vector<uint32_t> readIndexPath() {
+			std::vector<uint32_t> path(readUint32());
+			readToBuffer(path.data(), path.size() * sizeof(uint32_t));
+			return path;
+		}
+
+		template <typename T> std::vector<T> readVector() {
+			std::vector<T> vec(readUint32());
+			readToBuffer(vec.data(), vec.size() * sizeof(T));
+			return vec;
+		}
+
+		std::string readString() {
+			std::string str(readUint32(), '\0');
+			readToBuffer(str.data(), str.size());
+			return str;
+		}
+	};
+
+	GameObject* ResolvePath(const std::vector<uint32_t>& path)
+	{
+		GameObject* obj = g_scene.superroot;
+		for (uint32_t index : path) {
+			if (index >= obj->subobj.size())
+				throw std::runtime_error("an object of the journal is missing from the scene");
+			obj = obj->subobj[index];
+		}
+		return obj;
+	}
+
+	// The references are resolved once the objects they might point to are in the scene
+	struct PendingRefs {
+		std::vector<std::vector<uint32_t>> paths; // in the order of the references
+		bool hasPath(RecordReader& r) {
+			uint32_t length = r.readUint32();
+			std::vector<uint32_t>& path = paths.emplace_back();
+			if (length == nullPath) {
+				path.push_back(nullPath);
+				return false;
+			}
+			path.resize(length);
+			r.readToBuffer(path.data(), length * sizeof(uint32_t));
+			return true;
+		}
+		GameObject* resolve(size_t& next) const {
+			const auto& path = paths[next++];
+			if (!path.empty() && path[0] == nullPath)
+				return nullptr;
+			return ResolvePath(path);
+		}
+	};
+
+	void ReadEntries(RecordReader& r, std::vector<DBLEntry>& entries, PendingRefs& refs);
+
+	void ReadDbl(RecordReader& r, DBLList& dbl, PendingRefs& refs)
+	{
+		dbl.flags = r.readInt32();
+		ReadEntries(r, dbl.entries, refs);
+	}
+
+	void ReadEntries(RecordReader& r, std::vector<DBLEntry>& entries, PendingRefs& refs)
+	{
+		entries.resize(r.readUint32());
+		for (DBLEntry& entry : entries) {
+			entry.type = (DBLEntry::EType)r.readInt32();
+			entry.flags = r.readInt32();
+			switch (r.readByte()) {
+			case 0: entry.value = std::monostate(); break;
+			case 1: { double val; r.readTo(val); entry.value = val; break; }
+			case 2: entry.value = r.readFloat(); break;
+			case 3: entry.value = r.readUint32(); break;
+			case 4: entry.value = r.readString(); break;
+			case 5: entry.value = r.readVector<uint8_t>(); break;
+			case 6: refs.hasPath(r); entry.value = GORef(); break;
+			case 7: {
+				std::vector<GORef> vec(r.readUint32());
+				for (size_t i = 0; i < vec.size(); ++i)
+					refs.hasPath(r);
+				entry.value = std::move(vec);
+				break;
+			}
+			case 8: ReadDbl(r, entry.value.emplace<DBLList>(), refs); break;
+			case 9: entry.value = AudioRef{ r.readUint32() }; break;
+			default: throw std::runtime_error("unknown DBL value");
+			}
+		}
+	}
+
+	// Same traversal order as ReadEntries
+	void ResolveRefs(std::vector<DBLEntry>& entries, const PendingRefs& refs, size_t& next)
+	{
+		for (DBLEntry& entry : entries) {
+			if (GORef* ref = std::get_if<GORef>(&entry.value))
+				*ref = refs.resolve(next);
+			else if (auto* vec = std::get_if<std::vector<GORef>>(&entry.value))
+				for (GORef& ref : *vec)
+					ref = refs.resolve(next);
+			else if (DBLList* list = std::get_if<DBLList>(&entry.value))
+				ResolveRefs(list->entries, refs, next);
+		}
+	}
+
+	std::shared_ptr<Mesh> ReadMesh(RecordReader& r)
+	{
+		auto mesh = std::make_shared<Mesh>();
+		mesh->vertices = r.readVector<float>();
+		mesh->quadindices = r.readVector<uint16_t>();
+		mesh->triindices = r.readVector<uint16_t>();
+		mesh->weird = r.readUint32();
+		mesh->textureCoords = r.readVector<float>();
+		mesh->lightCoords = r.readVector<float>();
+		mesh->ftxFaces = r.readVector<Mesh::FTXFace>();
+		if (r.readByte()) {
+			mesh->extension = std::make_shared<Mesh::Extension>();
+			mesh->extension->type = r.readUint32();
+			for (auto& texAnim : mesh->extension->texAnims) {
+				texAnim.frames = r.readVector<std::pair<uint32_t, uint32_t>>();
+				texAnim.name = r.readString();
+			}
+		}
+		return mesh;
+	}
+
+	std::shared_ptr<ObjLine> ReadLine(RecordReader& r)
+	{
+		auto line = std::make_shared<ObjLine>();
+		line->vertices = r.readVector<float>();
+		line->terms = r.readVector<uint32_t>();
+		line->ftxo = r.readUint32();
+		line->weird = r.readUint32();
+		return line;
+	}
+
+	Chunk ReadChunk(RecordReader& r)
+	{
+		std::string data = r.readString();
+		Chunk chunk;
+		chunk.load(data.data());
+		return chunk;
+	}
+
+	struct SharedDataReader {
+		std::vector<std::shared_ptr<void>> recordData;
+
+		template <typename T, typename ReadFunc> std::shared_ptr<T> read(RecordReader& r, std::shared_ptr<T> GameObject::* member, ReadFunc readData) {
+			switch (r.readByte()) {
+			case SharedDataWriter::None:
+				return nullptr;
+			case SharedDataWriter::FromObject:
+				return ResolvePath(r.readIndexPath())->*member;
+			case SharedDataWriter::FromRecord:
+				return std::static_pointer_cast<T>(recordData.at(r.readUint32()));
+			default: {
+				std::shared_ptr<T> data = readData(r);
+				recordData.push_back(data);
+				return data;
+			}
+			}
+		}
+	};
+
+	std::shared_ptr<Chunk> ReadSharedChunk(RecordReader& r)
+	{
+		return std::make_shared<Chunk>(ReadChunk(r));
+	}
+
+	GameObject* ReadObject(RecordReader& r, GameObject* parent, SharedDataReader& shared, PendingRefs& refs)
+	{
+		GameObject* obj = new GameObject(r.readString().c_str());
+		obj->parent = parent;
+		obj->type = r.readUint32();
+		obj->flags = r.readUint32();
+		obj->isIncludedScene = r.readByte();
+		r.readToBuffer(obj->matrix.v, sizeof(obj->matrix.v));
+		obj->color = r.readUint32();
+		refs.hasPath(r);
+		if (r.readByte()) {
+			obj->light = std::make_shared<Light>();
+			r.readToBuffer(obj->light->param, sizeof(obj->light->param));
+		}
+		obj->mesh = shared.read(r, &GameObject::mesh, ReadMesh);
+		obj->line = shared.read(r, &GameObject::line, ReadLine);
+		obj->excChunk = shared.read(r, &GameObject::excChunk, ReadSharedChunk);
+		ReadDbl(r, obj->dbl, refs);
+		obj->subobj.resize(r.readUint32());
+		for (GameObject*& child : obj->subobj)
+			child = ReadObject(r, obj, shared, refs);
+		return obj;
+	}
+
+	// Same traversal order as ReadObject
+	void ResolveObjectRefs(GameObject* obj, const PendingRefs& refs, size_t& next)
+	{
+		obj->root = refs.resolve(next);
+		ResolveRefs(obj->dbl.entries, refs, next);
+		for (GameObject* child : obj->subobj)
+			ResolveObjectRefs(child, refs, next);
+	}
+
+	std::vector<Chunk>& PackOf(int pack)
+	{
+		Chunk* packs[] = { &g_scene.palPack, &g_scene.dxtPack, &g_scene.lgtPack };
+		return packs[pack]->subchunks;
+	}
+
+	void ApplyRecord(RecordType type, RecordReader& r)
+	{
+		switch (type) {
+		case RecordType::Transform: {
+			GameObject* obj = ResolvePath(r.readIndexPath());
+			r.readToBuffer(obj->matrix.v, sizeof(obj->matrix.v));
+			break;
+		}
+		case RecordType::DblRange: {
+			GameObject* obj = ResolvePath(r.readIndexPath());
+			uint32_t index = r.readUint32();
+			uint32_t numRemoved = r.readUint32();
+			int flags = r.readInt32();
+			std::vector<DBLEntry> inserted;
+			PendingRefs refs;
+			ReadEntries(r, inserted, refs);
+			size_t next = 0;
+			ResolveRefs(inserted, refs, next);
+			auto& entries = obj->dbl.entries;
+			if (index + numRemoved > entries.size())
+				throw std::runtime_error("DBL range out of bounds");
+			auto it = entries.erase(entries.begin() + index, entries.begin() + index + numRemoved);
+			entries.insert(it, std::make_move_iterator(inserted.begin()), std::make_move_iterator(inserted.end()));
+			obj->dbl.flags = flags;
+			break;
+		}
+		case RecordType::InsertObject: {
+			GameObject* parent = ResolvePath(r.readIndexPath());
+			uint32_t index = r.readUint32();
+			SharedDataReader shared;
+			PendingRefs refs;
+			GameObject* obj = ReadObject(r, parent, shared, refs);
+			parent->subobj.insert(parent->subobj.begin() + std::min<size_t>(index, parent->subobj.size()), obj);
+			size_t next = 0;
+			ResolveObjectRefs(obj, refs, next);
+			break;
+		}
+		case RecordType::RemoveObject: {
+			GameObject* parent = ResolvePath(r.readIndexPath());
+			uint32_t index = r.readUint32();
+			if (index >= parent->subobj.size())
+				throw std::runtime_error("removed object missing");
+			GameObject* obj = parent->subobj[index];
+			parent->subobj.erase(parent->subobj.begin() + index);
+			// like the history, the objects still referenced by the scene are left alone
+			std::vector<GameObject*> objects;
+			auto collect = [&objects](GameObject* o, auto& rec) -> void {
+				objects.push_back(o);
+				for (GameObject* child : o->subobj)
+					rec(child, rec);
+			};
+			collect(obj, collect);
+			for (GameObject* o : objects)
+				o->dbl.entries.clear();
+			for (auto it = objects.rbegin(); it != objects.rend(); ++it) {
+				auto rc = g_objRefCounts.find(*it);
+				if (rc != g_objRefCounts.end() && rc->second != 0)
+					continue;
+				if (rc != g_objRefCounts.end())
+					g_objRefCounts.erase(rc);
+				delete *it;
+			}
+			break;
+		}
+		case RecordType::MoveObject: {
+			GameObject* obj = ResolvePath(r.readIndexPath());
+			auto& oldSiblings = obj->parent->subobj;
+			oldSiblings.erase(std::find(oldSiblings.begin(), oldSiblings.end(), obj));
+			GameObject* newParent = ResolvePath(r.readIndexPath());
+			uint32_t newIndex = r.readUint32();
+			newParent->subobj.insert(newParent->subobj.begin() + std::min<size_t>(newIndex, newParent->subobj.size()), obj);
+			obj->parent = newParent;
+			break;
+		}
+		case RecordType::ObjectData: {
+			SharedDataReader shared;
+			uint32_t numObjects = r.readUint32();
+			for (uint32_t i = 0; i < numObjects; ++i) {
+				GameObject* obj = ResolvePath(r.readIndexPath());
+				obj->mesh = shared.read(r, &GameObject::mesh, ReadMesh);
+				obj->excChunk = shared.read(r, &GameObject::excChunk, ReadSharedChunk);
+			}
+			break;
+		}
+		case RecordType::Texture: {
+			uint32_t texId = r.readUint32();
+			auto [palchk, dxtchk] = FindTextureChunk(g_scene, texId);
+			if (!palchk)
+				throw std::runtime_error("texture missing");
+			*palchk = ReadChunk(r);
+			if (r.readByte()) {
+				Chunk dxt = ReadChunk(r);
+				if (dxtchk)
+					*dxtchk = std::move(dxt);
+			}
+			g_scene.textureIndex.invalidate();
+			break;
+		}
+		case RecordType::TextureTail: {
+			g_scene.numTextures = r.readUint32();
+			for (int pack = 0; pack < 3; ++pack) {
+				std::vector<Chunk>& chunks = PackOf(pack);
+				uint32_t start = r.readUint32();
+				uint32_t count = r.readUint32();
+				if (start > chunks.size())
+					throw std::runtime_error("texture pack shorter than expected");
+				chunks.erase(chunks.begin() + start, chunks.end());
+				chunks.reserve(start + count);
+				for (uint32_t i = 0; i < count; ++i)
+					chunks.push_back(ReadChunk(r));
+			}
+			g_scene.textureIndex.invalidate();
+			break;
+		}
+		default:
+			throw std::runtime_error("unknown record");
+		}
+	}
+
+	void StartCompaction()
+	{
+		WritePending(true);
+		g_lastCompaction = Clock::now();
+		const int slot = (g_baseSlot == 0) ? 1 : 0;
+		std::filesystem::path path = RecoveryZipPath(g_scenePath, slot);
+		if (!BackgroundSave::Start(path, ZipCompression::Profile::Fast))
+			return;
+		g_saving = true;
+		g_compacting = true;
+		g_savePath = path;
+		g_saveOffset = g_fileSize;
+		g_saveRecords = g_recordsSinceBase;
+	}
+
+	// The records written after the save started stay in the new journal
+	void Rebase(const std::filesystem::path& scenePath, int baseSlot)
+	{
+		if (!g_ownsFiles) {
+			// no edit yet, the journal of the new base is created by the next one
+			g_scenePath = scenePath;
+			g_baseSlot = baseSlot;
+			return;
+		}
+		std::string tail;
+		if (g_file) {
+			WritePending(false);
+			fclose(g_file);
+			g_file = nullptr;
+			std::string data;
+			if (ReadFile(JournalPath(g_scenePath), data) && data.size() >= g_saveOffset)
+				tail = data.substr(g_saveOffset);
+		}
+		const size_t tailRecords = g_recordsSinceBase - g_saveRecords;
+		const std::filesystem::path oldScenePath = g_scenePath;
+		const int oldSlot = g_baseSlot;
+		g_scenePath = scenePath;
+		g_baseSlot = baseSlot;
+		if (!WriteJournal(JournalPath(scenePath), MakeHeader(g_savePath), tail)) {
+			printf("Couldn't write the recovery journal of %s\n", scenePath.u8string().c_str());
+			CloseJournal();
+			return;
+		}
+		g_recordsSinceBase = tailRecords;
+
+		// the previous base is not needed anymore
+		if (!oldScenePath.empty() && oldScenePath != scenePath)
+			RemoveFile(JournalPath(oldScenePath));
+		if (!oldScenePath.empty() && oldSlot != -1 && (oldScenePath != scenePath || oldSlot != baseSlot))
+			RemoveFile(RecoveryZipPath(oldScenePath, oldSlot));
+	}
+}
+
+void RecoveryJournal::Start(const std::filesystem::path& scenePath)
+{
+	Discard();
+	g_scenePath = scenePath;
+	g_baseSlot = -1;
+}
+
+size_t RecoveryJournal::GetRecoverableEdits(const std::filesystem::path& scenePath)
+{
+	std::string data;
+	JournalContents contents;
+	if (!ReadFile(JournalPath(scenePath), data))
+		return 0;
+	if (!ParseJournal(data, contents))
+		return 0;
+	return contents.records.size();
+}
+
+void RecoveryJournal::Recover(const std::filesystem::path& scenePath)
+{
+	Discard();
+	std::string data;
+	JournalContents contents;
+	if (!ReadFile(JournalPath(scenePath), data) || !ParseJournal(data, contents)) {
+		g_scene.LoadSceneSPK(scenePath);
+		Start(scenePath);
+		return;
+	}
+	g_scene.LoadSceneSPK(contents.basePath);
+	g_scene.lastSpkFilepath = scenePath;
+
+	auto startTime = Clock::now();
+	size_t numApplied = 0;
+	try {
+		for (auto& [offset, size] : contents.records) {
+			ByteReader header((const uint8_t*)data.data() + offset);
+			RecordType type = (RecordType)header.readUint32();
+			RecordReader reader((const uint8_t*)data.data() + offset + recordHeaderSize);
+			ApplyRecord(type, reader);
+			numApplied += 1;
+		}
+	}
+	catch (const std::exception& ex) {
+		std::string msg = "Only " + std::to_string(numApplied) + " of the " + std::to_string(contents.records.size())
+			+ " edits could be recovered, as the scene doesn't match the recovery journal (" + ex.what() + ").";
+		warn(msg.c_str());
+	}
+	printf("Recovered %zu edits in %.3f s\n", numApplied, std::chrono::duration<double>(Clock::now() - startTime).count());
+
+	// the recovered edits stay in the journal until the next save
+	g_scenePath = scenePath;
+	g_ownsFiles = true;
+	g_baseSlot = -1;
+	for (int slot : { 0, 1 })
+		if (contents.basePath == RecoveryZipPath(scenePath, slot))
+			g_baseSlot = slot;
+	size_t recordsEnd = numApplied ? contents.records[numApplied - 1].first + contents.records[numApplied - 1].second : contents.header.size();
+	std::string records = data.substr(contents.header.size(), recordsEnd - contents.header.size());
+	if (!WriteJournal(JournalPath(scenePath), contents.header, records)) {
+		printf("Couldn't reopen the recovery journal of %s\n", scenePath.u8string().c_str());
+		CloseJournal();
+		return;
+	}
+	g_recordsSinceBase = numApplied;
+}
+
+void RecoveryJournal::Discard()
+{
+	CloseJournal();
+	if (g_saving && g_compacting)
+		g_discardedCompaction = true;
+	g_saving = g_compacting = false;
+	if (g_ownsFiles && !g_scenePath.empty()) {
+		RemoveFile(JournalPath(g_scenePath));
+		RemoveFile(RecoveryZipPath(g_scenePath, 0));
+		RemoveFile(RecoveryZipPath(g_scenePath, 1));
+	}
+	g_ownsFiles = false;
+	g_scenePath.clear();
+	g_baseSlot = -1;
+}
+
+void RecoveryJournal::Update()
+{
+	if (!g_file)
+		return;
+	const auto now = Clock::now();
+	if (g_pending.size() >= maxPendingBytes || (now - g_lastSync >= syncInterval && (!g_pending.empty() || g_unsynced)))
+		WritePending(true);
+	if (!g_saving && !BackgroundSave::IsRunning() && g_recordsSinceBase > 0 && now - g_lastCompaction >= compactionRetryDelay
+		&& (g_fileSize >= compactionBytes || now - g_baseTime >= compactionInterval))
+		StartCompaction();
+}
+
+void RecoveryJournal::OnSaveStarted(const std::filesystem::path& fn)
+{
+	if (g_file)
+		WritePending(true);
+	g_saving = true;
+	g_compacting = false;
+	g_savePath = fn;
+	g_saveOffset = g_fileSize;
+	g_saveRecords = g_recordsSinceBase;
+}
+
+bool RecoveryJournal::OnSaveFinished(const BackgroundSave::Result& result)
+{
+	if (!g_saving)
+		return std::exchange(g_discardedCompaction, false);
+	g_saving = false;
+	const bool compaction = g_compacting;
+	g_compacting = false;
+	if (!result.success) {
+		if (compaction)
+			printf("The recovery journal couldn't be compacted: %s\n", result.error.c_str());
+		return compaction;
+	}
+	if (compaction) {
+		Rebase(g_scenePath, (g_baseSlot == 0) ? 1 : 0);
+		g_stats.numCompactions += 1;
+	}
+	else {
+		const std::filesystem::path oldScenePath = g_scenePath;
+		Rebase(g_savePath, -1);
+		if (g_ownsFiles && !oldScenePath.empty())
+			for (int slot : { 0, 1 })
+				RemoveFile(RecoveryZipPath(oldScenePath, slot));
+	}
+	return compaction;
+}
+
+const RecoveryJournal::Stats& RecoveryJournal::GetStats()
+{
+	return g_stats;
+}
+
+std::vector<uint32_t> RecoveryJournal::GetIndexPath(GameObject* obj)
+{
+	std::vector<uint32_t> path;
+	FindIndexPath(obj, path);
+	return path;
+}
+
+void RecoveryJournal::RecordTransform(GameObject* obj)
+{
+	AddRecord(RecordType::Transform, [obj](Writer& w) {
+		WritePath(w, obj);
+		w.addData(obj->matrix.v, sizeof(obj->matrix.v));
+		});
+}
+
+void RecoveryJournal::RecordDblRange(GameObject* obj, size_t index, size_t numRemoved, size_t numInserted)
+{
+	AddRecord(RecordType::DblRange, [=](Writer& w) {
+		WritePath(w, obj);
+		w.addU32((uint32_t)index);
+		w.addU32((uint32_t)numRemoved);
+		w.addS32(obj->dbl.flags);
+		WriteEntries(w, obj->dbl.entries.data() + index, numInserted);
+		});
+}
+
+void RecoveryJournal::RecordInsertObject(GameObject* obj)
+{
+	AddRecord(RecordType::InsertObject, [obj](Writer& w) {
+		auto& siblings = obj->parent->subobj;
+		WritePath(w, obj->parent);
+		w.addU32((uint32_t)(std::find(siblings.begin(), siblings.end(), obj) - siblings.begin()));
+		std::unordered_set<GameObject*> subtree;
+		auto collect = [&subtree](GameObject* o, auto& rec) -> void {
+			subtree.insert(o);
+			for (GameObject* child : o->subobj)
+				rec(child, rec);
+		};
+		collect(obj, collect);
+		SharedDataWriter shared(subtree);
+		WriteObject(w, obj, shared);
+		});
+}
+
+void RecoveryJournal::RecordRemoveObject(GameObject* parent, size_t index)
+{
+	AddRecord(RecordType::RemoveObject, [=](Writer& w) {
+		WritePath(w, parent);
+		w.addU32((uint32_t)index);
+		});
+}
+
+void RecoveryJournal::RecordMoveObject(const std::vector<uint32_t>& sourcePath, GameObject* obj)
+{
+	AddRecord(RecordType::MoveObject, [&sourcePath, obj](Writer& w) {
+		auto& siblings = obj->parent->subobj;
+		WriteIndexPath(w, sourcePath);
+		WritePath(w, obj->parent);
+		w.addU32((uint32_t)(std::find(siblings.begin(), siblings.end(), obj) - siblings.begin()));
+		});
+}
+
+void RecoveryJournal::RecordObjectData(const std::vector<GameObject*>& objects)
+{
+	AddRecord(RecordType::ObjectData, [&objects](Writer& w) {
+		std::unordered_set<GameObject*> recordObjects(objects.begin(), objects.end());
+		SharedDataWriter shared(recordObjects);
+		w.addU32((uint32_t)objects.size());
+		for (GameObject* obj : objects) {
+			WritePath(w, obj);
+			shared.write(w, obj->mesh, WriteMesh);
+			shared.write(w, obj->excChunk, WriteChunk);
+		}
+		});
+}
+
+void RecoveryJournal::RecordTexture(uint32_t texId)
+{
+	AddRecord(RecordType::Texture, [texId](Writer& w) {
+		auto [palchk, dxtchk] = FindTextureChunk(g_scene, texId);
+		w.addU32(texId);
+		WriteChunk(w, *palchk);
+		w.addU8(dxtchk != nullptr);
+		if (dxtchk)
+			WriteChunk(w, *dxtchk);
+		});
+}
+
+void RecoveryJournal::RecordTextureTail(size_t numPal, size_t numDxt, size_t numLgt)
+{
+	AddRecord(RecordType::TextureTail, [=](Writer& w) {
+		w.addU32(g_scene.numTextures);
+		const size_t starts[3] = { numPal, numDxt, numLgt };
+		for (int pack = 0; pack < 3; ++pack) {
+			std::vector<Chunk>& chunks = PackOf(pack);
+			const size_t start = std::min(starts[pack], chunks.size());
+			w.addU32((uint32_t)start);
+			w.addU32((uint32_t)(chunks.size() - start));
+			for (size_t i = start; i < chunks.size(); ++i)
+				WriteChunk(w, chunks[i]);
+		}
+		});
+}
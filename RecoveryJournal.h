@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+struct GameObject;
+namespace BackgroundSave {
+	struct Result;
+}
+
+// Binary journal of the edits made to g_scene since its last save, written next to the scene ZIP
+// (<scene>.journal), so that the edits can be replayed on top of the save if the editor crashes.
+// Each record holds the state resulting from an edit, with the objects identified by their
+// child indices from the superroot. The records are written and synced to the disk in batches,
+// and the journal is regularly compacted by saving the scene to a recovery ZIP in the background.
+namespace RecoveryJournal {
+	struct Stats {
+		size_t numRecords = 0;
+		size_t numBytes = 0;
+		double serializeSeconds = 0.0;
+		size_t numSyncs = 0;
+		double syncSeconds = 0.0;
+		size_t numCompactions = 0;
+	};
+
+	// Starts journaling the scene that has just been loaded from scenePath. The journal is only created by the first edit.
+	void Start(const std::filesystem::path& scenePath);
+	// Returns the number of edits that can be recovered from a journal left by a crash, 0 if there is none.
+	size_t GetRecoverableEdits(const std::filesystem::path& scenePath);
+	// Loads the last save of the scene, replays the journal on top of it, and keeps journaling.
+	void Recover(const std::filesystem::path& scenePath);
+	// Stops journaling and deletes the journal, once the edits don't need to be recovered anymore.
+	void Discard();
+
+	// To call every frame once the edits are complete: writes the records to the disk and starts the compactions.
+	void Update();
+	// To call when the user starts saving the scene. The saved file becomes the base of the journal once the save succeeded.
+	void OnSaveStarted(const std::filesystem::path& fn);
+	// To call with the result of every background save. Returns true if it was a compaction that shouldn't be reported.
+	bool OnSaveFinished(const BackgroundSave::Result& result);
+	const Stats& GetStats();
+
+	// Child indices of the object from the superroot
+	std::vector<uint32_t> GetIndexPath(GameObject* obj);
+
+	// Records, taking the current state of the scene
+	void RecordTransform(GameObject* obj);
+	// The entries [index, index + numRemoved) were replaced with the entries [index, index + numInserted) of the object's DBL.
+	void RecordDblRange(GameObject* obj, size_t index, size_t numRemoved, size_t numInserted);
+	void RecordInsertObject(GameObject* obj);
+	void RecordRemoveObject(GameObject* parent, size_t index);
+	void RecordMoveObject(const std::vector<uint32_t>& sourcePath, GameObject* obj);
+	// Meshes and EXC chunks of the objects
+	void RecordObjectData(const std::vector<GameObject*>& objects);
+	void RecordTexture(uint32_t texId);
+	// The texture packs were truncated or extended after their first numPal, numDxt and numLgt chunks.
+	void RecordTextureTail(size_t numPal, size_t numDxt, size_t numLgt);
+}
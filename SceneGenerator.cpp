@@ -0,0 +1,339 @@
+#include "SceneGenerator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <variant>
+
+#include "ByteWriter.h"
+#include "chunk.h"
+#include "classInfo.h"
+#include "gameobj.h"
+#include "texture.h"
+#include "vecmat.h"
+
+#include <nlohmann/json.hpp>
+
+namespace {
+	constexpr int typeGroup = 1; // ZGROUP
+	constexpr int typeMeshObject = 2; // ZSTDOBJ
+
+	// The first DBL members (components, creation, script) are kept as created
+	constexpr size_t numInitialMembers = 4;
+
+	std::shared_ptr<Mesh> GenerateMesh(std::mt19937& rng, int gridSize, uint16_t texId)
+	{
+		// the indices are stored multiplied by 2 in 16 bits
+		gridSize = std::clamp(gridSize, 1, 127);
+		const int side = gridSize + 1;
+		std::uniform_real_distribution<float> height(-0.5f, 0.5f);
+
+		auto mesh = std::make_shared<Mesh>();
+		mesh->vertices.reserve(3 * side * side);
+		for (int z = 0; z < side; ++z)
+			for (int x = 0; x < side; ++x)
+				mesh->vertices.insert(mesh->vertices.end(), { (float)x - 0.5f * gridSize, height(rng), (float)z - 0.5f * gridSize });
+
+		static const float quadUvs[8] = { 0,0, 0,1, 1,1, 1,0 };
+		for (int z = 0; z < gridSize; ++z) {
+			for (int x = 0; x < gridSize; ++x) {
+				const int v = z * side + x;
+				for (int corner : { v, v + side, v + side + 1, v + 1 })
+					mesh->quadindices.push_back((uint16_t)(corner << 1));
+				if (texId != 0xFFFF) {
+					mesh->ftxFaces.push_back({ (uint16_t)FTXFlag::textureBilinear, 0, texId, 0, 0, 0 });
+					mesh->textureCoords.insert(mesh->textureCoords.end(), std::begin(quadUvs), std::end(quadUvs));
+				}
+			}
+		}
+		return mesh;
+	}
+
+	void AddGeneratedTexture(Scene& scene, std::mt19937& rng, int size, size_t index)
+	{
+		std::vector<uint8_t> pixels(4 * size * size);
+		std::uniform_int_distribution<int> channel(0, 255);
+		const uint8_t colors[2][3] = {
+			{ (uint8_t)channel(rng), (uint8_t)channel(rng), (uint8_t)channel(rng) },
+			{ (uint8_t)channel(rng), (uint8_t)channel(rng), (uint8_t)channel(rng) },
+		};
+		const int cell = std::max(size / 8, 1);
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				const uint8_t* color = colors[((x / cell) + (y / cell)) & 1];
+				uint8_t* pixel = pixels.data() + 4 * (y * size + x);
+				pixel[0] = color[0];
+				pixel[1] = color[1];
+				pixel[2] = color[2];
+				pixel[3] = 255;
+			}
+		}
+		AddTexture(scene, pixels.data(), size, size, "synth_" + std::to_string(index));
+	}
+
+	void AddGeneratedWave(Scene& scene, size_t numSamples, size_t index)
+	{
+		constexpr uint32_t sampleRate = 22050;
+		const uint32_t dataSize = (uint32_t)(2 * numSamples);
+		ByteWriter<std::string> wav;
+		wav.addData("RIFF", 4);
+		wav.addU32(36 + dataSize);
+		wav.addData("WAVEfmt ", 8);
+		wav.addU32(16);
+		wav.addU16(1); // PCM
+		wav.addU16(1); // mono
+		wav.addU32(sampleRate);
+		wav.addU32(2 * sampleRate);
+		wav.addU16(2);
+		wav.addU16(16);
+		wav.addData("data", 4);
+		wav.addU32(dataSize);
+		const double frequency = 220.0 * (1 + index % 4);
+		for (size_t i = 0; i < numSamples; ++i)
+			wav.addS16((int16_t)(8000.0 * std::sin(2.0 * 3.14159265358979 * frequency * (double)i / sampleRate)));
+
+		int wavObjId = (int)scene.audioMgr.audioObjects.size();
+		scene.audioMgr.allocateSlot(wavObjId);
+		scene.audioMgr.audioObjects[wavObjId] = std::make_shared<WaveAudioObject>();
+		scene.audioMgr.audioNames[wavObjId] = "synth_" + std::to_string(index) + ".wav";
+
+		Chunk& chk = scene.wavPack.subchunks.emplace_back();
+		chk.tag = 'WPCM';
+		std::string data = wav.take();
+		chk.maindata.resize(data.size());
+		memcpy(chk.maindata.data(), data.data(), data.size());
+	}
+
+	// Classes without mesh, light or line that have object references in their DBL
+	std::vector<int> FindReferencingClasses()
+	{
+		std::vector<int> classes;
+		for (auto& [name, id] : g_classInfo_stringIdMap) {
+			if (ClassInfo::GetObjTypeCategory(id) & (0x0020 | 0x0080 | 0x0400))
+				continue;
+			GameObject probe("probe", id);
+			auto members = ClassInfo::GetMemberNames(&probe);
+			if (std::any_of(members.begin(), members.end(), [](const ClassInfo::ObjectMember& mem) { return mem.info->type == "ZGEOMREF"; }))
+				classes.push_back(id);
+		}
+		return classes;
+	}
+
+	void FillDbl(GameObject* obj, std::mt19937& rng, const SceneGenerator::Params& params, const std::vector<GameObject*>& targets)
+	{
+		std::uniform_int_distribution<int> letter('a', 'z');
+		std::uniform_int_distribution<int> byte(0, 255);
+		std::uniform_int_distribution<size_t> target(0, targets.empty() ? 0 : targets.size() - 1);
+		auto& entries = obj->dbl.entries;
+		for (size_t i = numInitialMembers; i < entries.size(); ++i) {
+			DBLEntry& entry = entries[i];
+			if (auto* str = std::get_if<std::string>(&entry.value)) {
+				str->resize(params.dblStringLength);
+				for (char& c : *str)
+					c = (char)letter(rng);
+			}
+			else if (auto* data = std::get_if<std::vector<uint8_t>>(&entry.value)) {
+				data->resize(params.dblDataSize);
+				for (uint8_t& b : *data)
+					b = (uint8_t)byte(rng);
+			}
+			else if (auto* ref = std::get_if<GORef>(&entry.value)) {
+				if (!targets.empty())
+					*ref = targets[target(rng)];
+			}
+			else if (auto* refs = std::get_if<std::vector<GORef>>(&entry.value)) {
+				if (!targets.empty())
+					for (int r = 0; r < 4; ++r)
+						refs->emplace_back(targets[target(rng)]);
+			}
+		}
+	}
+
+	double SecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+SceneGenerator::Params SceneGenerator::Params::scaled(double scale) const
+{
+	auto scaleCount = [scale](size_t count) { return (size_t)std::llround((double)count * scale); };
+	Params p = *this;
+	p.numObjects = scaleCount(numObjects);
+	p.numUniqueMeshes = scaleCount(numUniqueMeshes);
+	p.numSharedMeshes = std::max<size_t>(scaleCount(numSharedMeshes), 1);
+	p.numReferencingObjects = scaleCount(numReferencingObjects);
+	p.numTextures = scaleCount(numTextures);
+	p.numWaves = scaleCount(numWaves);
+	return p;
+}
+
+void SceneGenerator::Generate(Scene& scene, const Params& params)
+{
+	scene.LoadEmpty();
+	std::mt19937 rng(params.seed);
+
+	for (size_t i = 0; i < params.numTextures; ++i)
+		AddGeneratedTexture(scene, rng, params.textureSize, i);
+	for (size_t i = 0; i < params.numWaves; ++i)
+		AddGeneratedWave(scene, params.waveSamples, i);
+
+	std::vector<uint16_t> texIds;
+	for (Chunk& chk : scene.palPack.subchunks)
+		texIds.push_back((uint16_t)*(uint32_t*)chk.maindata.data());
+	std::uniform_int_distribution<size_t> pickTexture(0, texIds.empty() ? 0 : texIds.size() - 1);
+	auto randomTexture = [&]() -> uint16_t { return texIds.empty() ? 0xFFFF : texIds[pickTexture(rng)]; };
+
+	std::vector<std::shared_ptr<Mesh>> sharedMeshes;
+	for (size_t i = 0; i < params.numSharedMeshes; ++i)
+		sharedMeshes.push_back(GenerateMesh(rng, params.meshGridSize, randomTexture()));
+
+	// Groups, each one under a random group that is not too deep
+	std::vector<std::pair<GameObject*, int>> groups = { { scene.rootobj, 0 } };
+	const size_t numGroups = params.numObjects / std::max<size_t>(params.objectsPerGroup, 1);
+	for (size_t i = 0; i < numGroups; ++i) {
+		std::vector<size_t> candidates;
+		for (size_t g = 0; g < groups.size(); ++g)
+			if (groups[g].second < params.maxDepth || g == 0)
+				candidates.push_back(g);
+		auto [parent, depth] = groups[candidates[std::uniform_int_distribution<size_t>(0, candidates.size() - 1)(rng)]];
+		GameObject* group = scene.CreateObject(typeGroup, parent);
+		group->name = "Group" + std::to_string(i);
+		groups.emplace_back(group, depth + 1);
+	}
+
+	std::uniform_int_distribution<size_t> pickGroup(0, groups.size() - 1);
+	std::uniform_int_distribution<size_t> pickShared(0, sharedMeshes.empty() ? 0 : sharedMeshes.size() - 1);
+	std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+	std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+	std::vector<GameObject*> objects;
+	objects.reserve(params.numObjects);
+	for (size_t i = 0; i < params.numObjects; ++i) {
+		GameObject* obj = scene.CreateObject(typeMeshObject, groups[pickGroup(rng)].first);
+		obj->name = "Object" + std::to_string(i);
+		obj->matrix = Matrix::getRotationYMatrix(angle(rng)) * Matrix::getTranslationMatrix(Vector3(position(rng), 0.0f, position(rng)));
+		if (i < params.numUniqueMeshes || sharedMeshes.empty())
+			obj->mesh = GenerateMesh(rng, params.meshGridSize, randomTexture());
+		else
+			obj->mesh = sharedMeshes[pickShared(rng)];
+		obj->color = 0xFF808080;
+		FillDbl(obj, rng, params, {});
+		objects.push_back(obj);
+	}
+
+	const std::vector<int> referencingClasses = FindReferencingClasses();
+	if (!referencingClasses.empty()) {
+		std::uniform_int_distribution<size_t> pickClass(0, referencingClasses.size() - 1);
+		for (size_t i = 0; i < params.numReferencingObjects; ++i) {
+			GameObject* obj = scene.CreateObject(referencingClasses[pickClass(rng)], groups[pickGroup(rng)].first);
+			obj->name = "Referencing" + std::to_string(i);
+			FillDbl(obj, rng, params, objects);
+		}
+	}
+}
+
+bool SceneGenerator::GenerateFile(const std::filesystem::path& fn, const Params& params)
+{
+	auto scene = std::make_unique<Scene>();
+	Generate(*scene, params);
+	return scene->SaveSceneSPK(fn);
+}
+
+nlohmann::json SceneGenerator::RunBenchmark(const std::filesystem::path& directory, const std::vector<double>& scales, int repetitions)
+{
+	using Clock = std::chrono::steady_clock;
+	std::error_code ec;
+	std::filesystem::create_directories(directory, ec);
+
+	nlohmann::json results;
+	results["version"] = 1;
+	results["timestamp"] = (int64_t)time(nullptr);
+	results["hardwareThreads"] = std::thread::hardware_concurrency();
+	results["repetitions"] = repetitions;
+	nlohmann::json& runs = results["scales"];
+	runs = nlohmann::json::array();
+
+	for (double scale : scales) {
+		const Params params = Params().scaled(scale);
+		const std::filesystem::path generatedPath = directory / ("synthetic_" + std::to_string(params.numObjects) + ".zip");
+		const std::filesystem::path resavedPath = directory / ("synthetic_" + std::to_string(params.numObjects) + "_resaved.zip");
+
+		auto scene = std::make_unique<Scene>();
+		auto startTime = Clock::now();
+		Generate(*scene, params);
+		const double generateSeconds = SecondsSince(startTime);
+		if (!scene->SaveSceneSPK(generatedPath)) {
+			printf("Benchmark: couldn't write %s\n", generatedPath.u8string().c_str());
+			continue;
+		}
+		scene->Close();
+
+		std::map<std::string, std::vector<double>> timings;
+		size_t spkBytes = 0;
+		for (int r = 0; r < repetitions; ++r) {
+			startTime = Clock::now();
+			scene->LoadSceneSPK(generatedPath);
+			timings["LoadSceneSPK"].push_back(SecondsSince(startTime));
+
+			startTime = Clock::now();
+			Chunk spk = scene->ConstructSPK();
+			timings["ConstructSPK"].push_back(SecondsSince(startTime));
+			spkBytes = spk.saveToString().size();
+
+			startTime = Clock::now();
+			scene->SaveSceneSPK(resavedPath);
+			timings["SaveSceneSPK"].push_back(SecondsSince(startTime));
+
+			startTime = Clock::now();
+			scene->Close();
+			timings["Close"].push_back(SecondsSince(startTime));
+		}
+
+		nlohmann::json run;
+		run["scale"] = scale;
+		run["objects"] = params.numObjects;
+		run["uniqueMeshes"] = params.numUniqueMeshes;
+		run["sharedMeshes"] = params.numSharedMeshes;
+		run["referencingObjects"] = params.numReferencingObjects;
+		run["textures"] = params.numTextures;
+		run["waves"] = params.numWaves;
+		run["zipBytes"] = std::filesystem::file_size(generatedPath, ec);
+		run["spkBytes"] = spkBytes;
+		run["generateSeconds"] = generateSeconds;
+		printf("Benchmark scale %g (%zu objects):\n", scale, params.numObjects);
+		for (auto& [stage, seconds] : timings) {
+			std::vector<double> sorted = seconds;
+			std::sort(sorted.begin(), sorted.end());
+			const double median = sorted[sorted.size() / 2];
+			run["stages"][stage] = { { "medianSeconds", median }, { "minSeconds", sorted.front() }, { "runs", seconds } };
+			printf("  %-14s median %9.3f ms, min %9.3f ms\n", stage.c_str(), median * 1000.0, sorted.front() * 1000.0);
+		}
+		runs.push_back(std::move(run));
+
+		std::filesystem::remove(generatedPath, ec);
+		std::filesystem::remove(resavedPath, ec);
+	}
+	return results;
+}
+
+bool SceneGenerator::RunBenchmarkToFile(const std::filesystem::path& jsonPath)
+{
+	nlohmann::json results = RunBenchmark(std::filesystem::temp_directory_path() / "c47edit_benchmark", { 0.1, 1.0, 10.0 }, 5);
+	FILE* file = nullptr;
+	_wfopen_s(&file, jsonPath.c_str(), L"wb");
+	if (!file)
+		return false;
+	std::string text = results.dump(2);
+	fwrite(text.data(), text.size(), 1, file);
+	fclose(file);
+	printf("Benchmark results written to %s\n", jsonPath.u8string().c_str());
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include <nlohmann/json_fwd.hpp>
+
+struct Scene;
+
+// Generation of synthetic scenes, to measure the editor's performance without real game levels.
+namespace SceneGenerator {
+	struct Params {
+		uint32_t seed = 47;
+		// objects with a mesh, not counting the groups containing them
+		size_t numObjects = 1000;
+		size_t objectsPerGroup = 16;
+		int maxDepth = 4;
+		// meshes used by a single object, the other objects share the meshes of a small pool
+		size_t numUniqueMeshes = 200;
+		size_t numSharedMeshes = 32;
+		// number of quads on each side of a mesh
+		int meshGridSize = 8;
+		// length of the string members and size of the data members of the DBLs
+		size_t dblStringLength = 16;
+		size_t dblDataSize = 64;
+		// objects whose ZGEOMREF members point to other objects
+		size_t numReferencingObjects = 100;
+		size_t numTextures = 32;
+		int textureSize = 64;
+		size_t numWaves = 8;
+		size_t waveSamples = 22050;
+
+		// The counts multiplied by the scale
+		Params scaled(double scale) const;
+	};
+
+	// Replaces the scene's content with generated objects, textures and waves.
+	void Generate(Scene& scene, const Params& params);
+	bool GenerateFile(const std::filesystem::path& fn, const Params& params);
+
+	// Times the generation, LoadSceneSPK, ConstructSPK, SaveSceneSPK and Close at each scale of the
+	// default parameters, working on files in the directory. Returns the medians and all the runs.
+	nlohmann::json RunBenchmark(const std::filesystem::path& directory, const std::vector<double>& scales, int repetitions);
+	// Runs the benchmark at the default scales and writes the results to a JSON file.
+	// Only run from the command line (--benchmark), as it takes minutes at the largest scale.
+	bool RunBenchmarkToFile(const std::filesystem::path& jsonPath);
+}
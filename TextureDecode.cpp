@@ -0,0 +1,310 @@
+#include "TextureDecode.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "chunk.h"
+#include "gameobj.h"
+#include "texture.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+
+namespace {
+	struct CachedLayout {
+		uint8_t header[20];
+		size_t dataSize;
+		std::shared_ptr<const TextureDecode::Layout> layout;
+	};
+
+	// The data pointers of chunks that were freed can be reused by other chunks,
+	// so the header and size are compared before using a cached layout.
+	std::mutex g_layoutMutex;
+	std::unordered_map<const uint8_t*, CachedLayout> g_layoutCache;
+	constexpr size_t maxCachedLayouts = 8192;
+
+	bool MatchesChunk(const CachedLayout& cached, const Chunk* chk) {
+		return cached.dataSize == chk->maindata.size() && cached.layout->tag == chk->tag
+			&& memcmp(cached.header, chk->maindata.data(), sizeof(cached.header)) == 0;
+	}
+
+	std::vector<uint32_t>& GetScratch(size_t numPixels) {
+		thread_local std::vector<uint32_t> scratch;
+		if (scratch.size() < numPixels)
+			scratch.resize(numPixels);
+		return scratch;
+	}
+
+#if defined(_MSC_VER)
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+	TARGET_AVX2 void ExpandPaletteAVX2(const uint8_t* indices, size_t count, const uint32_t* palette, uint32_t* output) {
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i idx = _mm_loadu_si128((const __m128i*)(indices + i));
+			__m256i lo = _mm256_i32gather_epi32((const int*)palette, _mm256_cvtepu8_epi32(idx), 4);
+			__m256i hi = _mm256_i32gather_epi32((const int*)palette, _mm256_cvtepu8_epi32(_mm_srli_si128(idx, 8)), 4);
+			_mm256_storeu_si256((__m256i*)(output + i), lo);
+			_mm256_storeu_si256((__m256i*)(output + i + 8), hi);
+		}
+		for (; i < count; i++)
+			output[i] = palette[indices[i]];
+	}
+}
+
+std::shared_ptr<const TextureDecode::Layout> TextureDecode::ParseLayout(const Chunk* chk)
+{
+	auto layout = std::make_shared<Layout>();
+	const uint8_t* data = chk->maindata.data();
+	const TexInfo* ti = (const TexInfo*)data;
+	layout->tag = chk->tag;
+	layout->id = ti->id;
+	layout->width = ti->width;
+	layout->height = ti->height;
+
+	const uint8_t* pnt = data + 20;
+	while (*(pnt++)); // skip name
+	const int numMipmaps = *(const uint16_t*)(data + 8);
+	layout->levels.resize(numMipmaps);
+	for (int m = 0; m < numMipmaps; m++) {
+		Level& level = layout->levels[m];
+		level.width = std::max(layout->width >> m, 1);
+		level.height = std::max(layout->height >> m, 1);
+		level.size = *(const uint32_t*)pnt;
+		level.offset = pnt + 4 - data;
+		pnt += level.size + 4;
+	}
+
+	if (chk->tag == 'PALN') {
+		uint32_t npalentries = *(const uint32_t*)pnt; pnt += 4;
+		if (npalentries > 256) npalentries = 256;
+		memcpy(layout->palette.data(), pnt, 4 * npalentries);
+		layout->numPaletteEntries = npalentries;
+		layout->paletteHasTransparency = std::any_of(layout->palette.begin(), layout->palette.begin() + npalentries,
+			[](uint32_t color) { return (color & 0xFF000000) != 0xFF000000; });
+	}
+	return layout;
+}
+
+std::shared_ptr<const TextureDecode::Layout> TextureDecode::GetLayout(const Chunk* chk)
+{
+	std::lock_guard<std::mutex> lock(g_layoutMutex);
+	auto it = g_layoutCache.find(chk->maindata.data());
+	if (it != g_layoutCache.end() && MatchesChunk(it->second, chk))
+		return it->second.layout;
+
+	if (g_layoutCache.size() >= maxCachedLayouts)
+		g_layoutCache.clear();
+	CachedLayout& cached = g_layoutCache[chk->maindata.data()];
+	memcpy(cached.header, chk->maindata.data(), sizeof(cached.header));
+	cached.dataSize = chk->maindata.size();
+	cached.layout = ParseLayout(chk);
+	return cached.layout;
+}
+
+void TextureDecode::ForgetLayout(const Chunk* chk)
+{
+	std::lock_guard<std::mutex> lock(g_layoutMutex);
+	g_layoutCache.erase(chk->maindata.data());
+}
+
+void TextureDecode::ClearLayoutCache()
+{
+	std::lock_guard<std::mutex> lock(g_layoutMutex);
+	g_layoutCache.clear();
+}
+
+bool TextureDecode::IsAVX2Supported()
+{
+	static const bool supported = []() {
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+		// the OS must also save the YMM registers
+		if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	}();
+	return supported;
+}
+
+void TextureDecode::ExpandPaletteScalar(const uint8_t* indices, size_t count, const uint32_t* palette, uint32_t* output)
+{
+	for (size_t i = 0; i < count; i++)
+		output[i] = palette[indices[i]];
+}
+
+void TextureDecode::ExpandPalette(const uint8_t* indices, size_t count, const uint32_t* palette, uint32_t* output)
+{
+	if (IsAVX2Supported())
+		ExpandPaletteAVX2(indices, count, palette, output);
+	else
+		ExpandPaletteScalar(indices, count, palette, output);
+}
+
+void TextureDecode::DecodeBC1(const uint8_t* blocks, int width, int height, uint32_t* output)
+{
+	auto expand565 = [](uint32_t c, int rgb[3]) {
+		rgb[0] = ((c >> 11) & 31) * 255 / 31;
+		rgb[1] = ((c >> 5) & 63) * 255 / 63;
+		rgb[2] = (c & 31) * 255 / 31;
+	};
+	auto pack = [](int r, int g, int b, int a) { return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | ((uint32_t)a << 24); };
+
+	const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	for (int by = 0; by < blocksY; by++) {
+		for (int bx = 0; bx < blocksX; bx++) {
+			const uint8_t* block = blocks + 8 * ((size_t)by * blocksX + bx);
+			const uint32_t c0 = block[0] | (block[1] << 8);
+			const uint32_t c1 = block[2] | (block[3] << 8);
+			int rgb0[3], rgb1[3];
+			expand565(c0, rgb0);
+			expand565(c1, rgb1);
+			uint32_t colors[4];
+			colors[0] = pack(rgb0[0], rgb0[1], rgb0[2], 255);
+			colors[1] = pack(rgb1[0], rgb1[1], rgb1[2], 255);
+			if (c0 > c1) {
+				colors[2] = pack((2 * rgb0[0] + rgb1[0]) / 3, (2 * rgb0[1] + rgb1[1]) / 3, (2 * rgb0[2] + rgb1[2]) / 3, 255);
+				colors[3] = pack((rgb0[0] + 2 * rgb1[0]) / 3, (rgb0[1] + 2 * rgb1[1]) / 3, (rgb0[2] + 2 * rgb1[2]) / 3, 255);
+			}
+			else {
+				colors[2] = pack((rgb0[0] + rgb1[0]) / 2, (rgb0[1] + rgb1[1]) / 2, (rgb0[2] + rgb1[2]) / 2, 255);
+				colors[3] = 0;
+			}
+			uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+			// the blocks on the right and bottom edges can be partly outside of the image
+			const int numRows = std::min(4, height - 4 * by);
+			const int numCols = std::min(4, width - 4 * bx);
+			for (int y = 0; y < numRows; y++) {
+				uint32_t* row = output + (size_t)(4 * by + y) * width + 4 * bx;
+				const uint32_t rowIndices = indices >> (8 * y);
+				for (int x = 0; x < numCols; x++)
+					row[x] = colors[(rowIndices >> (2 * x)) & 3];
+			}
+		}
+	}
+}
+
+const uint32_t* TextureDecode::DecodeLevel(const Chunk* chk, const Layout& layout, int level)
+{
+	const Level& lvl = layout.levels[level];
+	const uint8_t* pixels = chk->maindata.data() + lvl.offset;
+	if (layout.tag == 'RGBA')
+		return (const uint32_t*)pixels;
+	if (layout.tag == 'DXT1') {
+		std::vector<uint32_t>& scratch = GetScratch((size_t)lvl.width * lvl.height);
+		DecodeBC1(pixels, lvl.width, lvl.height, scratch.data());
+		return scratch.data();
+	}
+	std::vector<uint32_t>& scratch = GetScratch(lvl.size);
+	ExpandPalette(pixels, lvl.size, layout.palette.data(), scratch.data());
+	return scratch.data();
+}
+
+void TextureDecode::DecodeLevelTo(const Chunk* chk, const Layout& layout, int level, uint32_t* output)
+{
+	const Level& lvl = layout.levels[level];
+	const uint8_t* pixels = chk->maindata.data() + lvl.offset;
+	if (layout.tag == 'RGBA')
+		memcpy(output, pixels, lvl.size);
+	else if (layout.tag == 'DXT1')
+		DecodeBC1(pixels, lvl.width, lvl.height, output);
+	else
+		ExpandPalette(pixels, lvl.size, layout.palette.data(), output);
+}
+
+size_t TextureDecode::GetNumPixels(const Layout& layout, int level)
+{
+	const Level& lvl = layout.levels[level];
+	if (layout.tag == 'PALN')
+		return std::max<size_t>(lvl.size, (size_t)lvl.width * lvl.height);
+	if (layout.tag == 'RGBA')
+		return std::max<size_t>(lvl.size / 4, (size_t)lvl.width * lvl.height);
+	return (size_t)lvl.width * lvl.height;
+}
+
+bool TextureDecode::UsesTransparency(const Chunk* chk, const Layout& layout)
+{
+	if (layout.levels.empty())
+		return false;
+	const Level& lvl = layout.levels[0];
+	const uint8_t* pixels = chk->maindata.data() + lvl.offset;
+	if (layout.tag == 'PALN') {
+		// only the indices of the transparent entries need to be looked for
+		if (!layout.paletteHasTransparency)
+			return false;
+		bool transparent[256];
+		for (int i = 0; i < 256; i++)
+			transparent[i] = (layout.palette[i] & 0xFF000000) != 0xFF000000;
+		return std::any_of(pixels, pixels + lvl.size, [&](uint8_t index) { return transparent[index]; });
+	}
+	else if (layout.tag == 'RGBA') {
+		const uint32_t* rgba = (const uint32_t*)pixels;
+		return std::any_of(rgba, rgba + lvl.size / 4, [](uint32_t color) { return (color & 0xFF000000) != 0xFF000000; });
+	}
+	else if (layout.tag == 'DXT1') {
+		const uint32_t* rgba = DecodeLevel(chk, layout, 0);
+		return std::any_of(rgba, rgba + (size_t)lvl.width * lvl.height, [](uint32_t color) { return (color & 0xFF000000) != 0xFF000000; });
+	}
+	return false;
+}
+
+void TextureDecode::PrintBenchmark(const Scene& scene)
+{
+	size_t numTextures = 0, numPixels = 0;
+	for (const Chunk& chk : scene.palPack.subchunks) {
+		if (chk.tag != 'PALN')
+			continue;
+		numTextures++;
+		for (const Level& level : ParseLayout(&chk)->levels)
+			numPixels += level.size;
+	}
+	if (numPixels == 0) {
+		printf("Texture decode benchmark: no PALN texture in the palPack\n");
+		return;
+	}
+	printf("Texture decode benchmark: %zu PALN textures, %.2f megapixels with mipmaps, AVX2 %s\n", numTextures, numPixels / 1e6,
+		IsAVX2Supported() ? "supported" : "not supported");
+
+	constexpr int repetitions = 5;
+	auto timeRun = [&](const char* label, auto func) {
+		auto startTime = std::chrono::steady_clock::now();
+		for (int r = 0; r < repetitions; r++)
+			for (const Chunk& chk : scene.palPack.subchunks)
+				if (chk.tag == 'PALN')
+					func(chk);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() / repetitions;
+		printf("  %-24s %8.3f ms, %8.2f ms/MP\n", label, seconds * 1000.0, seconds * 1000.0 / (numPixels / 1e6));
+	};
+
+	timeRun("parse layouts", [](const Chunk& chk) { ParseLayout(&chk); });
+	timeRun("cached layouts", [](const Chunk& chk) { GetLayout(&chk); });
+	timeRun("expand scalar", [](const Chunk& chk) {
+		auto layout = GetLayout(&chk);
+		for (const Level& level : layout->levels) {
+			std::vector<uint32_t>& scratch = GetScratch(level.size);
+			ExpandPaletteScalar(chk.maindata.data() + level.offset, level.size, layout->palette.data(), scratch.data());
+		}
+		});
+	if (IsAVX2Supported()) {
+		timeRun("expand AVX2", [](const Chunk& chk) {
+			auto layout = GetLayout(&chk);
+			for (const Level& level : layout->levels) {
+				std::vector<uint32_t>& scratch = GetScratch(level.size);
+				ExpandPaletteAVX2(chk.maindata.data() + level.offset, level.size, layout->palette.data(), scratch.data());
+			}
+			});
+	}
+	timeRun("transparency check", [](const Chunk& chk) { UsesTransparency(&chk, *GetLayout(&chk)); });
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct Chunk;
+struct Scene;
+
+// Decoding of the PALN and RGBA texture chunks of the palPack and lgtPack, and of the DXT1 chunks
+// of the dxtPack, into RGBA8 pixels.
+namespace TextureDecode {
+	struct Level {
+		int width, height;
+		// position of the level's pixels (palette indices or RGBA8) in the chunk's data, and their size in bytes
+		size_t offset;
+		uint32_t size;
+	};
+
+	struct Layout {
+		uint32_t tag = 0;
+		uint32_t id = 0;
+		int width = 0, height = 0;
+		std::vector<Level> levels;
+		// PALN only, the entries missing from the chunk are zero
+		std::array<uint32_t, 256> palette = {};
+		uint32_t numPaletteEntries = 0;
+		bool paletteHasTransparency = false;
+	};
+
+	// Parses the header, the mipmap sizes and the palette of the texture chunk.
+	std::shared_ptr<const Layout> ParseLayout(const Chunk* chk);
+	// Same, but only parses the chunk the first time, the layouts are cached by chunk data.
+	std::shared_ptr<const Layout> GetLayout(const Chunk* chk);
+	void ForgetLayout(const Chunk* chk);
+	void ClearLayoutCache();
+
+	// output[i] = palette[indices[i]], with AVX2 gathers if the CPU supports them.
+	void ExpandPalette(const uint8_t* indices, size_t count, const uint32_t* palette, uint32_t* output);
+	void ExpandPaletteScalar(const uint8_t* indices, size_t count, const uint32_t* palette, uint32_t* output);
+	bool IsAVX2Supported();
+
+	// BC1 (DXT1) blocks to RGBA8 pixels, the transparent texels of 3-color blocks being black.
+	void DecodeBC1(const uint8_t* blocks, int width, int height, uint32_t* output);
+
+	// Returns the RGBA8 pixels of a mipmap level, either pointing into the chunk's data (RGBA)
+	// or to a thread-local buffer (PALN, DXT1) that stays valid until the next DecodeLevel on the same thread.
+	const uint32_t* DecodeLevel(const Chunk* chk, const Layout& layout, int level);
+	// Same, writing into output that must hold GetNumPixels pixels.
+	void DecodeLevelTo(const Chunk* chk, const Layout& layout, int level, uint32_t* output);
+	// Number of pixels written by DecodeLevelTo, at least width*height.
+	size_t GetNumPixels(const Layout& layout, int level);
+	// True if a pixel of the first level isn't fully opaque.
+	bool UsesTransparency(const Chunk* chk, const Layout& layout);
+
+	// Times the layout parsing and the palette expansion of all the levels of the palPack's textures.
+	void PrintBenchmark(const Scene& scene);
+}
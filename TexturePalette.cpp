@@ -0,0 +1,242 @@
+#include "TexturePalette.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+#include "ThreadPool.h"
+
+namespace {
+	// 5 bits for red, green and blue, 4 for alpha
+	constexpr int histogramBits = 19;
+
+	int Channel(uint32_t color, int c) { return (color >> (8 * c)) & 255; }
+	uint32_t Pack(int r, int g, int b, int a) { return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | ((uint32_t)a << 24); }
+
+	// The color of fully transparent pixels doesn't matter
+	uint32_t Normalize(uint32_t color) { return (color & 0xFF000000) ? color : 0; }
+
+	uint32_t HistogramBin(uint32_t color) {
+		return ((color >> 3) & 31) | (((color >> 11) & 31) << 5) | (((color >> 19) & 31) << 10) | ((color >> 28) << 15);
+	}
+	uint32_t BinCenter(uint32_t bin) {
+		return Pack(((bin & 31) << 3) | 4, (((bin >> 5) & 31) << 3) | 4, (((bin >> 10) & 31) << 3) | 4, ((bin >> 15) << 4) | 8);
+	}
+
+	int Distance(uint32_t a, uint32_t b) {
+		int dist = 0;
+		for (int c = 0; c < 4; c++) {
+			int d = Channel(a, c) - Channel(b, c);
+			dist += d * d;
+		}
+		return dist;
+	}
+
+	// Nearest palette entry, with a direct-mapped cache of the last colors looked up.
+	// The palette is stored by channel so that the distances to all entries are computed in SIMD.
+	struct NearestFinder {
+		static constexpr int maxEntries = 256;
+		alignas(32) int channels[4][maxEntries];
+		int numEntries;
+		std::array<uint64_t, 4096> cache;
+
+		explicit NearestFinder(const std::vector<uint32_t>& palette) : numEntries((int)palette.size()) {
+			for (int c = 0; c < 4; c++)
+				for (int i = 0; i < maxEntries; i++)
+					channels[c][i] = (i < numEntries) ? Channel(palette[i], c) : 4096;
+			cache.fill(0);
+		}
+
+		uint8_t find(uint32_t color) {
+			uint64_t& slot = cache[(color * 2654435761u) >> 20];
+			// bit 40 marks the used slots
+			if ((slot >> 40) && (uint32_t)(slot >> 8) == color)
+				return (uint8_t)slot;
+			const int r = Channel(color, 0), g = Channel(color, 1), b = Channel(color, 2), a = Channel(color, 3);
+			alignas(32) int distances[maxEntries];
+			for (int i = 0; i < maxEntries; i++) {
+				int dr = channels[0][i] - r, dg = channels[1][i] - g, db = channels[2][i] - b, da = channels[3][i] - a;
+				distances[i] = dr * dr + dg * dg + db * db + da * da;
+			}
+			int best = 0;
+			for (int i = 1; i < numEntries; i++)
+				if (distances[i] < distances[best])
+					best = i;
+			slot = (1ull << 40) | ((uint64_t)color << 8) | (uint64_t)best;
+			return (uint8_t)best;
+		}
+	};
+
+	size_t GetNumBands(size_t numPixels) {
+		return std::clamp<size_t>(numPixels / 65536, 1, ThreadPool::global().getNumThreads());
+	}
+
+	struct Box {
+		size_t begin, end;
+		uint64_t count;
+		int widestChannel, range;
+	};
+}
+
+std::vector<uint32_t> TexturePalette::MakePalette(const uint32_t* pixels, size_t numPixels, int maxColors)
+{
+	// histograms of bands of pixels, then merged
+	const size_t numBands = GetNumBands(numPixels);
+	std::vector<std::vector<uint32_t>> bandHistograms(numBands);
+	ThreadPool::global().parallelFor(numBands, [&](size_t band) {
+		auto& histogram = bandHistograms[band];
+		histogram.assign((size_t)1 << histogramBits, 0);
+		for (size_t i = band * numPixels / numBands; i < (band + 1) * numPixels / numBands; i++)
+			histogram[HistogramBin(Normalize(pixels[i]))]++;
+		});
+	struct Bin {
+		uint32_t color;
+		uint32_t count;
+	};
+	std::vector<Bin> bins;
+	for (uint32_t bin = 0; bin < (1u << histogramBits); bin++) {
+		uint32_t count = 0;
+		for (auto& histogram : bandHistograms)
+			count += histogram[bin];
+		if (count)
+			bins.push_back({ (bin == 0) ? 0 : BinCenter(bin), count });
+	}
+	bandHistograms.clear();
+
+	auto measure = [&bins](Box& box) {
+		int lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+		box.count = 0;
+		for (size_t i = box.begin; i < box.end; i++) {
+			for (int c = 0; c < 4; c++) {
+				lo[c] = std::min(lo[c], Channel(bins[i].color, c));
+				hi[c] = std::max(hi[c], Channel(bins[i].color, c));
+			}
+			box.count += bins[i].count;
+		}
+		box.widestChannel = 0;
+		for (int c = 1; c < 4; c++)
+			if (hi[c] - lo[c] > hi[box.widestChannel] - lo[box.widestChannel])
+				box.widestChannel = c;
+		box.range = hi[box.widestChannel] - lo[box.widestChannel];
+	};
+
+	// median cut: split the box with the largest range weighted by its pixel count, at the median of its widest channel
+	std::vector<Box> boxes;
+	if (!bins.empty()) {
+		measure(boxes.emplace_back(Box{ 0, bins.size() }));
+	}
+	while ((int)boxes.size() < maxColors) {
+		Box* toSplit = nullptr;
+		double bestScore = 0.0;
+		for (Box& box : boxes) {
+			double score = (double)box.range * std::sqrt((double)box.count);
+			if (box.end - box.begin > 1 && score > bestScore) {
+				bestScore = score;
+				toSplit = &box;
+			}
+		}
+		if (!toSplit)
+			break;
+		const int c = toSplit->widestChannel;
+		std::sort(bins.begin() + toSplit->begin, bins.begin() + toSplit->end,
+			[c](const Bin& a, const Bin& b) { return Channel(a.color, c) < Channel(b.color, c); });
+		uint64_t half = toSplit->count / 2, sum = 0;
+		size_t split = toSplit->begin;
+		while (split < toSplit->end - 1 && sum + bins[split].count <= half)
+			sum += bins[split++].count;
+		split = std::max(split, toSplit->begin + 1);
+		Box upper{ split, toSplit->end };
+		toSplit->end = split;
+		measure(*toSplit);
+		measure(upper);
+		boxes.push_back(upper);
+	}
+
+	std::vector<uint32_t> palette;
+	for (const Box& box : boxes) {
+		uint64_t sums[4] = {};
+		for (size_t i = box.begin; i < box.end; i++)
+			for (int c = 0; c < 4; c++)
+				sums[c] += (uint64_t)Channel(bins[i].color, c) * bins[i].count;
+		palette.push_back(Pack((int)(sums[0] / box.count), (int)(sums[1] / box.count), (int)(sums[2] / box.count), (int)(sums[3] / box.count)));
+	}
+	if (palette.empty())
+		palette.push_back(0);
+
+	// k-means iteration on the exact colors: each entry becomes the mean of the pixels nearest to it
+	struct Accumulator {
+		std::vector<std::array<uint64_t, 5>> sums;
+	};
+	std::vector<Accumulator> bandSums(numBands);
+	ThreadPool::global().parallelFor(numBands, [&](size_t band) {
+		auto& sums = bandSums[band].sums;
+		sums.assign(palette.size(), {});
+		NearestFinder finder(palette);
+		for (size_t i = band * numPixels / numBands; i < (band + 1) * numPixels / numBands; i++) {
+			uint32_t color = Normalize(pixels[i]);
+			auto& entry = sums[finder.find(color)];
+			for (int c = 0; c < 4; c++)
+				entry[c] += Channel(color, c);
+			entry[4]++;
+		}
+		});
+	for (size_t p = 0; p < palette.size(); p++) {
+		std::array<uint64_t, 5> total = {};
+		for (auto& band : bandSums)
+			for (int c = 0; c < 5; c++)
+				total[c] += band.sums[p][c];
+		if (total[4])
+			palette[p] = Pack((int)((total[0] + total[4] / 2) / total[4]), (int)((total[1] + total[4] / 2) / total[4]),
+				(int)((total[2] + total[4] / 2) / total[4]), (int)((total[3] + total[4] / 2) / total[4]));
+	}
+	return palette;
+}
+
+void TexturePalette::MapToPalette(const uint32_t* pixels, int width, int height, const std::vector<uint32_t>& palette, bool dither, uint8_t* indices)
+{
+	const size_t numPixels = (size_t)width * height;
+	if (!dither) {
+		const size_t numBands = GetNumBands(numPixels);
+		ThreadPool::global().parallelFor(numBands, [&](size_t band) {
+			NearestFinder finder(palette);
+			for (size_t i = band * numPixels / numBands; i < (band + 1) * numPixels / numBands; i++)
+				indices[i] = finder.find(Normalize(pixels[i]));
+			});
+		return;
+	}
+
+	// Floyd-Steinberg, the errors of the current and next rows in 1/16
+	NearestFinder finder(palette);
+	std::vector<std::array<int, 4>> errors((size_t)width + 2), nextErrors((size_t)width + 2);
+	for (int y = 0; y < height; y++) {
+		std::fill(nextErrors.begin(), nextErrors.end(), std::array<int, 4>{});
+		for (int x = 0; x < width; x++) {
+			const size_t i = (size_t)y * width + x;
+			int wanted[4];
+			for (int c = 0; c < 4; c++)
+				wanted[c] = std::clamp(Channel(pixels[i], c) + errors[x + 1][c] / 16, 0, 255);
+			uint8_t index = finder.find(Normalize(Pack(wanted[0], wanted[1], wanted[2], wanted[3])));
+			indices[i] = index;
+			for (int c = 0; c < 4; c++) {
+				int error = wanted[c] - Channel(palette[index], c);
+				errors[x + 2][c] += error * 7;
+				nextErrors[x][c] += error * 3;
+				nextErrors[x + 1][c] += error * 5;
+				nextErrors[x + 2][c] += error;
+			}
+		}
+		std::swap(errors, nextErrors);
+	}
+}
+
+double TexturePalette::ComputePSNR(const uint32_t* original, const uint8_t* indices, size_t numPixels, const std::vector<uint32_t>& palette)
+{
+	double squaredError = 0.0;
+	for (size_t i = 0; i < numPixels; i++)
+		squaredError += Distance(Normalize(original[i]), palette[indices[i]]);
+	if (squaredError == 0.0)
+		return std::numeric_limits<double>::infinity();
+	const double mse = squaredError / (4.0 * (double)numPixels);
+	return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Quantization of RGBA8 images to 8-bit palette indices, to make PALN textures.
+namespace TexturePalette {
+	// Palette of at most maxColors RGBA colors for the pixels, made by median cut on a histogram
+	// of the colors and refined with a k-means iteration.
+	std::vector<uint32_t> MakePalette(const uint32_t* pixels, size_t numPixels, int maxColors = 256);
+	// Index of the nearest palette color of every pixel, with Floyd-Steinberg error diffusion if dither is true.
+	void MapToPalette(const uint32_t* pixels, int width, int height, const std::vector<uint32_t>& palette, bool dither, uint8_t* indices);
+	// Peak signal-to-noise ratio in dB of the indexed image compared to the original, over the 4 channels.
+	double ComputePSNR(const uint32_t* original, const uint8_t* indices, size_t numPixels, const std::vector<uint32_t>& palette);
+}
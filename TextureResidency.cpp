@@ -0,0 +1,245 @@
+#include "TextureResidency.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <set>
+
+#include "ThreadPool.h"
+
+TextureResidency::TextureResidency(TextureUploader& uploader, TextureJobFactory jobFactory, size_t budget)
+	: uploader(uploader), jobFactory(std::move(jobFactory)), budget(budget)
+{
+}
+
+TextureResidency::~TextureResidency()
+{
+	clear();
+}
+
+void* TextureResidency::get(uint32_t texId)
+{
+	auto [it, inserted] = entries.try_emplace(texId);
+	Entry& entry = it->second;
+	entry.lastUse = frame;
+	if (inserted) {
+		TextureDecodeJob job = jobFactory(texId);
+		if (!job) {
+			entry.state = State::Missing;
+			return nullptr;
+		}
+		entry.decoded = ThreadPool::global().submit(std::move(job));
+		loading.push_back(texId);
+		stats.numLoading++;
+		return nullptr;
+	}
+	if (entry.state != State::Resident)
+		return nullptr;
+	lru.splice(lru.begin(), lru, entry.lruPosition);
+	return entry.handle;
+}
+
+void TextureResidency::upload(uint32_t texId, Entry& entry)
+{
+	DecodedTexture texture = entry.decoded.get();
+	auto startTime = std::chrono::steady_clock::now();
+	entry.handle = texture.levels.empty() ? nullptr : uploader.upload(texture);
+	stats.uploadSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	stats.numLoading--;
+	if (!entry.handle) {
+		entry.state = State::Missing;
+		return;
+	}
+	entry.state = State::Resident;
+	entry.numBytes = texture.numBytes;
+	lru.push_front(texId);
+	entry.lruPosition = lru.begin();
+	stats.numUploads++;
+	stats.numResident++;
+	stats.residentBytes += entry.numBytes;
+}
+
+void TextureResidency::release(uint32_t texId, Entry& entry)
+{
+	if (entry.state == State::Resident) {
+		uploader.release(entry.handle);
+		lru.erase(entry.lruPosition);
+		stats.numResident--;
+		stats.residentBytes -= entry.numBytes;
+	}
+	else if (entry.state == State::Loading) {
+		// the job still runs, its result is simply dropped with the future
+		loading.erase(std::find(loading.begin(), loading.end(), texId));
+		stats.numLoading--;
+	}
+}
+
+void TextureResidency::evict()
+{
+	while (stats.residentBytes > budget && !lru.empty()) {
+		const uint32_t texId = lru.back();
+		Entry& entry = entries.at(texId);
+		// the rest of the list was also used since the last update
+		if (entry.lastUse == frame)
+			break;
+		release(texId, entry);
+		entries.erase(texId);
+		stats.numEvictions++;
+	}
+}
+
+void TextureResidency::update()
+{
+	auto startTime = std::chrono::steady_clock::now();
+	size_t next = 0;
+	while (next < loading.size()) {
+		const uint32_t texId = loading[next];
+		Entry& entry = entries.at(texId);
+		if (entry.decoded.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			next++;
+			continue;
+		}
+		upload(texId, entry);
+		loading.erase(loading.begin() + next);
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() > uploadTimeLimit)
+			break;
+	}
+	evict();
+	frame++;
+}
+
+void TextureResidency::finishLoading()
+{
+	for (uint32_t texId : loading)
+		upload(texId, entries.at(texId));
+	loading.clear();
+}
+
+void TextureResidency::invalidate(uint32_t texId)
+{
+	auto it = entries.find(texId);
+	if (it == entries.end())
+		return;
+	release(texId, it->second);
+	entries.erase(it);
+}
+
+void TextureResidency::clear()
+{
+	for (auto& [texId, entry] : entries)
+		if (entry.state == State::Resident)
+			uploader.release(entry.handle);
+	entries.clear();
+	loading.clear();
+	lru.clear();
+	stats.numResident = 0;
+	stats.residentBytes = 0;
+	stats.numLoading = 0;
+}
+
+bool TextureResidency::isResident(uint32_t texId) const
+{
+	auto it = entries.find(texId);
+	return it != entries.end() && it->second.state == State::Resident;
+}
+
+bool TextureResidencySelfCheck()
+{
+	struct MockUploader : TextureUploader {
+		std::set<void*> live;
+		size_t nextHandle = 1;
+		size_t numDoubleReleases = 0;
+		void* upload(const DecodedTexture& texture) override {
+			void* handle = (void*)(uintptr_t)nextHandle++;
+			live.insert(handle);
+			return handle;
+		}
+		void release(void* handle) override {
+			if (!live.erase(handle))
+				numDoubleReleases++;
+		}
+	};
+
+	// textures 1 to 9 exist, 32x32 with mipmaps
+	static constexpr size_t numPixels = 1024 + 256 + 64 + 16 + 4 + 1;
+	static constexpr size_t textureBytes = 4 * numPixels;
+	size_t numJobs = 0;
+	MockUploader uploader;
+	TextureJobFactory factory = [&numJobs](uint32_t texId) -> TextureDecodeJob {
+		numJobs++;
+		if (texId == 0 || texId > 9)
+			return {};
+		return []() {
+			auto pixels = std::make_shared<std::vector<uint32_t>>(numPixels);
+			DecodedTexture texture;
+			for (int size = 32, offset = 0; size >= 1; offset += size * size, size /= 2)
+				texture.levels.push_back(DecodedTexture::Level{ size, size, pixels->data() + offset, (size_t)4 * size * size });
+			texture.storage = pixels;
+			texture.numBytes = textureBytes;
+			return texture;
+		};
+	};
+
+	int numFailures = 0;
+	auto check = [&numFailures](bool condition, const char* what) {
+		printf("  %-60s %s\n", what, condition ? "ok" : "FAILED");
+		if (!condition)
+			numFailures++;
+	};
+	printf("Texture residency self-check:\n");
+	{
+		TextureResidency residency(uploader, factory, 3 * textureBytes);
+		check(!residency.get(1) && !residency.get(2) && !residency.get(3), "not resident on first use");
+		residency.finishLoading();
+		residency.update();
+		check(residency.get(1) && residency.get(2) && residency.get(3), "resident once loaded");
+		check(numJobs == 3 && uploader.live.size() == 3, "decoded and uploaded once each");
+
+		// 3 is the least recently used when 4 comes in
+		residency.update();
+		residency.get(1);
+		residency.get(2);
+		residency.get(4);
+		residency.finishLoading();
+		residency.update();
+		check(!residency.isResident(3) && residency.isResident(1) && residency.isResident(4), "least recently used evicted");
+		check(residency.getStats().residentBytes <= residency.getBudget(), "within budget");
+
+		// all used in the same frame: over budget rather than reloading every frame
+		for (uint32_t texId : { 1, 2, 4, 5, 6 })
+			residency.get(texId);
+		residency.finishLoading();
+		residency.update();
+		check(residency.getStats().numResident == 5, "textures used in the last frame kept");
+		residency.update();
+		check(residency.getStats().numResident == 3, "evicted once not used anymore");
+
+		size_t uploadsBefore = residency.getStats().numUploads;
+		residency.get(7);
+		residency.invalidate(7);
+		residency.finishLoading();
+		residency.update();
+		check(residency.getStats().numUploads == uploadsBefore && !residency.isResident(7), "invalidated while loading not uploaded");
+
+		residency.get(5);
+		residency.update();
+		void* before = residency.get(5);
+		residency.invalidate(5);
+		check(!residency.get(5), "invalidated texture reloaded");
+		residency.finishLoading();
+		check(residency.get(5) && residency.get(5) != before, "reloaded texture uploaded again");
+
+		size_t jobsBefore = numJobs;
+		for (int i = 0; i < 3; ++i) {
+			check(!residency.get(42), "missing texture");
+			residency.update();
+		}
+		check(numJobs == jobsBefore + 1, "missing texture only looked up once");
+
+		residency.clear();
+		check(uploader.live.empty(), "all released by clear");
+	}
+	check(uploader.numDoubleReleases == 0, "no texture released twice");
+	printf("Texture residency self-check: %s\n", (numFailures == 0) ? "passed" : "FAILED");
+	return numFailures == 0;
+}
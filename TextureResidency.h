@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Data of all the mipmap levels of a texture, ready to be uploaded
+struct DecodedTexture {
+	enum class Format { RGBA8, DXT1 };
+	struct Level {
+		int width, height;
+		const void* data;
+		size_t dataSize;
+	};
+	Format format = Format::RGBA8;
+	std::vector<Level> levels;
+	// keeps the pixels alive
+	std::shared_ptr<const void> storage;
+	size_t numBytes = 0;
+};
+
+// Creates and destroys the GPU textures, with GL in the editor and mocked in the self-check.
+struct TextureUploader {
+	virtual ~TextureUploader() = default;
+	virtual void* upload(const DecodedTexture& texture) = 0;
+	virtual void release(void* handle) = 0;
+};
+
+// Decodes a texture on a worker thread, so it must only use data it owns.
+using TextureDecodeJob = std::function<DecodedTexture()>;
+// Called on the main thread when a texture is first used, returns an empty job if the texture doesn't exist.
+using TextureJobFactory = std::function<TextureDecodeJob(uint32_t texId)>;
+
+// Keeps the textures used recently on the GPU, within a memory budget.
+// A texture is decoded on the thread pool the first time it is asked for, and uploaded by the
+// main thread in a later update. When the budget is exceeded, the least recently used
+// textures are released, except the ones used since the last update.
+struct TextureResidency {
+	struct Stats {
+		size_t numResident = 0;
+		size_t residentBytes = 0;
+		size_t numLoading = 0;
+		size_t numUploads = 0;
+		size_t numEvictions = 0;
+		double uploadSeconds = 0.0;
+	};
+
+	TextureResidency(TextureUploader& uploader, TextureJobFactory jobFactory, size_t budget);
+	~TextureResidency();
+	TextureResidency(const TextureResidency&) = delete;
+	TextureResidency& operator=(const TextureResidency&) = delete;
+
+	// Returns the handle of the texture, or null while it is loading or if it doesn't exist.
+	void* get(uint32_t texId);
+	// To call once per frame: uploads the decoded textures, within a time limit, then evicts.
+	void update();
+	// Waits for all the loading textures and uploads them.
+	void finishLoading();
+	// The texture will be reloaded the next time it is asked for.
+	void invalidate(uint32_t texId);
+	void clear();
+
+	size_t getBudget() const { return budget; }
+	void setBudget(size_t bytes) { budget = bytes; }
+	const Stats& getStats() const { return stats; }
+	bool isResident(uint32_t texId) const;
+
+private:
+	enum class State { Loading, Resident, Missing };
+	struct Entry {
+		State state = State::Loading;
+		std::future<DecodedTexture> decoded;
+		void* handle = nullptr;
+		size_t numBytes = 0;
+		uint64_t lastUse = 0;
+		std::list<uint32_t>::iterator lruPosition;
+	};
+
+	void upload(uint32_t texId, Entry& entry);
+	void release(uint32_t texId, Entry& entry);
+	void evict();
+
+	TextureUploader& uploader;
+	TextureJobFactory jobFactory;
+	size_t budget;
+	double uploadTimeLimit = 0.004;
+	uint64_t frame = 1;
+	std::unordered_map<uint32_t, Entry> entries;
+	std::vector<uint32_t> loading;
+	// most recently used first
+	std::list<uint32_t> lru;
+	Stats stats;
+};
+
+// Checks the loading, eviction and invalidation policies with a mock uploader, without GL.
+bool TextureResidencySelfCheck();
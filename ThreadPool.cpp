@@ -0,0 +1,98 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	threads.reserve(numThreads);
+	for (unsigned int i = 0; i < numThreads; ++i)
+		threads.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (auto& thread : threads)
+		thread.join();
+}
+
+void ThreadPool::push(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push(std::move(task));
+	}
+	condition.notify_one();
+}
+
+void ThreadPool::workerLoop()
+{
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+	if (count == 0)
+		return;
+	if (count == 1) {
+		func(0);
+		return;
+	}
+
+	// Helpers that only start after all indices were taken simply return,
+	// so the state must outlive this call.
+	struct State {
+		std::function<void(size_t)> func;
+		size_t count;
+		std::atomic<size_t> next = 0;
+		std::atomic<size_t> done = 0;
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+	auto state = std::make_shared<State>();
+	state->func = func;
+	state->count = count;
+
+	auto work = [](State& st) {
+		size_t i;
+		while ((i = st.next++) < st.count) {
+			st.func(i);
+			if (++st.done == st.count) {
+				std::lock_guard<std::mutex> lock(st.mutex);
+				st.finished.notify_all();
+			}
+		}
+	};
+
+	size_t numHelpers = std::min<size_t>(threads.size(), count - 1);
+	for (size_t h = 0; h < numHelpers; ++h)
+		push([state, work]() { work(*state); });
+	work(*state);
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->finished.wait(lock, [&] { return state->done == state->count; });
+}
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads executing queued tasks.
+struct ThreadPool {
+	explicit ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int getNumThreads() const { return (unsigned int)threads.size(); }
+
+	template <typename Func> auto submit(Func&& func) -> std::future<std::invoke_result_t<std::decay_t<Func>>> {
+		using Result = std::invoke_result_t<std::decay_t<Func>>;
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+		auto future = task->get_future();
+		push([task]() { (*task)(); });
+		return future;
+	}
+
+	// Calls func(i) for every i in [0, count) and returns when all calls are done.
+	// The calling thread takes part in the work, so this can also be used from inside a task.
+	void parallelFor(size_t count, const std::function<void(size_t)>& func);
+
+	// Pool shared by the whole editor, with one thread per hardware thread.
+	static ThreadPool& global();
+
+private:
+	void push(std::function<void()> task);
+	void workerLoop();
+
+	std::vector<std::thread> threads;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+};
@@ -0,0 +1,916 @@
+#include "UndoHistory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "BackgroundSave.h"
+#include "DblImage.h"
+#include "RecoveryJournal.h"
+#include "gameobj.h"
+#include "texture.h"
+#include "video.h"
+
+using UndoHistory::Command;
+
+namespace {
+	// A step's memory usage changes when it is undone or redone, so it is measured whenever it changes stack
+	struct Step {
+		std::unique_ptr<Command> command;
+		size_t memoryUsage;
+	};
+
+	size_t g_memoryBudget = 256 << 20;
+	std::deque<Step> g_undoStack;
+	std::vector<Step> g_redoStack;
+	// sums of the memoryUsage of the steps of each stack
+	size_t g_undoMemory = 0, g_redoMemory = 0;
+
+	// false while the benchmark edits the scene, whose steps are all undone in the end
+	bool g_journaling = true;
+
+	// true while the move at the top of the undo stack can still be extended
+	bool g_coalescing = false;
+
+	// step at the top of the undo stack that is not journaled yet
+	Command* g_journalPending = nullptr;
+
+	// object whose DBL is compared against g_dblBaseline
+	GameObject* g_dblObject = nullptr;
+	DBLList g_dblBaseline;
+
+	// Memory estimations
+
+	size_t EstimateMemory(const DBLList& dbl);
+
+	size_t EstimateMemory(const DBLEntry& entry)
+	{
+		size_t size = sizeof(DBLEntry);
+		if (auto* str = std::get_if<std::string>(&entry.value))
+			size += str->capacity();
+		else if (auto* data = std::get_if<std::vector<uint8_t>>(&entry.value))
+			size += data->capacity();
+		else if (auto* refs = std::get_if<std::vector<GORef>>(&entry.value))
+			size += refs->capacity() * sizeof(GORef);
+		else if (auto* list = std::get_if<DBLList>(&entry.value))
+			size += EstimateMemory(*list);
+		return size;
+	}
+
+	size_t EstimateMemory(const DBLList& dbl)
+	{
+		size_t size = 0;
+		for (const DBLEntry& entry : dbl.entries)
+			size += EstimateMemory(entry);
+		return size;
+	}
+
+	size_t EstimateMemory(const Mesh& mesh)
+	{
+		return sizeof(Mesh) + mesh.vertices.capacity() * sizeof(float)
+			+ (mesh.quadindices.capacity() + mesh.triindices.capacity()) * sizeof(uint16_t)
+			+ (mesh.textureCoords.capacity() + mesh.lightCoords.capacity()) * sizeof(float)
+			+ mesh.ftxFaces.capacity() * sizeof(Mesh::FTXFace);
+	}
+
+	size_t EstimateMemory(const Chunk& chunk)
+	{
+		size_t size = sizeof(Chunk) + chunk.maindata.size();
+		for (const auto& data : chunk.multidata)
+			size += sizeof(data) + data.size();
+		for (const Chunk& sub : chunk.subchunks)
+			size += EstimateMemory(sub);
+		return size;
+	}
+
+	size_t EstimateObjectMemory(const GameObject* obj)
+	{
+		size_t size = sizeof(GameObject) + obj->name.capacity() + obj->subobj.capacity() * sizeof(GameObject*) + EstimateMemory(obj->dbl);
+		// only count the data that is not shared with other objects
+		if (obj->mesh && obj->mesh.use_count() == 1)
+			size += EstimateMemory(*obj->mesh);
+		if (obj->excChunk && obj->excChunk.use_count() == 1)
+			size += EstimateMemory(*obj->excChunk);
+		return size;
+	}
+
+	// DBL comparison
+
+	bool SameDbl(const DBLList& a, const DBLList& b);
+
+	bool SameEntry(const DBLEntry& a, const DBLEntry& b)
+	{
+		if (a.type != b.type || a.flags != b.flags || a.value.index() != b.value.index())
+			return false;
+		return std::visit([&b](const auto& va) -> bool {
+			using T = std::decay_t<decltype(va)>;
+			const T& vb = std::get<T>(b.value);
+			if constexpr (std::is_floating_point_v<T>)
+				return memcmp(&va, &vb, sizeof(T)) == 0; // NaN must be equal to itself
+			else if constexpr (std::is_same_v<T, GORef>)
+				return va.get() == vb.get();
+			else if constexpr (std::is_same_v<T, std::vector<GORef>>)
+				return std::equal(va.begin(), va.end(), vb.begin(), vb.end(), [](const GORef& x, const GORef& y) { return x.get() == y.get(); });
+			else if constexpr (std::is_same_v<T, DBLList>)
+				return SameDbl(va, vb);
+			else if constexpr (std::is_same_v<T, AudioRef>)
+				return va.id == vb.id;
+			else
+				return va == vb;
+			}, a.value);
+	}
+
+	bool SameDbl(const DBLList& a, const DBLList& b)
+	{
+		return a.flags == b.flags && std::equal(a.entries.begin(), a.entries.end(), b.entries.begin(), b.entries.end(), SameEntry);
+	}
+
+	// The history keeps its object references as plain pointers, as GORefs would count
+	// as references and prevent deleting objects only mentioned by the history.
+	// The objects removed from the scene are kept alive by the history anyway.
+	template <typename Func> void ForEachRef(std::vector<DBLEntry>& entries, Func& func)
+	{
+		for (DBLEntry& entry : entries) {
+			if (GORef* ref = std::get_if<GORef>(&entry.value))
+				func(*ref);
+			else if (auto* refs = std::get_if<std::vector<GORef>>(&entry.value))
+				for (GORef& ref : *refs)
+					func(ref);
+			else if (DBLList* list = std::get_if<DBLList>(&entry.value))
+				ForEachRef(list->entries, func);
+		}
+	}
+
+	template <typename Func> void ForEachObject(GameObject* obj, Func& func)
+	{
+		func(obj);
+		for (GameObject* child : obj->subobj)
+			ForEachObject(child, func);
+	}
+
+	struct StoredEntries {
+		std::vector<DBLEntry> entries; // with null references
+		std::vector<GameObject*> refs;
+
+		StoredEntries(std::vector<DBLEntry> copied) : entries(std::move(copied)) {
+			auto detach = [this](GORef& ref) { refs.push_back(ref.get()); ref.deref(); };
+			ForEachRef(entries, detach);
+		}
+		std::vector<DBLEntry> restore() const {
+			std::vector<DBLEntry> copy = entries;
+			size_t next = 0;
+			auto attach = [this, &next](GORef& ref) { ref = refs[next++]; };
+			ForEachRef(copy, attach);
+			return copy;
+		}
+		size_t memoryUsage() const {
+			size_t size = refs.capacity() * sizeof(GameObject*);
+			for (const DBLEntry& entry : entries)
+				size += EstimateMemory(entry);
+			return size;
+		}
+	};
+
+	// Objects in the history but not in the scene anymore
+	struct DetachedSubtree {
+		GameObject* obj;
+		GameObject* parent;
+		size_t index = 0;
+		std::vector<GameObject*> refs;
+		bool detached = false;
+
+		DetachedSubtree(GameObject* obj) : obj(obj), parent(obj->parent) {}
+
+		void detach() {
+			auto& siblings = parent->subobj;
+			auto it = std::find(siblings.begin(), siblings.end(), obj);
+			index = it - siblings.begin();
+			siblings.erase(it);
+			auto detachRef = [this](GORef& ref) { refs.push_back(ref.get()); ref.deref(); };
+			auto detachObj = [&detachRef](GameObject* o) { ForEachRef(o->dbl.entries, detachRef); };
+			ForEachObject(obj, detachObj);
+			detached = true;
+		}
+		void attach() {
+			auto& siblings = parent->subobj;
+			siblings.insert(siblings.begin() + std::min(index, siblings.size()), obj);
+			size_t next = 0;
+			auto attachRef = [this, &next](GORef& ref) { ref = refs[next++]; };
+			auto attachObj = [&attachRef](GameObject* o) { ForEachRef(o->dbl.entries, attachRef); };
+			ForEachObject(obj, attachObj);
+			refs.clear();
+			detached = false;
+		}
+		// Deletes the objects for good, except the ones still referenced
+		// by the scene, which are left alone like Scene::RemoveObject does with children.
+		void destroy() {
+			std::vector<GameObject*> objects;
+			auto collect = [&objects](GameObject* o) { objects.push_back(o); };
+			ForEachObject(obj, collect);
+			for (auto it = objects.rbegin(); it != objects.rend(); ++it) {
+				GameObject* o = *it;
+				auto rc = g_objRefCounts.find(o);
+				if (rc != g_objRefCounts.end() && rc->second != 0)
+					continue;
+				if (rc != g_objRefCounts.end())
+					g_objRefCounts.erase(rc);
+				// the address of the mesh might be reused by another one
+				if (o->mesh && o->mesh.use_count() == 1)
+					InvalidateMesh(o->mesh.get());
+				delete o;
+			}
+		}
+		size_t memoryUsage() const {
+			size_t size = refs.capacity() * sizeof(GameObject*);
+			auto add = [&size](GameObject* o) { size += EstimateObjectMemory(o); };
+			ForEachObject(obj, add);
+			return size;
+		}
+	};
+
+	void SwapChunks(Chunk& a, Chunk& b)
+	{
+		std::swap(a.tag, b.tag);
+		a.multidata.swap(b.multidata);
+		a.subchunks.swap(b.subchunks);
+		std::swap(a.maindata, b.maindata);
+	}
+
+	// Commands
+
+	struct GroupCommand : Command {
+		const char* groupName;
+		std::vector<std::unique_ptr<Command>> commands;
+		GroupCommand(const char* name) : groupName(name) {}
+		void undo() override {
+			for (auto it = commands.rbegin(); it != commands.rend(); ++it)
+				(*it)->undo();
+		}
+		void redo() override {
+			for (auto& cmd : commands)
+				cmd->redo();
+		}
+		size_t memoryUsage() const override {
+			size_t size = sizeof(*this);
+			for (auto& cmd : commands)
+				size += cmd->memoryUsage();
+			return size;
+		}
+		const char* name() const override { return groupName; }
+		void journal(bool undone) const override {
+			if (undone)
+				for (auto it = commands.rbegin(); it != commands.rend(); ++it)
+					(*it)->journal(true);
+			else
+				for (auto& cmd : commands)
+					cmd->journal(false);
+		}
+	};
+
+	// Nested groups are merged into the outermost one
+	std::unique_ptr<GroupCommand> g_openGroup;
+	int g_groupDepth = 0;
+
+	// The state after the edit is only taken when the step is undone for the first time,
+	// as the edit might still be going on when the step is pushed.
+	struct TransformCommand : Command {
+		GameObject* obj;
+		Matrix before, after;
+		bool hasAfter = false;
+		TransformCommand(GameObject* obj, const Matrix& before) : obj(obj), before(before) {}
+		void undo() override {
+			if (!hasAfter) {
+				after = obj->matrix;
+				hasAfter = true;
+			}
+			obj->matrix = before;
+		}
+		void redo() override { obj->matrix = after; }
+		size_t memoryUsage() const override { return sizeof(*this); }
+		const char* name() const override { return "Move"; }
+		void journal(bool undone) const override { RecoveryJournal::RecordTransform(obj); }
+		bool journaledOnceComplete() const override { return true; }
+	};
+
+	// Replaces the entries [index, index + before.size) with after
+	struct DblCommand : Command {
+		GameObject* obj;
+		size_t index;
+		StoredEntries before, after;
+		int flagsBefore, flagsAfter;
+		DblCommand(GameObject* obj, size_t index, StoredEntries before, StoredEntries after, int flagsBefore, int flagsAfter)
+			: obj(obj), index(index), before(std::move(before)), after(std::move(after)), flagsBefore(flagsBefore), flagsAfter(flagsAfter) {}
+		void apply(const StoredEntries& from, const StoredEntries& to, int flags) {
+			auto& entries = obj->dbl.entries;
+			auto it = entries.erase(entries.begin() + index, entries.begin() + index + from.entries.size());
+			auto restored = to.restore();
+			entries.insert(it, std::make_move_iterator(restored.begin()), std::make_move_iterator(restored.end()));
+			obj->dbl.flags = flags;
+			DblImage::Invalidate(obj);
+		}
+		void undo() override { apply(after, before, flagsBefore); }
+		void redo() override { apply(before, after, flagsAfter); }
+		size_t memoryUsage() const override { return sizeof(*this) + before.memoryUsage() + after.memoryUsage(); }
+		const char* name() const override { return "Edit properties"; }
+		void journal(bool undone) const override {
+			const size_t numBefore = before.entries.size(), numAfter = after.entries.size();
+			RecoveryJournal::RecordDblRange(obj, index, undone ? numAfter : numBefore, undone ? numBefore : numAfter);
+		}
+	};
+
+	struct SubtreeCommand : Command {
+		DetachedSubtree subtree;
+		bool isDeletion;
+		SubtreeCommand(GameObject* obj, bool isDeletion) : subtree(obj), isDeletion(isDeletion) {
+			if (isDeletion)
+				subtree.detach();
+		}
+		~SubtreeCommand() override {
+			if (subtree.detached)
+				subtree.destroy();
+		}
+		void undo() override { isDeletion ? subtree.attach() : subtree.detach(); }
+		void redo() override { isDeletion ? subtree.detach() : subtree.attach(); }
+		size_t memoryUsage() const override { return sizeof(*this) + (subtree.detached ? subtree.memoryUsage() : 0); }
+		const char* name() const override { return isDeletion ? "Delete object" : "Create object"; }
+		void journal(bool undone) const override {
+			if (subtree.detached)
+				RecoveryJournal::RecordRemoveObject(subtree.parent, subtree.index);
+			else
+				RecoveryJournal::RecordInsertObject(subtree.obj);
+		}
+	};
+
+	struct ReparentCommand : Command {
+		GameObject* obj;
+		GameObject* oldParent, * newParent;
+		size_t oldIndex, newIndex;
+		std::vector<uint32_t> sourcePath; // where the object was before its last move
+		ReparentCommand(GameObject* obj, GameObject* oldParent, size_t oldIndex, GameObject* newParent, size_t newIndex, std::vector<uint32_t> sourcePath)
+			: obj(obj), oldParent(oldParent), newParent(newParent), oldIndex(oldIndex), newIndex(newIndex), sourcePath(std::move(sourcePath)) {}
+		void move(GameObject* from, GameObject* to, size_t index) {
+			sourcePath = RecoveryJournal::GetIndexPath(obj);
+			from->subobj.erase(std::find(from->subobj.begin(), from->subobj.end(), obj));
+			to->subobj.insert(to->subobj.begin() + std::min(index, to->subobj.size()), obj);
+			obj->parent = to;
+		}
+		void undo() override { move(newParent, oldParent, oldIndex); }
+		void redo() override { move(oldParent, newParent, newIndex); }
+		size_t memoryUsage() const override { return sizeof(*this); }
+		const char* name() const override { return "Move in hierarchy"; }
+		void journal(bool undone) const override { RecoveryJournal::RecordMoveObject(sourcePath, obj); }
+	};
+
+	// Mesh and EXC chunk pointers of objects
+	struct ObjectDataCommand : Command {
+		struct State {
+			GameObject* obj;
+			std::shared_ptr<Mesh> mesh;
+			std::shared_ptr<Chunk> excChunk;
+		};
+		const char* commandName;
+		std::vector<State> before, after;
+
+		ObjectDataCommand(const char* name, const std::vector<GameObject*>& objects) : commandName(name) {
+			for (GameObject* obj : objects)
+				before.push_back({ obj, obj->mesh, obj->excChunk });
+		}
+		~ObjectDataCommand() override {
+			// the addresses of the freed meshes might be reused by other ones
+			for (auto* states : { &before, &after })
+				for (State& state : *states)
+					if (state.mesh && state.mesh.use_count() == 1)
+						InvalidateMesh(state.mesh.get());
+		}
+		static void apply(const std::vector<State>& states) {
+			for (const State& state : states) {
+				state.obj->mesh = state.mesh;
+				state.obj->excChunk = state.excChunk;
+				// the skinned vertices depend on the EXC chunk
+				if (state.mesh)
+					InvalidateMesh(state.mesh.get());
+			}
+		}
+		void undo() override {
+			if (after.empty())
+				for (const State& state : before)
+					after.push_back({ state.obj, state.obj->mesh, state.obj->excChunk });
+			apply(before);
+		}
+		void redo() override { apply(after); }
+		size_t memoryUsage() const override {
+			// data that would be freed with this step
+			std::unordered_map<const void*, long> heldCounts;
+			for (auto* states : { &before, &after })
+				for (const State& state : *states) {
+					heldCounts[state.mesh.get()] += 1;
+					heldCounts[state.excChunk.get()] += 1;
+				}
+			size_t size = sizeof(*this) + (before.capacity() + after.capacity()) * sizeof(State);
+			std::unordered_map<const void*, bool> counted;
+			for (auto* states : { &before, &after })
+				for (const State& state : *states) {
+					if (state.mesh && state.mesh.use_count() <= heldCounts[state.mesh.get()] && !counted[state.mesh.get()]) {
+						size += EstimateMemory(*state.mesh);
+						counted[state.mesh.get()] = true;
+					}
+					if (state.excChunk && state.excChunk.use_count() <= heldCounts[state.excChunk.get()] && !counted[state.excChunk.get()]) {
+						size += EstimateMemory(*state.excChunk);
+						counted[state.excChunk.get()] = true;
+					}
+				}
+			return size;
+		}
+		const char* name() const override { return commandName; }
+		void journal(bool undone) const override {
+			std::vector<GameObject*> objects;
+			for (const State& state : before)
+				objects.push_back(state.obj);
+			RecoveryJournal::RecordObjectData(objects);
+		}
+		// the new copies are modified after the step is pushed
+		bool journaledOnceComplete() const override { return true; }
+	};
+
+	// Swaps the texture's chunks with the other version kept by the step
+	struct TextureReplaceCommand : Command {
+		uint32_t texId;
+		Chunk pal, dxt;
+		TextureReplaceCommand(uint32_t texId, const Chunk& pal, const Chunk* dxt) : texId(texId), pal(pal) {
+			if (dxt)
+				this->dxt = *dxt;
+		}
+		void swap() {
+			BackgroundSave::EditPacks();
+			auto [palchk, dxtchk] = FindTextureChunk(g_scene, texId);
+			SwapChunks(pal, *palchk);
+			if (dxtchk)
+				SwapChunks(dxt, *dxtchk);
+			InvalidateTexture(texId);
+		}
+		void undo() override { swap(); }
+		void redo() override { swap(); }
+		size_t memoryUsage() const override { return sizeof(*this) + EstimateMemory(pal) + EstimateMemory(dxt); }
+		const char* name() const override { return "Replace texture"; }
+		void journal(bool undone) const override { RecoveryJournal::RecordTexture(texId); }
+		// pushed before the texture is replaced
+		bool journaledOnceComplete() const override { return true; }
+	};
+
+	// Textures appended to the PAL, DXT and LGT packs
+	struct TextureAddCommand : Command {
+		uint32_t numTexturesBefore, numTexturesAfter = 0;
+		size_t numPal, numDxt, numLgt;
+		std::vector<Chunk> removedPal, removedDxt, removedLgt;
+
+		TextureAddCommand() {
+			numTexturesBefore = g_scene.numTextures;
+			numPal = g_scene.palPack.subchunks.size();
+			numDxt = g_scene.dxtPack.subchunks.size();
+			numLgt = g_scene.lgtPack.subchunks.size();
+		}
+		static void removeTail(std::vector<Chunk>& pack, size_t count, std::vector<Chunk>& removed, bool uncache) {
+			removed.reserve(pack.size() - count);
+			for (size_t i = count; i < pack.size(); ++i) {
+				if (uncache)
+					UncacheTexture(*(uint32_t*)pack[i].maindata.data());
+				SwapChunks(removed.emplace_back(), pack[i]);
+			}
+			pack.erase(pack.begin() + count, pack.end());
+		}
+		// The textures restored may have been asked for while they were missing, so they must be reloaded
+		static void restoreTail(std::vector<Chunk>& pack, std::vector<Chunk>& removed, bool invalidate) {
+			pack.reserve(pack.size() + removed.size());
+			for (Chunk& chk : removed) {
+				Chunk& restored = pack.emplace_back();
+				SwapChunks(restored, chk);
+				if (invalidate)
+					InvalidateTexture(*(uint32_t*)restored.maindata.data());
+			}
+			removed.clear();
+		}
+		void undo() override {
+			BackgroundSave::EditPacks();
+			numTexturesAfter = g_scene.numTextures;
+			removeTail(g_scene.palPack.subchunks, numPal, removedPal, true);
+			removeTail(g_scene.dxtPack.subchunks, numDxt, removedDxt, false);
+			removeTail(g_scene.lgtPack.subchunks, numLgt, removedLgt, true);
+			g_scene.numTextures = numTexturesBefore;
+			g_scene.textureIndex.invalidate();
+		}
+		void redo() override {
+			BackgroundSave::EditPacks();
+			restoreTail(g_scene.palPack.subchunks, removedPal, true);
+			restoreTail(g_scene.dxtPack.subchunks, removedDxt, false);
+			restoreTail(g_scene.lgtPack.subchunks, removedLgt, true);
+			g_scene.numTextures = numTexturesAfter;
+			g_scene.textureIndex.invalidate();
+		}
+		size_t memoryUsage() const override {
+			size_t size = sizeof(*this);
+			for (auto* removed : { &removedPal, &removedDxt, &removedLgt })
+				for (const Chunk& chk : *removed)
+					size += EstimateMemory(chk);
+			return size;
+		}
+		const char* name() const override { return "Add textures"; }
+		void journal(bool undone) const override { RecoveryJournal::RecordTextureTail(numPal, numDxt, numLgt); }
+		bool journaledOnceComplete() const override { return true; }
+	};
+
+	template <typename Stack> void PushStep(Stack& stack, size_t& stackMemory, std::unique_ptr<Command> command)
+	{
+		const size_t memoryUsage = command->memoryUsage();
+		stackMemory += memoryUsage;
+		stack.push_back({ std::move(command), memoryUsage });
+	}
+
+	template <typename Stack> std::unique_ptr<Command> PopStep(Stack& stack, size_t& stackMemory)
+	{
+		Step step = std::move(stack.back());
+		stack.pop_back();
+		stackMemory -= step.memoryUsage;
+		return std::move(step.command);
+	}
+
+	void ClearRedo()
+	{
+		g_redoStack.clear();
+		g_redoMemory = 0;
+	}
+
+	// The last step can still take more memory once pushed, as the copy-on-write edits
+	// copy the data after pushing the step that keeps the original.
+	void RemeasureLastStep()
+	{
+		if (g_undoStack.empty())
+			return;
+		Step& step = g_undoStack.back();
+		g_undoMemory -= step.memoryUsage;
+		step.memoryUsage = step.command->memoryUsage();
+		g_undoMemory += step.memoryUsage;
+	}
+
+	// Only the undo stack is trimmed: the redo stack is cleared by the next step anyway
+	void TrimToBudget()
+	{
+		while (g_undoStack.size() > 1 && g_undoMemory > g_memoryBudget) {
+			g_undoMemory -= g_undoStack.front().memoryUsage;
+			g_undoStack.pop_front();
+		}
+	}
+
+	void ForgetDbl()
+	{
+		g_dblObject = nullptr;
+		g_dblBaseline = {};
+	}
+
+	template <typename T> std::vector<GameObject*> FindObjectsSharing(const std::shared_ptr<T>& data, std::shared_ptr<T> GameObject::* member)
+	{
+		std::vector<GameObject*> objects;
+		auto check = [&](GameObject* o) {
+			if (o->*member == data)
+				objects.push_back(o);
+		};
+		ForEachObject(g_scene.superroot, check);
+		return objects;
+	}
+
+	template <typename T> T* CopyOnWrite(GameObject* obj, std::shared_ptr<T> GameObject::* member, const char* name)
+	{
+		std::shared_ptr<T> original = obj->*member;
+		if (!original)
+			return nullptr;
+		auto objects = FindObjectsSharing(original, member);
+		UndoHistory::Push(std::make_unique<ObjectDataCommand>(name, objects));
+		auto copy = std::make_shared<T>(*original);
+		for (GameObject* o : objects)
+			o->*member = copy;
+		return copy.get();
+	}
+}
+
+void UndoHistory::Push(std::unique_ptr<Command> command)
+{
+	if (g_groupDepth > 0) {
+		g_openGroup->commands.push_back(std::move(command));
+		return;
+	}
+	FlushJournal();
+	g_coalescing = false;
+	ClearRedo();
+	RemeasureLastStep();
+	PushStep(g_undoStack, g_undoMemory, std::move(command));
+	Command* pushed = g_undoStack.back().command.get();
+	if (pushed->journaledOnceComplete())
+		g_journalPending = pushed;
+	else if (g_journaling)
+		pushed->journal(false);
+	TrimToBudget();
+}
+
+bool UndoHistory::Undo()
+{
+	if (g_groupDepth > 0)
+		return false;
+	CommitDbl();
+	EndCoalescing();
+	FlushJournal();
+	if (g_undoStack.empty())
+		return false;
+	auto command = PopStep(g_undoStack, g_undoMemory);
+	command->undo();
+	if (g_journaling)
+		command->journal(true);
+	PushStep(g_redoStack, g_redoMemory, std::move(command));
+	ForgetDbl();
+	return true;
+}
+
+bool UndoHistory::Redo()
+{
+	if (g_groupDepth > 0)
+		return false;
+	CommitDbl();
+	EndCoalescing();
+	FlushJournal();
+	if (g_redoStack.empty())
+		return false;
+	auto command = PopStep(g_redoStack, g_redoMemory);
+	command->redo();
+	if (g_journaling)
+		command->journal(false);
+	PushStep(g_undoStack, g_undoMemory, std::move(command));
+	ForgetDbl();
+	return true;
+}
+
+bool UndoHistory::CanUndo()
+{
+	return !g_undoStack.empty();
+}
+
+bool UndoHistory::CanRedo()
+{
+	return !g_redoStack.empty();
+}
+
+const char* UndoHistory::GetUndoName()
+{
+	return g_undoStack.empty() ? "" : g_undoStack.back().command->name();
+}
+
+const char* UndoHistory::GetRedoName()
+{
+	return g_redoStack.empty() ? "" : g_redoStack.back().command->name();
+}
+
+void UndoHistory::Clear()
+{
+	ForgetDbl();
+	g_coalescing = false;
+	g_journalPending = nullptr;
+	g_openGroup.reset();
+	g_groupDepth = 0;
+	ClearRedo();
+	g_undoStack.clear();
+	g_undoMemory = 0;
+}
+
+void UndoHistory::FlushJournal()
+{
+	Command* pending = std::exchange(g_journalPending, nullptr);
+	if (pending && g_journaling)
+		pending->journal(false);
+}
+
+size_t UndoHistory::GetNumSteps()
+{
+	return g_undoStack.size() + g_redoStack.size();
+}
+
+size_t UndoHistory::GetMemoryUsage()
+{
+	RemeasureLastStep();
+	return g_undoMemory + g_redoMemory;
+}
+
+size_t UndoHistory::GetMemoryBudget()
+{
+	return g_memoryBudget;
+}
+
+void UndoHistory::SetMemoryBudget(size_t bytes)
+{
+	g_memoryBudget = bytes;
+	TrimToBudget();
+}
+
+void UndoHistory::BeginGroup(const char* name)
+{
+	FlushJournal();
+	if (g_groupDepth++ == 0)
+		g_openGroup = std::make_unique<GroupCommand>(name);
+}
+
+void UndoHistory::EndGroup()
+{
+	if (--g_groupDepth > 0)
+		return;
+	auto group = std::move(g_openGroup);
+	if (!group->commands.empty())
+		Push(std::move(group));
+}
+
+void UndoHistory::RecordTransform(GameObject* obj, const Matrix& before)
+{
+	if (g_coalescing && g_groupDepth == 0 && !g_undoStack.empty()) {
+		auto* last = dynamic_cast<TransformCommand*>(g_undoStack.back().command.get());
+		if (last && last->obj == obj)
+			return;
+	}
+	Push(std::make_unique<TransformCommand>(obj, before));
+	g_coalescing = true;
+}
+
+void UndoHistory::EndCoalescing()
+{
+	g_coalescing = false;
+}
+
+void UndoHistory::TrackDbl(GameObject* obj)
+{
+	if (obj == g_dblObject)
+		return;
+	CommitDbl();
+	g_dblObject = obj;
+	g_dblBaseline = obj ? obj->dbl : DBLList();
+}
+
+void UndoHistory::CommitDbl()
+{
+	if (!g_dblObject)
+		return;
+	auto& current = g_dblObject->dbl.entries;
+	auto& baseline = g_dblBaseline.entries;
+	const size_t minSize = std::min(current.size(), baseline.size());
+	size_t prefix = 0;
+	while (prefix < minSize && SameEntry(baseline[prefix], current[prefix]))
+		++prefix;
+	if (prefix == minSize && current.size() == baseline.size() && g_dblObject->dbl.flags == g_dblBaseline.flags)
+		return;
+	size_t suffix = 0;
+	while (suffix < minSize - prefix && SameEntry(baseline[baseline.size() - 1 - suffix], current[current.size() - 1 - suffix]))
+		++suffix;
+
+	const auto beforeBegin = baseline.begin() + prefix, beforeEnd = baseline.end() - suffix;
+	const auto afterBegin = current.begin() + prefix, afterEnd = current.end() - suffix;
+	StoredEntries before(std::vector<DBLEntry>(beforeBegin, beforeEnd));
+	StoredEntries after(std::vector<DBLEntry>(afterBegin, afterEnd));
+	Push(std::make_unique<DblCommand>(g_dblObject, prefix, std::move(before), std::move(after), g_dblBaseline.flags, g_dblObject->dbl.flags));
+
+	auto it = baseline.erase(beforeBegin, beforeEnd);
+	baseline.insert(it, afterBegin, afterEnd);
+	g_dblBaseline.flags = g_dblObject->dbl.flags;
+}
+
+void UndoHistory::DeleteObject(GameObject* obj)
+{
+	CommitDbl();
+	// the pending step must be journaled while the object is still in the scene
+	FlushJournal();
+	for (GameObject* o = g_dblObject; o; o = o->parent)
+		if (o == obj)
+			ForgetDbl();
+	Push(std::make_unique<SubtreeCommand>(obj, true));
+}
+
+void UndoHistory::RecordCreate(GameObject* obj)
+{
+	Push(std::make_unique<SubtreeCommand>(obj, false));
+}
+
+void UndoHistory::ReparentObject(GameObject* obj, GameObject* newParent)
+{
+	FlushJournal();
+	GameObject* oldParent = obj->parent;
+	auto& siblings = oldParent->subobj;
+	size_t oldIndex = std::find(siblings.begin(), siblings.end(), obj) - siblings.begin();
+	auto sourcePath = RecoveryJournal::GetIndexPath(obj);
+	g_scene.GiveObject(obj, newParent);
+	Push(std::make_unique<ReparentCommand>(obj, oldParent, oldIndex, newParent, newParent->subobj.size() - 1, std::move(sourcePath)));
+}
+
+Mesh* UndoHistory::EditMesh(GameObject* obj)
+{
+	Mesh* mesh = CopyOnWrite(obj, &GameObject::mesh, "Edit mesh");
+	if (mesh)
+		InvalidateMesh(mesh);
+	return mesh;
+}
+
+Chunk* UndoHistory::EditExcChunk(GameObject* obj)
+{
+	return CopyOnWrite(obj, &GameObject::excChunk, "Edit animation");
+}
+
+void UndoHistory::RecordTextureReplace(uint32_t texId)
+{
+	auto [palchk, dxtchk] = FindTextureChunk(g_scene, texId);
+	if (palchk)
+		Push(std::make_unique<TextureReplaceCommand>(texId, *palchk, dxtchk));
+}
+
+void UndoHistory::RecordTextureAdd()
+{
+	Push(std::make_unique<TextureAddCommand>());
+}
+
+void UndoHistory::PrintMemoryBenchmark()
+{
+	CommitDbl();
+	EndCoalescing();
+	ForgetDbl();
+
+	std::vector<GameObject*> objects;
+	size_t sceneBytes = 0;
+	auto collect = [&](GameObject* o) {
+		if (o->parent && o->root && o->parent != g_scene.superroot)
+			objects.push_back(o);
+		sceneBytes += EstimateObjectMemory(o);
+	};
+	ForEachObject(g_scene.superroot, collect);
+	for (Chunk* pack : { &g_scene.palPack, &g_scene.dxtPack, &g_scene.lgtPack, &g_scene.wavPack, &g_scene.anmPack })
+		sceneBytes += EstimateMemory(*pack);
+	constexpr size_t maxSteps = 256;
+	if (objects.size() > maxSteps)
+		objects.resize(maxSteps);
+
+	// the steps go to a scratch history without journaling, and are all undone in the end
+	FlushJournal();
+	auto undoStack = std::exchange(g_undoStack, {});
+	auto redoStack = std::exchange(g_redoStack, {});
+	const size_t undoMemory = std::exchange(g_undoMemory, 0), redoMemory = std::exchange(g_redoMemory, 0);
+	const size_t previousBudget = std::exchange(g_memoryBudget, std::numeric_limits<size_t>::max());
+	g_journaling = false;
+
+	printf("Undo history memory benchmark: %zu objects, full scene copy ~ %zu KiB\n", objects.size(), sceneBytes / 1024);
+	auto measure = [&](const char* kind, auto step) {
+		const size_t memBefore = GetMemoryUsage();
+		const size_t stepsBefore = g_undoStack.size();
+		auto startTime = std::chrono::steady_clock::now();
+		for (GameObject* obj : objects)
+			step(obj);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		const size_t numSteps = g_undoStack.size() - stepsBefore;
+		if (numSteps == 0) {
+			printf("  %-16s no step\n", kind);
+			return;
+		}
+		const size_t bytesPerStep = (GetMemoryUsage() - memBefore) / numSteps;
+		printf("  %-16s %4zu steps, %8zu bytes/step, %7.2f us/step, %8.1f steps per full copy\n", kind, numSteps, bytesPerStep,
+			seconds * 1e6 / (double)numSteps, (double)sceneBytes / (double)std::max<size_t>(bytesPerStep, 1));
+	};
+	measure("Move", [](GameObject* obj) {
+		RecordTransform(obj, obj->matrix);
+		obj->matrix._41 += 1.0f;
+		EndCoalescing();
+		});
+	measure("DBL value", [](GameObject* obj) {
+		for (DBLEntry& entry : obj->dbl.entries) {
+			if (float* val = std::get_if<float>(&entry.value)) {
+				TrackDbl(obj);
+				*val += 1.0f;
+				CommitDbl();
+				TrackDbl(nullptr);
+				break;
+			}
+		}
+		});
+	measure("Mesh", [](GameObject* obj) {
+		if (obj->mesh)
+			EditMesh(obj);
+		});
+	measure("Delete", [](GameObject* obj) {
+		if (obj->getRefCount() == 0)
+			DeleteObject(obj);
+		});
+
+	while (Undo())
+		;
+	g_undoStack = std::move(undoStack);
+	g_redoStack = std::move(redoStack);
+	g_undoMemory = undoMemory;
+	g_redoMemory = redoMemory;
+	g_memoryBudget = previousBudget;
+	g_journaling = true;
+}
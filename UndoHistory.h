@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct GameObject;
+struct Mesh;
+struct Chunk;
+struct Matrix;
+
+// Undo/redo journal of the edits made to g_scene.
+// A step only keeps what its edit changed (the previous shared_ptr of an edited mesh, the modified
+// range of a DBL list, the matrices of a moved object...), everything else stays shared with the scene.
+// Meshes and EXC chunks are never modified in place: EditMesh and EditExcChunk give the edited objects
+// a new copy while the step keeps the old one.
+namespace UndoHistory {
+	struct Command {
+		virtual ~Command() = default;
+		virtual void undo() = 0;
+		virtual void redo() = 0;
+		// Approximate number of bytes only kept alive by this step
+		virtual size_t memoryUsage() const = 0;
+		virtual const char* name() const = 0;
+		// Writes the state resulting from the step, or from its undoing, to the recovery journal
+		virtual void journal(bool undone) const = 0;
+		// Steps whose edit goes on after being pushed are only journaled once the next one starts
+		virtual bool journaledOnceComplete() const { return false; }
+	};
+
+	void Push(std::unique_ptr<Command> command);
+	bool Undo();
+	bool Redo();
+	bool CanUndo();
+	bool CanRedo();
+	const char* GetUndoName();
+	const char* GetRedoName();
+	void Clear();
+	// Journals the last step if it was waiting for its edit to complete.
+	void FlushJournal();
+
+	size_t GetNumSteps();
+	size_t GetMemoryUsage();
+	size_t GetMemoryBudget();
+	// The oldest steps are forgotten when the history takes more memory than the budget.
+	void SetMemoryBudget(size_t bytes);
+
+	// The commands pushed between BeginGroup and EndGroup form a single step.
+	void BeginGroup(const char* name);
+	void EndGroup();
+
+	// To call before changing the matrix of an object. Successive moves of the same
+	// object are merged into one step until EndCoalescing is called.
+	void RecordTransform(GameObject* obj, const Matrix& before);
+	void EndCoalescing();
+
+	// DBL of the object shown in the property editor. The changes are found by comparing the DBL
+	// with a copy taken when the object started being tracked, and recorded as a range of entries.
+	void TrackDbl(GameObject* obj);
+	void CommitDbl();
+
+	// Scene structure
+	void DeleteObject(GameObject* obj);
+	void RecordCreate(GameObject* obj);
+	void ReparentObject(GameObject* obj, GameObject* newParent);
+
+	// Copy-on-write: every object sharing the data gets a new copy that can be modified.
+	Mesh* EditMesh(GameObject* obj);
+	Chunk* EditExcChunk(GameObject* obj);
+
+	// Textures, to call before replacing one or adding some at the end of the packs.
+	void RecordTextureReplace(uint32_t texId);
+	void RecordTextureAdd();
+
+	// Prints how much memory the steps of each kind take on the current scene.
+	// The steps are made in a scratch history and undone, leaving the history and the journal as they were.
+	void PrintMemoryBenchmark();
+}
@@ -0,0 +1,272 @@
+#include "ViewCulling.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+
+#include <emmintrin.h>
+
+#include "gameobj.h"
+
+namespace {
+	std::unordered_map<const Mesh*, ViewCulling::Bounds> g_meshBounds;
+}
+
+ViewCulling::Bounds ViewCulling::Bounds::transform(const Matrix& matrix) const
+{
+	Bounds result;
+	result.center = center.transform(matrix);
+	for (int j = 0; j < 3; j++)
+		result.extent.coord[j] = std::abs(matrix.m[0][j]) * extent.x + std::abs(matrix.m[1][j]) * extent.y + std::abs(matrix.m[2][j]) * extent.z;
+	return result;
+}
+
+ViewCulling::Bounds ViewCulling::Bounds::merge(const Bounds& other) const
+{
+	const Vector3 lo = min(), hi = max(), otherLo = other.min(), otherHi = other.max();
+	return fromMinMax(Vector3(std::min(lo.x, otherLo.x), std::min(lo.y, otherLo.y), std::min(lo.z, otherLo.z)),
+		Vector3(std::max(hi.x, otherHi.x), std::max(hi.y, otherHi.y), std::max(hi.z, otherHi.z)));
+}
+
+ViewCulling::Frustum ViewCulling::Frustum::fromMatrix(const Matrix& viewProj)
+{
+	// the clip coordinates are v * viewProj, so the planes come from the matrix's columns
+	auto column = [&viewProj](int j, int i) { return viewProj.m[i][j]; };
+	Frustum frustum;
+	for (int i = 0; i < 4; i++) {
+		frustum.planes[0][i] = column(3, i) + column(0, i); // left
+		frustum.planes[1][i] = column(3, i) - column(0, i); // right
+		frustum.planes[2][i] = column(3, i) + column(1, i); // bottom
+		frustum.planes[3][i] = column(3, i) - column(1, i); // top
+		frustum.planes[4][i] = column(3, i) + column(2, i); // near, GL's -w <= z which also contains D3D's 0 <= z
+		frustum.planes[5][i] = column(3, i) - column(2, i); // far
+	}
+	return frustum;
+}
+
+ViewCulling::Result ViewCulling::Test(const Frustum& frustum, const Bounds& bounds)
+{
+	Result result = Result::Inside;
+	for (const auto& plane : frustum.planes) {
+		const float distance = plane[0] * bounds.center.x + plane[1] * bounds.center.y + plane[2] * bounds.center.z + plane[3];
+		const float radius = std::abs(plane[0]) * bounds.extent.x + std::abs(plane[1]) * bounds.extent.y + std::abs(plane[2]) * bounds.extent.z;
+		if (distance + radius < 0.0f)
+			return Result::Outside;
+		if (distance - radius < 0.0f)
+			result = Result::Intersecting;
+	}
+	return result;
+}
+
+void ViewCulling::TestBatch(const Frustum& frustum, const Bounds* boxes, size_t count, uint8_t* visible)
+{
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 planes[6][4], absNormals[6][3];
+	for (int p = 0; p < 6; p++) {
+		for (int i = 0; i < 4; i++)
+			planes[p][i] = _mm_set1_ps(frustum.planes[p][i]);
+		for (int i = 0; i < 3; i++)
+			absNormals[p][i] = _mm_and_ps(planes[p][i], signMask);
+	}
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const Bounds* b = boxes + i;
+		const __m128 cx = _mm_setr_ps(b[0].center.x, b[1].center.x, b[2].center.x, b[3].center.x);
+		const __m128 cy = _mm_setr_ps(b[0].center.y, b[1].center.y, b[2].center.y, b[3].center.y);
+		const __m128 cz = _mm_setr_ps(b[0].center.z, b[1].center.z, b[2].center.z, b[3].center.z);
+		const __m128 ex = _mm_setr_ps(b[0].extent.x, b[1].extent.x, b[2].extent.x, b[3].extent.x);
+		const __m128 ey = _mm_setr_ps(b[0].extent.y, b[1].extent.y, b[2].extent.y, b[3].extent.y);
+		const __m128 ez = _mm_setr_ps(b[0].extent.z, b[1].extent.z, b[2].extent.z, b[3].extent.z);
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; p++) {
+			// distance of the box's corner the furthest along the plane's normal
+			__m128 distance = _mm_add_ps(_mm_mul_ps(planes[p][0], cx), _mm_mul_ps(planes[p][1], cy));
+			distance = _mm_add_ps(distance, _mm_add_ps(_mm_mul_ps(planes[p][2], cz), planes[p][3]));
+			__m128 radius = _mm_add_ps(_mm_mul_ps(absNormals[p][0], ex), _mm_mul_ps(absNormals[p][1], ey));
+			radius = _mm_add_ps(radius, _mm_mul_ps(absNormals[p][2], ez));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+		}
+		const int mask = _mm_movemask_ps(outside);
+		for (int k = 0; k < 4; k++)
+			visible[i + k] = !(mask & (1 << k));
+	}
+	for (; i < count; i++)
+		visible[i] = Test(frustum, boxes[i]) != Result::Outside;
+}
+
+const ViewCulling::Bounds& ViewCulling::GetMeshBounds(const Mesh* mesh)
+{
+	auto [it, inserted] = g_meshBounds.try_emplace(mesh);
+	if (inserted && mesh->getNumVertices() > 0) {
+		const float* vertices = mesh->vertices.data();
+		Vector3 lo(vertices[0], vertices[1], vertices[2]), hi = lo;
+		for (size_t i = 1; i < mesh->getNumVertices(); i++) {
+			for (int j = 0; j < 3; j++) {
+				lo.coord[j] = std::min(lo.coord[j], vertices[3 * i + j]);
+				hi.coord[j] = std::max(hi.coord[j], vertices[3 * i + j]);
+			}
+		}
+		it->second = Bounds::fromMinMax(lo, hi);
+	}
+	return it->second;
+}
+
+void ViewCulling::InvalidateMesh(const Mesh* mesh)
+{
+	g_meshBounds.erase(mesh);
+}
+
+void ViewCulling::ClearCache()
+{
+	g_meshBounds.clear();
+}
+
+void ViewCulling::Cull(const Frustum& frustum, const std::vector<Node>& nodes, std::vector<uint32_t>& visible, Stats& stats)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	stats = {};
+	visible.clear();
+	const uint32_t numNodes = (uint32_t)nodes.size();
+
+	// world bounds of each mesh, then of each subtree, from the leaves up
+	std::vector<Bounds> ownBounds(numNodes), groupBounds(numNodes);
+	std::vector<uint8_t> hasBounds(numNodes), hasAlwaysVisible(numNodes);
+	std::vector<uint32_t> numMeshes(numNodes);
+	for (uint32_t i = numNodes; i-- > 0;) {
+		const Node& node = nodes[i];
+		bool has = false, always = node.mesh && node.alwaysVisible;
+		uint32_t count = node.mesh ? 1 : 0;
+		Bounds bounds;
+		if (node.mesh && !node.alwaysVisible) {
+			ownBounds[i] = GetMeshBounds(node.mesh).transform(node.transform);
+			bounds = ownBounds[i];
+			has = true;
+		}
+		for (uint32_t child = i + 1; child < node.subtreeEnd; child = nodes[child].subtreeEnd) {
+			always = always || hasAlwaysVisible[child];
+			count += numMeshes[child];
+			if (hasBounds[child]) {
+				bounds = has ? bounds.merge(groupBounds[child]) : groupBounds[child];
+				has = true;
+			}
+		}
+		groupBounds[i] = bounds;
+		hasBounds[i] = has;
+		hasAlwaysVisible[i] = always;
+		numMeshes[i] = count;
+		if (node.mesh)
+			stats.numObjects++;
+	}
+
+	// the groups are tested while walking down, the remaining objects are gathered to be tested together
+	std::vector<uint32_t> candidates;
+	for (uint32_t i = 0; i < numNodes;) {
+		const Node& node = nodes[i];
+		if (node.subtreeEnd > i + 1 && hasBounds[i] && !hasAlwaysVisible[i]) {
+			stats.numGroupsTested++;
+			const Result result = Test(frustum, groupBounds[i]);
+			if (result == Result::Outside) {
+				stats.numGroupsCulled++;
+				stats.numCulled += numMeshes[i];
+				i = node.subtreeEnd;
+				continue;
+			}
+			if (result == Result::Inside) {
+				for (uint32_t j = i; j < node.subtreeEnd; j++)
+					if (nodes[j].mesh)
+						visible.push_back(j);
+				i = node.subtreeEnd;
+				continue;
+			}
+		}
+		if (node.mesh) {
+			if (node.alwaysVisible)
+				visible.push_back(i);
+			else
+				candidates.push_back(i);
+		}
+		i++;
+	}
+
+	std::vector<Bounds> boxes(candidates.size());
+	for (size_t k = 0; k < candidates.size(); k++)
+		boxes[k] = ownBounds[candidates[k]];
+	std::vector<uint8_t> isVisible(candidates.size());
+	TestBatch(frustum, boxes.data(), boxes.size(), isVisible.data());
+	stats.numTested = candidates.size();
+	for (size_t k = 0; k < candidates.size(); k++) {
+		if (isVisible[k])
+			visible.push_back(candidates[k]);
+		else
+			stats.numCulled++;
+	}
+	stats.numDrawn = visible.size();
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+bool ViewCulling::SelfCheck()
+{
+	std::mt19937 rng(47);
+	std::uniform_real_distribution<float> position(-20000.0f, 20000.0f), size(1.0f, 2000.0f), unit(-1.0f, 1.0f);
+	const Matrix viewProj = Matrix::getLHLookAtViewMatrix(Vector3(0, 0, 0), Vector3(1, 0.2f, 3), Vector3(0, 1, 0))
+		* Matrix::getLHPerspectiveMatrix(60.0f * 3.14159f / 180.0f, 16.0f / 9.0f, 1.0f, 30000.0f);
+	const Frustum frustum = Frustum::fromMatrix(viewProj);
+	bool success = true;
+
+	// batched tests
+	std::vector<Bounds> boxes(10003);
+	for (Bounds& box : boxes)
+		box = { Vector3(position(rng), position(rng), position(rng)), Vector3(size(rng), size(rng), size(rng)) };
+	std::vector<uint8_t> visible(boxes.size());
+	TestBatch(frustum, boxes.data(), boxes.size(), visible.data());
+	size_t numMismatches = 0, numVisible = 0;
+	for (size_t i = 0; i < boxes.size(); i++) {
+		numMismatches += visible[i] != (Test(frustum, boxes[i]) != Result::Outside);
+		numVisible += visible[i];
+	}
+	printf("  batched tests: %zu of %zu boxes visible, %zu mismatches\n", numVisible, boxes.size(), numMismatches);
+	success = success && numMismatches == 0;
+
+	// hierarchy of random groups of objects with a few meshes
+	std::vector<Mesh> meshes(8);
+	for (Mesh& mesh : meshes)
+		for (int v = 0; v < 3 * 16; v++)
+			mesh.vertices.push_back(unit(rng) * size(rng));
+	std::vector<Node> nodes;
+	auto addNode = [&](int depth, const Matrix& parentTransform, auto& rec) -> void {
+		const uint32_t index = (uint32_t)nodes.size();
+		nodes.emplace_back();
+		const Matrix transform = Matrix::getTranslationMatrix(Vector3(position(rng), position(rng), position(rng)) * (depth == 0 ? 1.0f : 0.05f)) * parentTransform;
+		nodes[index].transform = transform;
+		if (rng() % 4 != 0)
+			nodes[index].mesh = &meshes[rng() % meshes.size()];
+		nodes[index].alwaysVisible = rng() % 50 == 0;
+		const int numChildren = (depth < 3) ? (int)(rng() % 6) : 0;
+		for (int c = 0; c < numChildren; c++)
+			rec(depth + 1, transform, rec);
+		nodes[index].subtreeEnd = (uint32_t)nodes.size();
+	};
+	for (int root = 0; root < 200; root++)
+		addNode(0, Matrix::getIdentity(), addNode);
+
+	std::vector<uint32_t> culled, expected;
+	Stats stats;
+	Cull(frustum, nodes, culled, stats);
+	for (uint32_t i = 0; i < nodes.size(); i++)
+		if (nodes[i].mesh && (nodes[i].alwaysVisible || Test(frustum, GetMeshBounds(nodes[i].mesh).transform(nodes[i].transform)) != Result::Outside))
+			expected.push_back(i);
+	std::sort(culled.begin(), culled.end());
+	const bool sameObjects = culled == expected;
+	printf("  hierarchy: %zu objects, %zu groups tested, %zu culled, %zu objects tested, %zu culled, %zu drawn, %s\n", stats.numObjects,
+		stats.numGroupsTested, stats.numGroupsCulled, stats.numTested, stats.numCulled, stats.numDrawn, sameObjects ? "OK" : "FAILED");
+	success = success && sameObjects && stats.numCulled + stats.numDrawn == stats.numObjects;
+	for (const Mesh& mesh : meshes)
+		InvalidateMesh(&mesh);
+
+	printf("View culling self-check %s\n", success ? "passed" : "FAILED");
+	return success;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "vecmat.h"
+
+struct Mesh;
+
+// Rejection of the objects outside of the camera's view, on the CPU.
+namespace ViewCulling {
+	// Axis-aligned box
+	struct Bounds {
+		Vector3 center, extent;
+		static Bounds fromMinMax(const Vector3& min, const Vector3& max) { return { (min + max) * 0.5f, (max - min) * 0.5f }; }
+		Vector3 min() const { return center - extent; }
+		Vector3 max() const { return center + extent; }
+		Bounds transform(const Matrix& matrix) const;
+		Bounds merge(const Bounds& other) const;
+	};
+
+	struct Frustum {
+		// a*x + b*y + c*z + d >= 0 inside
+		float planes[6][4];
+		// From the matrix transforming the world to the clip space (view * projection)
+		static Frustum fromMatrix(const Matrix& viewProj);
+	};
+
+	enum class Result { Outside, Intersecting, Inside };
+	Result Test(const Frustum& frustum, const Bounds& bounds);
+	// Sets visible[i] to whether boxes[i] is not outside, 4 boxes at a time
+	void TestBatch(const Frustum& frustum, const Bounds* boxes, size_t count, uint8_t* visible);
+
+	// Box of the mesh's vertices in its own space, computed once
+	const Bounds& GetMeshBounds(const Mesh* mesh);
+	void InvalidateMesh(const Mesh* mesh);
+	void ClearCache();
+
+	// Object hierarchy flattened in depth-first order
+	struct Node {
+		// null if the object has no mesh to draw
+		const Mesh* mesh = nullptr;
+		// never culled, like the animated meshes whose bounds are unknown
+		bool alwaysVisible = false;
+		Matrix transform;
+		// index after the node's last descendant
+		uint32_t subtreeEnd = 0;
+	};
+
+	struct Stats {
+		size_t numObjects = 0;
+		// objects and groups of objects tested against the frustum
+		size_t numTested = 0;
+		size_t numGroupsTested = 0;
+		size_t numGroupsCulled = 0;
+		size_t numCulled = 0;
+		size_t numDrawn = 0;
+		double seconds = 0.0;
+	};
+
+	// Fills visible with the indices of the nodes with meshes that can be in view. The subtrees whose combined bounds
+	// are outside are rejected at once, the remaining objects are tested in batches.
+	void Cull(const Frustum& frustum, const std::vector<Node>& nodes, std::vector<uint32_t>& visible, Stats& stats);
+
+	// Compares the batched tests and the hierarchical culling with testing every box alone, on random boxes.
+	bool SelfCheck();
+}
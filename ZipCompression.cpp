@@ -0,0 +1,99 @@
+#include "ZipCompression.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "ThreadPool.h"
+
+#include <miniz/miniz.h>
+
+namespace {
+	struct ProfileSettings {
+		const char* name;
+		int level;
+		size_t blockSize; // 0 = never split the entry
+	};
+
+	constexpr ProfileSettings profileSettings[ZipCompression::numProfiles] = {
+		{ "Fast", 1, 1u << 20 },
+		{ "Balanced", 6, 1u << 20 },
+		{ "Smallest", 10, 0 },
+	};
+
+	// Deflates a block on its own, without dictionary from the previous block.
+	// Non-final blocks end with a sync flush so that the next block starts on a byte boundary.
+	bool DeflateBlock(const uint8_t* data, size_t size, int level, bool last, std::string& out)
+	{
+		out.reserve(size / 2 + 64);
+		tdefl_compressor* comp = tdefl_compressor_alloc();
+		if (!comp)
+			return false;
+		mz_uint flags = tdefl_create_comp_flags_from_zip_params(level, -15, MZ_DEFAULT_STRATEGY);
+		auto putBuf = [](const void* buf, int len, void* user) -> mz_bool {
+			((std::string*)user)->append((const char*)buf, (size_t)len);
+			return MZ_TRUE;
+		};
+		tdefl_status status = tdefl_init(comp, putBuf, &out, (int)flags);
+		if (status == TDEFL_STATUS_OKAY)
+			status = tdefl_compress_buffer(comp, data, size, last ? TDEFL_FINISH : TDEFL_SYNC_FLUSH);
+		tdefl_compressor_free(comp);
+		return status == (last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY);
+	}
+}
+
+const char* ZipCompression::GetProfileName(Profile profile)
+{
+	return profileSettings[(int)profile].name;
+}
+
+ZipCompression::CompressedEntry ZipCompression::CompressEntry(const char* name, const std::string& data, Profile profile, const std::atomic<bool>* cancel)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	const ProfileSettings& settings = profileSettings[(int)profile];
+
+	size_t numBlocks = 1;
+	if (settings.blockSize != 0 && data.size() > 2 * settings.blockSize)
+		numBlocks = (data.size() + settings.blockSize - 1) / settings.blockSize;
+	size_t blockSize = (numBlocks == 1) ? data.size() : settings.blockSize;
+
+	CompressedEntry entry;
+	std::vector<std::string> blocks(numBlocks);
+	std::vector<char> blockOk(numBlocks, 0);
+	const uint8_t* bytes = (const uint8_t*)data.data();
+
+	// one extra job computes the CRC of the whole entry alongside the blocks
+	ThreadPool::global().parallelFor(numBlocks + 1, [&](size_t i) {
+		if (i == numBlocks) {
+			entry.crc32 = (uint32_t)mz_crc32(MZ_CRC32_INIT, bytes, data.size());
+			return;
+		}
+		if (cancel && *cancel)
+			return;
+		size_t offset = i * blockSize;
+		size_t size = std::min(blockSize, data.size() - offset);
+		blockOk[i] = DeflateBlock(bytes + offset, size, settings.level, i == numBlocks - 1, blocks[i]);
+	});
+
+	if (cancel && *cancel)
+		return {};
+	size_t totalSize = 0;
+	for (size_t i = 0; i < numBlocks; ++i) {
+		if (!blockOk[i]) {
+			CompressedEntry failed;
+			failed.error = std::string("DEFLATE compression of ") + name + " failed.";
+			return failed;
+		}
+		totalSize += blocks[i].size();
+	}
+	entry.deflated.reserve(totalSize);
+	for (auto& block : blocks)
+		entry.deflated += block;
+
+	entry.report.name = name;
+	entry.report.uncompressedSize = data.size();
+	entry.report.compressedSize = entry.deflated.size();
+	entry.report.numBlocks = numBlocks;
+	entry.report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	return entry;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ZipCompression {
+	enum class Profile {
+		Fast,
+		Balanced,
+		Smallest,
+	};
+	static constexpr int numProfiles = 3;
+	const char* GetProfileName(Profile profile);
+
+	struct EntryReport {
+		std::string name;
+		size_t uncompressedSize = 0;
+		size_t compressedSize = 0;
+		size_t numBlocks = 0;
+		double seconds = 0.0;
+	};
+
+	// Raw DEFLATE stream ready to be stored in a ZIP with MZ_ZIP_FLAG_COMPRESSED_DATA.
+	struct CompressedEntry {
+		std::string deflated;
+		uint32_t crc32 = 0;
+		EntryReport report;
+		// set if a block couldn't be deflated, the entry is then empty
+		std::string error;
+	};
+
+	// Compresses one ZIP entry. Large entries are cut into blocks that are deflated
+	// in parallel (pigz style) and concatenated into a single valid DEFLATE stream.
+	// Returns an empty entry if cancel becomes true during the compression, or with an error if it failed.
+	CompressedEntry CompressEntry(const char* name, const std::string& data, Profile profile, const std::atomic<bool>* cancel = nullptr);
+}
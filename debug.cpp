@@ -13,6 +13,17 @@
 #include "gameobj.h"
 #include "imgui/imgui.h"
 #include "classInfo.h"
+#include "UndoHistory.h"
+#include "SceneGenerator.h"
+#include "DblImage.h"
+#include "MeshOptimizer.h"
+#include "ViewCulling.h"
+#include "RayCast.h"
+#include "texture.h"
+#include "TextureDecode.h"
+#include "TextureResidency.h"
+#include "video.h"
+#include "GuiUtils.h"
 
 #include "ScriptParser.h"
 #include <fmt/format.h>
@@ -78,7 +89,9 @@ void IGDebugMenus()
 			uint16_t minI5 = 0xFFFF, maxI5 = 0;
 			auto walkObj = [&](GameObject* obj, auto& rec) -> void {
 				if (obj->mesh) {
-					for (auto& face : obj->mesh->ftxFaces) {
+					auto& ftxFaces = obj->mesh->ftxFaces;
+					bool hasFlag = std::any_of(ftxFaces.begin(), ftxFaces.end(), [](const Mesh::FTXFace& face) { return face[0] & 0x0200u; });
+					for (auto& face : hasFlag ? UndoHistory::EditMesh(obj)->ftxFaces : ftxFaces) {
 						face[0] &= ~0x0200u;
 						if (face[0] & 0x80) {
 							minI4 = std::min(minI4, face[4]);
@@ -92,7 +105,9 @@ void IGDebugMenus()
 					rec(child, rec);
 				}
 			};
+			UndoHistory::BeginGroup("FTX Stats");
 			walkObj(g_scene.superroot, walkObj);
+			UndoHistory::EndGroup();
 			printf("face[4] in [0x%04X, 0x%04X]\n", minI4, maxI4);
 			printf("face[5] in [0x%04X, 0x%04X]\n", minI5, maxI5);
 		}
@@ -118,10 +133,11 @@ void IGDebugMenus()
 		}
 		if (ImGui::MenuItem("Delete face anims")) {
 			auto walkObj = [](GameObject* obj, auto& rec) -> void {
-				if (obj->excChunk) {
-					auto& subchunks = obj->excChunk->subchunks;
+				auto isFaceAnim = [](const Chunk& chk) { return chk.tag == 'HPMO'; };
+				if (obj->excChunk && std::any_of(obj->excChunk->subchunks.begin(), obj->excChunk->subchunks.end(), isFaceAnim)) {
+					auto& subchunks = UndoHistory::EditExcChunk(obj)->subchunks;
 					for (auto it = subchunks.begin(); it != subchunks.end(); ) {
-						if (it->tag == 'HPMO') {
+						if (isFaceAnim(*it)) {
 							it = subchunks.erase(it);
 							printf("removed at %s\n", obj->getPath().c_str());
 						}
@@ -134,8 +150,47 @@ void IGDebugMenus()
 					rec(child, rec);
 				}
 			};
+			UndoHistory::BeginGroup("Delete face anims");
 			walkObj(g_scene.superroot, walkObj);
-
+			UndoHistory::EndGroup();
+		}
+		if (ImGui::MenuItem("Undo memory benchmark")) {
+			UndoHistory::PrintMemoryBenchmark();
+		}
+		if (ImGui::MenuItem("Texture import benchmark")) {
+			PrintTextureImportBenchmark();
+		}
+		if (ImGui::MenuItem("Texture decode benchmark")) {
+			TextureDecode::PrintBenchmark(g_scene);
+		}
+		if (ImGui::MenuItem("Texture upload benchmark")) {
+			PrintTextureUploadBenchmark();
+		}
+		if (ImGui::MenuItem("Texture residency self-check")) {
+			TextureResidencySelfCheck();
+		}
+		if (ImGui::MenuItem("Mesh preparation benchmark")) {
+			PrintMeshPreparationBenchmark();
+		}
+		if (ImGui::MenuItem("Mesh optimizer self-check")) {
+			MeshOptimizer::SelfCheck();
+		}
+		if (ImGui::MenuItem("View culling self-check")) {
+			ViewCulling::SelfCheck();
+		}
+		if (ImGui::MenuItem("Ray cast benchmark")) {
+			RayCast::PrintBenchmark();
+		}
+		if (ImGui::MenuItem("Lightmap atlas benchmark")) {
+			PrintLightmapAtlasBenchmark();
+		}
+		if (ImGui::MenuItem("DBL image benchmark")) {
+			DblImage::PrintBenchmark();
+		}
+		if (ImGui::MenuItem("Generate synthetic scene...")) {
+			auto zipPath = GuiUtils::SaveDialogBox("Scene ZIP archive\0*.zip\0\0\0", "zip", "synthetic.zip", "Save synthetic scene as...");
+			if (!zipPath.empty())
+				SceneGenerator::GenerateFile(zipPath, {});
 		}
 		if (ImGui::MenuItem("List Components")) {
 			auto walkObj = [](GameObject* obj, auto& rec) -> void {
@@ -6,6 +6,7 @@
 #include <array>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <map>
 #include <unordered_map>
 
@@ -15,9 +16,14 @@
 #include "vecmat.h"
 #include "ByteWriter.h"
 #include "classInfo.h"
+#include "ThreadPool.h"
 
 #include <miniz/miniz.h>
 
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+
 std::unordered_map<GameObject*, size_t> g_objRefCounts;
 Scene g_scene;
 
@@ -892,32 +898,46 @@ Chunk Scene::ConstructSPK()
 	return newSpkChunk;
 }
 
-void Scene::SaveSceneSPK(const std::filesystem::path& fn)
+bool Scene::SaveSceneSPK(const std::filesystem::path& fn, const SaveOptions& options)
 {
 	mz_zip_archive outzip;
 	mz_zip_zero_struct(&outzip);
 	mz_bool mzr;
+	auto fail = [&options](const char* message) {
+		if (options.error)
+			*options.error = message;
+		return false;
+	};
 
+	// Write to a temporary file first, and only replace the destination once the whole ZIP is written,
+	// so that a crash or a cancellation in the middle cannot leave a corrupted scene.
+	std::filesystem::path tempPath = fn;
+	tempPath += ".tmp";
 	FILE* outputZipFile = nullptr;
-	_wfopen_s(&outputZipFile, fn.c_str(), L"wb");
-	if (!outputZipFile) { warn("Couldn't create the new scene ZIP file for saving."); return; }
+	_wfopen_s(&outputZipFile, tempPath.c_str(), L"wb");
+	if (!outputZipFile) return fail("Couldn't create the new scene ZIP file for saving.");
 
-	// TEMP
 	struct FileDestructor {
 		FILE* file;
-		FileDestructor(FILE* file) : file(file) {}
-		~FileDestructor() { fclose(file); }
+		std::filesystem::path path;
+		bool keep = false;
+		FileDestructor(FILE* file, std::filesystem::path path) : file(file), path(std::move(path)) {}
+		~FileDestructor() {
+			if (file) fclose(file);
+			if (!keep) { std::error_code ec; std::filesystem::remove(path, ec); }
+		}
 	};
-	auto _ = FileDestructor(outputZipFile);
+	auto tempFile = FileDestructor(outputZipFile, tempPath);
 	
 	mzr = mz_zip_writer_init_cfile(&outzip, outputZipFile, 0);
-	if (!mzr) { warn("Could not initialize the ZIP writer for saving."); return; }
+	if (!mzr) return fail("Could not initialize the ZIP writer for saving.");
 
-	if (!zipmem.empty()) {
+	const std::vector<uint8_t>& sourceZip = options.sourceZip ? *options.sourceZip : zipmem;
+	if (!sourceZip.empty()) {
 		mz_zip_archive inzip;
 		mz_zip_zero_struct(&inzip);
-		mzr = mz_zip_reader_init_mem(&inzip, zipmem.data(), zipmem.size(), 0);
-		if (!mzr) { warn("Couldn't reopen the original scene ZIP file."); return; }
+		mzr = mz_zip_reader_init_mem(&inzip, sourceZip.data(), sourceZip.size(), 0);
+		if (!mzr) { mz_zip_writer_end(&outzip); return fail("Couldn't reopen the original scene ZIP file."); }
 
 		int nfiles = mz_zip_reader_get_num_files(&inzip);
 		// Determine files to copy from original ZIP
@@ -936,22 +956,71 @@ void Scene::SaveSceneSPK(const std::filesystem::path& fn)
 		mz_zip_reader_end(&inzip);
 	}
 
-	auto saveChunk = [&outzip](Chunk* chk, const char* filename) {
-		auto str = chk->saveToString();
-		mz_zip_writer_add_mem(&outzip, filename, str.data(), str.size(), MZ_DEFAULT_COMPRESSION);
+	// Serialize and compress every pack concurrently, while the SPK is being constructed here.
+	// Entries are then added to the ZIP in their usual order.
+	auto compressChunk = [&options](Chunk* chk, const char* filename, bool isPack) {
+		return ThreadPool::global().submit([chk, filename, isPack, &options]() {
+			if (options.cancel && *options.cancel)
+				return ZipCompression::CompressedEntry{};
+			std::string data = (isPack && options.serializePack) ? options.serializePack(filename, *chk) : chk->saveToString();
+			return ZipCompression::CompressEntry(filename, data, options.profile, options.cancel);
+		});
 	};
-	Chunk spkchk = ConstructSPK();
-	saveChunk(&spkchk, "Pack.SPK");
-	oldSpkChunk = std::move(spkchk);
-	saveChunk(&palPack, "Pack.PAL");
-	saveChunk(&dxtPack, "Pack.DXT");
-	saveChunk(&lgtPack, "Pack.LGT");
-	saveChunk(&wavPack, "Pack.WAV");
+	std::vector<std::future<ZipCompression::CompressedEntry>> entries;
+	entries.push_back(compressChunk(&palPack, "Pack.PAL", true));
+	entries.push_back(compressChunk(&dxtPack, "Pack.DXT", true));
+	entries.push_back(compressChunk(&lgtPack, "Pack.LGT", true));
+	entries.push_back(compressChunk(&wavPack, "Pack.WAV", true));
 	if (hasAnmPack)
-		saveChunk(&anmPack, "Pack.ANM");
+		entries.push_back(compressChunk(&anmPack, "Pack.ANM", true));
 
-	mz_zip_writer_finalize_archive(&outzip);
+	Chunk spkchk = ConstructSPK();
+	entries.insert(entries.begin(), compressChunk(&spkchk, "Pack.SPK", false));
+
+	if (options.reports)
+		options.reports->clear();
+	bool success = true;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		// always wait for every task, as they reference the chunks
+		ZipCompression::CompressedEntry entry = entries[i].get();
+		if (!success || (options.cancel && *options.cancel)) {
+			success = false;
+			continue;
+		}
+		if (!entry.error.empty()) {
+			success = fail(entry.error.c_str());
+			continue;
+		}
+		const auto& report = entry.report;
+		mzr = mz_zip_writer_add_mem_ex(&outzip, report.name.c_str(), entry.deflated.data(), entry.deflated.size(), nullptr, 0,
+			MZ_ZIP_FLAG_COMPRESSED_DATA | MZ_DEFAULT_LEVEL, report.uncompressedSize, entry.crc32);
+		if (!mzr) {
+			success = fail("Failed to write an entry to the scene ZIP file.");
+			continue;
+		}
+		if (options.reports)
+			options.reports->push_back(report);
+		if (options.progress)
+			options.progress(i + 1, entries.size());
+	}
+
+	if (success && !mz_zip_writer_finalize_archive(&outzip))
+		success = fail("Couldn't finish writing the scene ZIP file.");
 	mz_zip_writer_end(&outzip);
+	if (!success)
+		return false;
+
+	fflush(outputZipFile);
+	_commit(_fileno(outputZipFile));
+	fclose(outputZipFile);
+	tempFile.file = nullptr;
+
+	if (!MoveFileExW(tempPath.c_str(), fn.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		return fail("Couldn't replace the scene ZIP file with the newly saved one.");
+	tempFile.keep = true;
+
+	oldSpkChunk = std::move(spkchk);
+	return true;
 }
 
 void Scene::Close()
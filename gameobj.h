@@ -6,8 +6,10 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -16,8 +18,10 @@
 #include <vector>
 
 #include "chunk.h"
+#include "texture.h"
 #include "vecmat.h"
 #include "AudioManager.h"
+#include "ZipCompression.h"
 
 struct GameObject;
 struct Chunk;
@@ -188,6 +192,21 @@ struct GameObject
 inline void GORef::deref() noexcept { if (m_obj) { g_objRefCounts[m_obj]--; m_obj = nullptr; } }
 inline void GORef::set(GameObject * obj) noexcept { deref(); m_obj = obj; if (m_obj) g_objRefCounts[m_obj]++; }
 
+struct SaveOptions {
+	ZipCompression::Profile profile = ZipCompression::Profile::Balanced;
+	std::vector<ZipCompression::EntryReport>* reports = nullptr;
+	// Original scene ZIP whose other files are copied, instead of the scene's zipmem.
+	const std::vector<uint8_t>* sourceZip = nullptr;
+	// Serializes an asset pack (Pack.PAL, Pack.DXT...) instead of the scene's own pack. May be called from any thread.
+	std::function<std::string(const char* filename, Chunk& pack)> serializePack;
+	// Called each time an entry has been written.
+	std::function<void(size_t entriesDone, size_t numEntries)> progress;
+	// The save is aborted as soon as possible when this becomes true.
+	const std::atomic<bool>* cancel = nullptr;
+	// Receives the reason why the save failed. The save shows no message box, as it may run on a worker thread.
+	std::string* error = nullptr;
+};
+
 struct Scene {
 	Chunk oldSpkChunk;
 	GameObject* rootobj = nullptr, * cliprootobj = nullptr, * superroot = nullptr;
@@ -205,6 +224,8 @@ struct Scene {
 
 	std::vector<std::tuple<std::string, std::string, uint32_t>> textureMaterialMap;
 	uint32_t numTextures = 0;
+	// To invalidate when textures are added, removed or renamed
+	TextureIndex textureIndex;
 	
 	std::vector<std::string> zipFilesIncluded;
 	std::vector<std::string> dlcFiles;
@@ -215,7 +236,7 @@ struct Scene {
 	void LoadEmpty();
 	void LoadSceneSPK(const std::filesystem::path& fn);
 	Chunk ConstructSPK();
-	void SaveSceneSPK(const std::filesystem::path& fn);
+	bool SaveSceneSPK(const std::filesystem::path& fn, const SaveOptions& options = {});
 	void Close();
 	~Scene() { Close(); }
 	
@@ -12,6 +12,7 @@
 #include <memory>
 #include <optional>
 #include <random>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "chunk.h"
@@ -19,6 +20,8 @@
 #include "gameobj.h"
 #include "global.h"
 #include "texture.h"
+#include "TextureResidency.h"
+#include "LightmapAtlas.h"
 #include "vecmat.h"
 #include "video.h"
 #include "window.h"
@@ -28,6 +31,15 @@
 #include "ModelImporter.h"
 #include "PathfinderInfo.h"
 #include "ScriptParser.h"
+#include "BackgroundSave.h"
+#include "UndoHistory.h"
+#include "RecoveryJournal.h"
+#include "SceneGenerator.h"
+#include "AssetExport.h"
+#include "DblImage.h"
+#include "ViewCulling.h"
+#include "PortalVisibility.h"
+#include "Picking.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -45,6 +57,7 @@
 #include <stb_image_write.h>
 
 GameObject* selobj = 0;
+GameObject* objtogive = 0;
 Vector3 campos(0, 0, -50), camori(0,0,0);
 float camNearDist = 1.0f, camFarDist = 10000.0f;
 float camspeed = 1920.0f;
@@ -53,6 +66,11 @@ bool findsel = false;
 uint32_t framesincursec = 0, framespersec = 0, lastfpscheck;
 Vector3 cursorpos(0, 0, 0);
 bool renderExc = false;
+bool useFrustumCulling = true;
+ViewCulling::Stats g_cullingStats;
+bool usePortalVisibility = false;
+PortalVisibility::Stats g_portalStats;
+bool usePickingBvh = true;
 
 enum class ObjVisibility {
 	Default = 0,
@@ -85,7 +103,6 @@ bool IsObjectVisible(GameObject* obj) {
 }
 
 GameObject *bestpickobj = 0;
-float bestpickdist;
 Vector3 bestpickintersectionpnt(0, 0, 0);
 
 bool wndShowTextures = false;
@@ -93,6 +110,11 @@ bool wndShowSounds = false;
 bool wndShowAudioObjects = false;
 bool wndShowZDefines = false;
 bool wndShowPathfinderInfo = false;
+bool wndShowSaveReport = false;
+
+ZipCompression::Profile saveProfile = ZipCompression::Profile::Balanced;
+std::vector<ZipCompression::EntryReport> lastSaveReport;
+double lastSaveSeconds = 0.0;
 
 std::function<void()> deferredCommand;
 
@@ -252,8 +274,10 @@ void CopyObjectToAnotherScene(Scene& srcScene, Scene& destScene, GameObject* ogO
 		};
 	walkObj(ogObject, destScene.rootobj, walkObj);
 
-	if (!srcScene.lgtPack.subchunks.empty() && destScene.lgtPack.subchunks.empty()) // TODO: Improve
+	if (!srcScene.lgtPack.subchunks.empty() && destScene.lgtPack.subchunks.empty()) { // TODO: Improve
 		destScene.lgtPack.subchunks.emplace_back(srcScene.lgtPack.subchunks[0]);
+		destScene.textureIndex.invalidate();
+	}
 	std::map<int, int> textureMap;
 	auto fixref = [&cloneMap](GORef& ref) {
 		if (ref) {
@@ -360,6 +384,7 @@ void CopyObjectToAnotherScene(Scene& srcScene, Scene& destScene, GameObject* ogO
 								auto& texCopyLgt = destScene.lgtPack.subchunks.emplace_back(*ogPal);
 								*(uint32_t*)texCopyLgt.maindata.data() = destScene.numTextures;
 							}
+							destScene.textureIndex.invalidate();
 							textureMap[ogTexId] = destScene.numTextures;
 							face[index] = (uint16_t)destScene.numTextures;
 						}
@@ -445,6 +470,8 @@ void CmdDuplicateObjectAndAdapt(GameObject* obj)
 			break;
 		}
 	}
+
+	UndoHistory::RecordCreate(clone);
 }
 
 void CmdDeleteObjectSafely(GameObject* obj)
@@ -459,8 +486,10 @@ void CmdDeleteObjectSafely(GameObject* obj)
 
 	if (selobj == obj)
 		selobj = nullptr;
+	if (objtogive == obj)
+		objtogive = nullptr;
 
-	g_scene.RemoveObject(obj);
+	UndoHistory::DeleteObject(obj);
 }
 
 void IGOTNode(GameObject *o)
@@ -503,7 +532,7 @@ void IGOTNode(GameObject *o)
 	if ((o->flags & 0x10 || o == g_scene.rootobj || o == g_scene.cliprootobj) && o != g_scene.superroot) { // is it a group
 		if (ImGui::GetIO().KeyCtrl && ImGui::BeginDragDropTarget()) {
 			if (const auto* payload = ImGui::AcceptDragDropPayload("GameObject")) {
-				deferredCommand = std::bind(&Scene::GiveObject, &g_scene, *(GameObject**)payload->Data, o);
+				deferredCommand = std::bind(UndoHistory::ReparentObject, *(GameObject**)payload->Data, o);
 			}
 			ImGui::EndDragDropTarget();
 		}
@@ -531,16 +560,20 @@ void IGOTNode(GameObject *o)
 			if (!fpath.empty()) {
 				Scene subscene;
 				subscene.LoadSceneSPK(fpath);
+				UndoHistory::BeginGroup("Import subscene");
 				try {
+					BackgroundSave::EditPacks();
+					UndoHistory::RecordTextureAdd();
 					CopyObjectToAnotherScene(subscene, g_scene, subscene.rootobj->subobj.at(0));
+					UndoHistory::RecordCreate(g_scene.rootobj->subobj.back());
 					UncacheAllTextures();
-					GlifyAllTextures();
 				}
 				catch (const std::exception& exc) {
 					std::string msg = "Failed to import subscene!\nReason: ";
 					msg += exc.what();
 					MessageBoxA(hWindow, msg.c_str(), "c47edit", 16);
 				}
+				UndoHistory::EndGroup();
 			}
 		}
 		if (menuItemWhen("Extract subscene", !isRootObject(o))) {
@@ -554,7 +587,11 @@ void IGOTNode(GameObject *o)
 				subscene.LoadEmpty();
 				try {
 					CopyObjectToAnotherScene(g_scene, subscene, o);
-					subscene.SaveSceneSPK(fpath);
+					SaveOptions options;
+					std::string error;
+					options.error = &error;
+					if (!subscene.SaveSceneSPK(fpath, options))
+						warn(error.c_str());
 				}
 				catch (const std::exception& exc) {
 					std::string msg = "Failed to extract subscene!\nReason: ";
@@ -597,197 +634,22 @@ Vector3 GetYXZRotVecFromMatrix(Matrix *m)
 
 constexpr uint32_t swap_rb(uint32_t a) { return (a & 0xFF00FF00) | ((a & 0xFF0000) >> 16) | ((a & 255) << 16); }
 
-GameObject *objtogive = 0;
 uint32_t curtexid = 0;
 
-std::vector<uint32_t> UnsplitDblImage(GameObject* obj, void* data, int type, int width, int height, bool opacity)
-{
-	std::vector<uint32_t> unpacked(width * height, 0xFFFF00FF);
-	uint8_t* ptr = (uint8_t*)data;
-	auto read8 = [&ptr]() {uint8_t val = *(uint8_t*)ptr; ptr += 1; return val; };
-	auto read16 = [&ptr]() {int16_t val = *(int16_t*)ptr; ptr += 2; return val; };
-	auto read32 = [&ptr]() {int32_t val = *(int32_t*)ptr; ptr += 4; return val; };
-	bool weird = false;
-	int numQuads = read32();
-	if (numQuads == 0x40000001) {
-		numQuads = read32();
-		weird = true;
-	}
-	numQuads &= 0xFFFFFF;
-	int numVerts = read32();
-	std::vector<std::array<int32_t, 4>> quadIndices;
-	std::vector<std::array<int16_t, 2>> vertices;
-	quadIndices.resize(numQuads);
-	for (auto& qi : quadIndices)
-		for (auto& c : qi)
-			c = read32();
-	vertices.resize(numVerts);
-	for (auto& v : vertices)
-		for (auto& c : v)
-			c = read32();
-	std::vector<uint32_t> palette;
-	if (type >= 2 && type <= 4) {
-		int numPaletteColors = read32();
-		palette.resize(numPaletteColors);
-		for (uint32_t& c : palette)
-			c = swap_rb(read32());
-	}
-	for (int i = 0; i < numQuads; ++i) {
-		auto& qi = quadIndices[i];
-		auto [lowX, highX] = std::minmax({ vertices[qi[0]][0], vertices[qi[1]][0], vertices[qi[2]][0], vertices[qi[3]][0] });
-		auto [lowY, highY] = std::minmax({ vertices[qi[0]][1], vertices[qi[1]][1], vertices[qi[2]][1], vertices[qi[3]][1] });
-		if(weird)
-			read32();
-		int16_t dw = read16();
-		int16_t dh = read16();
-		int16_t s2 = read16();
-		int16_t s3 = read16();
-		int rw = (s2 >= 0) ? s2 : dw;
-		int rh = (s3 >= 0) ? s3 : dh;
-		if (type == 0) {
-			for (int dy = 0; dy < dh; ++dy) {
-				for (int dx = 0; dx < dw; ++dx) {
-					uint32_t c = swap_rb(read32());
-					if (dx < rw && dy < rh)
-						unpacked[(lowY + dy) * width + (lowX + dx)] = c;
-				}
-			}
-		}
-		else if (type == 2) {
-			for (int dy = 0; dy < dh; ++dy) {
-				for (int dx = 0; dx < dw; ++dx) {
-					uint32_t c = palette[read8()];
-					if (dx < rw && dy < rh)
-						unpacked[(lowY + dy) * width + (lowX + dx)] = c;
-				}
-			}
-		}
-		else if (type == 3) {
-			for (int dy = 0; dy < dh; ++dy) {
-				for (int dx = 0; dx < dw; ++dx) {
-					uint32_t c = palette[read8()] & 0xFFFFFF;
-					if (dx < rw && dy < rh)
-						unpacked[(lowY + dy) * width + (lowX + dx)] = c;
-				}
-			}
-			for (int dy = 0; dy < dh; ++dy) {
-				for (int dx = 0; dx < dw; ++dx) {
-					uint8_t val = read8();
-					if (dx < rw && dy < rh)
-						unpacked[(lowY + dy) * width + (lowX + dx)] |= (uint32_t)val << 24;
-				}
-			}
-		}
-		else if (type == 4) {
-			for (int dy = 0; dy < dh; ++dy) {
-				for (int dx = 0; dx < dw; dx += 2) {
-					uint8_t byte = read8();
-					if (dx < rw && dy < rh)
-						unpacked[(lowY + dy) * width + (lowX + dx)] = palette[byte & 15];
-					if (dx + 1 < rw && dy < rh)
-						unpacked[(lowY + dy) * width + (lowX + dx + 1)] = palette[byte >> 4];
-				}
-			}
-		}
-
-	}
-	if (opacity) {
-		// inverse alpha
-		for (auto& col : unpacked)
-			col ^= 0xFF000000;
-	}
-	else {
-		// force alpha to 255
-		for (auto& col : unpacked)
-			col = 0xFF000000 | (col & 0x00FFFFFF);
-	}
-	return unpacked;
-}
-
-std::vector<uint8_t> SplitDblImage(uint32_t* image, int width, int height) {
-	// NOTE: Texture pieces can only have a max size of 256x256 pixels.
-	// For D3D and OGL renderers, pieces can be non power of 2.
-	// For Glide, they HAVE to be power of 2.
-	// Hence:
-	// This algorithm will split image in 256x256 textures, remaining are upped to power of 2.
-	// Not exactly how the original dbl images were splitted by devs, but good enough.
-
-	std::vector<uint8_t> buffer;
-	auto writeAny = [&buffer](const auto& val) {uint8_t* ptr = (uint8_t*)&val; buffer.insert(buffer.end(), ptr, ptr + sizeof(val)); };
-	auto write16 = [&](int16_t val) {writeAny(val); };
-	auto write32 = [&](int32_t val) {writeAny(val); };
-	auto bitceil = [](uint32_t val) {
-		for (uint32_t t = 0x80000000; t != 0; t >>= 1) {
-			if (t & val) {
-				return (t == val) ? t : (t << 1);
-			}
-		}
-		return 0u;
-		};
-
-	static constexpr int MAX_LENGTH = 256;
-	int numQuadsX = width / MAX_LENGTH + ((width % MAX_LENGTH) ? 1 : 0);
-	int numQuadsY = height / MAX_LENGTH + ((height % MAX_LENGTH) ? 1 : 0);
-	int numQuads = numQuadsX * numQuadsY;
-	int numVertices = (numQuadsX + 1) * (numQuadsY + 1);
-	write32(numQuads);
-	write32(numVertices);
-	for (int y = 0; y < numQuadsY; ++y) {
-		for (int x = 0; x < numQuadsX; ++x) {
-			write32((y + 1) * (numQuadsX + 1) + x);
-			write32((y + 1) * (numQuadsX + 1) + x + 1);
-			write32(y * (numQuadsX + 1) + x + 1);
-			write32(y * (numQuadsX + 1) + x);
-		}
-	}
-	for (int y = 0; y < numQuadsY + 1; ++y) {
-		for (int x = 0; x < numQuadsX + 1; ++x) {
-			write32(std::min(x * MAX_LENGTH, width));
-			write32(std::min(y * MAX_LENGTH, height));
-		}
-	}
-	for (int y = 0; y < numQuadsY; ++y) {
-		for (int x = 0; x < numQuadsX; ++x) {
-			int px0 = x * MAX_LENGTH;
-			int py0 = y * MAX_LENGTH;
-			int px1 = std::min((x + 1) * MAX_LENGTH, width);
-			int py1 = std::min((y + 1) * MAX_LENGTH, height);
-			int sqwidth = px1 - px0;
-			int sqheight = py1 - py0;
-			int texwidth = bitceil(sqwidth);
-			int texheight = bitceil(sqheight);
-			write16(texwidth);
-			write16(texheight);
-			write16(sqwidth);
-			write16(sqheight);
-			for (int v = py0; v < py0+texheight; ++v) {
-				for (int u = px0; u < px0+texwidth; ++u) {
-					if (u < px1 && v < py1)
-						write32(swap_rb(image[v * width + u]) ^ 0xFF000000);
-					else
-						write32(0);
-				}
-			}
-		}
-	}
-	return buffer;
-}
-
-GLuint GetDblImageTexture(GameObject* obj, void* data, int type, int width, int height, bool opacity, bool refresh) {
-	static GameObject* previousObj = nullptr;
+GLuint GetDblImageTexture(GameObject* obj, const std::vector<uint8_t>& data, int type, int width, int height, bool opacity) {
+	static uint64_t uploadedSerial = 0;
 	static GLuint tex = 0;
-	if (!refresh && obj == previousObj)
+	auto image = DblImage::GetCached(obj, data, type, width, height, opacity);
+	if (image->serial == uploadedSerial)
 		return tex;
-	if (tex)
-		glDeleteTextures(1, &tex);
-	previousObj = obj;
+	uploadedSerial = image->serial;
 
-	auto image = UnsplitDblImage(obj, data, type, width, height, opacity);
-	glGenTextures(1, &tex);
+	if (!tex)
+		glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 4, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.data());
+	glTexImage2D(GL_TEXTURE_2D, 0, 4, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image->pixels.data());
 	return tex;
 }
 
@@ -925,6 +787,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				data.resize(len);
 				fread(data.data(), data.size(), 1, file);
 				fclose(file);
+				DblImage::Invalidate(selobj);
 			}
 			if (name == "Squares") {
 				std::string& name = std::get<std::string>((e + 1)->value);
@@ -935,13 +798,12 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				uint32_t& opacity = std::get<uint32_t>((e + 6)->value);
 				uint32_t& format = std::get<uint32_t>((e + 12)->value);
 				uint32_t& picSize = std::get<uint32_t>((e + 13)->value);
-				bool refresh = false;
 				if (ImGui::Button("Import image")) {
 					auto fpath = GuiUtils::OpenDialogBox("PNG Image\0*.png\0\0\0\0", "png");
 					if (!fpath.empty()) {
 						int impWidth, impHeight, impChannels;
 						auto image = stbi_load(fpath.string().c_str(), &impWidth, &impHeight, &impChannels, 4);
-						data = SplitDblImage((uint32_t*)image, impWidth, impHeight);
+						data = DblImage::Split((uint32_t*)image, impWidth, impHeight);
 						width = impWidth;
 						height = impHeight;
 						picSplitX = 0;
@@ -949,7 +811,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 						format = 0;
 						picSize = 0;
 						stbi_image_free(image);
-						refresh = true;
+						DblImage::Invalidate(selobj);
 					}
 				}
 				if (!data.empty()) {
@@ -958,11 +820,11 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 						auto fname = std::filesystem::path(name).stem().string() + ".png";
 						auto fpath = GuiUtils::SaveDialogBox("PNG Image\0*.png\0\0\0\0", "png", fname.c_str());
 						if (!fpath.empty()) {
-							auto image = UnsplitDblImage(selobj, data.data(), format, width, height, opacity);
-							stbi_write_png(fpath.string().c_str(), width, height, 4, image.data(), 0);
+							auto image = DblImage::GetCached(selobj, data, format, width, height, opacity);
+							stbi_write_png(fpath.string().c_str(), width, height, 4, image->pixels.data(), 0);
 						}
 					}
-					GLuint tex = GetDblImageTexture(selobj, data.data(), format, width, height, opacity, refresh);
+					GLuint tex = GetDblImageTexture(selobj, data, format, width, height, opacity);
 					int dispHeight = std::min(128u, height);
 					int dispWidth = width * dispHeight / height;
 					ImGui::Image((void*)(uintptr_t)tex, ImVec2((float)dispWidth, (float)dispHeight));
@@ -1145,6 +1007,7 @@ void IGObjectInfo()
 	ImGui::SetNextWindowPos(ImVec2(965, 23), ImGuiCond_FirstUseEver);
 	ImGui::SetNextWindowSize(ImVec2(310, 425), ImGuiCond_FirstUseEver);
 	ImGui::Begin("Object information");
+	UndoHistory::TrackDbl(selobj);
 	if (!selobj)
 		ImGui::Text("No object selected.");
 	else {
@@ -1161,7 +1024,7 @@ void IGObjectInfo()
 		ImGui::SameLine();
 		if (ImGui::Button("Give it here!"))
 			if(objtogive)
-				g_scene.GiveObject(objtogive, selobj);
+				UndoHistory::ReparentObject(objtogive, selobj);
 
 		if (ImGui::Button("Find in graph"))
 			findsel = true;
@@ -1175,6 +1038,7 @@ void IGObjectInfo()
 
 		ImGui::Text("%s (%i, %04X) %s", ClassInfo::GetObjTypeString(selobj->type), selobj->type, selobj->flags, selobj->isIncludedScene ? "Included Scene" : "");
 		IGStdStringInput("Name", selobj->name);
+		const Matrix matrixBefore = selobj->matrix;
 		ImGui::DragFloat3("Position", &selobj->matrix._41);
 		/*for (int i = 0; i < 3; i++) {
 			ImGui::PushID(i);
@@ -1191,6 +1055,8 @@ void IGObjectInfo()
 			Matrix mz = Matrix::getRotationZMatrix(rota.z);
 			selobj->matrix = mz * mx * my * Matrix::getTranslationMatrix(selobj->matrix.getTranslationVector());
 		}
+		if (selobj->matrix != matrixBefore)
+			UndoHistory::RecordTransform(selobj, matrixBefore);
 		ImGui::Text("Num. references: %zu", selobj->getRefCount());
 		if (ImGui::CollapsingHeader("Properties (DBL)"))
 		{
@@ -1245,10 +1111,13 @@ void IGObjectInfo()
 			if (ImGui::Button("Import")) {
 				auto filepath = GuiUtils::OpenDialogBox(modelFileFilter, "glb");
 				if (!filepath.empty()) {
+					BackgroundSave::EditPacks();
+					UndoHistory::BeginGroup("Import mesh");
+					UndoHistory::RecordTextureAdd();
 					if (auto optMesh = ImportWithAssimp(filepath)) {
 						if (!selobj->mesh)
 							selobj->mesh = std::make_shared<Mesh>();
-						*selobj->mesh = std::move(optMesh->first);
+						*UndoHistory::EditMesh(selobj) = std::move(optMesh->first);
 						if (optMesh->second) {
 							selobj->excChunk = std::make_shared<Chunk>(std::move(*optMesh->second));
 							// set exchunk to every other object sharing the same mesh
@@ -1264,8 +1133,8 @@ void IGObjectInfo()
 						//	selobj->excChunk = nullptr;
 						InvalidateMesh(selobj->mesh.get());
 						UncacheAllTextures();
-						GlifyAllTextures();
 					}
+					UndoHistory::EndGroup();
 				}
 			}
 			ImGui::SameLine();
@@ -1289,7 +1158,7 @@ void IGObjectInfo()
 				ImGui::EndDisabled();
 				ImGui::Checkbox("Invert faces", &invertFaces);
 				if (ImGui::Button("Apply")) {
-					Mesh* mesh = selobj->mesh.get();
+					Mesh* mesh = UndoHistory::EditMesh(selobj);
 					if (doScale) {
 						float* verts = mesh->vertices.data();
 						for (size_t i = 0; i < mesh->vertices.size(); i += 3) {
@@ -1367,6 +1236,7 @@ void IGObjectInfo()
 		if (selobj->mesh && ImGui::CollapsingHeader("FTXO")) {
 			// TODO: place this in "DebugUI.cpp"
 			if (ImGui::Button("Change texture")) {
+				UndoHistory::EditMesh(selobj);
 				uint16_t* ftxFace = (uint16_t*)selobj->mesh->ftxFaces.data();
 				uint32_t numFaces = selobj->mesh->ftxFaces.size();
 				for (size_t i = 0; i < numFaces; ++i) {
@@ -1384,6 +1254,7 @@ void IGObjectInfo()
 				for(int i = 0; i < 6; ++i)
 					ImGui::InputScalar(std::to_string(i).c_str(), ImGuiDataType_U16, &newFace[i], nullptr, nullptr, "%04X", ImGuiInputTextFlags_CharsHexadecimal);
 				if (ImGui::Button("Apply")) {
+					UndoHistory::EditMesh(selobj);
 					for (auto& ftxFace : selobj->mesh->ftxFaces)
 						ftxFace = newFace;
 					InvalidateMesh(selobj->mesh.get());
@@ -1497,6 +1368,30 @@ void IGObjectInfo()
 	if (nextobjtosel) selobj = nextobjtosel;
 }
 
+void PollBackgroundSave()
+{
+	if (auto saveResult = BackgroundSave::PollFinished()) {
+		if (RecoveryJournal::OnSaveFinished(*saveResult))
+			return;
+		if (saveResult->success) {
+			lastSaveReport = std::move(saveResult->reports);
+			lastSaveSeconds = saveResult->seconds;
+			wndShowSaveReport = true;
+		}
+		else if (!saveResult->cancelled)
+			warn(("The scene could not be saved.\n" + saveResult->error).c_str());
+	}
+}
+
+void PollAssetExport()
+{
+	if (auto result = AssetExport::PollFinished()) {
+		printf("Exported %zu files (%zu bytes) in %.3f s\n", result->numFiles, result->numBytes, result->seconds);
+		if (result->numFailed > 0)
+			warn((std::to_string(result->numFailed) + " files could not be exported.").c_str());
+	}
+}
+
 void CmdSaveScene()
 {
 	auto newfn = g_scene.lastSpkFilepath.filename().u8string();
@@ -1505,8 +1400,55 @@ void CmdSaveScene()
 		newfn = newfn.substr(atpos + 1);
 
 	auto zipPath = GuiUtils::SaveDialogBox("Scene ZIP archive\0*.zip\0\0\0", "zip", std::filesystem::u8path(newfn), "Save Scene ZIP archive as...");
-	if (!zipPath.empty())
-		g_scene.SaveSceneSPK(zipPath);
+	if (zipPath.empty())
+		return;
+	// a compaction of the recovery journal might be running
+	if (BackgroundSave::IsRunning()) {
+		BackgroundSave::Wait();
+		PollBackgroundSave();
+	}
+	if (BackgroundSave::Start(zipPath, saveProfile))
+		RecoveryJournal::OnSaveStarted(zipPath);
+}
+
+void IGSaveReport()
+{
+	ImGui::SetNextWindowSize(ImVec2(420.0f, 230.0f), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Save report", &wndShowSaveReport);
+	ImGui::Text("Profile: %s, total time: %.3f s", ZipCompression::GetProfileName(saveProfile), lastSaveSeconds);
+	if (ImGui::BeginTable("SaveReportTable", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+		ImGui::TableSetupColumn("Entry");
+		ImGui::TableSetupColumn("Size");
+		ImGui::TableSetupColumn("Compressed");
+		ImGui::TableSetupColumn("Blocks");
+		ImGui::TableSetupColumn("Time");
+		ImGui::TableHeadersRow();
+		size_t totalSize = 0, totalCompressed = 0;
+		for (const auto& report : lastSaveReport) {
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(report.name.c_str());
+			ImGui::TableNextColumn();
+			ImGui::Text("%zu KiB", report.uncompressedSize / 1024);
+			ImGui::TableNextColumn();
+			ImGui::Text("%zu KiB (%.1f%%)", report.compressedSize / 1024, report.uncompressedSize ? 100.0 * report.compressedSize / report.uncompressedSize : 0.0);
+			ImGui::TableNextColumn();
+			ImGui::Text("%zu", report.numBlocks);
+			ImGui::TableNextColumn();
+			ImGui::Text("%.1f ms", report.seconds * 1000.0);
+			totalSize += report.uncompressedSize;
+			totalCompressed += report.compressedSize;
+		}
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Total");
+		ImGui::TableNextColumn();
+		ImGui::Text("%zu KiB", totalSize / 1024);
+		ImGui::TableNextColumn();
+		ImGui::Text("%zu KiB", totalCompressed / 1024);
+		ImGui::EndTable();
+	}
+	ImGui::End();
 }
 
 void IGMain()
@@ -1514,10 +1456,26 @@ void IGMain()
 	ImGui::SetNextWindowPos(ImVec2(965, 453), ImGuiCond_FirstUseEver);
 	ImGui::SetNextWindowSize(ImVec2(310, 203), ImGuiCond_FirstUseEver);
 	ImGui::Begin("c47edit");
-	if (ImGui::Button("Save Scene")) {
+	if (BackgroundSave::IsRunning()) {
+		ImGui::ProgressBar(BackgroundSave::GetProgress(), ImVec2(150.0f, 0.0f), "Saving...");
+		ImGui::SameLine();
+		if (ImGui::Button("Cancel"))
+			BackgroundSave::Cancel();
+	}
+	else if (ImGui::Button("Save Scene")) {
 		CmdSaveScene();
 	}
 	ImGui::SameLine();
+	ImGui::SetNextItemWidth(90.0f);
+	if (ImGui::BeginCombo("##SaveProfile", ZipCompression::GetProfileName(saveProfile))) {
+		for (int i = 0; i < ZipCompression::numProfiles; ++i) {
+			auto profile = (ZipCompression::Profile)i;
+			if (ImGui::Selectable(ZipCompression::GetProfileName(profile), profile == saveProfile))
+				saveProfile = profile;
+		}
+		ImGui::EndCombo();
+	}
+	ImGui::SameLine();
 	ImGui::Text("%4u FPS", framespersec);
 	ImGui::DragFloat("Cam speed", &camspeed, 4.0f, 0.0f, FLT_MAX, "%.f /sec");
 	ImGui::DragFloat3("Cam pos", &campos.x, 1.0f);
@@ -1543,6 +1501,60 @@ void IGMain()
 	ImGui::End();
 }
 
+// Makes the textured faces of every mesh use the first texture of each group of duplicates.
+// Returns the number of meshes modified.
+static size_t MergeDuplicateTextures(const std::vector<std::vector<uint32_t>>& duplicates)
+{
+	std::unordered_map<uint16_t, uint16_t> remap;
+	for (const auto& texIds : duplicates)
+		for (size_t i = 1; i < texIds.size(); i++)
+			remap[(uint16_t)texIds[i]] = (uint16_t)texIds[0];
+
+	// one object per mesh, as EditMesh gives the new copy to all the objects sharing it
+	std::vector<GameObject*> objects;
+	std::unordered_set<Mesh*> visited;
+	auto walk = [&](GameObject* obj, auto& rec) -> void {
+		if (obj->mesh && visited.insert(obj->mesh.get()).second) {
+			for (const auto& face : obj->mesh->ftxFaces) {
+				if ((face[0] & FTXFlag::textureMask) && !(face[2] & 0x8000) && remap.count(face[2])) {
+					objects.push_back(obj);
+					break;
+				}
+			}
+		}
+		for (GameObject* child : obj->subobj)
+			rec(child, rec);
+		};
+	walk(g_scene.superroot, walk);
+
+	UndoHistory::BeginGroup("Merge duplicate textures");
+	for (GameObject* obj : objects) {
+		Mesh* mesh = UndoHistory::EditMesh(obj);
+		for (auto& face : mesh->ftxFaces) {
+			if ((face[0] & FTXFlag::textureMask) && !(face[2] & 0x8000)) {
+				auto it = remap.find(face[2]);
+				if (it != remap.end())
+					face[2] = it->second;
+			}
+		}
+	}
+	UndoHistory::EndGroup();
+	return objects.size();
+}
+
+// Shows the progress of the running asset export instead of the "Export all" buttons.
+// Returns false if no export is running.
+static bool IGAssetExportProgress()
+{
+	if (!AssetExport::IsRunning())
+		return false;
+	ImGui::ProgressBar(AssetExport::GetProgress(), ImVec2(100.0f, 0.0f), "Exporting...");
+	ImGui::SameLine();
+	if (ImGui::Button("Cancel##AssetExport"))
+		AssetExport::Cancel();
+	return true;
+}
+
 void IGTextures()
 {
 	ImGui::SetNextWindowSize(ImVec2(512.0f, 350.0f), ImGuiCond_FirstUseEver);
@@ -1550,20 +1562,39 @@ void IGTextures()
 
 	if (ImGui::Button("Add")) {
 		auto filepaths = GuiUtils::MultiOpenDialogBox("Image\0*.png;*.bmp;*.jpg;*.jpeg;*.gif\0\0\0\0", "png");
-		for (const auto& filepath : filepaths) {
-			AddTexture(g_scene, filepath);
-			GlifyTexture(&g_scene.palPack.subchunks.back());
+		BackgroundSave::EditPacks();
+		if (!filepaths.empty()) {
+			UndoHistory::RecordTextureAdd();
+			AddTextures(g_scene, filepaths);
 		}
 	}
 	ImGui::SameLine();
+	ImGui::Checkbox("256 colors", &quantizeImportedTextures);
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("Import the textures as 8-bit paletted PALN textures, like the game's, instead of 32-bit RGBA.\nThe PSNR and sizes are printed in the console.");
+	if (quantizeImportedTextures) {
+		ImGui::SameLine();
+		ImGui::Checkbox("Dither", &ditherImportedTextures);
+	}
+	ImGui::SameLine();
 	if (ImGui::Button("Replace")) {
 		auto [palchk, dxtchk] = FindTextureChunk(g_scene, curtexid);
 		if (palchk) {
 			auto fpath = GuiUtils::OpenDialogBox("Image\0*.png;*.bmp;*.jpg;*.jpeg;*.gif\0\0\0\0", "png");
 			if (!fpath.empty()) {
 				uint32_t tid = *(uint32_t*)palchk->maindata.data();
-				ImportTexture(fpath, *palchk, *dxtchk, tid);
-				InvalidateTexture(tid);
+				Chunk newPal, newDxt;
+				if (ImportTexture(fpath, newPal, newDxt, tid)) {
+					BackgroundSave::EditPacks();
+					UndoHistory::RecordTextureReplace(tid);
+					for (auto [dst, src] : { std::make_pair(palchk, &newPal), std::make_pair(dxtchk, &newDxt) }) {
+						dst->tag = src->tag;
+						dst->maindata = std::move(src->maindata);
+					}
+					InvalidateTexture(tid);
+				}
+				else
+					warn("The image couldn't be read.");
 			}
 		}
 	}
@@ -1579,20 +1610,42 @@ void IGTextures()
 		}
 	}
 	ImGui::SameLine();
-	if (ImGui::Button("Export all")) {
+	if (!IGAssetExportProgress() && ImGui::Button("Export all")) {
 		auto dirpath = GuiUtils::SelectFolderDialogBox("Export all the textures in PNG to:");
-		if (!dirpath.empty()) {
-			for (Chunk& chk : g_scene.palPack.subchunks) {
-				TexInfo* ti = (TexInfo*)chk.maindata.data();
-				std::string name = ti->name;
-				if (name.empty()) {
-					char tbuf[20];
-					sprintf_s(tbuf, "NoName%04X", ti->id);
-					name = tbuf;
-				}
-				ExportTexture(&chk, dirpath / (name + ".png"));
-			}
-		}
+		if (!dirpath.empty())
+			AssetExport::Start(g_scene, dirpath, AssetExport::Textures);
+	}
+	ImGui::SameLine();
+	static std::vector<std::vector<uint32_t>> duplicateTextures;
+	if (ImGui::Button("Duplicates")) {
+		duplicateTextures = FindDuplicateTextures(g_scene);
+		ImGui::OpenPopup("DuplicateTextures");
+	}
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("Find the textures having the same pixels");
+	if (ImGui::BeginPopup("DuplicateTextures")) {
+		if (duplicateTextures.empty())
+			ImGui::TextUnformatted("No duplicate textures");
+		for (const auto& texIds : duplicateTextures) {
+			std::string line;
+			for (uint32_t texId : texIds) {
+				Chunk* palchk = FindTextureChunk(g_scene, texId).first;
+				char tbuf[20];
+				sprintf_s(tbuf, "%s%i: ", line.empty() ? "" : ", ", texId);
+				line += tbuf;
+				line += palchk ? ((TexInfo*)palchk->maindata.data())->getName() : "?";
+			}
+			ImGui::BulletText("%s", line.c_str());
+		}
+		if (!duplicateTextures.empty() && ImGui::Button("Merge")) {
+			size_t numMeshes = MergeDuplicateTextures(duplicateTextures);
+			printf("Merged %zu groups of duplicate textures in %zu meshes\n", duplicateTextures.size(), numMeshes);
+			duplicateTextures.clear();
+			ImGui::CloseCurrentPopup();
+		}
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Make the faces use the first texture of each group.\nThe other textures are kept in the packs.");
+		ImGui::EndPopup();
 	}
 
 	static int packShown = 0;
@@ -1638,8 +1691,7 @@ void IGTextures()
 				curtexid = ti->id;
 			if (ImGui::IsItemVisible()) {
 				ImGui::SameLine();
-				auto t = texmap.find(ti->id);
-				ImGui::Image((t != texmap.end()) ? t->second : nullptr, ImVec2(imgsize, imgsize));
+				ImGui::Image(GetTexture(ti->id), ImVec2(imgsize, imgsize));
 				ImGui::SameLine();
 				ImGui::BeginGroup();
 				ImGui::Text("%i: %s", ti->id, ti->name);
@@ -1655,7 +1707,7 @@ void IGTextures()
 			ImGui::Text("ID: %i\nSize: %i*%i\nNum mipmaps: %i\nFlags: %08X\nUnknown: %08X\nName: %s", ti->id, ti->width, ti->height, ti->numMipmaps, ti->flags, ti->random, ti->name);
 			auto conform = getConformanceLevel(ti->width, ti->height);
 			ImGui::TextColored(conformanceColor[conform], "%s", conformanceText[conform]);
-			ImGui::Image(texmap.at(curtexid), ImVec2(ti->width, ti->height));
+			ImGui::Image(GetTexture(curtexid), ImVec2(ti->width, ti->height));
 		}
 		ImGui::EndTable();
 	}
@@ -1686,6 +1738,7 @@ void IGSounds()
 	if (ImGui::Button("Add")) {
 		auto filePaths = GuiUtils::MultiOpenDialogBox("Sound Wave file (*.wav)\0*.WAV\0\0\0", "wav");
 		if (!filePaths.empty()) {
+			BackgroundSave::EditPacks();
 			for (const auto& fpath : filePaths) {
 				FILE* file = nullptr;
 				_wfopen_s(&file, fpath.c_str(), L"rb");
@@ -1715,6 +1768,7 @@ void IGSounds()
 	if (ImGui::Button("Replace")) {
 		auto fpath = GuiUtils::OpenDialogBox("Sound Wave file (*.wav)\0*.WAV\0\0\0", "wav");
 		if (!fpath.empty()) {
+			BackgroundSave::EditPacks();
 			Chunk& chk = g_scene.wavPack.subchunks[selectedWaveIndex];
 			FILE* file;
 			_wfopen_s(&file, fpath.c_str(), L"rb");
@@ -1744,26 +1798,10 @@ void IGSounds()
 	}
 	ImGui::EndDisabled();
 	ImGui::SameLine();
-	if (ImGui::Button("Export all")) {
+	if (!IGAssetExportProgress() && ImGui::Button("Export all")) {
 		auto dirpath = GuiUtils::SelectFolderDialogBox("Export all WAV sounds to:\n(this will also create subfolders)");
-		if (!dirpath.empty()) {
-			for (size_t id = 1; id < g_scene.audioMgr.audioObjects.size(); ++id) {
-				auto& ptr = g_scene.audioMgr.audioObjects[id];
-				auto& name = g_scene.audioMgr.audioNames[id];
-				if (ptr && ptr->getType() == WaveAudioObject::TYPEID) {
-					WaveAudioObject* wave = (WaveAudioObject*)ptr.get();
-					Chunk& chk = g_scene.wavPack.subchunks[getWaveDataIndex(wave)];
-					auto fpath = dirpath / std::filesystem::path(name).relative_path();
-					std::filesystem::create_directories(fpath.parent_path());
-					FILE* file;
-					_wfopen_s(&file, fpath.c_str(), L"wb");
-					if (file) {
-						fwrite(chk.maindata.data(), chk.maindata.size(), 1, file);
-						fclose(file);
-					}
-				}
-			}
-		}
+		if (!dirpath.empty())
+			AssetExport::Start(g_scene, dirpath, AssetExport::Waves);
 	}
 	ImGui::SameLine();
 	static ImGuiTextFilter filter;
@@ -2139,107 +2177,107 @@ GameObject* FindObjectNamed(const char *name, GameObject *sup = g_scene.rootobj)
 	return 0;
 }
 
-void RenderObject(GameObject *o, const Matrix& parentTransform)
+// Draws the objects of the hierarchy which can be in view of viewProj
+void RenderScene(GameObject* root, const Matrix& viewProj)
 {
-	Matrix transform = o->matrix * parentTransform;
-	if (o->mesh && (o->flags & 0x20) && IsObjectVisible(o)) {
-		if (!rendertextures) {
-			uint32_t clr = swap_rb(o->color);
-			glColor4ubv((uint8_t*)&clr);
-		}
-		DrawMesh(o->mesh.get(), transform, o->excChunk.get());
+	// the hierarchy flattened with the world transforms, and if each object can be moved by the gizmo
+	// or its animation, so is not drawn from the static batches
+	static std::vector<ViewCulling::Node> nodes;
+	static std::vector<GameObject*> objects;
+	static std::vector<bool> moving;
+	static std::vector<uint32_t> visible;
+	static PortalVisibility::Result portals;
+	nodes.clear();
+	objects.clear();
+	moving.clear();
+	auto walk = [](GameObject* o, const Matrix& parentTransform, bool isMoving, auto& rec) -> void {
+		const uint32_t index = (uint32_t)nodes.size();
+		const Matrix transform = o->matrix * parentTransform;
+		isMoving = isMoving || o == selobj || o->excChunk;
+		ViewCulling::Node node;
+		node.transform = transform;
+		if (o->mesh && (o->flags & 0x20) && IsObjectVisible(o)) {
+			node.mesh = o->mesh.get();
+			// the static batches are culled by cells instead
+			node.alwaysVisible = o->excChunk || (useStaticBatching && rendertextures && !isMoving);
+		}
+		nodes.push_back(node);
+		objects.push_back(o);
+		moving.push_back(isMoving);
+		for (GameObject* child : o->subobj)
+			rec(child, transform, isMoving, rec);
+		nodes[index].subtreeEnd = (uint32_t)nodes.size();
+	};
+	walk(root, Matrix::getIdentity(), false, walk);
+
+	// the objects of the rooms not seen through the gates are left out, so their groups are rejected at once,
+	// except the static ones, which stay in their batches so that the batches aren't rebuilt when the view changes
+	if (usePortalVisibility) {
+		PortalVisibility::Compute(nodes, objects, campos, viewProj, portals, g_portalStats);
+		for (uint32_t i = 0; i < (uint32_t)nodes.size(); i++)
+			if (!portals.roomFrustums[portals.nodeRooms[i]] && !(nodes[i].alwaysVisible && !moving[i]))
+				nodes[i].mesh = nullptr;
 	}
-	for (auto e = o->subobj.begin(); e != o->subobj.end(); e++)
-		RenderObject(*e, transform);
-}
-
-Vector3 finalintersectpnt = Vector3(0, 0, 0);
+	else
+		g_portalStats = {};
 
-template <int numverts>
-bool IsRayIntersectingFace(const Vector3& raystart, const Vector3& raydir, float* bver, uint16_t* bfac, const Matrix& worldmtx)
-{
-	Vector3 pnts[numverts];
-	for (int i = 0; i < 3; i++)
-	{
-		Vector3 v(bver[bfac[i] * 3 / 2], bver[bfac[i] * 3 / 2 + 1], bver[bfac[i] * 3 / 2 + 2]);
-		pnts[i] = v.transform(worldmtx);
+	const ViewCulling::Frustum frustum = ViewCulling::Frustum::fromMatrix(viewProj);
+	if (useFrustumCulling)
+		ViewCulling::Cull(frustum, nodes, visible, g_cullingStats);
+	else {
+		visible.clear();
+		for (uint32_t i = 0; i < (uint32_t)nodes.size(); i++)
+			if (nodes[i].mesh)
+				visible.push_back(i);
+		g_cullingStats = {};
+		g_cullingStats.numObjects = g_cullingStats.numDrawn = visible.size();
 	}
-
-	Vector3 edges[numverts];
-	for (int i = 0; i < 2; i++)
-		edges[i] = pnts[i + 1] - pnts[i];
-
-	Vector3 planenorm = edges[1].cross(edges[0]);
-	float planeord = -planenorm.dot(pnts[0]);
-
-	float planenorm_dot_raydir = planenorm.dot(raydir);
-	if (planenorm_dot_raydir >= 0) return false;
-
-	float param = -(planenorm.dot(raystart) + planeord) / planenorm_dot_raydir;
-	if (param < 0) return false;
-
-	Vector3 interpnt = raystart + raydir * param;
-
-	if constexpr (numverts >= 4) {
-		for (int i = 3; i < numverts; i++)
-		{
-			Vector3 v(bver[bfac[i] * 3 / 2], bver[bfac[i] * 3 / 2 + 1], bver[bfac[i] * 3 / 2 + 2]);
-			pnts[i] = v.transform(worldmtx);
-		}
-
-		for (int i = 2; i < numverts - 1; i++)
-			edges[i] = pnts[i + 1] - pnts[i];
+	// the batch cells are drawn if they are in view through one of the rooms seen
+	static std::vector<ViewCulling::Frustum> cullingFrustums;
+	cullingFrustums.clear();
+	if (usePortalVisibility) {
+		for (const auto& roomFrustum : portals.roomFrustums)
+			if (roomFrustum)
+				cullingFrustums.push_back(*roomFrustum);
 	}
-	edges[numverts - 1] = pnts[0] - pnts[numverts - 1];
-
-	// Check if plane/ray intersection point is inside face
-
-	for (int i = 0; i < numverts; i++)
-	{
-		Vector3 edgenorm = -planenorm.cross(edges[i]);
-		Vector3 ptoi = interpnt - pnts[i];
-		if (edgenorm.dot(ptoi) < 0)
-			return false;
+	else if (useFrustumCulling)
+		cullingFrustums.push_back(frustum);
+	SetMeshCullingFrustums(cullingFrustums.data(), cullingFrustums.size());
+
+	// and the ones of the other rooms outside of the gates they are seen through
+	if (usePortalVisibility) {
+		visible.erase(std::remove_if(visible.begin(), visible.end(), [](uint32_t i) {
+			const uint16_t room = portals.nodeRooms[i];
+			if (room == portals.cameraRoom || nodes[i].alwaysVisible)
+				return false;
+			const auto bounds = ViewCulling::GetMeshBounds(nodes[i].mesh).transform(nodes[i].transform);
+			if (ViewCulling::Test(*portals.roomFrustums[room], bounds) != ViewCulling::Result::Outside)
+				return false;
+			g_portalStats.numObjectsHidden++;
+			return true;
+		}), visible.end());
 	}
 
-	finalintersectpnt = interpnt;
-	return true;
-}
-
-GameObject *IsRayIntersectingObject(const Vector3& raystart, const Vector3& raydir, GameObject *o, const Matrix& worldmtx)
-{
-	float d;
-	Matrix objmtx = o->matrix * worldmtx;
-	if (o->mesh && IsObjectVisible(o))
-	{
-		Mesh *m = o->mesh.get();
-		float* vertices = (o->excChunk && o->excChunk->findSubchunk('LCHE')) ? ApplySkinToMesh(m, o->excChunk.get()) : m->vertices.data();
-		for (size_t i = 0; i < m->getNumQuads(); i++)
-			if (IsRayIntersectingFace<4>(raystart, raydir, vertices, m->quadindices.data() + i * 4, objmtx))
-				if ((d = (finalintersectpnt - campos).sqlen2xz()) < bestpickdist)
-				{
-					bestpickdist = d;
-					bestpickobj = o;
-					bestpickintersectionpnt = finalintersectpnt;
-				}
-		for(size_t i = 0; i < m->getNumTris(); i++)
-			if (IsRayIntersectingFace<3>(raystart, raydir, vertices, m->triindices.data() + i * 3, objmtx))
-				if ((d = (finalintersectpnt - campos).sqlen2xz()) < bestpickdist)
-				{
-					bestpickdist = d;
-					bestpickobj = o;
-					bestpickintersectionpnt = finalintersectpnt;
-				}
+	for (uint32_t i : visible) {
+		GameObject* o = objects[i];
+		const bool isMoving = moving[i];
+		if (!rendertextures) {
+			uint32_t clr = swap_rb(o->color);
+			glColor4ubv((uint8_t*)&clr);
+		}
+		DrawMesh(o->mesh.get(), nodes[i].transform, o->excChunk.get(), isMoving ? nullptr : o);
 	}
-	for (auto c = o->subobj.begin(); c != o->subobj.end(); c++)
-		IsRayIntersectingObject(raystart, raydir, *c, objmtx);
-	return 0;
 }
 
 void UIClean()
 {
+	// the scene is about to be replaced, the export keeps copies of the chunks it still has to write
+	AssetExport::EditPacks();
+	UndoHistory::Clear();
+	RecoveryJournal::Discard();
 	UncacheAllTextures();
 	UncacheAllMeshes();
+	DblImage::ClearCache();
 	selobj = nullptr;
 	objVisibilityMap.clear();
 	bestpickobj = nullptr;
@@ -2249,20 +2287,62 @@ void UIClean()
 	g_pfInfo = {};
 }
 
+// Forgets the selected objects that are not part of the scene anymore
+void ForgetDetachedObjects()
+{
+	auto isInScene = [](GameObject* obj) {
+		for (; obj->parent; obj = obj->parent) {
+			auto& siblings = obj->parent->subobj;
+			if (std::find(siblings.begin(), siblings.end(), obj) == siblings.end())
+				return false;
+		}
+		return obj == g_scene.superroot;
+		};
+	for (GameObject** obj : { &selobj, &objtogive, &bestpickobj, &nextobjtosel })
+		if (*obj && !isInScene(*obj))
+			*obj = nullptr;
+}
+
+void CmdUndo()
+{
+	UndoHistory::Undo();
+	ForgetDetachedObjects();
+}
+
+void CmdRedo()
+{
+	UndoHistory::Redo();
+	ForgetDetachedObjects();
+}
+
 bool CmdOpenScene()
 {
 	auto zipPath = GuiUtils::OpenDialogBox("Scene ZIP archive\0*.zip\0\0\0", "zip", "Select a Scene ZIP archive (containing Pack.SPK)");
 	if (zipPath.empty())
 		return false;
+	BackgroundSave::Wait();
+	PollBackgroundSave();
 	UIClean();
-	g_scene.LoadSceneSPK(zipPath);
-	GlifyAllTextures();
+	bool recover = false;
+	if (size_t numEdits = RecoveryJournal::GetRecoverableEdits(zipPath)) {
+		std::wstring msg = L"c47edit was not closed properly while editing this scene.\n\n" + std::to_wstring(numEdits)
+			+ L" edits made after it was last saved can be recovered. Recover them?";
+		recover = MessageBoxW(hWindow, msg.c_str(), L"c47edit", MB_ICONWARNING | MB_YESNO) == IDYES;
+	}
+	if (recover)
+		RecoveryJournal::Recover(zipPath);
+	else {
+		g_scene.LoadSceneSPK(zipPath);
+		RecoveryJournal::Start(zipPath);
+	}
 	return true;
 }
 
 void CmdNewScene()
 {
 	if (MessageBoxW(hWindow, L"Create a new empty scene?", L"c47edit", MB_ICONWARNING | MB_YESNO) == IDYES) {
+		BackgroundSave::Wait();
+		PollBackgroundSave();
 		UIClean();
 		g_scene.LoadEmpty();
 	}
@@ -2286,6 +2366,28 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 		exit(-2);
 	}
 
+	// Command line tools, run without opening the editor
+	if (__argc >= 2 && !strcmp(__argv[1], "--benchmark")) {
+		auto jsonPath = std::filesystem::path((__argc >= 3) ? __argv[2] : "benchmark.json");
+		return SceneGenerator::RunBenchmarkToFile(jsonPath) ? 0 : 1;
+	}
+	if (__argc >= 3 && !strcmp(__argv[1], "--generate")) {
+		SceneGenerator::Params params;
+		if (__argc >= 4)
+			params = params.scaled(atof(__argv[3]));
+		return SceneGenerator::GenerateFile(std::filesystem::path(__argv[2]), params) ? 0 : 1;
+	}
+	if (__argc >= 4 && !strcmp(__argv[1], "--export")) {
+		g_scene.LoadSceneSPK(std::filesystem::path(__argv[2]));
+		auto result = AssetExport::Export(g_scene, std::filesystem::path(__argv[3]), AssetExport::Textures | AssetExport::Waves,
+			[](size_t filesDone, size_t numFiles) {
+				if (filesDone % 64 == 0 || filesDone == numFiles)
+					printf("%zu/%zu\n", filesDone, numFiles);
+			});
+		printf("Exported %zu files (%zu bytes) in %.3f s, %zu failed\n", result.numFiles, result.numBytes, result.seconds, result.numFailed);
+		return (result.numFailed == 0) ? 0 : 1;
+	}
+
 	bool appnoquit = true;
 	InitWindow();
 
@@ -2338,11 +2440,17 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 					cammove.y += 1;
 				if (ImGui::IsKeyDown((ImGuiKey)'F'))
 					cammove.y -= 1;
-				if (ImGui::IsKeyPressed((ImGuiKey)'Y'))
+				if (ImGui::IsKeyPressed((ImGuiKey)'Y') && !io.KeyCtrl)
 					wireframe = !wireframe;
 				if (ImGui::IsKeyPressed((ImGuiKey)'T'))
 					rendertextures = !rendertextures;
 			}
+			if (!io.WantTextInput && io.KeyCtrl) {
+				if (ImGui::IsKeyPressed((ImGuiKey)'Z'))
+					io.KeyShift ? CmdRedo() : CmdUndo();
+				else if (ImGui::IsKeyPressed((ImGuiKey)'Y'))
+					CmdRedo();
+			}
 			campos += cammove * camspeed * deltaTimeSec * (io.KeyShift ? 2.0f : 1.0f);
 			if (io.MouseDown[0] && !io.WantCaptureMouse && !(io.KeyAlt || io.KeyCtrl))
 			{
@@ -2362,12 +2470,16 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 					raystart = campos + ncd + crab * (msx / xs) - hi * (msy / ys);
 					raydir = raystart - campos;
 
-					bestpickobj = 0;
-					bestpickdist = std::numeric_limits<float>::infinity();
-					IsRayIntersectingObject(raystart, raydir, g_scene.superroot, Matrix::getIdentity());
+					const Picking::Hit hit = usePickingBvh ? Picking::Pick(g_scene.superroot, raystart, raydir, campos, IsObjectVisible)
+						: Picking::PickBruteForce(g_scene.superroot, raystart, raydir, campos, IsObjectVisible);
+					bestpickobj = hit.object;
+					if (hit.object)
+						bestpickintersectionpnt = hit.position;
 					if (io.KeyAlt) {
-						if (bestpickobj && selobj)
+						if (bestpickobj && selobj) {
+							UndoHistory::RecordTransform(selobj, selobj->matrix);
 							selobj->matrix.setTranslationVector(bestpickintersectionpnt);
+						}
 					}
 					else {
 						selobj = bestpickobj;
@@ -2392,8 +2504,10 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 				for (GameObject* par = selobj->parent; par; par = par->parent)
 					parentMat *= par->matrix;
 				Matrix globalMat = selobj->matrix * parentMat;
-				if (ImGuizmo::Manipulate(lookat.v, persp.v, ImGuizmo::TRANSLATE | ImGuizmo::ROTATE, ImGuizmo::WORLD, globalMat.v))
+				if (ImGuizmo::Manipulate(lookat.v, persp.v, ImGuizmo::TRANSLATE | ImGuizmo::ROTATE, ImGuizmo::WORLD, globalMat.v)) {
+					UndoHistory::RecordTransform(selobj, selobj->matrix);
 					selobj->matrix = globalMat * parentMat.getInverse4x3();
+				}
 			}
 
 			IGMain();
@@ -2407,6 +2521,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 			if (wndShowAudioObjects) IGAudioObjects();
 			if (wndShowZDefines) IGZDefines();
 			if (wndShowPathfinderInfo) IGPathfinderInfo();
+			if (wndShowSaveReport) IGSaveReport();
 			if (ImGui::BeginMainMenuBar()) {
 				if (ImGui::BeginMenu("Scene")) {
 					if (ImGui::MenuItem("New"))
@@ -2420,6 +2535,25 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 						DestroyWindow(hWindow);
 					ImGui::EndMenu();
 				}
+				if (ImGui::BeginMenu("Edit")) {
+					std::string undoLabel = std::string("Undo ") + UndoHistory::GetUndoName();
+					std::string redoLabel = std::string("Redo ") + UndoHistory::GetRedoName();
+					if (ImGui::MenuItem(undoLabel.c_str(), "Ctrl+Z", false, UndoHistory::CanUndo()))
+						CmdUndo();
+					if (ImGui::MenuItem(redoLabel.c_str(), "Ctrl+Y", false, UndoHistory::CanRedo()))
+						CmdRedo();
+					ImGui::Separator();
+					int budgetMiB = (int)(UndoHistory::GetMemoryBudget() >> 20);
+					ImGui::SetNextItemWidth(100.0f);
+					if (ImGui::InputInt("History budget (MiB)", &budgetMiB, 16, 256, ImGuiInputTextFlags_EnterReturnsTrue))
+						UndoHistory::SetMemoryBudget((size_t)std::max(budgetMiB, 1) << 20);
+					ImGui::Text("History: %zu steps, %.1f MiB", UndoHistory::GetNumSteps(), (double)UndoHistory::GetMemoryUsage() / 1048576.0);
+					const auto& journalStats = RecoveryJournal::GetStats();
+					ImGui::Text("Recovery journal: %zu edits, %.1f us/edit, %zu syncs, %.2f ms/sync, %zu compactions",
+						journalStats.numRecords, journalStats.serializeSeconds * 1e6 / (double)std::max<size_t>(journalStats.numRecords, 1),
+						journalStats.numSyncs, journalStats.syncSeconds * 1e3 / (double)std::max<size_t>(journalStats.numSyncs, 1), journalStats.numCompactions);
+					ImGui::EndMenu();
+				}
 				if (ImGui::BeginMenu("Create")) {
 					static const uint16_t quickAccess[] = {
 						2, // ZSTDOBJ
@@ -2427,7 +2561,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 					};
 					for (auto id : quickAccess) {
 						if (ImGui::MenuItem(ClassInfo::GetObjTypeString(id))) {
-							g_scene.CreateObject(id, g_scene.rootobj);
+							UndoHistory::RecordCreate(g_scene.CreateObject(id, g_scene.rootobj));
 						}
 					}
 					ImGui::Separator();
@@ -2444,7 +2578,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 							for (auto& [name, id] : g_classInfo_stringIdMap) {
 								if (ClassInfo::GetObjTypeCategory(id) & flags) {
 									if (ImGui::MenuItem(name.c_str())) {
-										g_scene.CreateObject(id, g_scene.rootobj);
+										UndoHistory::RecordCreate(g_scene.CreateObject(id, g_scene.rootobj));
 									}
 								}
 							}
@@ -2459,6 +2593,67 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 					ImGui::MenuItem("Audio objects", nullptr, &wndShowAudioObjects);
 					ImGui::MenuItem("ZDefines", nullptr, &wndShowZDefines);
 					ImGui::MenuItem("Pathfinder info", nullptr, &wndShowPathfinderInfo);
+					ImGui::MenuItem("Save report", nullptr, &wndShowSaveReport);
+
+					ImGui::Separator();
+					TextureResidency& residency = GetTextureResidency();
+					int textureBudgetMiB = (int)(residency.getBudget() >> 20);
+					ImGui::SetNextItemWidth(100.0f);
+					if (ImGui::InputInt("Texture budget (MiB)", &textureBudgetMiB, 16, 256, ImGuiInputTextFlags_EnterReturnsTrue))
+						residency.setBudget((size_t)std::max(textureBudgetMiB, 1) << 20);
+					if (ImGui::Checkbox("Compressed textures (DXT1)", &useCompressedTextures))
+						UncacheAllTextures();
+					const auto& textureStats = residency.getStats();
+					ImGui::Text("Textures: %zu resident, %.1f MiB, %zu loading, %zu uploads in %.1f ms, %zu evictions",
+						textureStats.numResident, (double)textureStats.residentBytes / 1048576.0, textureStats.numLoading,
+						textureStats.numUploads, textureStats.uploadSeconds * 1000.0, textureStats.numEvictions);
+					if (ImGui::Checkbox("Lightmap atlases", &useLightmapAtlas))
+						UncacheAllMeshes();
+					const auto& atlasStats = LightmapAtlas::GetStats();
+					const auto& drawStats = GetMeshDrawStats();
+					ImGui::Text("Lightmaps: %zu of %zu in %zu atlases. Drawn: %zu lists, %zu parts in %.2f ms",
+						atlasStats.numPacked, atlasStats.numLightmaps, atlasStats.numAtlases,
+						drawStats.numLists, drawStats.numParts, drawStats.seconds * 1000.0);
+					ImGui::Checkbox("Static batching", &useStaticBatching);
+					ImGui::Text("Draw calls: %zu, %zu batches of %zu static objects (%.1f MiB), %zu rebuilt in %.2f ms. Frame: %.1f ms",
+						drawStats.numDrawCalls, drawStats.numBatches, drawStats.numBatchedInstances, drawStats.numBatchBytes / 1048576.0,
+						drawStats.numBatchRebuilds, drawStats.batchRebuildSeconds * 1000.0, drawStats.frameSeconds * 1000.0);
+					ImGui::Checkbox("Frustum culling", &useFrustumCulling);
+					ImGui::Text("Objects: %zu, %zu tested, %zu culled (%zu of %zu groups), %zu drawn, %zu batch cells culled, in %.2f ms",
+						g_cullingStats.numObjects, g_cullingStats.numTested, g_cullingStats.numCulled, g_cullingStats.numGroupsCulled,
+						g_cullingStats.numGroupsTested, g_cullingStats.numDrawn, drawStats.numCulledBatchCells, g_cullingStats.seconds * 1000.0);
+					ImGui::Checkbox("Portal visibility", &usePortalVisibility);
+					ImGui::Text("Rooms: %zu, %zu gates, camera in %s, %zu rooms visited, %zu of %zu portals passed, %zu objects hidden, in %.2f ms",
+						g_portalStats.numRooms, g_portalStats.numGates, g_portalStats.cameraRoom.empty() ? "(outside)" : g_portalStats.cameraRoom.c_str(),
+						g_portalStats.numRoomsVisited, g_portalStats.numPortalsPassed, g_portalStats.numPortalsTested,
+						g_portalStats.numObjectsHidden, g_portalStats.seconds * 1000.0);
+					ImGui::Checkbox("Picking hierarchy", &usePickingBvh);
+					const auto& pickStats = Picking::GetStats();
+					ImGui::Text("Last pick: %zu objects, %zu nodes, %zu faces tested in %.3f ms. %zu mesh trees, %zu rebuilds, %zu refits",
+						pickStats.numObjects, pickStats.numNodesVisited, pickStats.numFacesTested, pickStats.seconds * 1000.0,
+						pickStats.numMeshTrees, pickStats.numRebuilds, pickStats.numRefits);
+					if (ImGui::MenuItem("Picking benchmark"))
+						Picking::PrintBenchmark(g_scene.superroot, campos, ncd, IsObjectVisible);
+					ImGui::Checkbox("Vertex buffers", &useVertexBuffers);
+					ImGui::Text("Geometry per frame: %.2f MiB from memory, %.2f MiB uploaded. Buffers: %.1f MiB",
+						drawStats.numClientBytes / 1048576.0, drawStats.numUploadedBytes / 1048576.0, drawStats.numBufferBytes / 1048576.0);
+					const auto& prepStats = GetMeshPreparationStats();
+					ImGui::Text("Prepared meshes: %zu, %zu parts, %zu/%zu vertices welded, %.2f MiB in %.1f ms",
+						prepStats.numMeshes, prepStats.numParts, prepStats.numVertices, prepStats.numCorners,
+						prepStats.numBytes / 1048576.0, prepStats.seconds * 1000.0);
+					if (ImGui::Checkbox("Optimize meshes for the vertex cache", &optimizeMeshes))
+						UncacheAllMeshes();
+					if (prepStats.numTriangles)
+						ImGui::Text("Vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %.1f ms",
+							(double)prepStats.cacheMissesBefore / prepStats.numTriangles, (double)prepStats.cacheMissesAfter / prepStats.numTriangles,
+							(double)prepStats.cacheMissesBefore / prepStats.numVertices, (double)prepStats.cacheMissesAfter / prepStats.numVertices,
+							prepStats.optimizeSeconds * 1000.0);
+					ImGui::Checkbox("Prepare meshes in the background", &prepareMeshesInBackground);
+					const auto& loadingStats = GetMeshLoadingStats();
+					ImGui::Text("Mesh loading: %zu pending, %zu drawn untextured. Last: %zu meshes over %zu frames in %.2f s",
+						loadingStats.numPending, loadingStats.numFallbackDraws, loadingStats.numPreparedMeshes, loadingStats.numFrames, loadingStats.seconds);
+					ImGui::Text("Frame times while loading: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms",
+						loadingStats.frameP50 * 1000.0, loadingStats.frameP90 * 1000.0, loadingStats.frameP99 * 1000.0, loadingStats.frameMax * 1000.0);
 
 					ImGui::Separator();
 					auto& chunks = g_scene.remainingChunks;
@@ -2522,7 +2717,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 			glCullFace(GL_BACK);
 			glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
 			BeginMeshDraw();
-			RenderObject(g_scene.superroot, Matrix::getIdentity());
+			RenderScene(g_scene.superroot, projMatrix);
 			RenderMeshLists();
 			EndMeshDraw();
 
@@ -2568,6 +2763,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 			ImGui::Render();
 			ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
 			EndDrawing();
+			UpdateTextures();
 			//_sleep(16);
 
 			framesincursec++;
@@ -2582,6 +2778,22 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 				deferredCommand();
 				deferredCommand = nullptr;
 			}
+
+			// an edit made with the mouse or a text field is complete once released
+			if (!ImGui::IsAnyItemActive() && !ImGuizmo::IsUsing()) {
+				UndoHistory::CommitDbl();
+				UndoHistory::EndCoalescing();
+				UndoHistory::FlushJournal();
+				RecoveryJournal::Update();
+			}
+
+			PollBackgroundSave();
+			PollAssetExport();
 		}
 	}
+	AssetExport::Cancel();
+	AssetExport::Wait();
+	BackgroundSave::Wait();
+	RecoveryJournal::Discard();
+	UndoHistory::Clear();
 }
\ No newline at end of file
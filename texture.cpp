@@ -1,108 +1,200 @@
 #include "texture.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <filesystem>
 #include <functional>
 #include <map>
+#include <memory>
+#include <optional>
 
 #include "global.h"
 #include "chunk.h"
 #include "gameobj.h"
 #include "ByteWriter.h"
+#include "LightmapAtlas.h"
+#include "TextureDecode.h"
+#include "TexturePalette.h"
+#include "TextureResidency.h"
+#include "ThreadPool.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#include <GL/gl.h>
+#include <GL/glew.h>
+
+#include <emmintrin.h>
 
 #include <stb_image.h>
 #include <stb_image_write.h>
 #include "squish.h"
 
-std::map<uint32_t, void*> texmap;
+bool useCompressedTextures = true;
+bool quantizeImportedTextures = false;
+bool ditherImportedTextures = false;
 
-void GlifyTexture(Chunk* c) {
-	uint8_t* d = (uint8_t*)c->maindata.data();
-	uint32_t texid = *(uint32_t*)d;
-	int texh = *(uint16_t*)(d + 4);
-	int texw = *(uint16_t*)(d + 6);
-	int nmipmaps = *(uint16_t*)(d + 8);
-	uint8_t* firstbmp = d + 20;
-	while (*(firstbmp++));
+namespace {
+	bool IsCompressedUploadSupported() {
+		return GLEW_VERSION_1_3 && GLEW_EXT_texture_compression_s3tc;
+	}
 
-	uint32_t pal[256];
-	if (c->tag == 'PALN')
+	struct GLTextureUploader : TextureUploader {
+		void* upload(const DecodedTexture& texture) override {
+			GLuint gltex;
+			glGenTextures(1, &gltex);
+			glBindTexture(GL_TEXTURE_2D, gltex);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (texture.levels.size() > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			// the chains of some textures don't go down to 1x1
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)texture.levels.size() - 1);
+			for (size_t m = 0; m < texture.levels.size(); m++) {
+				const DecodedTexture::Level& level = texture.levels[m];
+				if (texture.format == DecodedTexture::Format::DXT1)
+					glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)m, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, level.width, level.height, 0, (GLsizei)level.dataSize, level.data);
+				else
+					glTexImage2D(GL_TEXTURE_2D, (GLint)m, 4, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, level.data);
+			}
+			glBindTexture(GL_TEXTURE_2D, 0);
+			return (void*)(uintptr_t)gltex;
+		}
+		void release(void* handle) override {
+			GLuint gltex = (GLuint)(uintptr_t)handle;
+			glDeleteTextures(1, &gltex);
+		}
+	};
+	GLTextureUploader g_glTextureUploader;
+
+	// The jobs decode a copy of the chunk, as the packs can be modified in the meantime.
+	std::shared_ptr<Chunk> CopyTextureChunk(const Chunk* texChunk)
 	{
-		uint8_t* pnt = firstbmp;
-		for (int m = 0; m < nmipmaps; m++)
-			pnt += *(uint32_t*)pnt + 4;
-		uint32_t npalentries = *(uint32_t*)pnt; pnt += 4;
-		if (npalentries > 256) npalentries = 256;
-		memcpy(pal, pnt, 4 * npalentries);
+		auto copy = std::make_shared<Chunk>(texChunk->tag);
+		copy->maindata = texChunk->maindata;
+		return copy;
 	}
 
-	GLuint gltex;
-	glGenTextures(1, &gltex);
-	glBindTexture(GL_TEXTURE_2D, gltex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (nmipmaps > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	texmap[texid] = (void*)(uintptr_t)gltex;
+	// PALN, RGBA or DXT1 chunk decoded to RGBA8
+	TextureDecodeJob MakeRGBA8DecodeJob(const Chunk* texChunk)
+	{
+		return [copy = CopyTextureChunk(texChunk)]() {
+			auto layout = TextureDecode::ParseLayout(copy.get());
+			std::vector<size_t> offsets;
+			size_t numPixels = 0;
+			for (int m = 0; m < (int)layout->levels.size(); m++) {
+				offsets.push_back(numPixels);
+				numPixels += TextureDecode::GetNumPixels(*layout, m);
+			}
+			auto pixels = std::make_shared<std::vector<uint32_t>>(numPixels);
+			DecodedTexture texture;
+			for (int m = 0; m < (int)layout->levels.size(); m++) {
+				const auto& level = layout->levels[m];
+				uint32_t* levelPixels = pixels->data() + offsets[m];
+				TextureDecode::DecodeLevelTo(copy.get(), *layout, m, levelPixels);
+				texture.levels.push_back({ level.width, level.height, levelPixels, (size_t)4 * level.width * level.height });
+			}
+			texture.storage = pixels;
+			texture.numBytes = numPixels * 4;
+			return texture;
+			};
+	}
 
-	uint8_t* bmp = firstbmp;
-	for (int m = 0; m < nmipmaps; m++)
+	// DXT1 chunk uploaded as is
+	TextureDecodeJob MakeDXT1UploadJob(const Chunk* dxtChunk)
 	{
-		uint32_t mmsize = *(uint32_t*)bmp; bmp += 4;
-		int mmWidth = std::max(texw >> m, 1);
-		int mmHeight = std::max(texh >> m, 1);
-		if (c->tag == 'PALN')
-		{
-			uint32_t* pix32 = new uint32_t[mmsize];
-			for (uint32_t p = 0; p < mmsize; p++)
-				pix32[p] = pal[bmp[p]];
-			glTexImage2D(GL_TEXTURE_2D, m, 4, mmWidth, mmHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pix32);
-			delete[] pix32;
-		}
-		else if (c->tag == 'RGBA')
-			glTexImage2D(GL_TEXTURE_2D, m, 4, mmWidth, mmHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, bmp);
-		else
-			ferr("Unknown texture format in Pack(Repeat).PAL.");
-		bmp += mmsize;
+		return [copy = CopyTextureChunk(dxtChunk)]() {
+			auto layout = TextureDecode::ParseLayout(copy.get());
+			DecodedTexture texture;
+			texture.format = DecodedTexture::Format::DXT1;
+			for (const auto& level : layout->levels) {
+				texture.levels.push_back({ level.width, level.height, copy->maindata.data() + level.offset, level.size });
+				texture.numBytes += level.size;
+			}
+			texture.storage = copy;
+			return texture;
+			};
+	}
+
+	TextureDecodeJob MakeTextureDecodeJob(uint32_t texId)
+	{
+		if (LightmapAtlas::IsAtlasId(texId))
+			return LightmapAtlas::MakeDecodeJob(texId);
+		auto [texChunk, dxtChunk] = FindTextureChunk(g_scene, texId);
+		if (!texChunk)
+			return {};
+		const bool hasDxt1 = dxtChunk && dxtChunk->tag == 'DXT1';
+		if (hasDxt1 && useCompressedTextures && IsCompressedUploadSupported())
+			return MakeDXT1UploadJob(dxtChunk);
+		if (texChunk->tag == 'PALN' || texChunk->tag == 'RGBA')
+			return MakeRGBA8DecodeJob(texChunk);
+		if (hasDxt1)
+			return MakeRGBA8DecodeJob(dxtChunk);
+		return {};
 	}
 }
 
-void GlifyAllTextures()
+TextureResidency& GetTextureResidency()
 {
-	for (Chunk& c : g_scene.palPack.subchunks)
-		GlifyTexture(&c);
-	for (Chunk& c : g_scene.lgtPack.subchunks)
-		GlifyTexture(&c);
+	static TextureResidency residency(g_glTextureUploader, MakeTextureDecodeJob, (size_t)256 << 20);
+	return residency;
+}
 
-	glBindTexture(GL_TEXTURE_2D, 0);
+void* GetTexture(uint32_t texid)
+{
+	return GetTextureResidency().get(texid);
+}
+
+void UpdateTextures()
+{
+	GetTextureResidency().update();
 }
 
 void InvalidateTexture(uint32_t texid)
 {
-	GLuint gltex = (GLuint)(uintptr_t)texmap.at(texid);
-	glDeleteTextures(1, &gltex);
-	GlifyTexture(FindTextureChunk(g_scene, texid).first);
+	// the name may have changed
+	g_scene.textureIndex.invalidate();
+	g_scene.textureIndex.forgetContent(texid);
+	if (Chunk* texChunk = FindTextureChunk(g_scene, texid).first)
+		TextureDecode::ForgetLayout(texChunk);
+	if (LightmapAtlas::Find(texid))
+		LightmapAtlas::Invalidate();
+	GetTextureResidency().invalidate(texid);
+}
+
+void UncacheTexture(uint32_t texid)
+{
+	g_scene.textureIndex.forgetContent(texid);
+	GetTextureResidency().invalidate(texid);
 }
 
 void UncacheAllTextures()
 {
-	for (auto& [id, vtex] : texmap) {
-		GLuint gltex = (GLuint)(uintptr_t)vtex;
-		glDeleteTextures(1, &gltex);
-	}
-	texmap.clear();
+	GetTextureResidency().clear();
+	TextureDecode::ClearLayoutCache();
+	LightmapAtlas::Invalidate();
 }
 
 std::tuple<uint32_t, Chunk*, Chunk*> AddUninitializedTexture(Scene& scene)
 {
 	uint32_t texId = ++scene.numTextures;
+	scene.textureIndex.invalidate();
+	// the ID can be one of textures removed by an undo, which may have been asked for since
+	if (&scene == &g_scene)
+		GetTextureResidency().invalidate(texId);
 	Chunk& chk = scene.palPack.subchunks.emplace_back();
 	Chunk& dxtchk = scene.dxtPack.subchunks.emplace_back();
 	return { texId, &chk, &dxtchk };
 }
 
+// Takes back the texture added last by AddUninitializedTexture
+static void RemoveUninitializedTexture(Scene& scene)
+{
+	scene.numTextures -= 1;
+	scene.palPack.subchunks.pop_back();
+	scene.dxtPack.subchunks.pop_back();
+}
+
 uint32_t AddTexture(Scene& scene, uint8_t* pixels, int width, int height, std::string_view name)
 {
 	auto [id, chk, dxtchk] = AddUninitializedTexture(scene);
@@ -113,22 +205,331 @@ uint32_t AddTexture(Scene& scene, uint8_t* pixels, int width, int height, std::s
 uint32_t AddTexture(Scene& scene, const std::filesystem::path& filepath)
 {
 	auto [id, chk, dxtchk] = AddUninitializedTexture(scene);
-	ImportTexture(filepath, *chk, *dxtchk, id);
+	if (!ImportTexture(filepath, *chk, *dxtchk, id)) {
+		RemoveUninitializedTexture(scene);
+		return 0;
+	}
 	return id;
 }
 
 uint32_t AddTexture(Scene& scene, const void* mem, size_t memSize, std::string_view name)
 {
 	auto [id, chk, dxtchk] = AddUninitializedTexture(scene);
-	ImportTexture(mem, memSize, name, *chk, *dxtchk, id);
+	if (!ImportTexture(mem, memSize, name, *chk, *dxtchk, id)) {
+		RemoveUninitializedTexture(scene);
+		return 0;
+	}
 	return id;
 }
 
+uint64_t HashTexturePixels(const uint8_t* pixels, int width, int height)
+{
+	const size_t numBytes = (size_t)4 * width * height;
+	uint64_t hash = 0x9E3779B97F4A7C15ull ^ (((uint64_t)width << 32) | (uint32_t)height);
+	auto mix = [&hash](uint64_t word) {
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
+	};
+	size_t i = 0;
+	for (; i + 8 <= numBytes; i += 8) {
+		uint64_t word;
+		memcpy(&word, pixels + i, 8);
+		mix(word);
+	}
+	if (i < numBytes) {
+		uint64_t word = 0;
+		memcpy(&word, pixels + i, numBytes - i);
+		mix(word);
+	}
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+void TextureIndex::forgetContent(uint32_t texId)
+{
+	decodedHashes.erase(texId);
+	for (auto* hashes : { &byContent, &bySource }) {
+		for (auto it = hashes->begin(); it != hashes->end();) {
+			if (it->second == texId)
+				it = hashes->erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+// Hashes the palPack textures that weren't decoded yet. The ones without levels are left out.
+static void HashSceneTextures(Scene& scene)
+{
+	std::vector<Chunk*> toHash;
+	for (Chunk& chk : scene.palPack.subchunks)
+		if (!scene.textureIndex.decodedHashes.count(*(uint32_t*)chk.maindata.data()))
+			toHash.push_back(&chk);
+	std::vector<std::optional<uint64_t>> hashes(toHash.size());
+	ThreadPool::global().parallelFor(toHash.size(), [&](size_t i) {
+		auto layout = TextureDecode::GetLayout(toHash[i]);
+		if (layout->levels.empty())
+			return;
+		const uint32_t* pixels = TextureDecode::DecodeLevel(toHash[i], *layout, 0);
+		hashes[i] = HashTexturePixels((const uint8_t*)pixels, layout->width, layout->height);
+		});
+	for (size_t i = 0; i < toHash.size(); i++) {
+		if (!hashes[i])
+			continue;
+		const uint32_t texId = *(uint32_t*)toHash[i]->maindata.data();
+		scene.textureIndex.decodedHashes[texId] = *hashes[i];
+		scene.textureIndex.byContent.try_emplace(*hashes[i], texId);
+	}
+}
+
+// The RGBA8 pixels of the first level, empty if the texture has no levels
+static std::vector<uint32_t> DecodeFirstLevel(const Chunk* texChunk, int& width, int& height)
+{
+	auto layout = TextureDecode::GetLayout(texChunk);
+	if (layout->levels.empty())
+		return {};
+	std::vector<uint32_t> pixels(TextureDecode::GetNumPixels(*layout, 0));
+	TextureDecode::DecodeLevelTo(texChunk, *layout, 0, pixels.data());
+	width = layout->width;
+	height = layout->height;
+	pixels.resize((size_t)width * height);
+	return pixels;
+}
+
+uint32_t FindTextureByContent(Scene& scene, const uint8_t* pixels, int width, int height)
+{
+	HashSceneTextures(scene);
+	auto it = scene.textureIndex.byContent.find(HashTexturePixels(pixels, width, height));
+	if (it == scene.textureIndex.byContent.end())
+		return 0;
+	// the texture must still exist, and have the same pixels, not only the same hash
+	Chunk* texChunk = FindTextureChunk(scene, it->second).first;
+	if (!texChunk)
+		return 0;
+	int texWidth = 0, texHeight = 0;
+	const std::vector<uint32_t> texPixels = DecodeFirstLevel(texChunk, texWidth, texHeight);
+	if (texPixels.empty() || texWidth != width || texHeight != height || memcmp(texPixels.data(), pixels, texPixels.size() * 4) != 0)
+		return 0;
+	return it->second;
+}
+
+uint32_t FindOrAddTexture(Scene& scene, uint8_t* pixels, int width, int height, std::string_view name)
+{
+	if (uint32_t texId = FindTextureByContent(scene, pixels, width, height))
+		return texId;
+	// a quantized texture differs from its image, so it is found by the image's hash, then checked by its name and size
+	const uint64_t sourceHash = HashTexturePixels(pixels, width, height);
+	auto it = scene.textureIndex.bySource.find(sourceHash);
+	if (it != scene.textureIndex.bySource.end()) {
+		Chunk* texChunk = FindTextureChunk(scene, it->second).first;
+		const TexInfo* ti = texChunk ? (const TexInfo*)texChunk->maindata.data() : nullptr;
+		if (ti && ti->width == width && ti->height == height && name == ti->getName())
+			return it->second;
+	}
+	uint32_t texId = AddTexture(scene, pixels, width, height, name);
+	scene.textureIndex.bySource[sourceHash] = texId;
+	return texId;
+}
+
+uint32_t FindOrAddTexture(Scene& scene, const std::filesystem::path& filepath)
+{
+	int width, height, channels;
+	uint8_t* pixels = stbi_load(filepath.string().c_str(), &width, &height, &channels, 4);
+	if (!pixels)
+		return 0;
+	uint32_t texId = FindOrAddTexture(scene, pixels, width, height, filepath.stem().string());
+	stbi_image_free(pixels);
+	return texId;
+}
+
+uint32_t FindOrAddTexture(Scene& scene, const void* mem, size_t memSize, std::string_view name)
+{
+	int width, height, channels;
+	uint8_t* pixels = stbi_load_from_memory((const uint8_t*)mem, (int)memSize, &width, &height, &channels, 4);
+	if (!pixels)
+		return 0;
+	uint32_t texId = FindOrAddTexture(scene, pixels, width, height, name);
+	stbi_image_free(pixels);
+	return texId;
+}
+
+std::vector<std::vector<uint32_t>> FindDuplicateTextures(Scene& scene)
+{
+	HashSceneTextures(scene);
+	std::map<uint64_t, std::vector<Chunk*>> groups;
+	for (Chunk& chk : scene.palPack.subchunks) {
+		const uint32_t texId = *(uint32_t*)chk.maindata.data();
+		auto it = scene.textureIndex.decodedHashes.find(texId);
+		if (it != scene.textureIndex.decodedHashes.end())
+			groups[it->second].push_back(&chk);
+	}
+	// the textures with the same hash are compared, so a collision can't group different textures
+	std::vector<std::vector<uint32_t>> duplicates;
+	for (auto& [hash, chunks] : groups) {
+		if (chunks.size() < 2)
+			continue;
+		struct Content {
+			std::vector<uint32_t> pixels;
+			int width, height;
+			std::vector<uint32_t> texIds;
+		};
+		std::vector<Content> contents;
+		for (Chunk* chk : chunks) {
+			int width = 0, height = 0;
+			std::vector<uint32_t> pixels = DecodeFirstLevel(chk, width, height);
+			auto same = std::find_if(contents.begin(), contents.end(), [&](const Content& content) {
+				return content.width == width && content.height == height && content.pixels == pixels;
+				});
+			if (same == contents.end())
+				same = contents.insert(contents.end(), { std::move(pixels), width, height, {} });
+			same->texIds.push_back(*(uint32_t*)chk->maindata.data());
+		}
+		for (Content& content : contents) {
+			if (content.texIds.size() >= 2) {
+				std::sort(content.texIds.begin(), content.texIds.end());
+				duplicates.push_back(std::move(content.texIds));
+			}
+		}
+	}
+	std::sort(duplicates.begin(), duplicates.end());
+	return duplicates;
+}
+
+void CompressDXT1(const uint8_t* pixels, int width, int height, uint8_t* output)
+{
+	// DXT1 blocks are stored row by row, so bands of block rows can be compressed independently
+	constexpr int minBlockRowsPerBand = 8;
+	const int numBlockRows = (height + 3) / 4;
+	const size_t blockRowSize = (size_t)((width + 3) / 4) * 8;
+	const int numBands = std::min<int>(numBlockRows / minBlockRowsPerBand, 4 * ThreadPool::global().getNumThreads());
+	if (numBands <= 1) {
+		squish::CompressImage(pixels, width, height, output, squish::kDxt1);
+		return;
+	}
+	ThreadPool::global().parallelFor(numBands, [&](size_t band) {
+		const int firstRow = (int)(band * numBlockRows / numBands);
+		const int endRow = (int)((band + 1) * numBlockRows / numBands);
+		const int bandHeight = std::min(4 * endRow, height) - 4 * firstRow;
+		squish::CompressImage(pixels + (size_t)4 * width * 4 * firstRow, width, bandHeight, output + blockRowSize * firstRow, squish::kDxt1);
+		});
+}
+
+namespace {
+	// The linear values are stored on 14 bits, so that the sum of 4 of them fits in 16 bits.
+	constexpr int linearBits = 14;
+	constexpr int linearMax = (1 << linearBits) - 1;
+
+	struct GammaTables {
+		uint16_t srgbToLinear[256];
+		uint16_t alphaToLinear[256];
+		uint8_t linearToSrgb[linearMax + 1];
+		uint8_t linearToAlpha[linearMax + 1];
+		GammaTables() {
+			for (int i = 0; i < 256; i++) {
+				double s = i / 255.0;
+				double l = (s <= 0.04045) ? s / 12.92 : std::pow((s + 0.055) / 1.055, 2.4);
+				srgbToLinear[i] = (uint16_t)std::lround(l * linearMax);
+				alphaToLinear[i] = (uint16_t)std::lround(s * linearMax);
+			}
+			for (int i = 0; i <= linearMax; i++) {
+				double l = (double)i / linearMax;
+				double s = (l <= 0.0031308) ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+				linearToSrgb[i] = (uint8_t)std::lround(s * 255.0);
+				linearToAlpha[i] = (uint8_t)std::lround(l * 255.0);
+			}
+		}
+	};
+	const GammaTables& GetGammaTables() {
+		static const GammaTables tables;
+		return tables;
+	}
+
+	int GetNumMipmaps(int width, int height) {
+		int numMipmaps = 1;
+		while ((width >> numMipmaps) > 0 || (height >> numMipmaps) > 0)
+			numMipmaps++;
+		return numMipmaps;
+	}
+
+	// 2x2 box filter, dropping the last row/column of odd sizes like the GL mipmap sizes do
+	void DownsampleLinear(const uint16_t* src, int srcWidth, int srcHeight, uint16_t* dst)
+	{
+		const int dstWidth = std::max(srcWidth >> 1, 1);
+		const int dstHeight = std::max(srcHeight >> 1, 1);
+		const int dx = (srcWidth > 1) ? 4 : 0;
+		const __m128i two = _mm_set1_epi16(2);
+		for (int y = 0; y < dstHeight; y++) {
+			const uint16_t* row0 = src + (size_t)4 * srcWidth * std::min(2 * y, srcHeight - 1);
+			const uint16_t* row1 = src + (size_t)4 * srcWidth * std::min(2 * y + 1, srcHeight - 1);
+			uint16_t* out = dst + (size_t)4 * dstWidth * y;
+			int x = 0;
+			if (srcWidth > 1) {
+				// 2 destination pixels from 4 source pixels of both rows
+				for (; x + 2 <= dstWidth; x += 2) {
+					__m128i a = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(row0 + 8 * x)), _mm_loadu_si128((const __m128i*)(row1 + 8 * x)));
+					__m128i b = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(row0 + 8 * x + 8)), _mm_loadu_si128((const __m128i*)(row1 + 8 * x + 8)));
+					__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+					_mm_storeu_si128((__m128i*)(out + 4 * x), _mm_srli_epi16(_mm_add_epi16(sum, two), 2));
+				}
+			}
+			for (; x < dstWidth; x++) {
+				const uint16_t* p0 = row0 + 8 * x;
+				const uint16_t* p1 = row1 + 8 * x;
+				for (int c = 0; c < 4; c++)
+					out[4 * x + c] = (uint16_t)((p0[c] + p0[c + dx] + p1[c] + p1[c + dx] + 2) >> 2);
+			}
+		}
+	}
+
+	// Levels 1 and above of the mipmap chain of an RGBA8 image, filtered in linear space
+	std::vector<std::vector<uint8_t>> GenerateMipmaps(const uint8_t* pixels, int width, int height)
+	{
+		const GammaTables& tables = GetGammaTables();
+		const int numMipmaps = GetNumMipmaps(width, height);
+		std::vector<std::vector<uint8_t>> levels(numMipmaps - 1);
+		if (numMipmaps <= 1)
+			return levels;
+
+		const size_t numValues = (size_t)4 * width * height;
+		// level 1 is the largest, and of a single row or column of pixels when the image is 1 pixel thin
+		const size_t numNextValues = (size_t)4 * std::max(width >> 1, 1) * std::max(height >> 1, 1);
+		std::vector<uint16_t> linear(numValues), nextLinear(numNextValues);
+		for (size_t i = 0; i < numValues; i += 4) {
+			linear[i] = tables.srgbToLinear[pixels[i]];
+			linear[i + 1] = tables.srgbToLinear[pixels[i + 1]];
+			linear[i + 2] = tables.srgbToLinear[pixels[i + 2]];
+			linear[i + 3] = tables.alphaToLinear[pixels[i + 3]];
+		}
+		int levelWidth = width, levelHeight = height;
+		for (auto& level : levels) {
+			DownsampleLinear(linear.data(), levelWidth, levelHeight, nextLinear.data());
+			levelWidth = std::max(levelWidth >> 1, 1);
+			levelHeight = std::max(levelHeight >> 1, 1);
+			const size_t levelValues = (size_t)4 * levelWidth * levelHeight;
+			level.resize(levelValues);
+			for (size_t i = 0; i < levelValues; i += 4) {
+				level[i] = tables.linearToSrgb[nextLinear[i]];
+				level[i + 1] = tables.linearToSrgb[nextLinear[i + 1]];
+				level[i + 2] = tables.linearToSrgb[nextLinear[i + 2]];
+				level[i + 3] = tables.linearToAlpha[nextLinear[i + 3]];
+			}
+			std::swap(linear, nextLinear);
+		}
+		return levels;
+	}
+}
+
 void ImportTexture(uint8_t* pixels, int width, int height, std::string_view name, Chunk& chk, Chunk& dxtchk, int texid)
 {
-	int numMipmaps = 1;
+	const std::vector<std::vector<uint8_t>> mipmaps = GenerateMipmaps(pixels, width, height);
+	int numMipmaps = (int)mipmaps.size() + 1;
 	int flags = 0x14;
 	int random = 0x12345678;
+	auto levelPixels = [&](int m) { return (m == 0) ? pixels : mipmaps[m - 1].data(); };
+	auto levelWidth = [&](int m) { return std::max(width >> m, 1); };
+	auto levelHeight = [&](int m) { return std::max(height >> m, 1); };
 
 	ByteWriter<std::vector<uint8_t>> chkdata, dxtdata;
 	chkdata.addU32(texid);
@@ -140,21 +541,56 @@ void ImportTexture(uint8_t* pixels, int width, int height, std::string_view name
 	chkdata.addStringNT(name);
 	dxtdata = chkdata;
 
-	int size = width * height * 4;
-	chkdata.addS32(size);
-	chkdata.addData(pixels, size);
+	if (quantizeImportedTextures) {
+		// one palette for all levels, after the levels' indices
+		const auto palette = TexturePalette::MakePalette((const uint32_t*)pixels, (size_t)width * height);
+		for (int m = 0; m < numMipmaps; m++) {
+			int size = levelWidth(m) * levelHeight(m);
+			chkdata.addS32(size);
+			uint8_t* indices = chkdata.addEmpty(size);
+			TexturePalette::MapToPalette((const uint32_t*)levelPixels(m), levelWidth(m), levelHeight(m), palette, ditherImportedTextures, indices);
+			if (m == 0) {
+				const double psnr = TexturePalette::ComputePSNR((const uint32_t*)pixels, indices, size, palette);
+				size_t rgbaSize = 0;
+				for (int l = 0; l < numMipmaps; l++)
+					rgbaSize += 4 + (size_t)levelWidth(l) * levelHeight(l) * 4;
+				size_t palnSize = 0;
+				for (int l = 0; l < numMipmaps; l++)
+					palnSize += 4 + (size_t)levelWidth(l) * levelHeight(l);
+				palnSize += 4 + 4 * palette.size();
+				printf("Quantized %.*s: %zu colors, PSNR %.2f dB, %zu bytes instead of %zu\n", (int)name.size(), name.data(),
+					palette.size(), psnr, palnSize, rgbaSize);
+			}
+		}
+		chkdata.addU32((uint32_t)palette.size());
+		chkdata.addData(palette.data(), 4 * palette.size());
+		chk.tag = 'PALN';
+	}
+	else {
+		for (int m = 0; m < numMipmaps; m++) {
+			int size = levelWidth(m) * levelHeight(m) * 4;
+			chkdata.addS32(size);
+			chkdata.addData(levelPixels(m), size);
+		}
+		chk.tag = 'RGBA';
+	}
 
 	// 1 COPY >_<
-	chk.tag = 'RGBA';
 	auto str = chkdata.take();
 	chk.maindata.resize(str.size());
 	memcpy(chk.maindata.data(), str.data(), str.size());
 
-	// DXT
-	size = squish::GetStorageRequirements(width, height, squish::kDxt1);
-	dxtdata.addS32(size);
-	uint8_t* comp = dxtdata.addEmpty(size);
-	squish::CompressImage(pixels, width, height, comp, squish::kDxt1);
+	// DXT, with all levels compressed in parallel once the whole chunk is allocated
+	std::vector<size_t> dxtOffsets(numMipmaps);
+	for (int m = 0; m < numMipmaps; m++) {
+		int size = squish::GetStorageRequirements(levelWidth(m), levelHeight(m), squish::kDxt1);
+		dxtdata.addS32(size);
+		dxtOffsets[m] = dxtdata.size();
+		dxtdata.addEmpty(size);
+	}
+	ThreadPool::global().parallelFor(numMipmaps, [&](size_t m) {
+		CompressDXT1(levelPixels((int)m), levelWidth((int)m), levelHeight((int)m), dxtdata.getPointer(dxtOffsets[m]));
+		});
 
 	// 1 COPY >_<
 	dxtchk.tag = 'DXT1';
@@ -163,53 +599,84 @@ void ImportTexture(uint8_t* pixels, int width, int height, std::string_view name
 	memcpy(dxtchk.maindata.data(), str.data(), str.size());
 }
 
-void ImportTexture(const std::filesystem::path& filepath, Chunk& chk, Chunk& dxtchk, int texid)
+bool ImportTexture(const std::filesystem::path& filepath, Chunk& chk, Chunk& dxtchk, int texid)
 {
 	int width, height, channels;
 	uint8_t* pixels = stbi_load(filepath.string().c_str(), &width, &height, &channels, 4);
+	if (!pixels)
+		return false;
 	std::string name = filepath.stem().string();
 	ImportTexture(pixels, width, height, name, chk, dxtchk, texid);
 	stbi_image_free(pixels);
+	return true;
 }
 
-void ImportTexture(const void* mem, size_t memSize, std::string_view name, Chunk& chk, Chunk& dxtchk, int texid)
+std::vector<uint32_t> AddTextures(Scene& scene, const std::vector<std::filesystem::path>& filepaths)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	struct Imported {
+		Chunk chk, dxtchk;
+		bool success = false;
+	};
+	std::vector<Imported> imported(filepaths.size());
+	std::atomic<size_t> numPixels = 0;
+	ThreadPool::global().parallelFor(filepaths.size(), [&](size_t i) {
+		int width, height, channels;
+		uint8_t* pixels = stbi_load(filepaths[i].string().c_str(), &width, &height, &channels, 4);
+		if (!pixels)
+			return;
+		// the ID is only known once all the files are decoded
+		ImportTexture(pixels, width, height, filepaths[i].stem().string(), imported[i].chk, imported[i].dxtchk, 0);
+		stbi_image_free(pixels);
+		numPixels += (size_t)width * height;
+		imported[i].success = true;
+		});
+
+	// IDs are given in the order of the files, skipping the ones that couldn't be read
+	std::vector<uint32_t> texIds;
+	scene.palPack.subchunks.reserve(scene.palPack.subchunks.size() + filepaths.size());
+	scene.dxtPack.subchunks.reserve(scene.dxtPack.subchunks.size() + filepaths.size());
+	for (size_t i = 0; i < filepaths.size(); ++i) {
+		Imported& tex = imported[i];
+		if (!tex.success) {
+			printf("Couldn't read the image %s\n", filepaths[i].u8string().c_str());
+			continue;
+		}
+		auto [id, chk, dxtchk] = AddUninitializedTexture(scene);
+		for (auto [dst, src] : { std::make_pair(chk, &tex.chk), std::make_pair(dxtchk, &tex.dxtchk) }) {
+			dst->tag = src->tag;
+			dst->maindata = std::move(src->maindata);
+			*(uint32_t*)dst->maindata.data() = id;
+		}
+		texIds.push_back(id);
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	printf("Imported %zu textures (%.1f megapixels) in %.3f s: %.1f textures/s\n", texIds.size(), (double)numPixels / 1e6, seconds,
+		(double)texIds.size() / std::max(seconds, 1e-9));
+	return texIds;
+}
+
+bool ImportTexture(const void* mem, size_t memSize, std::string_view name, Chunk& chk, Chunk& dxtchk, int texid)
 {
 	int width, height, channels;
 	uint8_t* pixels = stbi_load_from_memory((const uint8_t*)mem, memSize, &width, &height, &channels, 4);
+	if (!pixels)
+		return false;
 	ImportTexture(pixels, width, height, name, chk, dxtchk, texid);
 	stbi_image_free(pixels);
+	return true;
 }
 
 DynArray<uint32_t> ConvertTextureToRGBA8(Chunk* texChunk) {
-	const TexInfo* ti = (const TexInfo*)texChunk->maindata.data();
-	uint8_t* firstbmp = texChunk->maindata.data() + 20;
-	while (*(firstbmp++)); // skip name
-
-	if (texChunk->tag == 'PALN')
-	{
-		uint32_t pal[256];
-		uint8_t* pnt = firstbmp;
-		for (int m = 0; m < (int)ti->numMipmaps; m++)
-			pnt += *(uint32_t*)pnt + 4;
-		uint32_t npalentries = *(uint32_t*)pnt; pnt += 4;
-		if (npalentries > 256) npalentries = 256;
-		memcpy(pal, pnt, 4 * npalentries);
-
-		pnt = firstbmp;
-		uint32_t mmsize = *(uint32_t*)pnt; pnt += 4;
-		auto pix32 = DynArray<uint32_t>(mmsize);
-		for (uint32_t p = 0; p < mmsize; p++)
-			pix32[p] = pal[pnt[p]];
-		return pix32;
-	}
-	else if (texChunk->tag == 'RGBA') {
-		uint8_t* pnt = firstbmp;
-		uint32_t mmsize = *(uint32_t*)pnt; pnt += 4;
-		auto pix32 = DynArray<uint32_t>(mmsize/4);
-		memcpy(pix32.data(), pnt, mmsize);
-		return pix32;
-	}
-	return {};
+	if (texChunk->tag != 'PALN' && texChunk->tag != 'RGBA' && texChunk->tag != 'DXT1')
+		return {};
+	auto layout = TextureDecode::GetLayout(texChunk);
+	if (layout->levels.empty())
+		return {};
+	auto pix32 = DynArray<uint32_t>(TextureDecode::GetNumPixels(*layout, 0));
+	TextureDecode::DecodeLevelTo(texChunk, *layout, 0, pix32.data());
+	return pix32;
 }
 
 void ExportTexture(Chunk* texChunk, const std::filesystem::path& filepath)
@@ -234,7 +701,31 @@ std::vector<uint8_t> ExportTextureToPNGInMemory(Chunk* texChunk)
 	return byteWriter.take();
 }
 
-std::pair<Chunk*, Chunk*> FindTextureChunk(Scene& scene, uint32_t id)
+bool TextureIndex::isUpToDate(const Scene& scene) const
+{
+	return valid && numPal == scene.palPack.subchunks.size() && numLgt == scene.lgtPack.subchunks.size();
+}
+
+void TextureIndex::rebuild(const Scene& scene)
+{
+	byId.clear();
+	byName.clear();
+	// the first texture with an ID or name is kept, like the scans did
+	const auto& palChunks = scene.palPack.subchunks;
+	for (size_t i = 0; i < palChunks.size(); ++i) {
+		const TexInfo* ti = (const TexInfo*)palChunks[i].maindata.data();
+		byId.try_emplace(ti->id, Entry{ (uint32_t)i, false });
+		byName.try_emplace(ti->getName(), (uint32_t)i);
+	}
+	const auto& lgtChunks = scene.lgtPack.subchunks;
+	for (size_t i = 0; i < lgtChunks.size(); ++i)
+		byId.try_emplace(*(const uint32_t*)lgtChunks[i].maindata.data(), Entry{ (uint32_t)i, true });
+	numPal = palChunks.size();
+	numLgt = lgtChunks.size();
+	valid = true;
+}
+
+static std::pair<Chunk*, Chunk*> ScanTextureChunk(Scene& scene, uint32_t id)
 {
 	for (Chunk& chk : scene.palPack.subchunks) {
 		uint32_t chkid = *(uint32_t*)chk.maindata.data();
@@ -253,7 +744,7 @@ std::pair<Chunk*, Chunk*> FindTextureChunk(Scene& scene, uint32_t id)
 	return { nullptr, nullptr };
 }
 
-std::pair<Chunk*, Chunk*> FindTextureChunkByName(Scene& scene, std::string_view name)
+static std::pair<Chunk*, Chunk*> ScanTextureChunkByName(Scene& scene, std::string_view name)
 {
 	for (Chunk& chk : scene.palPack.subchunks) {
 		const TexInfo* ti = (const TexInfo*)chk.maindata.data();
@@ -265,37 +756,132 @@ std::pair<Chunk*, Chunk*> FindTextureChunkByName(Scene& scene, std::string_view
 	return { nullptr, nullptr };
 }
 
+std::pair<Chunk*, Chunk*> FindTextureChunk(Scene& scene, uint32_t id)
+{
+	TextureIndex& index = scene.textureIndex;
+	if (!index.enabled)
+		return ScanTextureChunk(scene, id);
+	// a second try after rebuilding the index if the position was outdated
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		if (!index.isUpToDate(scene))
+			index.rebuild(scene);
+		auto it = index.byId.find(id);
+		if (it == index.byId.end())
+			return { nullptr, nullptr };
+		const auto [position, lightmap] = it->second;
+		auto& chunks = lightmap ? scene.lgtPack.subchunks : scene.palPack.subchunks;
+		if (position < chunks.size() && *(uint32_t*)chunks[position].maindata.data() == id) {
+			if (lightmap)
+				return { &chunks[position], nullptr };
+			assert(*(uint32_t*)scene.dxtPack.subchunks[position].maindata.data() == id);
+			return { &chunks[position], &scene.dxtPack.subchunks[position] };
+		}
+		index.invalidate();
+	}
+	return { nullptr, nullptr };
+}
+
+std::pair<Chunk*, Chunk*> FindTextureChunkByName(Scene& scene, std::string_view name)
+{
+	TextureIndex& index = scene.textureIndex;
+	if (!index.enabled)
+		return ScanTextureChunkByName(scene, name);
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		if (!index.isUpToDate(scene))
+			index.rebuild(scene);
+		auto it = index.byName.find(std::string(name));
+		if (it == index.byName.end())
+			return { nullptr, nullptr };
+		const uint32_t position = it->second;
+		auto& chunks = scene.palPack.subchunks;
+		if (position < chunks.size() && name == ((const TexInfo*)chunks[position].maindata.data())->getName())
+			return { &chunks[position], &scene.dxtPack.subchunks[position] };
+		index.invalidate();
+	}
+	return { nullptr, nullptr };
+}
+
 bool IsTextureUsingTransparency(const Chunk* texChunk)
 {
-	const TexInfo* ti = (const TexInfo*)texChunk->maindata.data();
-	const uint8_t* firstbmp = texChunk->maindata.data() + 20;
-	while (*(firstbmp++)); // skip name
+	return TextureDecode::UsesTransparency(texChunk, *TextureDecode::GetLayout(texChunk));
+}
 
-	if (texChunk->tag == 'PALN')
-	{
-		uint32_t pal[256];
-		const uint8_t* pnt = firstbmp;
-		for (int m = 0; m < (int)ti->numMipmaps; m++)
-			pnt += *(const uint32_t*)pnt + 4;
-		uint32_t npalentries = *(const uint32_t*)pnt; pnt += 4;
-		if (npalentries > 256)
-			npalentries = 256;
-		memcpy(pal, pnt, 4 * npalentries);
-
-		pnt = firstbmp;
-		const uint32_t mmsize = *(const uint32_t*)pnt; pnt += 4;
-		for (uint32_t p = 0; p < mmsize; p++)
-			if ((pal[pnt[p]] & 0xFF000000) != 0xFF000000)
-				return true;
+void PrintTextureImportBenchmark()
+{
+	printf("Texture import benchmark (%u threads):\n", ThreadPool::global().getNumThreads());
+	for (int size : { 256, 512, 1024, 2048 }) {
+		std::vector<uint8_t> pixels((size_t)4 * size * size);
+		uint32_t rng = 47;
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				uint8_t* p = &pixels[((size_t)y * size + x) * 4];
+				rng = rng * 1664525 + 1013904223;
+				p[0] = (uint8_t)(x * 255 / size);
+				p[1] = (uint8_t)(y * 255 / size);
+				p[2] = (uint8_t)(((((x / 16) ^ (y / 16)) & 1) ? 224 : 32) + (rng >> 29));
+				p[3] = 255;
+			}
+		}
+		const double megapixels = (double)size * size / 1e6;
+		const int repetitions = std::max(1, 2048 / size);
+
+		auto startTime = std::chrono::steady_clock::now();
+		for (int r = 0; r < repetitions; r++)
+			GenerateMipmaps(pixels.data(), size, size);
+		double mipSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() / repetitions;
+
+		Chunk chk, dxtchk;
+		startTime = std::chrono::steady_clock::now();
+		for (int r = 0; r < repetitions; r++)
+			ImportTexture(pixels.data(), size, size, "Benchmark", chk, dxtchk, 0);
+		double importSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() / repetitions;
+
+		printf("  %4d x %-4d %2d levels, mipmaps %7.2f ms/MP, full import %7.2f ms/MP, %zu + %zu bytes\n", size, size,
+			GetNumMipmaps(size, size), mipSeconds * 1000.0 / megapixels, importSeconds * 1000.0 / megapixels,
+			chk.maindata.size(), dxtchk.maindata.size());
 	}
-	else if (texChunk->tag == 'RGBA') {
-		const uint8_t* pnt = firstbmp;
-		const uint32_t mmsize = *(const uint32_t*)pnt; pnt += 4;
-		const uint32_t* pixels = reinterpret_cast<const uint32_t*>(pnt);
-		for (size_t i = 0; i < mmsize / 4; ++i) {
-			if ((pixels[i] & 0xFF000000) != 0xFF000000)
-				return true;
+}
+
+void PrintTextureUploadBenchmark()
+{
+	struct Mode {
+		const char* name;
+		std::function<TextureDecodeJob(Chunk* texChunk, Chunk* dxtChunk)> makeJob;
+	};
+	std::vector<Mode> modes = {
+		{ "PAL/RGBA to RGBA8", [](Chunk* texChunk, Chunk* dxtChunk) { return MakeRGBA8DecodeJob(texChunk); } },
+		{ "DXT1 to RGBA8 (CPU)", [](Chunk* texChunk, Chunk* dxtChunk) { return MakeRGBA8DecodeJob(dxtChunk); } },
+	};
+	if (IsCompressedUploadSupported())
+		modes.push_back({ "DXT1 compressed", [](Chunk* texChunk, Chunk* dxtChunk) { return MakeDXT1UploadJob(dxtChunk); } });
+	else
+		printf("Compressed texture upload not supported by the driver\n");
+
+	printf("Texture upload benchmark: %zu textures\n", g_scene.palPack.subchunks.size());
+	for (const Mode& mode : modes) {
+		std::vector<void*> handles;
+		size_t numBytes = 0;
+		double decodeSeconds = 0.0, uploadSeconds = 0.0;
+		for (size_t i = 0; i < g_scene.palPack.subchunks.size(); ++i) {
+			Chunk* texChunk = &g_scene.palPack.subchunks[i];
+			// the DXT pack can have fewer textures, or in another order
+			Chunk* dxtChunk = FindTextureChunk(g_scene, *(uint32_t*)texChunk->maindata.data()).second;
+			if (!dxtChunk || dxtChunk->tag != 'DXT1' || (texChunk->tag != 'PALN' && texChunk->tag != 'RGBA'))
+				continue;
+			auto startTime = std::chrono::steady_clock::now();
+			DecodedTexture texture = mode.makeJob(texChunk, dxtChunk)();
+			if (texture.levels.empty())
+				continue;
+			auto decodedTime = std::chrono::steady_clock::now();
+			handles.push_back(g_glTextureUploader.upload(texture));
+			glFinish();
+			uploadSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - decodedTime).count();
+			decodeSeconds += std::chrono::duration<double>(decodedTime - startTime).count();
+			numBytes += texture.numBytes;
 		}
+		for (void* handle : handles)
+			g_glTextureUploader.release(handle);
+		printf("  %-20s %4zu textures, decode %8.2f ms, upload %8.2f ms, %8.2f MiB\n", mode.name, handles.size(),
+			decodeSeconds * 1000.0, uploadSeconds * 1000.0, (double)numBytes / 1048576.0);
 	}
-	return false;
 }
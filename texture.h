@@ -2,8 +2,9 @@
 
 #include <cstdint>
 #include <filesystem>
-#include <map>
+#include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 struct Chunk;
@@ -20,18 +21,78 @@ struct TexInfo {
 	const char* getName() const { return name; }
 };
 
-extern std::map<uint32_t, void*> texmap;
+// Positions of the scene's textures in the packs, by ID and by name (palPack only).
+// Rebuilt on the next lookup once invalidated, when the packs' sizes changed,
+// or when the chunk at the indexed position doesn't have the ID anymore.
+struct TextureIndex {
+	struct Entry {
+		uint32_t position;
+		bool lightmap;
+	};
+	std::unordered_map<uint32_t, Entry> byId;
+	std::unordered_map<std::string, uint32_t> byName;
+	size_t numPal = 0, numLgt = 0;
+	bool valid = false;
+	// The lookups scan the packs when disabled (to compare in benchmarks)
+	bool enabled = true;
 
-void GlifyTexture(Chunk* c);
-void GlifyAllTextures();
+	// Content hashes (see HashTexturePixels) of the palPack textures decoded so far, kept when the
+	// positions are invalidated. The textures without levels have none.
+	std::unordered_map<uint32_t, uint64_t> decodedHashes;
+	std::unordered_map<uint64_t, uint32_t> byContent;
+	// Hashes of the images the textures were imported from, which differ from the decoded ones once quantized
+	std::unordered_map<uint64_t, uint32_t> bySource;
+
+	void invalidate() { valid = false; }
+	// To call when the pixels of the texture changed or it was removed.
+	void forgetContent(uint32_t texId);
+	bool isUpToDate(const Scene& scene) const;
+	void rebuild(const Scene& scene);
+};
+
+struct TextureResidency;
+
+// Upload the DXT1 version of the textures when the driver supports it, instead of RGBA8.
+extern bool useCompressedTextures;
+// Import the textures as 8-bit PALN chunks instead of RGBA, optionally with dithering.
+extern bool quantizeImportedTextures, ditherImportedTextures;
+
+// GL textures of g_scene, uploaded on first use and released when unused for a while (see TextureResidency).
+TextureResidency& GetTextureResidency();
+// Returns the GL texture, or null while it is loading or if it doesn't exist.
+void* GetTexture(uint32_t texid);
+// To call once per frame, uploads the textures decoded since the last frame.
+void UpdateTextures();
 void InvalidateTexture(uint32_t texid);
+void UncacheTexture(uint32_t texid);
 void UncacheAllTextures();
 uint32_t AddTexture(Scene& scene, uint8_t* pixels, int width, int height, std::string_view name);
+// 0 if the image couldn't be read
 uint32_t AddTexture(Scene& scene, const std::filesystem::path& filepath);
 uint32_t AddTexture(Scene& scene, const void* mem, size_t memSize, std::string_view name);
+// Decodes and compresses the images on all threads, and returns the IDs of the added textures (in the order of the files).
+std::vector<uint32_t> AddTextures(Scene& scene, const std::vector<std::filesystem::path>& filepaths);
+// Hash of the dimensions and RGBA8 pixels of an image
+uint64_t HashTexturePixels(const uint8_t* pixels, int width, int height);
+// Returns the ID of a palPack texture whose first level has the same pixels, 0 if there is none.
+uint32_t FindTextureByContent(Scene& scene, const uint8_t* pixels, int width, int height);
+// Same as AddTexture, but return the ID of an identical texture, or of the texture imported from the same image
+// with the same name, if there is one. 0 if the image couldn't be read.
+uint32_t FindOrAddTexture(Scene& scene, uint8_t* pixels, int width, int height, std::string_view name);
+uint32_t FindOrAddTexture(Scene& scene, const std::filesystem::path& filepath);
+uint32_t FindOrAddTexture(Scene& scene, const void* mem, size_t memSize, std::string_view name);
+// IDs of the palPack textures with identical first levels, grouped, in increasing order.
+std::vector<std::vector<uint32_t>> FindDuplicateTextures(Scene& scene);
 void ImportTexture(uint8_t* pixels, int width, int height, std::string_view name, Chunk& chk, Chunk& dxtchk, int texid);
-void ImportTexture(const std::filesystem::path& filepath, Chunk& chk, Chunk& dxtchk, int texid);
-void ImportTexture(const void* mem, size_t memSize, std::string_view name, Chunk& chk, Chunk& dxtchk, int texid);
+// false if the image couldn't be read, leaving the chunks unchanged
+bool ImportTexture(const std::filesystem::path& filepath, Chunk& chk, Chunk& dxtchk, int texid);
+bool ImportTexture(const void* mem, size_t memSize, std::string_view name, Chunk& chk, Chunk& dxtchk, int texid);
+// DXT1 compression of an RGBA8 image, split in bands of block rows compressed in parallel.
+void CompressDXT1(const uint8_t* pixels, int width, int height, uint8_t* output);
+// Prints the cost per megapixel of the mipmap generation and of the whole import for several image sizes.
+void PrintTextureImportBenchmark();
+// Prints the time and GPU memory taken to upload all the palPack's textures, with and without DXT1 compression.
+void PrintTextureUploadBenchmark();
 void ExportTexture(Chunk* texChunk, const std::filesystem::path& filepath);
 std::vector<uint8_t> ExportTextureToPNGInMemory(Chunk* texChunk);
 std::pair<Chunk*, Chunk*> FindTextureChunk(Scene& scene, uint32_t id);
@@ -3,7 +3,18 @@
 // Licensed under the GPL3+.
 // See LICENSE file for more details.
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <unordered_map>
 
 #include "video.h"
 #include "global.h"
@@ -11,6 +22,11 @@
 #include "window.h"
 #include "gameobj.h"
 #include "chunk.h"
+#include "LightmapAtlas.h"
+#include "MeshOptimizer.h"
+#include "ThreadPool.h"
+#include "ViewCulling.h"
+#include "Picking.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -27,6 +43,12 @@ bool rendertextures = true;
 bool renderColorTextures = true, renderLightmaps = true;
 bool enableAlphaTest = true;
 bool renderUntexturedFaces = false;
+bool useLightmapAtlas = true;
+bool optimizeMeshes = true;
+bool prepareMeshesInBackground = true;
+bool useStaticBatching = false;
+bool useVertexBuffers = true;
+MeshDrawStats g_meshDrawStats;
 
 void InitVideo()
 {
@@ -71,12 +93,9 @@ void EndDrawing()
 
 std::map<const Mesh*, std::vector<Vector3>> g_skinnedMeshMap;
 
-float* ApplySkinToMesh(const Mesh* mesh, Chunk* excChunk)
+// Writes the vertices of the mesh transformed by its bones to workBuffer, doesn't use any global state
+static void SkinVertices(const Mesh* mesh, Chunk* excChunk, std::vector<Vector3>& workBuffer)
 {
-	auto [it,inserted] = g_skinnedMeshMap.try_emplace(mesh);
-	if (!inserted)
-		return (float*)it->second.data();
-
 #pragma pack(push, 1)
 	struct BonePre {
 		uint16_t parentIndex, flags;
@@ -126,7 +145,6 @@ float* ApplySkinToMesh(const Mesh* mesh, Chunk* excChunk)
 		}
 
 		// working vector buffer
-		std::vector<Vector3>& workBuffer = it->second;
 		workBuffer.resize(mesh->getNumVertices());
 		memcpy(workBuffer.data(), mesh->vertices.data(), 12 * mesh->getNumVertices());
 
@@ -172,18 +190,61 @@ float* ApplySkinToMesh(const Mesh* mesh, Chunk* excChunk)
 			workBuffer[index1 / 3] = workBuffer[index2 / 3];
 		}
 	}
+}
+
+float* ApplySkinToMesh(const Mesh* mesh, Chunk* excChunk)
+{
+	auto [it,inserted] = g_skinnedMeshMap.try_emplace(mesh);
+	if (inserted)
+		SkinVertices(mesh, excChunk, it->second);
 	return (float*)it->second.data();
 }
 
+size_t g_gpuBufferBytes = 0;
+
+// Buffer object owned by a prepared mesh or a batch, created and deleted on the main thread
+struct GpuBuffer {
+	GLuint id = 0;
+	size_t size = 0;
+
+	GpuBuffer() = default;
+	GpuBuffer(GpuBuffer&& other) noexcept : id(other.id), size(other.size) { other.id = 0; other.size = 0; }
+	GpuBuffer& operator=(GpuBuffer&& other) noexcept { std::swap(id, other.id); std::swap(size, other.size); return *this; }
+	~GpuBuffer() { release(); }
+
+	void upload(GLenum target, const void* data, size_t dataSize) {
+		glGenBuffersARB(1, &id);
+		glBindBufferARB(target, id);
+		glBufferDataARB(target, dataSize, data, GL_STATIC_DRAW_ARB);
+		size = dataSize;
+		g_gpuBufferBytes += size;
+	}
+	void release() {
+		if (!id)
+			return;
+		glDeleteBuffersARB(1, &id);
+		g_gpuBufferBytes -= size;
+		id = 0;
+		size = 0;
+	}
+};
+
 // Prepared+Optimized Mesh for rendering
 struct ProMesh {
 	using IndexType = uint16_t;
+	// interleaved, the identical vertices of a part are welded
+	struct Vertex {
+		Vector3 position;
+		float u, v;
+		float lu, lv;
+		uint32_t color;
+	};
+	static_assert(sizeof(Vertex) == 32, "the vertices are compared and hashed as bytes");
 	struct Part {
-		std::vector<Vector3> vertices;
-		std::vector<std::pair<float, float>> texcoords;
-		std::vector<std::pair<float, float>> lightmapCoords;
-		std::vector<uint32_t> colors;
+		std::vector<Vertex> vertices;
 		std::vector<IndexType> indices;
+		// uploaded when first drawn
+		mutable GpuBuffer vertexBuffer, indexBuffer;
 	};
 	struct PartKey {
 		uint16_t flags, texId, lgtId; bool invisible;
@@ -195,98 +256,570 @@ struct ProMesh {
 		bool operator<(const PartKey& other) const { return asRefTuple() < other.asRefTuple(); }
 		bool operator==(const PartKey& other) const { return asRefTuple() == other.asRefTuple(); }
 	};
-	std::map<PartKey, Part> parts;
+	// sorted by key
+	std::vector<std::pair<PartKey, Part>> parts;
+	// different for every prepared mesh, to know when the static batches using it must be rebuilt
+	uint64_t serial = 0;
 
-	inline static std::map<Mesh*, ProMesh> g_proMeshes;
+	// Everything the preparation reads, so that it can run on a worker thread
+	struct Source {
+		std::shared_ptr<const Mesh> mesh;
+		// only for the skinned meshes
+		std::shared_ptr<Chunk> excChunk;
+		struct Lightmap {
+			bool inAtlas = false;
+			LightmapAtlas::Placement placement;
+			float halfTexelU = 0.0f, halfTexelV = 0.0f;
+		};
+		std::unordered_map<uint16_t, Lightmap> lightmaps;
+		std::shared_ptr<const std::vector<uint32_t>> colorMap;
+		bool optimize = false;
+	};
+	inline static std::shared_ptr<const std::vector<uint32_t>> g_colorMap;
+	inline static std::pair<const void*, size_t> g_colorMapKey;
 
-	// Get a prepared mesh from the cache, make one if not already done
-	static ProMesh* getProMesh(Mesh* mesh, Chunk* excChunk) {
-		// If ProMesh found in the cache, return it
-		auto it = g_proMeshes.find(mesh);
-		if (it != g_proMeshes.end())
-			return &it->second;
+	// Open addressing table of the vertices of a part, to find the identical ones
+	struct WeldTable {
+		std::vector<uint32_t> slots;
+		uint32_t mask = 0;
+		static constexpr uint32_t empty = 0xFFFFFFFF;
+
+		void init(size_t maxVertices) {
+			size_t size = 16;
+			while (size < 2 * maxVertices)
+				size *= 2;
+			slots.assign(size, empty);
+			mask = (uint32_t)size - 1;
+		}
+		static uint32_t hash(const Vertex& vtx) {
+			uint32_t words[8];
+			memcpy(words, &vtx, sizeof(words));
+			uint32_t h = 2166136261u;
+			for (uint32_t w : words)
+				h = (h ^ w) * 16777619u;
+			return h ^ (h >> 15);
+		}
+		// Returns the index of the identical vertex, or adds it
+		IndexType weld(std::vector<Vertex>& vertices, const Vertex& vtx) {
+			for (uint32_t s = hash(vtx) & mask;; s = (s + 1) & mask) {
+				if (slots[s] == empty) {
+					slots[s] = (uint32_t)vertices.size();
+					vertices.push_back(vtx);
+					return (IndexType)slots[s];
+				}
+				if (!memcmp(&vertices[slots[s]], &vtx, sizeof(Vertex)))
+					return (IndexType)slots[s];
+			}
+		}
+	};
 
-		// Else make one and return it:
+	// Gathers the source of the mesh's preparation from the scene, on the main thread.
+	// With copy, the mesh and animation are copied, else the source only points to them.
+	static Source makeSource(Mesh* mesh, Chunk* excChunk, bool copy) {
+		Source src;
+		src.mesh = copy ? std::make_shared<const Mesh>(*mesh) : std::shared_ptr<const Mesh>(std::shared_ptr<const Mesh>(), mesh);
+		if (excChunk && excChunk->findSubchunk('LCHE'))
+			src.excChunk = copy ? std::make_shared<Chunk>(*excChunk) : std::shared_ptr<Chunk>(std::shared_ptr<Chunk>(), excChunk);
+		for (const auto& face : mesh->ftxFaces) {
+			if (!(face[0] & FTXFlag::lightMapMask) || face[3] == 0xFFFF)
+				continue;
+			auto [lmIt, inserted] = src.lightmaps.try_emplace(face[3]);
+			if (!inserted)
+				continue;
+			Source::Lightmap& lightmap = lmIt->second;
+			if (Chunk* lgtChunk = FindTextureChunk(g_scene, face[3]).first) {
+				const TexInfo* lgtInfo = (const TexInfo*)lgtChunk->maindata.data();
+				lightmap.halfTexelU = 0.5f / lgtInfo->width;
+				lightmap.halfTexelV = 0.5f / lgtInfo->height;
+			}
+			if (useLightmapAtlas) {
+				if (const LightmapAtlas::Placement* placement = LightmapAtlas::Find(face[3])) {
+					lightmap.inAtlas = true;
+					lightmap.placement = *placement;
+				}
+			}
+		}
+		src.colorMap = getColorMap();
+		src.optimize = optimizeMeshes;
+		return src;
+	}
+
+	// Copy of the vertex colors of the lightmap pack, made again when its chunk changes
+	static std::shared_ptr<const std::vector<uint32_t>> getColorMap() {
+		if (g_scene.lgtPack.subchunks.empty())
+			return nullptr;
+		const Chunk& chunk = g_scene.lgtPack.subchunks[0];
+		std::pair<const void*, size_t> key = { chunk.maindata.data(), chunk.maindata.size() };
+		if (g_colorMap && g_colorMapKey == key)
+			return g_colorMap;
+		assert(chunk.tag == 'RGBA');
+		const uint8_t* colorMapData = chunk.maindata.data();
+		const uint8_t* colorMapEnd = colorMapData + chunk.maindata.size();
+		assert(*(uint16_t*)(colorMapData + 6) == 2); // the width of color map must be 2
+		colorMapData += 0x14; // skip texture header until name
+		while (colorMapData < colorMapEnd && *colorMapData++); // skip texture name
+		colorMapData += 4; // skip mipmap size
+		auto colorMap = std::make_shared<std::vector<uint32_t>>();
+		if (colorMapData < colorMapEnd)
+			colorMap->assign((const uint32_t*)colorMapData, (const uint32_t*)colorMapData + (colorMapEnd - colorMapData) / 4);
+		g_colorMap = std::move(colorMap);
+		g_colorMapKey = key;
+		return g_colorMap;
+	}
+
+	// Makes the prepared mesh, on any thread, adding to the stats
+	static ProMesh build(const Source& src, MeshPreparationStats& stats) {
+		auto startTime = std::chrono::steady_clock::now();
 
 		static const float defUvs[8] = { 0,0, 0,1, 1,1, 1,0 };
-		static const uint32_t defColors[4] = { 0xFF0000FF, 0xFF00FF00, 0xFFFF0000, 0xFF000000 };
 		static const int uvit[4] = { 0,1,2,3 };
 		static const int lgtit[4] = { 0,1,3,2 };
 
 		ProMesh pro;
+		const Mesh* mesh = src.mesh.get();
 		const float *verts = mesh->vertices.data();
-		size_t numQuads = mesh->getNumQuads();
-		size_t numTris = mesh->getNumTris();
-		const uint16_t *ftxFace = (uint16_t*)mesh->ftxFaces.data();
-		bool hasFtx = !mesh->ftxFaces.empty();
-
-		if (excChunk && excChunk->findSubchunk('LCHE'))
-			verts = ApplySkinToMesh(mesh, excChunk);
+		const size_t numQuads = mesh->getNumQuads();
+		const size_t numTris = mesh->getNumTris();
+		const size_t numFaces = numTris + numQuads;
+		const bool hasFtx = !mesh->ftxFaces.empty();
 
-		float *uvCoords = (float*)defUvs;
-		float *lgtCoords = (float*)defUvs;
-		if (hasFtx) {
-			uvCoords = (float*)mesh->textureCoords.data();
-			lgtCoords = (float*)mesh->lightCoords.data();
+		std::vector<Vector3> skinnedVertices;
+		if (src.excChunk) {
+			SkinVertices(mesh, src.excChunk.get(), skinnedVertices);
+			verts = (const float*)skinnedVertices.data();
 		}
 
-		uint32_t* colorMap = nullptr;
-		if (!g_scene.lgtPack.subchunks.empty()) {
-			assert(g_scene.lgtPack.subchunks[0].tag == 'RGBA');
-			uint8_t* colorMapData = g_scene.lgtPack.subchunks[0].maindata.data();
-			assert(*(uint16_t*)(colorMapData + 6) == 2); // the width of color map must be 2
-			colorMapData += 0x14; // skip texture header until name
-			while (*colorMapData++); // skip texture name
-			colorMapData += 4; // skip mipmap size
-			colorMap = (uint32_t*)colorMapData;
-		}
+		const uint32_t* colorMap = src.colorMap ? src.colorMap->data() : nullptr;
+		const size_t colorMapSize = src.colorMap ? src.colorMap->size() : 0;
 
-		auto nextFace = [&](int shape, ProMesh::IndexType* indices) {
+		// Calls func(shape, indices, ftxFace, uvCoords, lgtCoords) for every face, the triangles first
+		auto forEachFace = [&](auto&& func) {
+			const uint16_t* ftxFace = (uint16_t*)mesh->ftxFaces.data();
+			const float* uvCoords = hasFtx ? (const float*)mesh->textureCoords.data() : defUvs;
+			const float* lgtCoords = hasFtx ? (const float*)mesh->lightCoords.data() : defUvs;
+			for (size_t f = 0; f < numFaces; f++) {
+				const bool isTri = f < numTris;
+				const uint16_t* indices = isTri ? mesh->triindices.data() + 3 * f : mesh->quadindices.data() + 4 * (f - numTris);
+				const bool isTextured = hasFtx && (ftxFace[0] & FTXFlag::textureMask);
+				const bool isLit = hasFtx && (ftxFace[0] & FTXFlag::lightMapMask);
+				func(f, isTri ? 3 : 4, indices, ftxFace, isTextured ? uvCoords : defUvs, isLit ? lgtCoords : defUvs);
+				ftxFace += 6;
+				if (isTextured) uvCoords += 8; // for triangles, 4th UV is ignored.
+				if (isLit) lgtCoords += 8;
+			}
+		};
+
+		// First pass: the part and lightmap transform of each face, and the number of corners of each part
+		struct FaceInfo {
+			uint32_t part;
+			float lmOffsetU, lmOffsetV, lmScaleU, lmScaleV;
+		};
+		std::vector<FaceInfo> faceInfos(numFaces);
+		std::vector<PartKey> keys;
+		std::vector<size_t> numCorners, numIndices;
+		forEachFace([&](size_t f, int shape, const uint16_t* indices, const uint16_t* ftxFace, const float* uvs, const float* lgtUvs) {
 			bool isTextured = hasFtx && (ftxFace[0] & FTXFlag::textureMask);
 			bool isLit = hasFtx && (ftxFace[0] & FTXFlag::lightMapMask);
 			uint16_t texid = isTextured ? ftxFace[2] : 0xFFFF;
 			uint16_t lgtid = isLit ? ftxFace[3] : 0xFFFF;
-			auto& part = pro.parts[PartKey(texid, lgtid, ftxFace[0])];
-			IndexType prostart = (IndexType)part.vertices.size();
-			for (int j = 0; j < shape; j++) {
-				const float* uu = (isTextured ? uvCoords : defUvs) + uvit[j] * 2;
-				part.texcoords.push_back({ uu[0], uu[1] });
-				const float* lu = (isLit ? lgtCoords : defUvs) + uvit[j] * 2;
-				float lmOffsetU = 0.0f, lmOffsetV = 0.0f;
-				if (lgtid != 0xFFFF) {
-					const TexInfo* lgtInfo = (const TexInfo*)FindTextureChunk(g_scene, lgtid).first->maindata.data();
-					lmOffsetU = 0.5f / lgtInfo->width;
-					lmOffsetV = 0.5f / lgtInfo->height;
+			const Source::Lightmap* lightmap = nullptr;
+			if (lgtid != 0xFFFF) {
+				auto lmIt = src.lightmaps.find(lgtid);
+				if (lmIt != src.lightmaps.end())
+					lightmap = &lmIt->second;
+			}
+			const LightmapAtlas::Placement* atlas = (lightmap && lightmap->inAtlas) ? &lightmap->placement : nullptr;
+			// the lightmaps don't repeat in the atlases
+			for (int j = 0; atlas && j < shape; j++) {
+				const float* lu = lgtUvs + uvit[j] * 2;
+				if (lu[0] < -0.001f || lu[0] > 1.001f || lu[1] < -0.001f || lu[1] > 1.001f)
+					atlas = nullptr;
+			}
+			FaceInfo& info = faceInfos[f];
+			info = { 0, 0.0f, 0.0f, 1.0f, 1.0f };
+			if (atlas) {
+				info.lmOffsetU = atlas->offsetU;
+				info.lmOffsetV = atlas->offsetV;
+				info.lmScaleU = atlas->scaleU;
+				info.lmScaleV = atlas->scaleV;
+			}
+			else if (lightmap) {
+				info.lmOffsetU = lightmap->halfTexelU;
+				info.lmOffsetV = lightmap->halfTexelV;
+			}
+
+			// the faces with the same material usually follow each other
+			const PartKey key(texid, atlas ? atlas->atlasId : lgtid, hasFtx ? ftxFace[0] : 0);
+			uint32_t part = (f > 0) ? faceInfos[f - 1].part : 0;
+			if (part >= keys.size() || !(keys[part] == key)) {
+				part = (uint32_t)(std::find(keys.begin(), keys.end(), key) - keys.begin());
+				if (part == keys.size()) {
+					keys.push_back(key);
+					numCorners.push_back(0);
+					numIndices.push_back(0);
 				}
-				part.lightmapCoords.push_back({ lu[0] + lmOffsetU, lu[1] + lmOffsetV });
-				uint32_t color = (isLit && ftxFace[3] == 0xFFFF && colorMap) ? colorMap[4 * (ftxFace[5] - 1) + lgtit[j]] : 0xFFFFFFFF;
-				part.colors.push_back(color);
+			}
+			info.part = part;
+			numCorners[part] += shape;
+			numIndices[part] += 3 * (shape - 2);
+		});
+
+		// Second pass: the vertices, welded, and the indices
+		std::vector<Part> parts(keys.size());
+		std::vector<WeldTable> weldTables(keys.size());
+		for (size_t p = 0; p < keys.size(); p++) {
+			parts[p].vertices.reserve(numCorners[p]);
+			parts[p].indices.reserve(numIndices[p]);
+			weldTables[p].init(numCorners[p]);
+		}
+		forEachFace([&](size_t f, int shape, const uint16_t* indices, const uint16_t* ftxFace, const float* uvs, const float* lgtUvs) {
+			const FaceInfo& info = faceInfos[f];
+			Part& part = parts[info.part];
+			bool isLit = hasFtx && (ftxFace[0] & FTXFlag::lightMapMask);
+			IndexType corners[4];
+			for (int j = 0; j < shape; j++) {
+				Vertex vtx;
 				const float* v = verts + indices[j] * 3 / 2;
-				part.vertices.push_back({ v[0], v[1], v[2] });
+				vtx.position = { v[0], v[1], v[2] };
+				const float* uu = uvs + uvit[j] * 2;
+				vtx.u = uu[0];
+				vtx.v = uu[1];
+				const float* lu = lgtUvs + uvit[j] * 2;
+				vtx.lu = lu[0] * info.lmScaleU + info.lmOffsetU;
+				vtx.lv = lu[1] * info.lmScaleV + info.lmOffsetV;
+				const size_t colorIndex = 4 * (size_t)(ftxFace[5] - 1) + lgtit[j];
+				vtx.color = (isLit && ftxFace[3] == 0xFFFF && colorIndex < colorMapSize) ? colorMap[colorIndex] : 0xFFFFFFFF;
+				corners[j] = weldTables[info.part].weld(part.vertices, vtx);
 			}
 			for (int s = 2; s < shape; ++s)
 				for (int j : {0, s - 1, s})
-					part.indices.push_back((IndexType)(prostart + j));
-			ftxFace += 6;
-			if (isTextured) uvCoords += 8; // for triangles, 4th UV is ignored.
-			if (isLit) lgtCoords += 8;
-		};
+					part.indices.push_back(corners[j]);
+		});
 
-		for (size_t i = 0; i < numTris; i++) {
-			nextFace(3, mesh->triindices.data() + 3 * i);
+		// Reorder for the vertex cache, then for overdraw, then the vertices in the new order
+		auto optimizeStartTime = std::chrono::steady_clock::now();
+		for (Part& part : parts) {
+			const size_t partVertices = part.vertices.size();
+			const auto before = MeshOptimizer::AnalyzeVertexCache(part.indices.data(), part.indices.size(), partVertices);
+			stats.numTriangles += before.numTriangles;
+			stats.cacheMissesBefore += before.numMisses;
+			if (src.optimize) {
+				MeshOptimizer::OptimizeVertexCache(part.indices.data(), part.indices.size(), partVertices);
+				MeshOptimizer::OptimizeOverdraw(part.indices.data(), part.indices.size(), &part.vertices[0].position.x, sizeof(Vertex), partVertices);
+				MeshOptimizer::OptimizeVertexFetch(part.vertices.data(), sizeof(Vertex), partVertices, part.indices.data(), part.indices.size());
+				stats.cacheMissesAfter += MeshOptimizer::AnalyzeVertexCache(part.indices.data(), part.indices.size(), partVertices).numMisses;
+			}
+			else
+				stats.cacheMissesAfter += before.numMisses;
 		}
-		for (size_t i = 0; i < numQuads; i++) {
-			nextFace(4, mesh->quadindices.data() + 4 * i);
+		stats.optimizeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - optimizeStartTime).count();
+
+		size_t numVertices = 0, totalIndices = 0;
+		pro.parts.reserve(keys.size());
+		for (size_t p = 0; p < keys.size(); p++) {
+			parts[p].vertices.shrink_to_fit();
+			numVertices += parts[p].vertices.size();
+			totalIndices += parts[p].indices.size();
+			pro.parts.emplace_back(keys[p], std::move(parts[p]));
 		}
+		std::sort(pro.parts.begin(), pro.parts.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
 
-		g_proMeshes[mesh] = std::move(pro);
-		return &g_proMeshes[mesh];
+		stats.numMeshes++;
+		stats.numParts += pro.parts.size();
+		stats.numFaces += numFaces;
+		stats.numCorners += std::accumulate(numCorners.begin(), numCorners.end(), (size_t)0);
+		stats.numVertices += numVertices;
+		stats.numBytes += numVertices * sizeof(Vertex) + totalIndices * sizeof(IndexType);
+		stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		return pro;
 	}
 };
 
-std::map<ProMesh::PartKey, std::vector<std::pair<Matrix, const ProMesh::Part*>>> g_meshLists;
+// The prepared version of a mesh is kept and drawn while the next one is prepared
+struct MeshCacheEntry {
+	std::unique_ptr<ProMesh> ready;
+	// incremented when the mesh is invalidated, ready is current if readyGeneration == generation
+	uint32_t generation = 0, readyGeneration = 0;
+	std::future<std::pair<ProMesh, MeshPreparationStats>> pending;
+	uint32_t pendingGeneration = 0;
+};
+std::map<Mesh*, MeshCacheEntry> g_proMeshes;
+// meshes whose entries have a pending preparation
+std::vector<Mesh*> g_pendingMeshes;
+MeshPreparationStats g_meshPreparationStats;
+uint64_t g_nextProMeshSerial = 1;
+
+// The meshes never prepared yet are drawn untextured
+std::vector<std::pair<Matrix, const Mesh*>> g_fallbackDraws;
+
+// Frame times while the meshes are prepared
+struct MeshLoadingCapture {
+	bool active = false;
+	// set when all the meshes are uncached, to know which loadings are the scene's
+	bool cacheCleared = true;
+	bool fromEmptyCache = false;
+	// set when a mesh was prepared or a preparation was started or finished since the last frame
+	bool activity = false;
+	size_t numPrepared = 0;
+	std::vector<float> frameSeconds;
+	std::chrono::steady_clock::time_point lastFrameStart = std::chrono::steady_clock::now();
+};
+MeshLoadingCapture g_meshLoadingCapture;
+double g_lastFrameSeconds = 0.0;
+MeshLoadingStats g_meshLoadingStats;
+
+static void AddMeshPreparationStats(MeshPreparationStats& total, const MeshPreparationStats& stats)
+{
+	total.numMeshes += stats.numMeshes;
+	total.numParts += stats.numParts;
+	total.numFaces += stats.numFaces;
+	total.numCorners += stats.numCorners;
+	total.numVertices += stats.numVertices;
+	total.numBytes += stats.numBytes;
+	total.seconds += stats.seconds;
+	total.numTriangles += stats.numTriangles;
+	total.cacheMissesBefore += stats.cacheMissesBefore;
+	total.cacheMissesAfter += stats.cacheMissesAfter;
+	total.optimizeSeconds += stats.optimizeSeconds;
+}
+
+// Returns the current prepared mesh, preparing it on this thread if needed
+static const ProMesh* GetProMesh(Mesh* mesh, Chunk* excChunk)
+{
+	MeshCacheEntry& entry = g_proMeshes[mesh];
+	if (!entry.ready || entry.readyGeneration != entry.generation) {
+		entry.ready = std::make_unique<ProMesh>(ProMesh::build(ProMesh::makeSource(mesh, excChunk, false), g_meshPreparationStats));
+		entry.ready->serial = g_nextProMeshSerial++;
+		entry.readyGeneration = entry.generation;
+		g_meshLoadingCapture.activity = true;
+		g_meshLoadingCapture.numPrepared++;
+	}
+	return entry.ready.get();
+}
+
+// Returns the last prepared version of the mesh, or null if there is none yet,
+// and starts preparing the current version on the thread pool if not done yet
+static const ProMesh* RequestProMesh(Mesh* mesh, Chunk* excChunk)
+{
+	MeshCacheEntry& entry = g_proMeshes[mesh];
+	const bool isCurrent = entry.ready && entry.readyGeneration == entry.generation;
+	const bool isPending = entry.pending.valid() && entry.pendingGeneration == entry.generation;
+	if (!isCurrent && !isPending) {
+		// a preparation of an older version is dropped
+		if (!entry.pending.valid())
+			g_pendingMeshes.push_back(mesh);
+		entry.pending = ThreadPool::global().submit([source = ProMesh::makeSource(mesh, excChunk, true)]() {
+			MeshPreparationStats stats;
+			ProMesh pro = ProMesh::build(source, stats);
+			return std::make_pair(std::move(pro), stats);
+			});
+		entry.pendingGeneration = entry.generation;
+		g_meshLoadingCapture.activity = true;
+	}
+	return entry.ready.get();
+}
+
+// Swaps in the prepared meshes that are finished
+static void PollPreparedMeshes()
+{
+	auto finished = [](Mesh* mesh) {
+		auto it = g_proMeshes.find(mesh);
+		if (it == g_proMeshes.end() || !it->second.pending.valid())
+			return true;
+		MeshCacheEntry& entry = it->second;
+		if (entry.pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			return false;
+		auto [pro, stats] = entry.pending.get();
+		AddMeshPreparationStats(g_meshPreparationStats, stats);
+		// an older version is still better than nothing
+		if (!entry.ready || (entry.pendingGeneration == entry.generation && entry.readyGeneration != entry.generation)) {
+			entry.ready = std::make_unique<ProMesh>(std::move(pro));
+			entry.ready->serial = g_nextProMeshSerial++;
+			entry.readyGeneration = entry.pendingGeneration;
+		}
+		g_meshLoadingCapture.activity = true;
+		g_meshLoadingCapture.numPrepared++;
+		return true;
+	};
+	g_pendingMeshes.erase(std::remove_if(g_pendingMeshes.begin(), g_pendingMeshes.end(), finished), g_pendingMeshes.end());
+}
+
+// Called once per frame: records the frame times from the first frame preparing meshes to the first one without
+static void UpdateMeshLoading()
+{
+	MeshLoadingCapture& capture = g_meshLoadingCapture;
+	auto now = std::chrono::steady_clock::now();
+	const float frameSeconds = std::chrono::duration<float>(now - capture.lastFrameStart).count();
+	capture.lastFrameStart = now;
+	g_lastFrameSeconds = frameSeconds;
+
+	PollPreparedMeshes();
+	const bool busy = !g_pendingMeshes.empty() || capture.activity;
+	capture.activity = false;
+	if (busy && !capture.active) {
+		capture.active = true;
+		capture.fromEmptyCache = capture.cacheCleared;
+		capture.cacheCleared = false;
+		capture.frameSeconds.clear();
+	}
+	if (capture.active)
+		capture.frameSeconds.push_back(frameSeconds);
+
+	MeshLoadingStats& stats = g_meshLoadingStats;
+	stats.numPending = g_pendingMeshes.size();
+	stats.inProgress = capture.active;
+	if (capture.active && !busy) {
+		capture.active = false;
+		std::vector<float> sorted = capture.frameSeconds;
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&sorted](double p) { return (double)sorted[std::min(sorted.size() - 1, (size_t)std::ceil(p * sorted.size()) - 1)]; };
+		stats.numPreparedMeshes = capture.numPrepared;
+		stats.numFrames = sorted.size();
+		stats.seconds = std::accumulate(sorted.begin(), sorted.end(), 0.0);
+		stats.frameP50 = percentile(0.5);
+		stats.frameP90 = percentile(0.9);
+		stats.frameP99 = percentile(0.99);
+		stats.frameMax = sorted.back();
+		capture.numPrepared = 0;
+		// the scene was just opened, or all the meshes uncached
+		if (capture.fromEmptyCache)
+			printf("Meshes loaded: %zu prepared over %zu frames in %.2f s, frame time p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms (%s)\n",
+				stats.numPreparedMeshes, stats.numFrames, stats.seconds, stats.frameP50 * 1000.0, stats.frameP90 * 1000.0,
+				stats.frameP99 * 1000.0, stats.frameMax * 1000.0, prepareMeshesInBackground ? "background" : "synchronous");
+	}
+}
+
+// The static parts of a cell with the same material, transformed and merged to be drawn at once
+struct StaticBatch {
+	std::vector<ProMesh::Vertex> vertices;
+	std::vector<uint32_t> indices;
+	GpuBuffer vertexBuffer, indexBuffer;
+};
+
+// The static instances are grouped by the cell of a grid containing their origin,
+// so that an object moving only rebuilds the batches of its cell
+struct BatchCell {
+	// hash of the instances, their prepared meshes and matrices, of the last build and of the current frame
+	uint64_t signature = 0, newSignature = 0;
+	uint32_t lastFrame = 0;
+	std::vector<std::pair<Matrix, const ProMesh*>> instances;
+	std::map<ProMesh::PartKey, StaticBatch> batches;
+	ViewCulling::Bounds bounds;
+};
+static constexpr float batchCellSize = 4096.0f;
+std::map<std::array<int, 3>, BatchCell> g_batchCells;
+uint32_t g_batchFrame = 0;
+std::vector<ViewCulling::Frustum> g_cullingFrustums;
+
+struct MeshList {
+	std::vector<std::pair<Matrix, const ProMesh::Part*>> instances;
+	std::vector<StaticBatch*> batches;
+};
+std::map<ProMesh::PartKey, MeshList> g_meshLists;
+
+static uint64_t HashBytes(const void* data, size_t size, uint64_t hash)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+static void AddToStaticBatches(const void* instance, const ProMesh* pro, const Matrix& matrix)
+{
+	const Vector3 origin = matrix.getTranslationVector();
+	const std::array<int, 3> cellKey = { (int)std::floor(origin.x / batchCellSize), (int)std::floor(origin.y / batchCellSize),
+		(int)std::floor(origin.z / batchCellSize) };
+	BatchCell& cell = g_batchCells[cellKey];
+	if (cell.lastFrame != g_batchFrame) {
+		cell.lastFrame = g_batchFrame;
+		cell.instances.clear();
+		cell.newSignature = 14695981039346656037ull ^ (uint64_t)renderUntexturedFaces;
+	}
+	cell.instances.emplace_back(matrix, pro);
+	cell.newSignature = HashBytes(&instance, sizeof(instance), cell.newSignature);
+	cell.newSignature = HashBytes(&pro->serial, sizeof(pro->serial), cell.newSignature);
+	cell.newSignature = HashBytes(matrix.v, sizeof(matrix.v), cell.newSignature);
+}
+
+static void BuildCellBatches(BatchCell& cell)
+{
+	cell.batches.clear();
+	std::map<ProMesh::PartKey, std::pair<size_t, size_t>> sizes;
+	for (auto& [matrix, pro] : cell.instances) {
+		for (auto& [mat, part] : pro->parts) {
+			if (!renderUntexturedFaces && mat.invisible)
+				continue;
+			sizes[mat].first += part.vertices.size();
+			sizes[mat].second += part.indices.size();
+		}
+	}
+	for (auto& [mat, size] : sizes) {
+		StaticBatch& batch = cell.batches[mat];
+		batch.vertices.reserve(size.first);
+		batch.indices.reserve(size.second);
+	}
+	for (auto& [matrix, pro] : cell.instances) {
+		for (auto& [mat, part] : pro->parts) {
+			if (!renderUntexturedFaces && mat.invisible)
+				continue;
+			StaticBatch& batch = cell.batches.find(mat)->second;
+			const uint32_t base = (uint32_t)batch.vertices.size();
+			for (const ProMesh::Vertex& vtx : part.vertices) {
+				batch.vertices.push_back(vtx);
+				batch.vertices.back().position = vtx.position.transform(matrix);
+			}
+			for (ProMesh::IndexType index : part.indices)
+				batch.indices.push_back(base + index);
+		}
+	}
+
+	Vector3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (auto& [mat, batch] : cell.batches) {
+		for (const ProMesh::Vertex& vtx : batch.vertices) {
+			for (int j = 0; j < 3; j++) {
+				lo.coord[j] = std::min(lo.coord[j], vtx.position.coord[j]);
+				hi.coord[j] = std::max(hi.coord[j], vtx.position.coord[j]);
+			}
+		}
+	}
+	cell.bounds = ViewCulling::Bounds::fromMinMax(lo, hi);
+}
+
+// Rebuilds the batches of the cells whose instances changed, drops the cells without instances,
+// and adds the batches to the mesh lists
+static void UpdateStaticBatches()
+{
+	auto startTime = std::chrono::steady_clock::now();
+	for (auto it = g_batchCells.begin(); it != g_batchCells.end();) {
+		BatchCell& cell = it->second;
+		if (cell.lastFrame != g_batchFrame) {
+			it = g_batchCells.erase(it);
+			continue;
+		}
+		// the batches are rebuilt with new buffers
+		if (cell.signature != cell.newSignature || cell.batches.empty()) {
+			BuildCellBatches(cell);
+			cell.signature = cell.newSignature;
+			g_meshDrawStats.numBatchRebuilds++;
+		}
+		auto isOutside = [&cell](const ViewCulling::Frustum& frustum) { return ViewCulling::Test(frustum, cell.bounds) == ViewCulling::Result::Outside; };
+		if (!g_cullingFrustums.empty() && !cell.batches.empty() && std::all_of(g_cullingFrustums.begin(), g_cullingFrustums.end(), isOutside)) {
+			g_meshDrawStats.numCulledBatchCells++;
+			++it;
+			continue;
+		}
+		for (auto& [mat, batch] : cell.batches) {
+			g_meshLists[mat].batches.push_back(&batch);
+			g_meshDrawStats.numBatchBytes += batch.vertices.size() * sizeof(ProMesh::Vertex) + batch.indices.size() * sizeof(uint32_t);
+		}
+		g_meshDrawStats.numBatchedInstances += cell.instances.size();
+		++it;
+	}
+	g_meshDrawStats.batchRebuildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
 
-void DrawMesh(Mesh* mesh, const Matrix& matrix, Chunk* excChunk)
+void DrawMesh(Mesh* mesh, const Matrix& matrix, Chunk* excChunk, const void* staticInstance)
 {
 	if (!rendertextures)
 	{
@@ -300,27 +833,92 @@ void DrawMesh(Mesh* mesh, const Matrix& matrix, Chunk* excChunk)
 	}
 	else
 	{
-		ProMesh* pro = ProMesh::getProMesh(mesh, excChunk);
+		const ProMesh* pro = prepareMeshesInBackground ? RequestProMesh(mesh, excChunk) : GetProMesh(mesh, excChunk);
+		if (!pro) {
+			// the skinned meshes wait for their preparation, which does the skinning
+			if (!(excChunk && excChunk->findSubchunk('LCHE')))
+				g_fallbackDraws.emplace_back(matrix, mesh);
+			return;
+		}
+		if (useStaticBatching && staticInstance) {
+			AddToStaticBatches(staticInstance, pro, matrix);
+			return;
+		}
 		for (auto& [mat,part] : pro->parts) {
 			if (!renderUntexturedFaces && mat.invisible)
 				continue;
-			g_meshLists[mat].push_back({ matrix, &part });
+			g_meshLists[mat].instances.push_back({ matrix, &part });
 		}
 	}
 }
 
+// The state in which the prepared meshes are drawn
+static void SetTexturedMeshState()
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	if (renderLightmaps)
+		glEnableClientState(GL_COLOR_ARRAY);
+	else
+		glDisableClientState(GL_COLOR_ARRAY);
+	glActiveTextureARB(GL_TEXTURE0);
+	glClientActiveTextureARB(GL_TEXTURE0);
+	glEnable(GL_TEXTURE_2D);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glActiveTextureARB(GL_TEXTURE1);
+	glClientActiveTextureARB(GL_TEXTURE1);
+	glEnable(GL_TEXTURE_2D);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
 void RenderMeshLists()
 {
 	if (!rendertextures)
 		return;
-	for (auto& [mat, partList] : g_meshLists) {
+	auto startTime = std::chrono::steady_clock::now();
+	g_meshDrawStats = {};
+	g_meshDrawStats.frameSeconds = g_lastFrameSeconds;
+	if (useStaticBatching)
+		UpdateStaticBatches();
+	const bool useBuffers = useVertexBuffers && GLEW_ARB_vertex_buffer_object;
+	// Points GL to the vertices and returns the pointer to give to glDrawElements for the indices:
+	// in the buffers, uploaded when first drawn, or in memory, then copied by the driver at every draw
+	auto setGeometry = [useBuffers](const auto& vertices, const auto& indices, GpuBuffer& vertexBuffer, GpuBuffer& indexBuffer) -> const void* {
+		const size_t vertexBytes = vertices.size() * sizeof(vertices[0]), indexBytes = indices.size() * sizeof(indices[0]);
+		const uint8_t* base = (const uint8_t*)vertices.data();
+		const void* indexPointer = indices.data();
+		if (useBuffers) {
+			if (!vertexBuffer.id) {
+				vertexBuffer.upload(GL_ARRAY_BUFFER_ARB, vertices.data(), vertexBytes);
+				indexBuffer.upload(GL_ELEMENT_ARRAY_BUFFER_ARB, indices.data(), indexBytes);
+				g_meshDrawStats.numUploadedBytes += vertexBytes + indexBytes;
+			}
+			glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertexBuffer.id);
+			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, indexBuffer.id);
+			base = nullptr;
+			indexPointer = nullptr;
+		}
+		else
+			g_meshDrawStats.numClientBytes += vertexBytes + indexBytes;
+		glVertexPointer(3, GL_FLOAT, sizeof(ProMesh::Vertex), base + offsetof(ProMesh::Vertex, position));
+		if (renderLightmaps)
+			glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(ProMesh::Vertex), base + offsetof(ProMesh::Vertex, color));
+		glClientActiveTextureARB(GL_TEXTURE0);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(ProMesh::Vertex), base + offsetof(ProMesh::Vertex, u));
+		glClientActiveTextureARB(GL_TEXTURE1);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(ProMesh::Vertex), base + offsetof(ProMesh::Vertex, lu));
+		return indexPointer;
+	};
+	for (auto& [mat, list] : g_meshLists) {
+		if (list.instances.empty() && list.batches.empty())
+			continue;
+		g_meshDrawStats.numLists++;
+		g_meshDrawStats.numParts += list.instances.size();
+		g_meshDrawStats.numBatches += list.batches.size();
 		GLuint gltex = 0, gllgt = 0;
 		if (renderColorTextures)
-			if (auto t = texmap.find(mat.texId); t != texmap.end())
-				gltex = (GLuint)(uintptr_t)t->second;
+			gltex = (GLuint)(uintptr_t)GetTexture(mat.texId);
 		if (renderLightmaps)
-			if (auto t = texmap.find(mat.lgtId); t != texmap.end())
-				gllgt = (GLuint)(uintptr_t)t->second;
+			gllgt = (GLuint)(uintptr_t)GetTexture(mat.lgtId);
 		glActiveTextureARB(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, gltex);
 		glActiveTextureARB(GL_TEXTURE1);
@@ -339,35 +937,193 @@ void RenderMeshLists()
 		//else {
 		//	glDisable(GL_BLEND);
 		//}
-		for (auto& [matrix, partPtr] : partList) {
+		if (!list.batches.empty()) {
+			// already in world space
+			glLoadIdentity();
+			for (StaticBatch* batch : list.batches) {
+				const void* indices = setGeometry(batch->vertices, batch->indices, batch->vertexBuffer, batch->indexBuffer);
+				glDrawElements(GL_TRIANGLES, batch->indices.size(), GL_UNSIGNED_INT, indices);
+				g_meshDrawStats.numDrawCalls++;
+			}
+		}
+		for (auto& [matrix, partPtr] : list.instances) {
 			auto& part = *partPtr;
-			glVertexPointer(3, GL_FLOAT, 12, part.vertices.data());
-			if (renderLightmaps)
-				glColorPointer(4, GL_UNSIGNED_BYTE, 4, part.colors.data());
-			glClientActiveTextureARB(GL_TEXTURE0);
-			glTexCoordPointer(2, GL_FLOAT, 8, part.texcoords.data());
-			glClientActiveTextureARB(GL_TEXTURE1);
-			glTexCoordPointer(2, GL_FLOAT, 8, part.lightmapCoords.data());
+			const void* indices = setGeometry(part.vertices, part.indices, part.vertexBuffer, part.indexBuffer);
+			glLoadMatrixf(matrix.v);
+			glDrawElements(GL_TRIANGLES, part.indices.size(), GL_UNSIGNED_SHORT, indices);
+			g_meshDrawStats.numDrawCalls++;
+		}
+	}
+	if (useBuffers) {
+		// the other drawings use memory pointers
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+	}
+	g_meshDrawStats.numBufferBytes = g_gpuBufferBytes;
+
+	g_meshLoadingStats.numFallbackDraws = g_fallbackDraws.size();
+	if (!g_fallbackDraws.empty()) {
+		for (GLenum unit : { GL_TEXTURE1, GL_TEXTURE0 }) {
+			glActiveTextureARB(unit);
+			glClientActiveTextureARB(unit);
+			glDisable(GL_TEXTURE_2D);
+			glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		}
+		glDisableClientState(GL_COLOR_ARRAY);
+		glDisable(GL_ALPHA_TEST);
+		glColor4f(0.6f, 0.6f, 0.6f, 1.0f);
+		for (auto& [matrix, mesh] : g_fallbackDraws) {
 			glLoadMatrixf(matrix.v);
-			glDrawElements(GL_TRIANGLES, part.indices.size(), GL_UNSIGNED_SHORT, part.indices.data());
+			glVertexPointer(3, GL_FLOAT, 6, mesh->vertices.data());
+			glDrawElements(GL_QUADS, mesh->quadindices.size(), GL_UNSIGNED_SHORT, mesh->quadindices.data());
+			glDrawElements(GL_TRIANGLES, mesh->triindices.size(), GL_UNSIGNED_SHORT, mesh->triindices.data());
+			g_meshDrawStats.numDrawCalls += 2;
+			g_meshDrawStats.numClientBytes += mesh->vertices.size() * sizeof(float)
+				+ (mesh->quadindices.size() + mesh->triindices.size()) * sizeof(uint16_t);
 		}
+		glColor4f(1, 1, 1, 1);
+		SetTexturedMeshState();
 	}
+	g_meshDrawStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+const MeshDrawStats& GetMeshDrawStats()
+{
+	return g_meshDrawStats;
+}
+
+void SetMeshCullingFrustums(const ViewCulling::Frustum* frustums, size_t numFrustums)
+{
+	g_cullingFrustums.assign(frustums, frustums + numFrustums);
 }
 
 void InvalidateMesh(Mesh* mesh)
 {
-	ProMesh::g_proMeshes.erase(mesh);
+	// the stats keep counting the replaced mesh, until all the meshes are uncached,
+	// and the replaced mesh is drawn until the new one is prepared
+	auto it = g_proMeshes.find(mesh);
+	if (it != g_proMeshes.end())
+		it->second.generation++;
 	g_skinnedMeshMap.erase(mesh);
+	ViewCulling::InvalidateMesh(mesh);
+	Picking::InvalidateMesh(mesh);
 }
 
 void UncacheAllMeshes()
 {
-	ProMesh::g_proMeshes.clear();
+	// the pending preparations work on copies, their results are dropped
+	g_proMeshes.clear();
+	g_pendingMeshes.clear();
+	g_meshPreparationStats = {};
+	g_meshLoadingCapture.cacheCleared = true;
+	g_meshLoadingCapture.numPrepared = 0;
+	g_batchCells.clear();
 	g_skinnedMeshMap.clear();
+	ViewCulling::ClearCache();
+	Picking::ClearCache();
+	ProMesh::g_colorMap = nullptr;
+}
+
+const MeshPreparationStats& GetMeshPreparationStats()
+{
+	return g_meshPreparationStats;
+}
+
+const MeshLoadingStats& GetMeshLoadingStats()
+{
+	return g_meshLoadingStats;
+}
+
+void PrintMeshPreparationBenchmark()
+{
+	std::vector<std::pair<Mesh*, Chunk*>> meshes;
+	auto walk = [&meshes](GameObject* obj, auto& rec) -> void {
+		if (obj->mesh)
+			meshes.emplace_back(obj->mesh.get(), obj->excChunk.get());
+		for (GameObject* child : obj->subobj)
+			rec(child, rec);
+	};
+	walk(g_scene.superroot, walk);
+	size_t numLitFaces = 0;
+	for (auto& [mesh, excChunk] : meshes)
+		for (const auto& face : mesh->ftxFaces)
+			if (face[0] & FTXFlag::lightMapMask)
+				numLitFaces++;
+	printf("Mesh preparation benchmark: %zu meshes, %zu lightmapped faces, %zu textures\n", meshes.size(), numLitFaces,
+		g_scene.palPack.subchunks.size() + g_scene.lgtPack.subchunks.size());
+
+	for (bool useIndex : { false, true }) {
+		g_scene.textureIndex.enabled = useIndex;
+		UncacheAllMeshes();
+		auto startTime = std::chrono::steady_clock::now();
+		for (auto& [mesh, excChunk] : meshes)
+			GetProMesh(mesh, excChunk);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		printf("  %-18s %8.2f ms\n", useIndex ? "texture index" : "pack scans", seconds * 1000.0);
+	}
+	const MeshPreparationStats& stats = g_meshPreparationStats;
+	size_t sourceBytes = 0;
+	for (auto& [mesh, pro] : g_proMeshes)
+		sourceBytes += mesh->vertices.size() * sizeof(float) + (mesh->triindices.size() + mesh->quadindices.size()) * sizeof(uint16_t)
+			+ mesh->ftxFaces.size() * sizeof(mesh->ftxFaces[0]) + (mesh->textureCoords.size() + mesh->lightCoords.size()) * sizeof(float);
+	printf("  %zu unique meshes, %zu parts, %zu faces, %zu corners welded into %zu vertices (%.1f%%)\n", stats.numMeshes, stats.numParts,
+		stats.numFaces, stats.numCorners, stats.numVertices, stats.numCorners ? 100.0 * stats.numVertices / stats.numCorners : 0.0);
+	printf("  prepared %.2f MiB (source meshes %.2f MiB)\n", stats.numBytes / 1048576.0, sourceBytes / 1048576.0);
+	auto acmr = [&stats](size_t misses) { return stats.numTriangles ? (double)misses / stats.numTriangles : 0.0; };
+	auto atvr = [&stats](size_t misses) { return stats.numVertices ? (double)misses / stats.numVertices : 0.0; };
+	printf("  vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f%s, optimized in %.2f ms\n", acmr(stats.cacheMissesBefore),
+		acmr(stats.cacheMissesAfter), atvr(stats.cacheMissesBefore), atvr(stats.cacheMissesAfter),
+		optimizeMeshes ? "" : " (disabled)", stats.optimizeSeconds * 1000.0);
+	g_scene.textureIndex.enabled = true;
+	UncacheAllMeshes();
+}
+
+void PrintLightmapAtlasBenchmark()
+{
+	std::vector<std::pair<Mesh*, Chunk*>> objects;
+	auto walk = [&objects](GameObject* obj, auto& rec) -> void {
+		if (obj->mesh)
+			objects.emplace_back(obj->mesh.get(), obj->excChunk.get());
+		for (GameObject* child : obj->subobj)
+			rec(child, rec);
+	};
+	walk(g_scene.superroot, walk);
+	printf("Lightmap atlas benchmark: %zu objects with meshes\n", objects.size());
+
+	const bool wasUsingAtlas = useLightmapAtlas;
+	for (bool atlas : { false, true }) {
+		useLightmapAtlas = atlas;
+		if (atlas)
+			LightmapAtlas::Update(g_scene);
+		UncacheAllMeshes();
+		auto startTime = std::chrono::steady_clock::now();
+		std::set<ProMesh::PartKey> lists;
+		size_t numParts = 0, numDrawnParts = 0;
+		for (auto& [mesh, excChunk] : objects) {
+			const bool prepared = g_proMeshes.count(mesh);
+			const ProMesh* pro = GetProMesh(mesh, excChunk);
+			for (auto& [mat, part] : pro->parts) {
+				if (!renderUntexturedFaces && mat.invisible)
+					continue;
+				lists.insert(mat);
+				numDrawnParts++;
+				if (!prepared)
+					numParts++;
+			}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		printf("  %-10s %6zu parts, %6zu parts drawn, %5zu lists, prepared in %8.2f ms\n", atlas ? "atlas" : "lightmaps",
+			numParts, numDrawnParts, lists.size(), seconds * 1000.0);
+	}
+	const auto& stats = LightmapAtlas::GetStats();
+	printf("  %zu of %zu lightmaps packed into %zu atlases in %.2f ms\n", stats.numPacked, stats.numLightmaps, stats.numAtlases, stats.packSeconds * 1000.0);
+	useLightmapAtlas = wasUsingAtlas;
+	UncacheAllMeshes();
 }
 
 void BeginMeshDraw()
 {
+	UpdateMeshLoading();
 	if (!rendertextures) {
 		glEnableClientState(GL_VERTEX_ARRAY);
 		glDisableClientState(GL_COLOR_ARRAY);
@@ -377,22 +1133,16 @@ void BeginMeshDraw()
 	else {
 		if (!GLEW_ARB_multitexture)
 			ferr("Your OpenGL driver doesn't support multitextures. Big oof.");
-		glEnableClientState(GL_VERTEX_ARRAY);
-		if (renderLightmaps)
-			glEnableClientState(GL_COLOR_ARRAY);
-		else
-			glDisableClientState(GL_COLOR_ARRAY);
-		glActiveTextureARB(GL_TEXTURE0);
-		glClientActiveTextureARB(GL_TEXTURE0);
-		glEnable(GL_TEXTURE_2D);
-		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-		glActiveTextureARB(GL_TEXTURE1);
-		glClientActiveTextureARB(GL_TEXTURE1);
-		glEnable(GL_TEXTURE_2D);
-		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		SetTexturedMeshState();
 
-		for (auto& [mat, list] : g_meshLists)
-			list.clear();
+		if (useLightmapAtlas && LightmapAtlas::Update(g_scene))
+			UncacheAllMeshes();
+		for (auto& [mat, list] : g_meshLists) {
+			list.instances.clear();
+			list.batches.clear();
+		}
+		g_fallbackDraws.clear();
+		g_batchFrame++;
 	}
 	glColor4f(1, 1, 1, 1);
 }
@@ -8,12 +8,78 @@
 struct Mesh;
 struct Chunk;
 struct Matrix;
+namespace ViewCulling { struct Frustum; }
 
 extern int drawframes;
 extern bool rendertextures;
 extern bool renderColorTextures, renderLightmaps;
 extern bool enableAlphaTest;
 extern bool renderUntexturedFaces;
+// Draw the lightmaps from the atlases of LightmapAtlas
+extern bool useLightmapAtlas;
+// Reorder the prepared meshes' triangles and vertices for the GPU's caches (MeshOptimizer)
+extern bool optimizeMeshes;
+// Prepare the meshes on the thread pool, drawing them untextured until they are ready
+extern bool prepareMeshesInBackground;
+// Draw the static instances from merged buffers per material and cell of the world, instead of one draw per part
+extern bool useStaticBatching;
+// Draw the prepared meshes and batches from buffer objects uploaded once, if supported
+extern bool useVertexBuffers;
+
+// Totals of the meshes prepared since they were all uncached
+struct MeshPreparationStats {
+	size_t numMeshes = 0;
+	size_t numParts = 0;
+	size_t numFaces = 0;
+	// vertices before and after the welding
+	size_t numCorners = 0;
+	size_t numVertices = 0;
+	// vertices and indices
+	size_t numBytes = 0;
+	double seconds = 0.0;
+	// simulated post-transform cache misses, in the face order and after the optimization if enabled
+	size_t numTriangles = 0;
+	size_t cacheMissesBefore = 0;
+	size_t cacheMissesAfter = 0;
+	double optimizeSeconds = 0.0;
+};
+
+struct MeshLoadingStats {
+	// meshes being prepared in the background
+	size_t numPending = 0;
+	// meshes drawn untextured in the last frame, as they were never prepared
+	size_t numFallbackDraws = 0;
+	bool inProgress = false;
+	// of the last period during which meshes were prepared, from the first frame preparing meshes to the first one without
+	size_t numPreparedMeshes = 0;
+	size_t numFrames = 0;
+	double seconds = 0.0;
+	// frame time percentiles, in seconds
+	double frameP50 = 0.0, frameP90 = 0.0, frameP99 = 0.0, frameMax = 0.0;
+};
+
+struct MeshDrawStats {
+	// parts with the same textures and flags are drawn together, each list needs its textures bound
+	size_t numLists = 0;
+	// parts drawn one by one
+	size_t numParts = 0;
+	size_t numDrawCalls = 0;
+	// static batches drawn, the instances they contain, and how many were rebuilt in the frame
+	size_t numBatches = 0;
+	size_t numBatchedInstances = 0;
+	size_t numBatchRebuilds = 0;
+	size_t numCulledBatchCells = 0;
+	size_t numBatchBytes = 0;
+	double batchRebuildSeconds = 0.0;
+	// geometry given to GL from memory, copied by the driver at every draw, and uploaded to new buffer objects
+	size_t numClientBytes = 0;
+	size_t numUploadedBytes = 0;
+	// in all the buffer objects
+	size_t numBufferBytes = 0;
+	// of RenderMeshLists, and the time between the last two frames
+	double seconds = 0.0;
+	double frameSeconds = 0.0;
+};
 
 void InitVideo();
 void BeginDrawing();
@@ -21,7 +87,18 @@ void EndDrawing();
 float* ApplySkinToMesh(const Mesh* mesh, Chunk* excChunk);
 void BeginMeshDraw();
 void EndMeshDraw();
-void DrawMesh(Mesh* mesh, const Matrix& matrix, Chunk* excChunk = nullptr);
+// staticInstance identifies an instance which can be drawn from the static batches, null for the moving ones.
+void DrawMesh(Mesh* mesh, const Matrix& matrix, Chunk* excChunk = nullptr, const void* staticInstance = nullptr);
 void RenderMeshLists();
+// The static batch cells outside of all the frustums are not drawn, none to draw all
+void SetMeshCullingFrustums(const ViewCulling::Frustum* frustums, size_t numFrustums);
 void InvalidateMesh(Mesh* mesh);
 void UncacheAllMeshes();
+// Times the preparation of all the scene's meshes, with and without the texture index.
+void PrintMeshPreparationBenchmark();
+const MeshPreparationStats& GetMeshPreparationStats();
+const MeshLoadingStats& GetMeshLoadingStats();
+// Of the last RenderMeshLists
+const MeshDrawStats& GetMeshDrawStats();
+// Compares the numbers of parts and lists, and the time to prepare and draw them, without and with the lightmap atlases.
+void PrintLightmapAtlasBenchmark();